@@ -0,0 +1,172 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "Checkpoint.h"
+#include "Simulation.h"
+#include <openvdb/io/Stream.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sstream>
+using namespace openvdb;
+namespace imagesci {
+void WriteCheckpointString(std::ostream& ostr, const std::string& str) {
+	Index64 len = str.length();
+	WriteCheckpointValue(ostr, len);
+	ostr.write(str.data(), len);
+}
+bool ReadCheckpointString(std::istream& istr, std::string& str) {
+	Index64 len = 0;
+	if (!ReadCheckpointValue(istr, len))
+		return false;
+	str.resize(len);
+	if (len > 0)
+		istr.read(&str[0], len);
+	return !istr.fail();
+}
+void WriteCheckpointVdb(std::ostream& ostr, GridBase::ConstPtr grid) {
+	std::string bytes;
+	if (grid.get() != NULL) {
+		std::ostringstream vdbOut(std::ios_base::binary);
+		GridCPtrVec grids;
+		grids.push_back(grid);
+		io::Stream(vdbOut).write(grids);
+		bytes = vdbOut.str();
+	}
+	WriteCheckpointString(ostr, bytes);
+}
+bool ReadCheckpointVdb(std::istream& istr, GridBase::Ptr& grid) {
+	std::string bytes;
+	grid.reset();
+	if (!ReadCheckpointString(istr, bytes))
+		return false;
+	if (bytes.length() == 0)
+		return true;
+	try {
+		std::istringstream vdbIn(bytes, std::ios_base::binary);
+		GridPtrVecPtr grids = io::Stream(vdbIn).getGrids();
+		if (grids.get() != NULL && grids->size() > 0)
+			grid = (*grids)[0];
+	} catch (openvdb::Exception& e) {
+		std::cout << "OpenVDB: " << e.what() << std::endl;
+	}
+	return (grid.get() != NULL);
+}
+void WriteCheckpointMesh(std::ostream& ostr, const Mesh& mesh) {
+	WriteCheckpointVector(ostr, mesh.mVertexes);
+	WriteCheckpointVector(ostr, mesh.mVertexNormals);
+	WriteCheckpointVector(ostr, mesh.mVertexVelocity);
+	WriteCheckpointVector(ostr, mesh.mColors);
+	WriteCheckpointVector(ostr, mesh.mParticles);
+	WriteCheckpointVector(ostr, mesh.mParticleNormals);
+	WriteCheckpointVector(ostr, mesh.mParticleVelocity);
+	WriteCheckpointVector(ostr, mesh.mParticleLabel);
+	WriteCheckpointVector(ostr, mesh.mFaces);
+}
+bool ReadCheckpointMesh(std::istream& istr, Mesh& mesh) {
+	mesh.releaseIndexes();
+	bool ok = ReadCheckpointVector(istr, mesh.mVertexes)
+			&& ReadCheckpointVector(istr, mesh.mVertexNormals)
+			&& ReadCheckpointVector(istr, mesh.mVertexVelocity)
+			&& ReadCheckpointVector(istr, mesh.mColors)
+			&& ReadCheckpointVector(istr, mesh.mParticles)
+			&& ReadCheckpointVector(istr, mesh.mParticleNormals)
+			&& ReadCheckpointVector(istr, mesh.mParticleVelocity)
+			&& ReadCheckpointVector(istr, mesh.mParticleLabel)
+			&& ReadCheckpointVector(istr, mesh.mFaces);
+	if (!ok)
+		return false;
+	mesh.updateBoundingBox();
+	return true;
+}
+CheckpointWriter::CheckpointWriter() :
+		mHasPending(false), mWriting(false), mRunning(true), mLastWriteSeconds(
+				0.0), mWrittenCount(0) {
+	mThread = std::thread(&CheckpointWriter::process, this);
+}
+void CheckpointWriter::push(const std::string& file, std::string& bytes) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	mFile = file;
+	mPending.swap(bytes);
+	mHasPending = true;
+	mQueueChanged.notify_all();
+}
+void CheckpointWriter::process() {
+	while (true) {
+		std::string file, bytes;
+		{
+			std::unique_lock<std::mutex> lockMe(mLock);
+			while (mRunning && !mHasPending) {
+				mQueueChanged.wait(lockMe);
+			}
+			//A checkpoint still pending at shutdown is written before the thread exits.
+			if (!mHasPending)
+				break;
+			file = mFile;
+			bytes.swap(mPending);
+			mHasPending = false;
+			mWriting = true;
+		}
+		Simulation::Clock::time_point t0 = Simulation::Clock::now();
+		std::string tmpFile = file + ".tmp";
+		std::ofstream ofs(tmpFile, std::ios::out | std::ios::binary | std::ios::trunc);
+		bool ok = ofs.is_open();
+		if (ok) {
+			ofs.write(bytes.data(), bytes.length());
+			ofs.close();
+			ok = !ofs.fail();
+		}
+		if (ok) {
+			boost::system::error_code error;
+			boost::filesystem::rename(boost::filesystem::path(tmpFile),
+					boost::filesystem::path(file), error);
+			ok = !error;
+		}
+		if (!ok)
+			std::cout << "Could not write checkpoint " << file << std::endl;
+		Simulation::Clock::time_point t1 = Simulation::Clock::now();
+		{
+			std::lock_guard<std::mutex> lockMe(mLock);
+			mLastWriteSeconds = 1E-6
+					* std::chrono::duration_cast<std::chrono::microseconds>(
+							t1 - t0).count();
+			if (ok)
+				mWrittenCount++;
+			mWriting = false;
+			mQueueChanged.notify_all();
+		}
+	}
+}
+void CheckpointWriter::flush() {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	while (mHasPending || mWriting) {
+		mQueueChanged.wait(lockMe);
+	}
+}
+CheckpointWriter::~CheckpointWriter() {
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		mRunning = false;
+		mQueueChanged.notify_all();
+	}
+	if (mThread.joinable())
+		mThread.join();
+}
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+#include "ImageSciUtil.h"
+#include "Mesh.h"
+#include <openvdb/openvdb.h>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace imagesci {
+/*
+ * Binary helpers for Simulation::checkpoint. Values are written as raw bytes, so a checkpoint is only
+ * meant to be restored by the same build on the same platform.
+ */
+template<typename T> void WriteCheckpointValue(std::ostream& ostr,
+		const T& value) {
+	ostr.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+template<typename T> bool ReadCheckpointValue(std::istream& istr, T& value) {
+	istr.read(reinterpret_cast<char*>(&value), sizeof(T));
+	return istr.good();
+}
+template<typename T> void WriteCheckpointVector(std::ostream& ostr,
+		const std::vector<T>& values) {
+	openvdb::Index64 count = values.size();
+	WriteCheckpointValue(ostr, count);
+	if (count > 0)
+		ostr.write(reinterpret_cast<const char*>(values.data()),
+				sizeof(T) * count);
+}
+template<typename T> bool ReadCheckpointVector(std::istream& istr,
+		std::vector<T>& values) {
+	openvdb::Index64 count = 0;
+	if (!ReadCheckpointValue(istr, count))
+		return false;
+	values.resize(count);
+	if (count > 0)
+		istr.read(reinterpret_cast<char*>(values.data()), sizeof(T) * count);
+	return !istr.fail();
+}
+//Dense grids are restored into grids allocated with the same dimensions.
+template<typename T> void WriteCheckpointGrid(std::ostream& ostr,
+		const RegularGrid<T>& grid) {
+	openvdb::Index64 count = grid.valueCount();
+	WriteCheckpointValue(ostr, count);
+	ostr.write(reinterpret_cast<const char*>(grid.data()), sizeof(T) * count);
+}
+template<typename T> bool ReadCheckpointGrid(std::istream& istr,
+		RegularGrid<T>& grid) {
+	openvdb::Index64 count = 0;
+	if (!ReadCheckpointValue(istr, count) || count != grid.valueCount())
+		return false;
+	istr.read(reinterpret_cast<char*>(grid.data()), sizeof(T) * count);
+	return !istr.fail();
+}
+void WriteCheckpointString(std::ostream& ostr, const std::string& str);
+bool ReadCheckpointString(std::istream& istr, std::string& str);
+//VDB grids are length prefixed VDB streams, an empty pointer is written as zero length.
+void WriteCheckpointVdb(std::ostream& ostr, openvdb::GridBase::ConstPtr grid);
+bool ReadCheckpointVdb(std::istream& istr, openvdb::GridBase::Ptr& grid);
+template<typename GridT> bool ReadCheckpointVdb(std::istream& istr,
+		typename GridT::Ptr& grid) {
+	openvdb::GridBase::Ptr base;
+	if (!ReadCheckpointVdb(istr, base))
+		return false;
+	grid = openvdb::gridPtrCast<GridT>(base);
+	return (base.get() == NULL || grid.get() != NULL);
+}
+//Geometry buffers only, index buffers are left to the caller.
+void WriteCheckpointMesh(std::ostream& ostr, const Mesh& mesh);
+bool ReadCheckpointMesh(std::istream& istr, Mesh& mesh);
+/*
+ * Writes serialized checkpoints on a background thread. Each checkpoint is written to "<file>.tmp" and renamed
+ * over the previous one, so a job killed mid-write keeps its last complete checkpoint. A checkpoint that is still
+ * waiting when a newer one arrives is replaced.
+ */
+class CheckpointWriter {
+protected:
+	std::string mFile;
+	std::string mPending;
+	bool mHasPending;
+	bool mWriting;
+	bool mRunning;
+	double mLastWriteSeconds;
+	size_t mWrittenCount;
+	std::mutex mLock;
+	std::condition_variable mQueueChanged;
+	std::thread mThread;
+	void process();
+public:
+	CheckpointWriter();
+	//Takes the contents of bytes.
+	void push(const std::string& file, std::string& bytes);
+	void flush();
+	inline double getLastWriteSeconds() const {
+		return mLastWriteSeconds;
+	}
+	inline size_t getWrittenCount() const {
+		return mWrittenCount;
+	}
+	~CheckpointWriter();
+};
+}
+#endif /* CHECKPOINT_H_ */
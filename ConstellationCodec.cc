@@ -0,0 +1,346 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "ConstellationCodec.h"
+using namespace openvdb;
+namespace imagesci {
+static const float MAX_INT16 = 32767.0f;
+static inline float signNotZero(float v) {
+	return (v >= 0.0f) ? 1.0f : -1.0f;
+}
+static inline int16_t quantize(float v) {
+	return static_cast<int16_t>(std::floor(clamp(v, -1.0f, 1.0f) * MAX_INT16 + 0.5f));
+}
+math::Vec2<int16_t> EncodeNormal(const Vec3s& norm) {
+	float l1 = std::abs(norm[0]) + std::abs(norm[1]) + std::abs(norm[2]);
+	if (l1 < 1E-12f) {
+		return math::Vec2<int16_t>(0, 0);
+	}
+	float x = norm[0] / l1;
+	float y = norm[1] / l1;
+	if (norm[2] < 0.0f) {
+		float tx = (1.0f - std::abs(y)) * signNotZero(x);
+		float ty = (1.0f - std::abs(x)) * signNotZero(y);
+		x = tx;
+		y = ty;
+	}
+	return math::Vec2<int16_t>(quantize(x), quantize(y));
+}
+Vec3s DecodeNormal(const math::Vec2<int16_t>& code) {
+	float x = code[0] / MAX_INT16;
+	float y = code[1] / MAX_INT16;
+	Vec3s norm(x, y, 1.0f - std::abs(x) - std::abs(y));
+	if (norm[2] < 0.0f) {
+		norm[0] = (1.0f - std::abs(y)) * signNotZero(x);
+		norm[1] = (1.0f - std::abs(x)) * signNotZero(y);
+	}
+	norm.normalize(1E-6f);
+	return norm;
+}
+void ConstellationDelta::clear() {
+	mQuantum = 0.0f;
+	mRemoved.clear();
+	mVertexDeltas.clear();
+	mParticleDeltas.clear();
+	mParticleNormals.clear();
+	mAddedIds.clear();
+	mAddedSizes.clear();
+	mAddedVertexes.clear();
+	mAddedParticles.clear();
+	mAddedNormals.clear();
+	mParticleVelocityDeltas.clear();
+	mVertexVelocityDeltas.clear();
+	mParticleLabelDeltas.clear();
+	mAddedParticleVelocity.clear();
+	mAddedVertexVelocity.clear();
+	mAddedParticleLabels.clear();
+}
+static inline bool quantizeDelta(const Vec3s& d, float quantum,
+		math::Vec3<int16_t>& q) {
+	bool ok = true;
+	for (int c = 0; c < 3; c++) {
+		float v = std::floor(d[c] / quantum + 0.5f);
+		if (std::abs(v) > MAX_INT16)
+			ok = false;
+		q[c] = static_cast<int16_t>(clamp(v, -MAX_INT16, MAX_INT16));
+	}
+	return ok;
+}
+static inline Vec3s dequantizeDelta(const math::Vec3<int16_t>& q,
+		float quantum) {
+	return quantum * Vec3s(q[0], q[1], q[2]);
+}
+bool ConstellationDelta::encode(const Constellation& constellation,
+		const Constellation& reference, float quantum) {
+	clear();
+	size_t N = constellation.getNumSpringls();
+	size_t M = reference.getNumSpringls();
+	if (constellation.mSpringlIds.size() != N
+			|| reference.mSpringlIds.size() != M || quantum <= 0.0f)
+		return false;
+	//Velocities and labels are either absent or present for every springl of both frames.
+	bool particleVelocity = constellation.mParticleVelocity.size() > 0;
+	bool vertexVelocity = constellation.mVertexVelocity.size() > 0;
+	bool particleLabel = constellation.mParticleLabel.size() > 0;
+	if ((particleVelocity
+			&& (constellation.mParticleVelocity.size() != N
+					|| reference.mParticleVelocity.size() != M))
+			|| (vertexVelocity
+					&& (constellation.mVertexVelocity.size()
+							!= constellation.getNumVertexes()
+							|| reference.mVertexVelocity.size()
+									!= reference.getNumVertexes()))
+			|| (particleLabel
+					&& (constellation.mParticleLabel.size() != N
+							|| reference.mParticleLabel.size() != M)))
+		return false;
+	mQuantum = quantum;
+	std::vector<Index32> survivors;
+	std::vector<char> kept(M, 0);
+	survivors.reserve(N);
+	for (size_t i = 0; i < N; i++) {
+		Index32 index;
+		if (!reference.findSpringl(constellation.mSpringlIds[i], index))
+			continue;
+		//Survivors must come first and keep their order.
+		if (survivors.size() != i
+				|| (survivors.size() > 0 && index <= survivors.back())
+				|| reference.springls[index].size()
+						!= constellation.springls[i].size())
+			return false;
+		survivors.push_back(index);
+		kept[index] = 1;
+	}
+	for (size_t p = 0; p < M; p++) {
+		if (!kept[p])
+			mRemoved.push_back(reference.mSpringlIds[p]);
+	}
+	int S = survivors.size();
+	Index32 survivorVertexes =
+			(S < (int) N) ?
+					constellation.springls[S].offset :
+					constellation.getNumVertexes();
+	mVertexDeltas.resize(survivorVertexes);
+	mParticleDeltas.resize(S);
+	mParticleNormals.resize(S);
+	if (particleVelocity)
+		mParticleVelocityDeltas.resize(S);
+	if (vertexVelocity)
+		mVertexVelocityDeltas.resize(survivorVertexes);
+	if (particleLabel)
+		mParticleLabelDeltas.resize(S);
+	std::vector<char> inRange(S, 1);
+	OPENMP_FOR
+	for (int i = 0; i < S; i++) {
+		const Springl& springl = constellation.springls[i];
+		const Springl& ref = reference.springls[survivors[i]];
+		int K = springl.size();
+		bool ok = quantizeDelta(
+				constellation.mParticles[i] - reference.mParticles[ref.id],
+				quantum, mParticleDeltas[i]);
+		for (int k = 0; k < K; k++) {
+			ok &= quantizeDelta(
+					constellation.mVertexes[springl.offset + k]
+							- reference.mVertexes[ref.offset + k], quantum,
+					mVertexDeltas[springl.offset + k]);
+		}
+		mParticleNormals[i] = EncodeNormal(constellation.mParticleNormals[i]);
+		if (particleVelocity)
+			ok &= quantizeDelta(
+					constellation.mParticleVelocity[i]
+							- reference.mParticleVelocity[ref.id], quantum,
+					mParticleVelocityDeltas[i]);
+		if (vertexVelocity) {
+			for (int k = 0; k < K; k++) {
+				ok &= quantizeDelta(
+						constellation.mVertexVelocity[springl.offset + k]
+								- reference.mVertexVelocity[ref.offset + k],
+						quantum, mVertexVelocityDeltas[springl.offset + k]);
+			}
+		}
+		if (particleLabel)
+			mParticleLabelDeltas[i] = constellation.mParticleLabel[i]
+					- reference.mParticleLabel[ref.id];
+		inRange[i] = ok;
+	}
+	for (char ok : inRange) {
+		if (!ok)
+			return false;
+	}
+	for (size_t i = S; i < N; i++) {
+		const Springl& springl = constellation.springls[i];
+		mAddedIds.push_back(constellation.mSpringlIds[i]);
+		mAddedSizes.push_back(springl.size());
+		mAddedParticles.push_back(constellation.mParticles[i]);
+		mAddedNormals.push_back(constellation.mParticleNormals[i]);
+	}
+	mAddedVertexes.assign(constellation.mVertexes.begin() + survivorVertexes,
+			constellation.mVertexes.end());
+	if (particleVelocity)
+		mAddedParticleVelocity.assign(
+				constellation.mParticleVelocity.begin() + S,
+				constellation.mParticleVelocity.end());
+	if (vertexVelocity)
+		mAddedVertexVelocity.assign(
+				constellation.mVertexVelocity.begin() + survivorVertexes,
+				constellation.mVertexVelocity.end());
+	if (particleLabel)
+		mAddedParticleLabels.assign(constellation.mParticleLabel.begin() + S,
+				constellation.mParticleLabel.end());
+	return true;
+}
+//Survivors only move towards the front, so the reference is compacted in place like SpringLevelSet::clean.
+bool ConstellationDelta::apply(Constellation& reference) const {
+	size_t M = reference.getNumSpringls();
+	if (reference.mSpringlIds.size() != M)
+		return false;
+	//An attribute is present when any springl carries it.
+	bool particleVelocity = mParticleVelocityDeltas.size()
+			+ mAddedParticleVelocity.size() > 0;
+	bool vertexVelocity = mVertexVelocityDeltas.size()
+			+ mAddedVertexVelocity.size() > 0;
+	bool particleLabel = mParticleLabelDeltas.size()
+			+ mAddedParticleLabels.size() > 0;
+	if ((particleVelocity
+			&& (mParticleVelocityDeltas.size() != mParticleDeltas.size()
+					|| mAddedParticleVelocity.size() != mAddedIds.size()
+					|| reference.mParticleVelocity.size() != M))
+			|| (vertexVelocity
+					&& (mVertexVelocityDeltas.size() != mVertexDeltas.size()
+							|| mAddedVertexVelocity.size()
+									!= mAddedVertexes.size()
+							|| reference.mVertexVelocity.size()
+									!= reference.getNumVertexes()))
+			|| (particleLabel
+					&& (mParticleLabelDeltas.size() != mParticleDeltas.size()
+							|| mAddedParticleLabels.size() != mAddedIds.size()
+							|| reference.mParticleLabel.size() != M)))
+		return false;
+	std::vector<char> kept(M, 1);
+	for (Index64 id : mRemoved) {
+		Index32 index;
+		if (!reference.findSpringl(id, index))
+			return false;
+		kept[index] = 0;
+	}
+	if (M - mRemoved.size() != mParticleDeltas.size())
+		return false;
+	reference.releaseIndexes();
+	reference.mGeometry.invalidate();
+	Index32 springlOffset = 0;
+	Index32 vertexOffset = 0;
+	for (size_t p = 0; p < M; p++) {
+		if (!kept[p])
+			continue;
+		const Springl& springl = reference.springls[p];
+		int K = springl.size();
+		Index32 offset = springl.offset;
+		if (vertexOffset + K > mVertexDeltas.size())
+			return false;
+		for (int k = 0; k < K; k++) {
+			reference.mVertexes[vertexOffset + k] = reference.mVertexes[offset
+					+ k] + dequantizeDelta(mVertexDeltas[vertexOffset + k], mQuantum);
+			if (vertexVelocity)
+				reference.mVertexVelocity[vertexOffset + k] =
+						reference.mVertexVelocity[offset + k]
+								+ dequantizeDelta(
+										mVertexVelocityDeltas[vertexOffset + k],
+										mQuantum);
+		}
+		reference.mParticles[springlOffset] = reference.mParticles[p]
+				+ dequantizeDelta(mParticleDeltas[springlOffset], mQuantum);
+		if (particleVelocity)
+			reference.mParticleVelocity[springlOffset] =
+					reference.mParticleVelocity[p]
+							+ dequantizeDelta(
+									mParticleVelocityDeltas[springlOffset],
+									mQuantum);
+		if (particleLabel)
+			reference.mParticleLabel[springlOffset] =
+					reference.mParticleLabel[p]
+							+ mParticleLabelDeltas[springlOffset];
+		reference.mParticleNormals[springlOffset] = DecodeNormal(
+				mParticleNormals[springlOffset]);
+		reference.mSpringlIds[springlOffset] = reference.mSpringlIds[p];
+		reference.mFaces[springlOffset] = Vec4I(vertexOffset, vertexOffset + 1,
+				vertexOffset + 2,
+				(K == 4) ? vertexOffset + 3 : openvdb::util::INVALID_IDX);
+		vertexOffset += K;
+		springlOffset++;
+	}
+	if (vertexOffset != mVertexDeltas.size())
+		return false;
+	reference.mVertexes.resize(vertexOffset);
+	reference.mParticles.resize(springlOffset);
+	reference.mParticleNormals.resize(springlOffset);
+	reference.mSpringlIds.resize(springlOffset);
+	reference.mFaces.resize(springlOffset);
+	reference.mVertexes.insert(reference.mVertexes.end(),
+			mAddedVertexes.begin(), mAddedVertexes.end());
+	for (size_t a = 0; a < mAddedIds.size(); a++) {
+		int K = mAddedSizes[a];
+		reference.mFaces.push_back(
+				Vec4I(vertexOffset, vertexOffset + 1, vertexOffset + 2,
+						(K == 4) ?
+								vertexOffset + 3 : openvdb::util::INVALID_IDX));
+		reference.mParticles.push_back(mAddedParticles[a]);
+		reference.mParticleNormals.push_back(mAddedNormals[a]);
+		reference.mSpringlIds.push_back(mAddedIds[a]);
+		reference.mNextSpringlId = std::max(reference.mNextSpringlId,
+				mAddedIds[a] + 1);
+		vertexOffset += K;
+	}
+	if (vertexOffset != reference.mVertexes.size())
+		return false;
+	if (particleVelocity) {
+		reference.mParticleVelocity.resize(springlOffset);
+		reference.mParticleVelocity.insert(reference.mParticleVelocity.end(),
+				mAddedParticleVelocity.begin(), mAddedParticleVelocity.end());
+	} else {
+		reference.mParticleVelocity.clear();
+	}
+	if (vertexVelocity) {
+		reference.mVertexVelocity.resize(mVertexDeltas.size());
+		reference.mVertexVelocity.insert(reference.mVertexVelocity.end(),
+				mAddedVertexVelocity.begin(), mAddedVertexVelocity.end());
+	} else {
+		reference.mVertexVelocity.clear();
+	}
+	if (particleLabel) {
+		reference.mParticleLabel.resize(springlOffset);
+		reference.mParticleLabel.insert(reference.mParticleLabel.end(),
+				mAddedParticleLabels.begin(), mAddedParticleLabels.end());
+	} else {
+		reference.mParticleLabel.clear();
+	}
+	size_t N = reference.mFaces.size();
+	reference.springls.resize(N, Springl(&reference));
+	Index32 offset = 0;
+	for (size_t i = 0; i < N; i++) {
+		Springl& springl = reference.springls[i];
+		springl.id = i;
+		springl.offset = offset;
+		offset += springl.size();
+	}
+	reference.updateSpringlIdIndex();
+	return true;
+}
+}
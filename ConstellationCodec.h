@@ -0,0 +1,68 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CONSTELLATIONCODEC_H_
+#define CONSTELLATIONCODEC_H_
+#include <openvdb/openvdb.h>
+#include <vector>
+#include <iostream>
+#include "SpringLevelSetBase.h"
+#undef OPENVDB_REQUIRE_VERSION_NAME
+namespace imagesci {
+//Octahedral encoding of a unit vector into two 16 bit values.
+openvdb::math::Vec2<int16_t> EncodeNormal(const openvdb::Vec3s& norm);
+openvdb::Vec3s DecodeNormal(const openvdb::math::Vec2<int16_t>& code);
+/*
+ * Difference between two frames of a constellation, matched by persistent springl id. Clean keeps survivors in
+ * order and fill appends, so a frame is the previous frame without the removed springls followed by the added
+ * ones. Survivor positions are 16 bit deltas against the decoded previous frame, so quantization error does not
+ * accumulate from frame to frame. Survivor velocities are quantized the same way and labels are stored as differences,
+ * which are mostly zero. Added springls are stored in full.
+ */
+class ConstellationDelta {
+public:
+	float mQuantum;
+	std::vector<openvdb::Index64> mRemoved;
+	std::vector<openvdb::math::Vec3<int16_t>> mVertexDeltas;
+	std::vector<openvdb::math::Vec3<int16_t>> mParticleDeltas;
+	std::vector<openvdb::math::Vec2<int16_t>> mParticleNormals;
+	std::vector<openvdb::Index64> mAddedIds;
+	std::vector<uint8_t> mAddedSizes;
+	std::vector<openvdb::Vec3s> mAddedVertexes;
+	std::vector<openvdb::Vec3s> mAddedParticles;
+	std::vector<openvdb::Vec3s> mAddedNormals;
+	std::vector<openvdb::math::Vec3<int16_t>> mParticleVelocityDeltas;
+	std::vector<openvdb::math::Vec3<int16_t>> mVertexVelocityDeltas;
+	std::vector<uint8_t> mParticleLabelDeltas;
+	std::vector<openvdb::Vec3s> mAddedParticleVelocity;
+	std::vector<openvdb::Vec3s> mAddedVertexVelocity;
+	std::vector<uint8_t> mAddedParticleLabels;
+	ConstellationDelta():mQuantum(0.0f){
+	}
+	//Returns false if the frame cannot be expressed as a delta, when springls were reordered or moved out of range.
+	bool encode(const Constellation& constellation,
+			const Constellation& reference, float quantum);
+	//Advance the reference, which must be the previous frame, to this frame.
+	bool apply(Constellation& reference) const;
+	void clear();
+};
+}
+#endif /* CONSTELLATIONCODEC_H_ */
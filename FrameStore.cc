@@ -0,0 +1,730 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "FrameStore.h"
+#include "ImageSciUtil.h"
+#include <openvdb/io/Stream.h>
+#include <openvdb/io/Compression.h>
+#include <boost/filesystem.hpp>
+#include <sstream>
+#include <algorithm>
+using namespace openvdb;
+namespace imagesci {
+const Int32 FrameStore::FILE_MAGIC = 0x464C5353; //"SSLF"
+const Int32 FrameStore::FRAME_MAGIC = 0x4D415246; //"FRAM"
+const Int32 FrameStore::VERSION = 2;
+struct FrameBlockHeader {
+	Int32 mType;
+	Int32 mElementSize;
+	Index64 mCount;
+	Int32 mCompressed;
+	Int32 mReserved;
+};
+struct FrameDeltaHeader {
+	Int64 mKeyFrame;
+	float mQuantum;
+	Int32 mReserved;
+};
+//zlib never compresses by more than this factor, which bounds the decoded size of a compressed block.
+static const Int64 MAX_COMPRESSION_RATIO = 1032;
+//Check the block's element count against the bytes left before end, so a corrupt header is rejected before allocating.
+static bool CheckBlockSize(std::istream& istr, const FrameBlockHeader& header,
+		Int64 end) {
+	if (header.mElementSize <= 0)
+		return header.mCount == 0;
+	Int64 remaining = end - (Int64) istr.tellg();
+	if (!header.mCompressed)
+		return remaining >= 0
+				&& header.mCount <= (Index64) remaining / header.mElementSize;
+	Int64 zippedBytes = 0;
+	istr.read(reinterpret_cast<char*>(&zippedBytes), sizeof(Int64));
+	istr.seekg(-(Int64) sizeof(Int64), std::ios::cur);
+	remaining -= sizeof(Int64);
+	if (istr.fail() || remaining < 0 || std::abs(zippedBytes) > remaining)
+		return false;
+	//Blocks that did not compress are stored raw with a negated size.
+	if (zippedBytes <= 0)
+		return header.mCount <= (Index64) -zippedBytes / header.mElementSize
+				&& header.mCount * header.mElementSize == (Index64) -zippedBytes;
+	return header.mCount
+			<= (Index64) (zippedBytes * MAX_COMPRESSION_RATIO)
+					/ header.mElementSize;
+}
+template<typename T> static bool ReadBlockData(std::istream& istr,
+		const FrameBlockHeader& header, Int64 end, std::vector<T>& values) {
+	if (header.mElementSize != sizeof(T) || !CheckBlockSize(istr, header, end))
+		return false;
+	values.resize(header.mCount);
+	size_t numBytes = sizeof(T) * header.mCount;
+	if (header.mCompressed) {
+		io::unzipFromStream(istr, reinterpret_cast<char*>(values.data()),
+				numBytes);
+	} else if (numBytes > 0) {
+		istr.read(reinterpret_cast<char*>(values.data()), numBytes);
+	}
+	return !istr.fail();
+}
+static bool SkipBlockData(std::istream& istr, const FrameBlockHeader& header,
+		Int64 end) {
+	if (!CheckBlockSize(istr, header, end))
+		return false;
+	Int64 numBytes = header.mElementSize * header.mCount;
+	if (header.mCompressed) {
+		istr.read(reinterpret_cast<char*>(&numBytes), sizeof(Int64));
+		numBytes = std::abs(numBytes);
+	}
+	istr.seekg(numBytes, std::ios::cur);
+	return !istr.fail();
+}
+SimulationTimeStepDescription FrameIndexEntry::getDescription(
+		const std::string& name) const {
+	SimulationTimeStepDescription desc;
+	desc.mSimulationName = name;
+	desc.mSimulationIteration = mSimulationIteration;
+	desc.mSimulationTime = mSimulationTime;
+	desc.mTimeStep = mTimeStep;
+	desc.mSimulationDuration = mSimulationDuration;
+	desc.mComputeTimeSeconds = mComputeTimeSeconds;
+	desc.mMotionScheme = static_cast<MotionScheme>(mMotionScheme);
+	return desc;
+}
+FrameStore::FrameStore() :
+		mCompressed(true), mWritable(false), mDataEnd(0), mKeyFrameInterval(
+				0), mDeltaQuantum(1.0f / 1024.0f), mLastKeyFrame(-1) {
+}
+void FrameStore::setDeltaEncoding(int keyFrameInterval, float quantum) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	mKeyFrameInterval = std::max(keyFrameInterval, 0);
+	mDeltaQuantum = quantum;
+	mLastKeyFrame = -1;
+}
+bool FrameStore::readHeader() {
+	Int32 magic = 0, version = 0, compressed = 0, len = 0;
+	mDataIn.seekg(0, std::ios::beg);
+	mDataIn.read(reinterpret_cast<char*>(&magic), sizeof(Int32));
+	mDataIn.read(reinterpret_cast<char*>(&version), sizeof(Int32));
+	mDataIn.read(reinterpret_cast<char*>(&compressed), sizeof(Int32));
+	mDataIn.read(reinterpret_cast<char*>(&len), sizeof(Int32));
+	if (!mDataIn.good() || magic != FILE_MAGIC || version > VERSION || len < 0)
+		return false;
+	mName.resize(len);
+	if (len > 0)
+		mDataIn.read(&mName[0], len);
+	mCompressed = (compressed != 0);
+	return mDataIn.good();
+}
+//Recover the index by walking the frames in the data file after the first count entries of mIndex, which are kept.
+//The last kept frame is walked again to find where it ends. A truncated trailing frame is dropped.
+bool FrameStore::rebuildIndex(size_t count) {
+	mIndex.resize(std::min(count, mIndex.size()));
+	mDataEnd = 0;
+	mDataIn.clear();
+	mDataIn.seekg(0, std::ios::end);
+	Int64 fileSize = mDataIn.tellg();
+	if (!readHeader())
+		return false;
+	Int64 offset = mDataIn.tellg();
+	if (mIndex.size() > 0) {
+		offset = mIndex.back().mOffset;
+		mIndex.pop_back();
+	}
+	mDataEnd = offset;
+	while (offset < fileSize) {
+		Int32 magic = 0, blocks = 0;
+		FrameIndexEntry entry;
+		mDataIn.seekg(offset, std::ios::beg);
+		mDataIn.read(reinterpret_cast<char*>(&magic), sizeof(Int32));
+		mDataIn.read(reinterpret_cast<char*>(&entry), sizeof(FrameIndexEntry));
+		mDataIn.read(reinterpret_cast<char*>(&blocks), sizeof(Int32));
+		if (!mDataIn.good() || magic != FRAME_MAGIC)
+			break;
+		bool complete = true;
+		for (int b = 0; b < blocks && complete; b++) {
+			FrameBlockHeader header;
+			mDataIn.read(reinterpret_cast<char*>(&header),
+					sizeof(FrameBlockHeader));
+			complete = mDataIn.good()
+					&& SkipBlockData(mDataIn, header, fileSize)
+					&& mDataIn.tellg() <= fileSize;
+		}
+		if (!complete)
+			break;
+		entry.mOffset = offset;
+		mIndex.push_back(entry);
+		offset = mDataIn.tellg();
+		mDataEnd = offset;
+	}
+	mDataIn.clear();
+	return true;
+}
+bool FrameStore::create(const std::string& file, const std::string& name,
+		long resumeIteration, bool compressed) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	close();
+	mFile = file;
+	mName = name;
+	mCompressed = compressed;
+	if (resumeIteration >= 0
+			&& boost::filesystem::exists(boost::filesystem::path(mFile))) {
+		//Resume a restored run. Frames after the restored iteration are recorded again, so they are cut.
+		mDataIn.open(mFile, std::ios::in | std::ios::binary);
+		bool ok = rebuildIndex(0);
+		mDataIn.close();
+		if (!ok)
+			return false;
+		size_t count = 0;
+		while (count < mIndex.size()
+				&& mIndex[count].mSimulationIteration <= resumeIteration)
+			count++;
+		if (count < mIndex.size()) {
+			mDataEnd = mIndex[count].mOffset;
+			mIndex.resize(count);
+		}
+		boost::filesystem::resize_file(boost::filesystem::path(mFile),
+				mDataEnd);
+		mDataOut.open(mFile, std::ios::out | std::ios::binary | std::ios::app);
+		mIndexOut.open(getIndexFile(mFile),
+				std::ios::out | std::ios::binary | std::ios::trunc);
+		if (mIndex.size() > 0)
+			mIndexOut.write(reinterpret_cast<const char*>(&mIndex[0]),
+					sizeof(FrameIndexEntry) * mIndex.size());
+		mIndexOut.flush();
+	} else {
+		//A fresh run replaces any previous recording.
+		mDataOut.open(mFile,
+				std::ios::out | std::ios::binary | std::ios::trunc);
+		mIndexOut.open(getIndexFile(mFile),
+				std::ios::out | std::ios::binary | std::ios::trunc);
+		if (mDataOut.is_open()) {
+			Int32 compressedFlag = (mCompressed) ? 1 : 0;
+			Int32 len = mName.length();
+			mDataOut.write(reinterpret_cast<const char*>(&FILE_MAGIC),
+					sizeof(Int32));
+			mDataOut.write(reinterpret_cast<const char*>(&VERSION),
+					sizeof(Int32));
+			mDataOut.write(reinterpret_cast<const char*>(&compressedFlag),
+					sizeof(Int32));
+			mDataOut.write(reinterpret_cast<const char*>(&len), sizeof(Int32));
+			mDataOut.write(mName.c_str(), len);
+			mDataOut.flush();
+			mDataEnd = mDataOut.tellp();
+		}
+	}
+	mWritable = mDataOut.is_open() && mIndexOut.is_open();
+	return mWritable;
+}
+bool FrameStore::open(const std::string& file) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	close();
+	mFile = file;
+	mDataIn.open(mFile, std::ios::in | std::ios::binary);
+	if (!mDataIn.is_open() || !readHeader())
+		return false;
+	mDataIn.seekg(0, std::ios::end);
+	Int64 fileSize = mDataIn.tellg();
+	std::ifstream indexIn(getIndexFile(mFile), std::ios::in | std::ios::binary);
+	if (indexIn.is_open()) {
+		indexIn.seekg(0, std::ios::end);
+		size_t count = indexIn.tellg() / sizeof(FrameIndexEntry);
+		indexIn.seekg(0, std::ios::beg);
+		mIndex.resize(count);
+		if (count > 0)
+			indexIn.read(reinterpret_cast<char*>(&mIndex[0]),
+					sizeof(FrameIndexEntry) * count);
+		if (indexIn.fail()
+				|| (count > 0 && mIndex.back().mOffset >= fileSize)) {
+			mIndex.clear();
+		}
+	}
+	//Frames appended after the last index flush are recovered by walking the data file from the last indexed frame.
+	size_t indexed = mIndex.size();
+	if (indexed == 0)
+		std::cout << "Rebuilding frame index for " << mFile << std::endl;
+	if (!rebuildIndex(indexed))
+		return false;
+	if (indexed > 0 && mIndex.size() > indexed)
+		std::cout << "Recovered " << (mIndex.size() - indexed) << " unindexed frames in " << mFile << std::endl;
+	return true;
+}
+void FrameStore::writeBlock(BlockType type, Int32 elementSize, Index64 count,
+		const char* data, bool compress) {
+	size_t numBytes = elementSize * count;
+	compress = compress && numBytes > 0;
+	FrameBlockHeader header;
+	header.mType = type;
+	header.mElementSize = elementSize;
+	header.mCount = count;
+	header.mCompressed = (compress) ? 1 : 0;
+	header.mReserved = 0;
+	mDataOut.write(reinterpret_cast<const char*>(&header),
+			sizeof(FrameBlockHeader));
+	if (compress) {
+		io::zipToStream(mDataOut, data, numBytes);
+	} else if (numBytes > 0) {
+		mDataOut.write(data, numBytes);
+	}
+}
+static Int32 GetMetric(const std::map<std::string, double>& metrics,
+		const std::string& name) {
+	std::map<std::string, double>::const_iterator iter = metrics.find(name);
+	return (iter != metrics.end()) ? static_cast<Int32>(iter->second) : 0;
+}
+bool FrameStore::append(const SimulationTimeStepDescription& desc,
+		const std::map<std::string, double>& metrics,
+		const Constellation& constellation, const Mesh& isoSurface,
+		const ParticleVolume& particleVolume, FloatGrid::Ptr signedLevelSet) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (!mWritable)
+		return false;
+	FrameIndexEntry entry;
+	entry.mOffset = mDataEnd;
+	entry.mSimulationIteration = desc.mSimulationIteration;
+	entry.mSimulationTime = desc.mSimulationTime;
+	entry.mTimeStep = desc.mTimeStep;
+	entry.mSimulationDuration = desc.mSimulationDuration;
+	entry.mComputeTimeSeconds = desc.mComputeTimeSeconds;
+	entry.mMotionScheme = desc.mMotionScheme;
+	entry.mElements = constellation.getNumSpringls();
+	entry.mRemoved = GetMetric(metrics, "Removed");
+	entry.mAdded = GetMetric(metrics, "Added");
+	std::string signedLevelSetBytes;
+	if (signedLevelSet.get() != NULL) {
+		try {
+			std::ostringstream ostr(std::ios_base::binary);
+			GridCPtrVec grids;
+			grids.push_back(signedLevelSet);
+			io::Stream(ostr).write(grids);
+			signedLevelSetBytes = ostr.str();
+		} catch (openvdb::Exception& e) {
+			std::cout << "OpenVDB: " << e.what() << std::endl;
+		}
+	}
+	//Deltas are applied to the write reference so the next frame is encoded against what a reader reconstructs.
+	bool delta = false;
+	if (mKeyFrameInterval > 0 && mLastKeyFrame >= 0
+			&& (long) mIndex.size() - mLastKeyFrame < mKeyFrameInterval
+			&& mWriteDelta.encode(constellation, mWriteReference,
+					mDeltaQuantum)) {
+		delta = mWriteDelta.apply(mWriteReference);
+	}
+	Int32 blocks = (delta) ? 21 : 13;
+	mDataOut.write(reinterpret_cast<const char*>(&FRAME_MAGIC), sizeof(Int32));
+	mDataOut.write(reinterpret_cast<const char*>(&entry),
+			sizeof(FrameIndexEntry));
+	mDataOut.write(reinterpret_cast<const char*>(&blocks), sizeof(Int32));
+	if (delta) {
+		FrameDeltaHeader deltaHeader;
+		deltaHeader.mKeyFrame = mLastKeyFrame;
+		deltaHeader.mQuantum = mWriteDelta.mQuantum;
+		deltaHeader.mReserved = 0;
+		writeBlock(DELTA_HEADER, sizeof(FrameDeltaHeader), 1,
+				reinterpret_cast<const char*>(&deltaHeader), false);
+		writeBlock(DELTA_REMOVED, mWriteDelta.mRemoved);
+		writeBlock(DELTA_VERTEXES, mWriteDelta.mVertexDeltas);
+		writeBlock(DELTA_PARTICLES, mWriteDelta.mParticleDeltas);
+		writeBlock(DELTA_NORMALS, mWriteDelta.mParticleNormals);
+		writeBlock(ADDED_IDS, mWriteDelta.mAddedIds);
+		writeBlock(ADDED_SIZES, mWriteDelta.mAddedSizes);
+		writeBlock(ADDED_VERTEXES, mWriteDelta.mAddedVertexes);
+		writeBlock(ADDED_PARTICLES, mWriteDelta.mAddedParticles);
+		writeBlock(ADDED_NORMALS, mWriteDelta.mAddedNormals);
+		writeBlock(DELTA_PARTICLE_VELOCITY,
+				mWriteDelta.mParticleVelocityDeltas);
+		writeBlock(DELTA_VERTEX_VELOCITY, mWriteDelta.mVertexVelocityDeltas);
+		writeBlock(DELTA_PARTICLE_LABEL, mWriteDelta.mParticleLabelDeltas);
+		writeBlock(ADDED_PARTICLE_VELOCITY,
+				mWriteDelta.mAddedParticleVelocity);
+		writeBlock(ADDED_VERTEX_VELOCITY, mWriteDelta.mAddedVertexVelocity);
+		writeBlock(ADDED_PARTICLE_LABEL, mWriteDelta.mAddedParticleLabels);
+	} else {
+		writeBlock(PARTICLES, constellation.mParticles);
+		writeBlock(PARTICLE_NORMALS, constellation.mParticleNormals);
+		writeBlock(PARTICLE_VELOCITY, constellation.mParticleVelocity);
+		writeBlock(PARTICLE_LABEL, constellation.mParticleLabel);
+		writeBlock(VERTEXES, constellation.mVertexes);
+		writeBlock(VERTEX_VELOCITY, constellation.mVertexVelocity);
+		writeBlock(FACES, constellation.mFaces);
+		writeBlock(SPRINGL_IDS, constellation.mSpringlIds);
+		if (mKeyFrameInterval > 0) {
+			mWriteReference.copy(constellation);
+			mLastKeyFrame = mIndex.size();
+		}
+	}
+	writeBlock(ISO_VERTEXES, isoSurface.mVertexes);
+	writeBlock(ISO_FACES, isoSurface.mFaces);
+	writeBlock(FLUID_PARTICLES, particleVolume.mParticles);
+	writeBlock(FLUID_VELOCITIES, particleVolume.mVelocities);
+	//VDB grids are already compressed.
+	writeBlock(SIGNED_LEVEL_SET, 1, signedLevelSetBytes.size(),
+			signedLevelSetBytes.data(), false);
+	mDataOut.flush();
+	if (!mDataOut.good()) {
+		mLastKeyFrame = -1;
+		return false;
+	}
+	mDataEnd = mDataOut.tellp();
+	//The index entry is written after the frame so a crash never indexes a partial frame.
+	mIndexOut.write(reinterpret_cast<const char*>(&entry),
+			sizeof(FrameIndexEntry));
+	mIndexOut.flush();
+	mIndex.push_back(entry);
+	return mIndexOut.good();
+}
+bool FrameStore::read(size_t frame, SpringLevelSet& source) {
+	FloatGrid::Ptr signedLevelSet;
+	if (!read(frame, source.mConstellation, source.mIsoSurface,
+			source.mParticleVolume, signedLevelSet))
+		return false;
+	if (signedLevelSet.get() != NULL) {
+		source.transform() = signedLevelSet->transform();
+		signedLevelSet->setTransform(Transform::createLinearTransform(1.0));
+		source.mSignedLevelSet = signedLevelSet;
+	}
+	return true;
+}
+bool FrameStore::read(size_t frame, Constellation& constellation,
+		Mesh& isoSurface, ParticleVolume& particleVolume,
+		FloatGrid::Ptr& signedLevelSet) {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	if (frame >= mIndex.size())
+		return false;
+	//Take the idle reader nearest before the frame, so sequential reads apply a single delta.
+	std::unique_ptr<FrameReader> reader;
+	int best = -1;
+	for (int i = 0; i < (int) mIdleReaders.size(); i++) {
+		long ref = mIdleReaders[i]->mReferenceFrame;
+		if (ref < (long) frame
+				&& (best < 0 || ref > mIdleReaders[best]->mReferenceFrame))
+			best = i;
+	}
+	//Otherwise reuse any idle reader, which decodes from the keyframe, so there are never more readers than concurrent reads.
+	if (best < 0 && mIdleReaders.size() > 0)
+		best = mIdleReaders.size() - 1;
+	if (best >= 0) {
+		reader = std::move(mIdleReaders[best]);
+		mIdleReaders.erase(mIdleReaders.begin() + best);
+	} else {
+		reader.reset(new FrameReader());
+		reader->mDataIn.open(mFile, std::ios::in | std::ios::binary);
+		if (!reader->mDataIn.is_open())
+			return false;
+	}
+	//The index only grows while recording, so frames being appended are read under the lock.
+	if (!mWritable)
+		lockMe.unlock();
+	bool ok = readFrame(*reader, frame, &isoSurface, &particleVolume,
+			&signedLevelSet);
+	if (ok)
+		constellation.copy(reader->mReference);
+	if (!lockMe.owns_lock())
+		lockMe.lock();
+	mIdleReaders.push_back(std::move(reader));
+	return ok;
+}
+bool FrameStore::readFrame(FrameReader& reader, size_t frame, Mesh* isoSurface,
+		ParticleVolume* particleVolume, FloatGrid::Ptr* signedLevelSet) {
+	std::ifstream& istr = reader.mDataIn;
+	if (frame >= mIndex.size() || !istr.is_open())
+		return false;
+	Int32 magic = 0, blocks = 0;
+	FrameIndexEntry entry;
+	istr.clear();
+	istr.seekg(mIndex[frame].mOffset, std::ios::beg);
+	istr.read(reinterpret_cast<char*>(&magic), sizeof(Int32));
+	istr.read(reinterpret_cast<char*>(&entry), sizeof(FrameIndexEntry));
+	istr.read(reinterpret_cast<char*>(&blocks), sizeof(Int32));
+	if (!istr.good() || magic != FRAME_MAGIC)
+		return false;
+	//Blocks of this frame end where the next frame starts.
+	Int64 frameEnd =
+			(frame + 1 < mIndex.size()) ? mIndex[frame + 1].mOffset : mDataEnd;
+	Constellation& constellation = reader.mReference;
+	bool delta = false;
+	bool ok = true;
+	for (int b = 0; b < blocks && ok; b++) {
+		FrameBlockHeader header;
+		istr.read(reinterpret_cast<char*>(&header),
+				sizeof(FrameBlockHeader));
+		if (!istr.good()) {
+			ok = false;
+			break;
+		}
+		if (b == 0 && header.mType != DELTA_HEADER) {
+			//Keyframe, discard the previous frame.
+			reader.mReferenceFrame = -1;
+			constellation.releaseIndexes();
+			constellation.mGeometry.invalidate();
+			constellation.mParticleVelocity.clear();
+			constellation.mVertexVelocity.clear();
+			constellation.mParticleLabel.clear();
+			constellation.mSpringlIds.clear();
+		}
+		switch (header.mType) {
+		case DELTA_HEADER: {
+			std::vector<FrameDeltaHeader> deltaHeader;
+			ok = ReadBlockData(istr, header, frameEnd, deltaHeader)
+					&& deltaHeader.size() == 1
+					&& deltaHeader[0].mKeyFrame < (Int64) frame;
+			if (!ok)
+				break;
+			if (reader.mReferenceFrame != (long) frame - 1) {
+				//Seek, decode forward from the keyframe.
+				std::streampos pos = istr.tellg();
+				size_t start = deltaHeader[0].mKeyFrame;
+				if (reader.mReferenceFrame >= (long) start
+						&& reader.mReferenceFrame < (long) frame)
+					start = reader.mReferenceFrame + 1;
+				for (size_t j = start; j < frame && ok; j++) {
+					ok = readFrame(reader, j, NULL, NULL, NULL);
+				}
+				istr.clear();
+				istr.seekg(pos);
+			}
+			reader.mReadDelta.clear();
+			reader.mReadDelta.mQuantum = deltaHeader[0].mQuantum;
+			delta = true;
+			break;
+		}
+		case PARTICLES:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mParticles);
+			break;
+		case PARTICLE_NORMALS:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mParticleNormals);
+			break;
+		case PARTICLE_VELOCITY:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mParticleVelocity);
+			break;
+		case PARTICLE_LABEL:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mParticleLabel);
+			break;
+		case VERTEXES:
+			ok = ReadBlockData(istr, header, frameEnd, constellation.mVertexes);
+			break;
+		case VERTEX_VELOCITY:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mVertexVelocity);
+			break;
+		case FACES:
+			ok = ReadBlockData(istr, header, frameEnd, constellation.mFaces);
+			break;
+		case SPRINGL_IDS:
+			ok = ReadBlockData(istr, header, frameEnd,
+					constellation.mSpringlIds);
+			break;
+		case DELTA_REMOVED:
+			ok = delta && ReadBlockData(istr, header, frameEnd,
+					reader.mReadDelta.mRemoved);
+			break;
+		case DELTA_VERTEXES:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mVertexDeltas);
+			break;
+		case DELTA_PARTICLES:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mParticleDeltas);
+			break;
+		case DELTA_NORMALS:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mParticleNormals);
+			break;
+		case ADDED_IDS:
+			ok = delta && ReadBlockData(istr, header, frameEnd,
+					reader.mReadDelta.mAddedIds);
+			break;
+		case ADDED_SIZES:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedSizes);
+			break;
+		case ADDED_VERTEXES:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedVertexes);
+			break;
+		case ADDED_PARTICLES:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedParticles);
+			break;
+		case ADDED_NORMALS:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedNormals);
+			break;
+		case DELTA_PARTICLE_VELOCITY:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mParticleVelocityDeltas);
+			break;
+		case DELTA_VERTEX_VELOCITY:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mVertexVelocityDeltas);
+			break;
+		case DELTA_PARTICLE_LABEL:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mParticleLabelDeltas);
+			break;
+		case ADDED_PARTICLE_VELOCITY:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedParticleVelocity);
+			break;
+		case ADDED_VERTEX_VELOCITY:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedVertexVelocity);
+			break;
+		case ADDED_PARTICLE_LABEL:
+			ok = delta
+					&& ReadBlockData(istr, header, frameEnd,
+							reader.mReadDelta.mAddedParticleLabels);
+			break;
+		case ISO_VERTEXES:
+			if (isoSurface != NULL)
+				ok = ReadBlockData(istr, header, frameEnd,
+							isoSurface->mVertexes);
+			else
+				ok = SkipBlockData(istr, header, frameEnd);
+			break;
+		case ISO_FACES:
+			if (isoSurface != NULL)
+				ok = ReadBlockData(istr, header, frameEnd, isoSurface->mFaces);
+			else
+				ok = SkipBlockData(istr, header, frameEnd);
+			break;
+		case FLUID_PARTICLES:
+			if (particleVolume != NULL)
+				ok = ReadBlockData(istr, header, frameEnd,
+						particleVolume->mParticles);
+			else
+				ok = SkipBlockData(istr, header, frameEnd);
+			break;
+		case FLUID_VELOCITIES:
+			if (particleVolume != NULL)
+				ok = ReadBlockData(istr, header, frameEnd,
+						particleVolume->mVelocities);
+			else
+				ok = SkipBlockData(istr, header, frameEnd);
+			break;
+		case SIGNED_LEVEL_SET:
+			if (signedLevelSet != NULL && header.mCount > 0) {
+				if (header.mElementSize != 1 || header.mCompressed
+						|| !CheckBlockSize(istr, header, frameEnd)) {
+					ok = false;
+					break;
+				}
+				std::string bytes(header.mCount, '\0');
+				istr.read(&bytes[0], header.mCount);
+				try {
+					std::istringstream gridIn(bytes, std::ios_base::binary);
+					GridPtrVecPtr grids = io::Stream(gridIn).getGrids();
+					if (grids.get() != NULL && grids->size() > 0) {
+						*signedLevelSet = gridPtrCast<FloatGrid>((*grids)[0]);
+					}
+				} catch (openvdb::Exception& e) {
+					std::cout << "OpenVDB: " << e.what() << std::endl;
+				}
+			} else {
+				ok = SkipBlockData(istr, header, frameEnd);
+			}
+			break;
+		default:
+			//Skip blocks from newer writers.
+			ok = SkipBlockData(istr, header, frameEnd);
+			break;
+		}
+		ok = ok && !istr.fail();
+	}
+	if (ok && delta) {
+		//A failed delta leaves the reference partially updated.
+		ok = (reader.mReferenceFrame == (long) frame - 1)
+				&& reader.mReadDelta.apply(constellation);
+	} else if (ok) {
+		//Springl vertexes are contiguous, so springls follow directly from the faces.
+		size_t N = constellation.mFaces.size();
+		constellation.springls.resize(N, Springl(&constellation));
+		Index32 offset = 0;
+		for (size_t i = 0; i < N; i++) {
+			Springl& springl = constellation.springls[i];
+			springl.id = i;
+			springl.offset = offset;
+			offset += springl.size();
+		}
+		//Recordings without ids get fresh ones.
+		if (constellation.mSpringlIds.size() == N) {
+			constellation.mNextSpringlId = 0;
+			for (Index64 id : constellation.mSpringlIds) {
+				constellation.mNextSpringlId = std::max(
+						constellation.mNextSpringlId, id + 1);
+			}
+		}
+		constellation.updateSpringlIdIndex();
+	}
+	if (!ok) {
+		reader.mReferenceFrame = -1;
+		return false;
+	}
+	reader.mReferenceFrame = frame;
+	if (isoSurface != NULL) {
+		isoSurface->mQuadIndexes.clear();
+		isoSurface->mTriIndexes.clear();
+		for (Vec4I& face : isoSurface->mFaces) {
+			if (face[3] == openvdb::util::INVALID_IDX) {
+				isoSurface->mTriIndexes.push_back(face[0]);
+				isoSurface->mTriIndexes.push_back(face[1]);
+				isoSurface->mTriIndexes.push_back(face[2]);
+			} else {
+				isoSurface->mQuadIndexes.push_back(face[0]);
+				isoSurface->mQuadIndexes.push_back(face[1]);
+				isoSurface->mQuadIndexes.push_back(face[2]);
+				isoSurface->mQuadIndexes.push_back(face[3]);
+			}
+		}
+		isoSurface->mVertexNormals.clear();
+	}
+	return true;
+}
+void FrameStore::close() {
+	if (mDataOut.is_open())
+		mDataOut.close();
+	if (mIndexOut.is_open())
+		mIndexOut.close();
+	if (mDataIn.is_open())
+		mDataIn.close();
+	mIndex.clear();
+	mWritable = false;
+	mDataEnd = 0;
+	mLastKeyFrame = -1;
+	mIdleReaders.clear();
+}
+FrameStore::~FrameStore() {
+	close();
+}
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FRAMESTORE_H_
+#define FRAMESTORE_H_
+#include "Simulation.h"
+#include "ConstellationCodec.h"
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+namespace imagesci {
+//Fixed size record so frame i of the index is found at i*sizeof(FrameIndexEntry).
+struct FrameIndexEntry {
+	openvdb::Int64 mOffset;
+	openvdb::Int64 mSimulationIteration;
+	double mSimulationTime;
+	double mTimeStep;
+	double mSimulationDuration;
+	double mComputeTimeSeconds;
+	openvdb::Int32 mMotionScheme;
+	openvdb::Int32 mElements;
+	openvdb::Int32 mRemoved;
+	openvdb::Int32 mAdded;
+	SimulationTimeStepDescription getDescription(const std::string& name) const;
+};
+/*
+ * Append-only recording of a simulation run. Every frame is a sequence of columnar blocks (particles, vertexes,
+ * normals, faces, fluid particles and the signed level set) appended to one data file, and a fixed size entry
+ * appended to "<file>.idx" so any frame can be located without scanning. Blocks are optionally zlib compressed.
+ * With delta encoding enabled, frames between keyframes store only the springl changes from the previous frame
+ * (see ConstellationDelta), and reading one decodes forward from its keyframe.
+ */
+class FrameStore {
+public:
+	enum BlockType {
+		PARTICLES = 1,
+		PARTICLE_NORMALS = 2,
+		PARTICLE_VELOCITY = 3,
+		PARTICLE_LABEL = 4,
+		VERTEXES = 5,
+		VERTEX_VELOCITY = 6,
+		FACES = 7,
+		ISO_VERTEXES = 8,
+		ISO_FACES = 9,
+		FLUID_PARTICLES = 10,
+		FLUID_VELOCITIES = 11,
+		SIGNED_LEVEL_SET = 12,
+		SPRINGL_IDS = 13,
+		DELTA_HEADER = 14,
+		DELTA_REMOVED = 15,
+		DELTA_VERTEXES = 16,
+		DELTA_PARTICLES = 17,
+		DELTA_NORMALS = 18,
+		ADDED_IDS = 19,
+		ADDED_SIZES = 20,
+		ADDED_VERTEXES = 21,
+		ADDED_PARTICLES = 22,
+		ADDED_NORMALS = 23,
+		DELTA_PARTICLE_VELOCITY = 24,
+		DELTA_VERTEX_VELOCITY = 25,
+		DELTA_PARTICLE_LABEL = 26,
+		ADDED_PARTICLE_VELOCITY = 27,
+		ADDED_VERTEX_VELOCITY = 28,
+		ADDED_PARTICLE_LABEL = 29
+	};
+	static const openvdb::Int32 FILE_MAGIC;
+	static const openvdb::Int32 FRAME_MAGIC;
+	static const openvdb::Int32 VERSION;
+protected:
+	std::string mFile;
+	std::string mName;
+	bool mCompressed;
+	bool mWritable;
+	openvdb::Int64 mDataEnd;
+	std::ofstream mDataOut;
+	std::ofstream mIndexOut;
+	std::ifstream mDataIn;
+	std::vector<FrameIndexEntry> mIndex;
+	std::mutex mLock;
+	int mKeyFrameInterval;
+	float mDeltaQuantum;
+	long mLastKeyFrame;
+	Constellation mWriteReference;
+	ConstellationDelta mWriteDelta;
+	//Stream and last decoded frame of one reader, so concurrent reads decode in parallel and each continues from its own frame.
+	struct FrameReader {
+		std::ifstream mDataIn;
+		Constellation mReference;
+		ConstellationDelta mReadDelta;
+		long mReferenceFrame;
+		FrameReader() :
+				mReferenceFrame(-1) {
+		}
+	};
+	std::vector<std::unique_ptr<FrameReader>> mIdleReaders;
+	bool readHeader();
+	//Decode the springls of a frame into the reader's reference. Other blocks are skipped when their output is NULL.
+	bool readFrame(FrameReader& reader, size_t frame, Mesh* isoSurface,
+			ParticleVolume* particleVolume,
+			openvdb::FloatGrid::Ptr* signedLevelSet);
+	bool rebuildIndex(size_t count);
+	void writeBlock(BlockType type, openvdb::Int32 elementSize,
+			openvdb::Index64 count, const char* data, bool compress);
+	template<typename T> void writeBlock(BlockType type,
+			const std::vector<T>& values) {
+		writeBlock(type, sizeof(T), values.size(),
+				reinterpret_cast<const char*>(values.data()), mCompressed);
+	}
+public:
+	FrameStore();
+	//Open a store for recording. A negative resumeIteration starts a new recording, replacing an existing file.
+	//Otherwise the existing recording is kept up to and including resumeIteration and appended to.
+	bool create(const std::string& file, const std::string& name,
+			long resumeIteration = -1, bool compressed = true);
+	//Open an existing store for reading.
+	bool open(const std::string& file);
+	//Write a keyframe every keyFrameInterval frames and deltas in between. Zero writes only keyframes.
+	void setDeltaEncoding(int keyFrameInterval,
+			float quantum = 1.0f / 1024.0f);
+	//The signed level set is recorded with its own transform, the simulation transform when stashed.
+	bool append(const SimulationTimeStepDescription& desc,
+			const std::map<std::string, double>& metrics,
+			const Constellation& constellation, const Mesh& isoSurface,
+			const ParticleVolume& particleVolume,
+			openvdb::FloatGrid::Ptr signedLevelSet);
+	bool read(size_t frame, SpringLevelSet& source);
+	//Read into standalone buffers. The signed level set keeps its recorded transform.
+	bool read(size_t frame, Constellation& constellation, Mesh& isoSurface,
+			ParticleVolume& particleVolume,
+			openvdb::FloatGrid::Ptr& signedLevelSet);
+	void close();
+	inline size_t getNumFrames() const {
+		return mIndex.size();
+	}
+	inline const FrameIndexEntry& getEntry(size_t frame) const {
+		return mIndex[frame];
+	}
+	inline const std::string& getName() const {
+		return mName;
+	}
+	inline const std::string& getFile() const {
+		return mFile;
+	}
+	static std::string getIndexFile(const std::string& file) {
+		return file + ".idx";
+	}
+	~FrameStore();
+};
+}
+#endif /* FRAMESTORE_H_ */
@@ -54,6 +54,31 @@ struct MakeString{
 	operator std::string() const { return ss.str(); }
 	template<class T> MakeString & operator << (const T & val) { ss << val; return *this; }
 };
+//64-bit FNV-1a hash of raw bytes, for keying on-disk caches by content.
+class ContentHash {
+protected:
+	uint64_t mHash;
+public:
+	ContentHash():mHash(14695981039346656037ULL){
+	}
+	inline void append(const void* data,size_t numBytes){
+		const unsigned char* bytes=static_cast<const unsigned char*>(data);
+		for(size_t i=0;i<numBytes;i++){
+			mHash=(mHash^bytes[i])*1099511628211ULL;
+		}
+	}
+	template<typename T> inline void append(const T& value){
+		append(&value,sizeof(T));
+	}
+	template<typename T> inline void append(const std::vector<T>& values){
+		uint64_t count=values.size();
+		append(&count,sizeof(uint64_t));
+		if(count>0)append(values.data(),sizeof(T)*count);
+	}
+	inline uint64_t digest() const {
+		return mHash;
+	}
+};
 template<typename T> T clamp(T val, T min, T max) {
 	return std::min(std::max(val, min), max);
 }
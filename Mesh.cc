@@ -25,6 +25,7 @@
 #include <openvdb/util/Util.h>
 #include <vector>
 #include <list>
+#include "PlyBlockIO.h"
 #include "ply_io.h"
 namespace imagesci {
 
@@ -66,6 +67,23 @@ void Mesh::reset() {
 	mFaces.clear();
 	mVertexAuxBuffer.clear();
 }
+void Mesh::swap(Mesh& mesh) {
+	mLines.swap(mesh.mLines);
+	mParticles.swap(mesh.mParticles);
+	mParticleNormals.swap(mesh.mParticleNormals);
+	mVertexes.swap(mesh.mVertexes);
+	mColors.swap(mesh.mColors);
+	mVertexNormals.swap(mesh.mVertexNormals);
+	mQuadIndexes.swap(mesh.mQuadIndexes);
+	mTriIndexes.swap(mesh.mTriIndexes);
+	uvMap.swap(mesh.uvMap);
+	mVertexAuxBuffer.swap(mesh.mVertexAuxBuffer);
+	mParticleVelocity.swap(mesh.mParticleVelocity);
+	mVertexVelocity.swap(mesh.mVertexVelocity);
+	mParticleLabel.swap(mesh.mParticleLabel);
+	mFaces.swap(mesh.mFaces);
+	std::swap(mBoundingBox, mesh.mBoundingBox);
+}
 bool Mesh::save(const std::string& f) {
 	if (mVertexes.size() == 0)
 		return false;
@@ -75,6 +93,19 @@ bool Mesh::save(const std::string& f) {
 	int i, j, idx;
 	const char* fileName = f.c_str();
 	bool usingTexture = (uvMap.size() > 0);
+	MeshIndexes indexes;
+	getIndexes(indexes);
+	const std::vector<Index32>& quads = *indexes.mQuads;
+	const std::vector<Index32>& tris = *indexes.mTris;
+	const std::vector<Vec3s>& normals = *indexes.mNormals;
+	if (!usingTexture) {
+		bool written = WritePlyMeshBlock(f, *this, indexes);
+		if (written) {
+			std::cout << "Done." << std::endl;
+			return true;
+		}
+	}
+	std::lock_guard<std::mutex> lockMe(GetPlyIOLock());
 
 	PlyFile *ply;
 
@@ -89,7 +120,7 @@ bool Mesh::save(const std::string& f) {
 	// compute colors, if any
 	int numPts = mVertexes.size();
 
-	int numPolys = mQuadIndexes.size() / 4 + mTriIndexes.size() / 3;
+	int numPolys = quads.size() / 4 + tris.size() / 3;
 
 	std::vector<unsigned char> pointColors;
 
@@ -112,7 +143,7 @@ bool Mesh::save(const std::string& f) {
 	ply_describe_property(ply, "vertex", &MeshVertProps[1]);
 	ply_describe_property(ply, "vertex", &MeshVertProps[2]);
 
-	if(mVertexNormals.size()>0){
+	if(normals.size()>0){
 		ply_describe_property(ply, "vertex", &MeshVertProps[3]);
 		ply_describe_property(ply, "vertex", &MeshVertProps[4]);
 		ply_describe_property(ply, "vertex", &MeshVertProps[5]);
@@ -158,8 +189,8 @@ bool Mesh::save(const std::string& f) {
 		vert.x[0] = pt[0];
 		vert.x[1] = pt[1];
 		vert.x[2] = pt[2];
-		if(mVertexNormals.size()>0){
-			Vec3s n=mVertexNormals[i];
+		if(normals.size()>0){
+			Vec3s n=normals[i];
 			vert.n[0]=n[0];
 			vert.n[1]=n[1];
 			vert.n[2]=n[2];
@@ -195,12 +226,12 @@ bool Mesh::save(const std::string& f) {
 	faceT.uvs = (float*) uvs;
 	put_element_setup_ply(ply, "face");
 	if (usingTexture) {
-		int sz = mQuadIndexes.size() / 4;
+		int sz = quads.size() / 4;
 		for (int i = 0; i < sz; i++) {
 			faceT.nverts = 4;
 			faceT.uvcount = 8;
 			for (j = 0; j < 4; j++) {
-				faceT.verts[j] = mQuadIndexes[4 * i + j];
+				faceT.verts[j] = quads[4 * i + j];
 				uvs[j] = uvMap[4 * i + j];
 			}
 			if(faceT.velocity!=NULL){
@@ -211,12 +242,12 @@ bool Mesh::save(const std::string& f) {
 			}
 			put_element_ply(ply, (void *) &faceT);
 		}
-		sz = mTriIndexes.size() / 3;
+		sz = tris.size() / 3;
 		for (int i = 0; i < sz; i++) {
 			faceT.nverts = 3;
 			faceT.uvcount = 6;
 			for (j = 0; j < 3; j++) {
-				faceT.verts[j] = mTriIndexes[3 * i + j];
+				faceT.verts[j] = tris[3 * i + j];
 				uvs[j] = uvMap[3 * i + j];
 			}
 			if(faceT.velocity!=NULL){
@@ -228,11 +259,11 @@ bool Mesh::save(const std::string& f) {
 			put_element_ply(ply, (void *) &faceT);
 		}
 	} else {
-		int sz = mQuadIndexes.size() / 4;
+		int sz = quads.size() / 4;
 		for (int i = 0; i < sz; i++) {
 			for (j = 0; j < 4; j++) {
 				face.nverts = 4;
-				face.verts[j] = mQuadIndexes[4 * i + j];
+				face.verts[j] = quads[4 * i + j];
 			}
 			if(faceT.velocity!=NULL){
 				Vec3s velocity=mParticleVelocity[i];
@@ -242,11 +273,11 @@ bool Mesh::save(const std::string& f) {
 			}
 			put_element_ply(ply, (void *) &face);
 		}
-		sz = mTriIndexes.size() / 3;
+		sz = tris.size() / 3;
 		for (int i = 0; i < sz; i++) {
 			for (j = 0; j < 3; j++) {
 				face.nverts = 3;
-				face.verts[j] = mTriIndexes[3 * i + j];
+				face.verts[j] = tris[3 * i + j];
 			}
 			if(faceT.velocity!=NULL){
 				Vec3s velocity=mParticleVelocity[i];
@@ -278,7 +309,14 @@ bool Mesh::openGrid(const std::string& fileName) {
 		return false;
 }
 bool Mesh::openMesh(const std::string& file) {
+	if (ReadPlyMeshBlock(file, *this)) {
+		if (this->mVertexes.size() == 0)
+			return false;
+		this->updateBoundingBox();
+		return true;
+	}
 	int i, j, k;
+	std::lock_guard<std::mutex> lockMe(GetPlyIOLock());
 	int numPts = 0, numPolys = 0;
 	// open a PLY file for reading
 	PlyFile *ply;
@@ -539,33 +577,36 @@ void Mesh::dilate(float distance) {
 	}
 }
 void Mesh::updateVertexNormals(int SMOOTH_ITERATIONS, float DOT_TOLERANCE) {
-
-	Index32 sz = mTriIndexes.size();
+	MeshIndexes indexes;
+	getIndexes(indexes);
+	const std::vector<Index32>& quads = *indexes.mQuads;
+	const std::vector<Index32>& tris = *indexes.mTris;
+	Index32 sz = tris.size();
 	Vec3s pt;
 	mVertexNormals.resize(mVertexes.size(), Vec3f(0.0f));
 	for (Index32 i = 0; i < sz; i += 3) {
-		Vec3s v1 = mVertexes[mTriIndexes[i]];
-		Vec3s v2 = mVertexes[mTriIndexes[i + 1]];
-		Vec3s v3 = mVertexes[mTriIndexes[i + 2]];
+		Vec3s v1 = mVertexes[tris[i]];
+		Vec3s v2 = mVertexes[tris[i + 1]];
+		Vec3s v3 = mVertexes[tris[i + 2]];
 		Vec3f norm = (v2 - v1).cross(v3 - v1);
-		mVertexNormals[mTriIndexes[i]] += norm;
-		mVertexNormals[mTriIndexes[i + 1]] += norm;
-		mVertexNormals[mTriIndexes[i + 2]] += norm;
+		mVertexNormals[tris[i]] += norm;
+		mVertexNormals[tris[i + 1]] += norm;
+		mVertexNormals[tris[i + 2]] += norm;
 	}
-	sz = mQuadIndexes.size();
+	sz = quads.size();
 	for (int i = 0; i < sz; i += 4) {
-		Vec3s v1 = mVertexes[mQuadIndexes[i]];
-		Vec3s v2 = mVertexes[mQuadIndexes[i + 1]];
-		Vec3s v3 = mVertexes[mQuadIndexes[i + 2]];
-		Vec3s v4 = mVertexes[mQuadIndexes[i + 3]];
+		Vec3s v1 = mVertexes[quads[i]];
+		Vec3s v2 = mVertexes[quads[i + 1]];
+		Vec3s v3 = mVertexes[quads[i + 2]];
+		Vec3s v4 = mVertexes[quads[i + 3]];
 		Vec3f norm = (v1 - pt).cross(v2 - pt);
 		norm += (v2 - pt).cross(v3 - pt);
 		norm += (v3 - pt).cross(v4 - pt);
 		norm += (v4 - pt).cross(v1 - pt);
-		mVertexNormals[mQuadIndexes[i]] += norm;
-		mVertexNormals[mQuadIndexes[i + 1]] += norm;
-		mVertexNormals[mQuadIndexes[i + 2]] += norm;
-		mVertexNormals[mQuadIndexes[i + 3]] += norm;
+		mVertexNormals[quads[i]] += norm;
+		mVertexNormals[quads[i + 1]] += norm;
+		mVertexNormals[quads[i + 2]] += norm;
+		mVertexNormals[quads[i + 3]] += norm;
 	}
 #pragma omp for
 	for (size_t n=0;n<mVertexNormals.size();n++) {
@@ -575,14 +616,14 @@ void Mesh::updateVertexNormals(int SMOOTH_ITERATIONS, float DOT_TOLERANCE) {
 		int vertCount = mVertexes.size();
 		std::vector<Vec3f> tmp(vertCount);
 		std::vector<std::list<int>> vertNbrs(vertCount);
-		int indexCount = mQuadIndexes.size();
+		int indexCount = quads.size();
 		int v1, v2, v3, v4;
 
 		for (int i = 0; i < indexCount; i += 4) {
-			int v1 = mQuadIndexes[i];
-			int v2 = mQuadIndexes[i + 1];
-			int v3 = mQuadIndexes[i + 2];
-			int v4 = mQuadIndexes[i + 3];
+			int v1 = quads[i];
+			int v2 = quads[i + 1];
+			int v3 = quads[i + 2];
+			int v4 = quads[i + 3];
 
 			vertNbrs[v1].push_back(v2);
 			vertNbrs[v2].push_back(v3);
@@ -614,14 +655,18 @@ void Mesh::updateVertexNormals(int SMOOTH_ITERATIONS, float DOT_TOLERANCE) {
 	}
 }
 float Mesh::estimateVoxelSize(int stride) {
+	MeshIndexes indexes;
+	getIndexes(indexes);
+	const std::vector<Index32>& quads = *indexes.mQuads;
+	const std::vector<Index32>& tris = *indexes.mTris;
 	int count = 0;
 	//float maxLength = 0.0f;
-	int sz = mTriIndexes.size();
+	int sz = tris.size();
 	float mEstimatedVoxelSize = 0.0f;
 	for (int i = 0; i < sz; i += 3 * stride) {
-		Vec3s v1 = mVertexes[mTriIndexes[i]];
-		Vec3s v2 = mVertexes[mTriIndexes[i + 1]];
-		Vec3s v3 = mVertexes[mTriIndexes[i + 2]];
+		Vec3s v1 = mVertexes[tris[i]];
+		Vec3s v2 = mVertexes[tris[i + 1]];
+		Vec3s v3 = mVertexes[tris[i + 2]];
 		float e1 = (v1 - v2).length();
 		float e2 = (v1 - v3).length();
 		float e3 = (v2 - v3).length();
@@ -629,12 +674,12 @@ float Mesh::estimateVoxelSize(int stride) {
 		mEstimatedVoxelSize += e1 + e2 + e3;
 	}
 	count = sz / stride;
-	sz = mQuadIndexes.size();
+	sz = quads.size();
 	for (int i = 0; i < sz; i += 4 * stride) {
-		Vec3s v1 = mVertexes[mQuadIndexes[i]];
-		Vec3s v2 = mVertexes[mQuadIndexes[i + 1]];
-		Vec3s v3 = mVertexes[mQuadIndexes[i + 2]];
-		Vec3s v4 = mVertexes[mQuadIndexes[i + 3]];
+		Vec3s v1 = mVertexes[quads[i]];
+		Vec3s v2 = mVertexes[quads[i + 1]];
+		Vec3s v3 = mVertexes[quads[i + 2]];
+		Vec3s v4 = mVertexes[quads[i + 3]];
 		float e1 = (v1 - v2).length();
 		float e2 = (v2 - v3).length();
 		float e3 = (v3 - v4).length();
@@ -768,6 +813,11 @@ void Mesh::draw() {
 }
 
 void Mesh::updateGL() {
+	MeshIndexes indexes;
+	getIndexes(indexes);
+	const std::vector<Index32>& quads = *indexes.mQuads;
+	const std::vector<Index32>& tris = *indexes.mTris;
+	const std::vector<Vec3s>& normals = *indexes.mNormals;
 	mQuadCount = 0;
 	mTriangleCount = 0;
 	mTriangleIndexCount = 0;
@@ -888,7 +938,7 @@ void Mesh::updateGL() {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		std::cout << "Disable Lines " << std::endl;
 	}
-	if (mTriIndexes.size() > 0) {
+	if (tris.size() > 0) {
 		// clear old buffer
 		if (glIsBuffer(mGL.mTriIndexBuffer) == GL_TRUE)
 			glDeleteBuffers(1, &mGL.mTriIndexBuffer);
@@ -901,14 +951,14 @@ void Mesh::updateGL() {
 
 		// upload data
 		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-				sizeof(GLuint) * mTriIndexes.size(), &mTriIndexes[0],
+				sizeof(GLuint) * tris.size(), &tris[0],
 				GL_STATIC_DRAW); // upload data
 
-		mTriangleIndexCount = mTriIndexes.size();
+		mTriangleIndexCount = tris.size();
 		// release buffer
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	}
-	if (mQuadIndexes.size() > 0) {
+	if (quads.size() > 0) {
 		// clear old buffer
 		if (glIsBuffer(mGL.mQuadIndexBuffer) == GL_TRUE)
 			glDeleteBuffers(1, &mGL.mQuadIndexBuffer);
@@ -920,23 +970,23 @@ void Mesh::updateGL() {
 			throw Exception("Error: Unable to create index buffer");
 
 		// upload data
-		int sz = mQuadIndexes.size();
-		std::vector<GLuint> tmp(12 * (mQuadIndexes.size() / 4));
+		int sz = quads.size();
+		std::vector<GLuint> tmp(12 * (quads.size() / 4));
 #pragma omp for
 		for (unsigned int i = 0; i < sz; i += 4) {
 			int offset = 12 * (i / 4);
-			tmp[offset++] = mQuadIndexes[i + 1];
-			tmp[offset++] = mQuadIndexes[i + 2];
-			tmp[offset++] = mQuadIndexes[i + 0];
-			tmp[offset++] = mQuadIndexes[i + 2];
-			tmp[offset++] = mQuadIndexes[i + 3];
-			tmp[offset++] = mQuadIndexes[i + 1];
-			tmp[offset++] = mQuadIndexes[i + 0];
-			tmp[offset++] = mQuadIndexes[i + 1];
-			tmp[offset++] = mQuadIndexes[i + 3];
-			tmp[offset++] = mQuadIndexes[i + 3];
-			tmp[offset++] = mQuadIndexes[i];
-			tmp[offset++] = mQuadIndexes[i + 2];
+			tmp[offset++] = quads[i + 1];
+			tmp[offset++] = quads[i + 2];
+			tmp[offset++] = quads[i + 0];
+			tmp[offset++] = quads[i + 2];
+			tmp[offset++] = quads[i + 3];
+			tmp[offset++] = quads[i + 1];
+			tmp[offset++] = quads[i + 0];
+			tmp[offset++] = quads[i + 1];
+			tmp[offset++] = quads[i + 3];
+			tmp[offset++] = quads[i + 3];
+			tmp[offset++] = quads[i];
+			tmp[offset++] = quads[i + 2];
 		}
 		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * tmp.size(),
 				&tmp[0], GL_STATIC_DRAW); // upload data
@@ -960,7 +1010,7 @@ void Mesh::updateGL() {
 
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
-	if (mVertexNormals.size() > 0) {
+	if (normals.size() > 0) {
 		if (glIsBuffer(mGL.mNormalBuffer) == GL_TRUE)
 			glDeleteBuffers(1, &mGL.mNormalBuffer);
 
@@ -970,12 +1020,16 @@ void Mesh::updateGL() {
 			throw Exception("Error: Unable to create normal buffer");
 
 		glBufferData(GL_ARRAY_BUFFER,
-				sizeof(GLfloat) * 3 * mVertexNormals.size(), &mVertexNormals[0],
+				sizeof(GLfloat) * 3 * normals.size(), &normals[0],
 				GL_STATIC_DRAW);
 
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
-
+}
+void Mesh::getIndexes(MeshIndexes& indexes) const {
+	indexes.mQuads = &mQuadIndexes;
+	indexes.mTris = &mTriIndexes;
+	indexes.mNormals = &mVertexNormals;
 }
 Mesh::~Mesh() {
 	// TODO Auto-generated destructor stub
@@ -56,6 +56,15 @@ public:
 
 	}
 };
+//Index lists and vertex normals read by save() and updateGL(), either the mesh's own or built into the local buffers.
+struct MeshIndexes {
+	const std::vector<openvdb::Index32>* mQuads;
+	const std::vector<openvdb::Index32>* mTris;
+	const std::vector<openvdb::Vec3s>* mNormals;
+	std::vector<openvdb::Index32> mQuadBuffer;
+	std::vector<openvdb::Index32> mTriBuffer;
+	std::vector<openvdb::Vec3s> mNormalBuffer;
+};
 class Mesh{
 	private:
 
@@ -101,6 +110,8 @@ class Mesh{
 		void dilate(float distance);
 		void updateGL();
 		void reset();
+		//Exchange geometry with another mesh so both keep their allocations for reuse.
+		void swap(Mesh& mesh);
 		void updateVertexNormals(int SMOOTH_ITERATIONS=0,float DOT_TOLERANCE=0.75f);
 		void mapIntoBoundingBox(float voxelSize);
 		void mapOutOfBoundingBox(float voxelSize);
@@ -109,7 +120,11 @@ class Mesh{
 		bool save(const std::string& file);
 		void create(openvdb::FloatGrid::Ptr grid);
 		float estimateVoxelSize(int stride=4);
-		~Mesh();
+		//Subclasses that generate mQuadIndexes/mTriIndexes on demand build them into the buffers of indexes,
+		//so concurrent readers never share or free the same storage.
+		virtual void getIndexes(MeshIndexes& indexes) const;
+		virtual void releaseIndexes(){}
+		virtual ~Mesh();
 };
 class MeshVertexRange {
 public:
@@ -0,0 +1,109 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "MetricsLog.h"
+#include "json/json.h"
+#include <iostream>
+namespace imagesci {
+MetricsLog::MetricsLog() :
+		mVerbosity(METRICS_OFF), mRecordCount(0) {
+}
+MetricsLog& MetricsLog::getInstance() {
+	static MetricsLog log;
+	return log;
+}
+std::map<std::string, double>& MetricsLog::buffer() {
+	static thread_local std::map<std::string, double> values;
+	return values;
+}
+bool MetricsLog::open(const std::string& file, MetricsVerbosity verbosity) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (mOut.is_open())
+		mOut.close();
+	mFile = file;
+	mOut.open(file, std::ios::out | std::ios::app);
+	if (!mOut.is_open()) {
+		std::cout << "Could not open metrics log " << file << std::endl;
+		mVerbosity = METRICS_OFF;
+		return false;
+	}
+	mVerbosity = verbosity;
+	return true;
+}
+void MetricsLog::close() {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (mOut.is_open())
+		mOut.close();
+}
+void MetricsLog::setVerbosity(MetricsVerbosity verbosity) {
+	mVerbosity = verbosity;
+}
+void MetricsLog::set(const std::string& name, double value) {
+	if (isEnabled())
+		buffer()[name] = value;
+}
+void MetricsLog::add(const std::string& name, double value) {
+	if (isEnabled())
+		buffer()[name] += value;
+}
+void MetricsLog::max(const std::string& name, double value) {
+	if (!isEnabled())
+		return;
+	std::map<std::string, double>& values = buffer();
+	std::map<std::string, double>::iterator iter = values.find(name);
+	if (iter == values.end()) {
+		values[name] = value;
+	} else if (value > iter->second) {
+		iter->second = value;
+	}
+}
+void MetricsLog::commit(const std::string& name, long iteration, double time,
+		double timeStep) {
+	std::map<std::string, double>& values = buffer();
+	int verbosity = mVerbosity;
+	if (verbosity == METRICS_OFF) {
+		values.clear();
+		return;
+	}
+	Json::Value root;
+	root["Simulation"] = name;
+	root["Iteration"] = (Json::Int) iteration;
+	root["Time"] = time;
+	root["TimeStep"] = timeStep;
+	for (std::pair<const std::string, double>& value : values) {
+		root[value.first] = value.second;
+	}
+	values.clear();
+	Json::FastWriter writer;
+	std::string line = writer.write(root);
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (mOut.is_open()) {
+		mOut << line;
+		mOut.flush();
+	}
+	if (verbosity == METRICS_VERBOSE)
+		std::cout << line;
+	mRecordCount++;
+}
+MetricsLog::~MetricsLog() {
+	close();
+}
+}
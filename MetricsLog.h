@@ -0,0 +1,92 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef METRICSLOG_H_
+#define METRICSLOG_H_
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+namespace imagesci {
+enum MetricsVerbosity {
+	METRICS_OFF = 0, METRICS_FRAME = 1, METRICS_VERBOSE = 2
+};
+/*
+ * Line-delimited JSON log with one record per simulation frame. Solver code records values into a buffer owned by
+ * the calling thread, so the hot paths take no locks and print nothing. The simulation thread commits its buffer
+ * once per frame as a single line. METRICS_VERBOSE also echoes each record to stdout.
+ */
+class MetricsLog {
+protected:
+	std::ofstream mOut;
+	std::string mFile;
+	//Read without the lock by every set/add/max call.
+	std::atomic<int> mVerbosity;
+	std::atomic<size_t> mRecordCount;
+	std::mutex mLock;
+	static std::map<std::string, double>& buffer();
+	MetricsLog();
+public:
+	static MetricsLog& getInstance();
+	bool open(const std::string& file, MetricsVerbosity verbosity =
+			METRICS_FRAME);
+	void close();
+	void setVerbosity(MetricsVerbosity verbosity);
+	inline MetricsVerbosity getVerbosity() const {
+		return static_cast<MetricsVerbosity>(mVerbosity.load());
+	}
+	inline size_t getRecordCount() const {
+		return mRecordCount;
+	}
+	//Write and clear the calling thread's buffer.
+	void commit(const std::string& name, long iteration, double time,
+			double timeStep);
+	static inline bool isEnabled() {
+		return getInstance().mVerbosity.load(std::memory_order_relaxed)
+				!= METRICS_OFF;
+	}
+	static void set(const std::string& name, double value);
+	static void add(const std::string& name, double value);
+	static void max(const std::string& name, double value);
+	~MetricsLog();
+};
+//Adds the lifetime of the timer in seconds to "<name>Seconds".
+class MetricsTimer {
+protected:
+	typedef std::chrono::high_resolution_clock Clock;
+	std::string mName;
+	Clock::time_point mStart;
+public:
+	MetricsTimer(const std::string& name) :
+			mName(name), mStart(Clock::now()) {
+	}
+	~MetricsTimer() {
+		if (MetricsLog::isEnabled()) {
+			MetricsLog::add(mName + "Seconds",
+					1E-6 * std::chrono::duration_cast<std::chrono::microseconds>(
+									Clock::now() - mStart).count());
+		}
+	}
+};
+}
+#endif /* METRICSLOG_H_ */
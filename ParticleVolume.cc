@@ -21,6 +21,7 @@
 
 #include "ParticleVolume.h"
 #include "ImageSciUtil.h"
+#include "PlyBlockIO.h"
 #include "ply_io.h"
 using namespace openvdb;
 using namespace openvdb::tools;
@@ -65,7 +66,12 @@ bool ParticleVolume::save(const std::string& file) {
 	if(mParticles.size()==0)return false;
 	std::string f=GetFileNameWithoutExtension(file)+".ply";
 	std::cout<<"Saving "<<f<<" ... ";
+	if(WritePlyParticleBlock(f,*this)){
+		std::cout<<"Done."<<std::endl;
+		return true;
+	}
 	int i, j, idx;
+	std::lock_guard<std::mutex> lockMe(GetPlyIOLock());
 	char* elemNames[]={"vertex"};
 	const char* fileName = f.c_str();
 	PlyFile *ply;
@@ -118,7 +124,9 @@ bool ParticleVolume::save(const std::string& file) {
 }
 //Implement me
 bool ParticleVolume::open(const std::string& file) {
+	if(ReadPlyParticleBlock(file,*this))return true;
 	int i, j, k;
+	std::lock_guard<std::mutex> lockMe(GetPlyIOLock());
 	int numPts = 0, numPolys = 0;
 	// open a PLY file for reading
 	PlyFile *ply;
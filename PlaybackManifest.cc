@@ -0,0 +1,335 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "PlaybackManifest.h"
+#include "ImageSciUtil.h"
+#include <boost/filesystem.hpp>
+#include <iomanip>
+#include <algorithm>
+namespace imagesci {
+const std::string PlaybackManifest::HEADER = "ImageSci Manifest 1";
+PlaybackManifest::Entry::Entry() {
+	mDescription.mSimulationIteration = 0;
+	mDescription.mSimulationTime = 0.0;
+	mDescription.mTimeStep = 0.0;
+	mDescription.mSimulationDuration = 0.0;
+	mDescription.mComputeTimeSeconds = 0.0;
+	mDescription.mMotionScheme = MotionScheme::UNDEFINED;
+}
+PlaybackManifest::PlaybackManifest() :
+		mLoadedCount(0), mRunning(false) {
+}
+static void SplitFields(const std::string& line,
+		std::vector<std::string>& fields) {
+	fields.clear();
+	size_t start = 0;
+	while (true) {
+		size_t end = line.find('\t', start);
+		if (end == std::string::npos) {
+			fields.push_back(line.substr(start));
+			break;
+		}
+		fields.push_back(line.substr(start, end - start));
+		start = end + 1;
+	}
+}
+static void WriteEntry(std::ostream& ostr,
+		const SimulationTimeStepDescription& desc,
+		const std::string& constellationFile, const std::string& isoSurfaceFile,
+		const std::string& signedLevelSetFile,
+		const std::string& particleVolumeFile) {
+	ostr << desc.mSimulationIteration << "\t" << std::setprecision(17)
+			<< desc.mSimulationTime << "\t" << desc.mTimeStep << "\t"
+			<< desc.mSimulationDuration << "\t" << desc.mComputeTimeSeconds
+			<< "\t" << EncodeMotionScheme(desc.mMotionScheme) << "\t"
+			<< desc.mSimulationName << "\t" << constellationFile << "\t"
+			<< isoSurfaceFile << "\t" << signedLevelSetFile << "\t"
+			<< particleVolumeFile << "\n";
+}
+bool PlaybackManifest::Append(const std::string& file,
+		const SimulationTimeStepDescription& desc,
+		const SpringLevelSetDescription& springlDesc) {
+	std::ofstream ostr(file, std::ios::out | std::ios::app);
+	if (!ostr.is_open())
+		return false;
+	if (ostr.tellp() == 0)
+		ostr << HEADER << "\n";
+	WriteEntry(ostr, desc, springlDesc.mConstellationFile,
+			springlDesc.mIsoSurfaceFile, springlDesc.mSignedLevelSetFile,
+			springlDesc.mParticleVolumeFile);
+	return ostr.good();
+}
+bool PlaybackManifest::ParseSimFileName(const std::string& file,
+		std::string& name, long& iteration) {
+	std::string stem = boost::filesystem::path(file).stem().string();
+	size_t pos = stem.find_last_of('_');
+	if (pos == std::string::npos || pos + 1 >= stem.length())
+		return false;
+	char* end = NULL;
+	iteration = strtol(stem.c_str() + pos + 1, &end, 10);
+	name = stem.substr(0, pos);
+	return (*end == '\0');
+}
+//Iterations recorded more than once, such as a run stashed again into the same directory, keep the last line.
+//The manifest is rejected unless it lists exactly the iterations of the .sim files in the directory.
+bool PlaybackManifest::readManifest(const std::string& file) {
+	std::ifstream istr(file, std::ios::in);
+	std::string line;
+	if (!istr.is_open() || !std::getline(istr, line) || line != HEADER)
+		return false;
+	std::map<long, Entry> entries;
+	std::vector<std::string> fields;
+	while (std::getline(istr, line)) {
+		SplitFields(line, fields);
+		//A partially written last line is ignored.
+		if (fields.size() < 11)
+			continue;
+		Entry entry;
+		SimulationTimeStepDescription& desc = entry.mDescription;
+		desc.mSimulationIteration = atol(fields[0].c_str());
+		desc.mSimulationTime = atof(fields[1].c_str());
+		desc.mTimeStep = atof(fields[2].c_str());
+		desc.mSimulationDuration = atof(fields[3].c_str());
+		desc.mComputeTimeSeconds = atof(fields[4].c_str());
+		desc.mMotionScheme = DecodeMotionScheme(fields[5]);
+		desc.mSimulationName = fields[6];
+		entry.mConstellationFile = fields[7];
+		entry.mIsoSurfaceFile = fields[8];
+		entry.mSignedLevelSetFile = fields[9];
+		entry.mParticleVolumeFile = fields[10];
+		entries[desc.mSimulationIteration] = entry;
+	}
+	if (entries.size() == 0 || entries.size() != mSimFiles.size())
+		return false;
+	std::vector<long> iterations;
+	std::string name;
+	for (const std::string& simFile : mSimFiles) {
+		long iteration;
+		if (!ParseSimFileName(simFile, name, iteration))
+			return false;
+		iterations.push_back(iteration);
+	}
+	std::sort(iterations.begin(), iterations.end());
+	size_t i = 0;
+	for (std::pair<const long, Entry>& entry : entries) {
+		if (entry.first != iterations[i++])
+			return false;
+	}
+	std::lock_guard<std::mutex> lockMe(mLock);
+	for (std::pair<const long, Entry>& entry : entries) {
+		mEntries.push_back(entry.second);
+	}
+	mLoaded.assign(mEntries.size(), 1);
+	mLoadedCount = mEntries.size();
+	return true;
+}
+bool PlaybackManifest::Truncate(const std::string& file, long iteration) {
+	std::vector<std::string> lines;
+	{
+		std::ifstream istr(file, std::ios::in);
+		std::string line;
+		if (!istr.is_open() || !std::getline(istr, line) || line != HEADER)
+			return false;
+		std::vector<std::string> fields;
+		while (std::getline(istr, line)) {
+			SplitFields(line, fields);
+			if (fields.size() >= 11 && atol(fields[0].c_str()) <= iteration)
+				lines.push_back(line);
+		}
+	}
+	std::string tmpFile = file + ".tmp";
+	{
+		std::ofstream ostr(tmpFile, std::ios::out | std::ios::trunc);
+		if (!ostr.is_open())
+			return false;
+		ostr << HEADER << "\n";
+		for (const std::string& line : lines) {
+			ostr << line << "\n";
+		}
+		if (!ostr.good())
+			return false;
+	}
+	try {
+		boost::filesystem::rename(tmpFile, file);
+	} catch (boost::filesystem::filesystem_error& e) {
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+//Written to a temporary file first so a reader never sees a partial manifest.
+bool PlaybackManifest::writeManifest(const std::string& file) {
+	std::string tmpFile = file + ".tmp";
+	{
+		std::ofstream ostr(tmpFile, std::ios::out | std::ios::trunc);
+		if (!ostr.is_open())
+			return false;
+		ostr << HEADER << "\n";
+		for (const Entry& entry : mEntries) {
+			WriteEntry(ostr, entry.mDescription, entry.mConstellationFile,
+					entry.mIsoSurfaceFile, entry.mSignedLevelSetFile,
+					entry.mParticleVolumeFile);
+		}
+		if (!ostr.good())
+			return false;
+	}
+	try {
+		boost::filesystem::rename(tmpFile, file);
+	} catch (boost::filesystem::filesystem_error& e) {
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+bool PlaybackManifest::ParseSimFile(const std::string& file, Entry& entry) {
+	std::ifstream ifs(file, std::ifstream::in);
+	if (!ifs.is_open()) {
+		std::cout << "Could not open " << file << std::endl;
+		return false;
+	}
+	std::string input((std::istreambuf_iterator<char>(ifs)),
+			std::istreambuf_iterator<char>());
+	ifs.close();
+	Json::Reader reader;
+	Json::Value deserializeRoot;
+	if (!reader.parse(input, deserializeRoot)) {
+		std::cout << "Could not parse " << file << std::endl;
+		return false;
+	}
+	SpringLevelSetDescription springlDesc;
+	springlDesc.deserialize(deserializeRoot["Simulation Record"]);
+	entry.mDescription.deserialize(deserializeRoot["Simulation Record"]);
+	entry.mConstellationFile = springlDesc.mConstellationFile;
+	entry.mIsoSurfaceFile = springlDesc.mIsoSurfaceFile;
+	entry.mSignedLevelSetFile = springlDesc.mSignedLevelSetFile;
+	entry.mParticleVolumeFile = springlDesc.mParticleVolumeFile;
+	return true;
+}
+void PlaybackManifest::store(size_t frame, const Entry& entry, bool ok) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (mLoaded[frame] == 0) {
+		mEntries[frame] = entry;
+		mLoaded[frame] = (ok) ? 1 : 2;
+		mLoadedCount++;
+	}
+}
+void PlaybackManifest::process() {
+	Simulation::Clock::time_point t0 = Simulation::Clock::now();
+	int N = mSimFiles.size();
+	OPENMP_FOR
+	for (int i = 0; i < N; i++) {
+		{
+			std::lock_guard<std::mutex> lockMe(mLock);
+			if (!mRunning || mLoaded[i] != 0)
+				continue;
+		}
+		Entry entry;
+		bool ok = ParseSimFile(mSimFiles[i], entry);
+		store(i, entry, ok);
+	}
+	bool complete = true;
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		if (!mRunning || mLoadedCount < mEntries.size())
+			return;
+		for (char loaded : mLoaded) {
+			if (loaded != 1)
+				complete = false;
+		}
+	}
+	Simulation::Clock::time_point t1 = Simulation::Clock::now();
+	std::cout << "Indexed " << N << " frames in "
+			<< 1E-6 * std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count()
+			<< " sec" << std::endl;
+	if (complete) {
+		writeManifest(GetFile(mDirectory, mEntries[0].mDescription.mSimulationName));
+	}
+}
+bool PlaybackManifest::open(const std::string& directory) {
+	clear();
+	mDirectory = directory;
+	if (GetDirectoryListing(directory, mSimFiles, "", ".sim") == 0) {
+		std::cout << "Could not find any *.sim files" << std::endl;
+		return false;
+	}
+	std::vector<std::string> files;
+	GetDirectoryListing(directory, files, "", ".manifest");
+	for (const std::string& file : files) {
+		if (readManifest(file)) {
+			std::cout << "Read " << mEntries.size() << " frames from " << file
+					<< std::endl;
+			return true;
+		}
+		std::cout << file << " does not match the *.sim files, rebuilding."
+				<< std::endl;
+	}
+	mEntries.resize(mSimFiles.size());
+	mLoaded.assign(mSimFiles.size(), 0);
+	mLoadedCount = 0;
+	mRunning = true;
+	mThread = std::thread(&PlaybackManifest::process, this);
+	return true;
+}
+void PlaybackManifest::add(const SimulationTimeStepDescription& desc) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	Entry entry;
+	entry.mDescription = desc;
+	mEntries.push_back(entry);
+	mLoaded.push_back(1);
+	mLoadedCount++;
+}
+bool PlaybackManifest::get(size_t frame, Entry& entry) {
+	if (frame >= mEntries.size())
+		return false;
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		if (mLoaded[frame] != 0) {
+			entry = mEntries[frame];
+			return (mLoaded[frame] == 1);
+		}
+	}
+	Entry parsed;
+	bool ok = ParseSimFile(mSimFiles[frame], parsed);
+	store(frame, parsed, ok);
+	std::lock_guard<std::mutex> lockMe(mLock);
+	entry = mEntries[frame];
+	return (mLoaded[frame] == 1);
+}
+bool PlaybackManifest::isComplete() {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	return mLoadedCount == mEntries.size();
+}
+void PlaybackManifest::clear() {
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		mRunning = false;
+	}
+	if (mThread.joinable())
+		mThread.join();
+	mEntries.clear();
+	mSimFiles.clear();
+	mLoaded.clear();
+	mLoadedCount = 0;
+}
+PlaybackManifest::~PlaybackManifest() {
+	clear();
+}
+}
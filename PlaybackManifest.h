@@ -0,0 +1,83 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PLAYBACKMANIFEST_H_
+#define PLAYBACKMANIFEST_H_
+#include "Simulation.h"
+namespace imagesci {
+/*
+ * Frame index of a recording directory. Runs append one tab separated line per frame to "<name>.manifest" so
+ * playback can index a run without parsing every .sim file. Older runs fall back to parsing the .sim files in
+ * parallel on a background thread. Frames requested before the loader reaches them are parsed on demand, and the
+ * manifest is written once every frame has been parsed. A manifest whose iterations disagree with the .sim files,
+ * such as one left by an interrupted or restored run, is rebuilt the same way.
+ */
+class PlaybackManifest {
+public:
+	struct Entry {
+		SimulationTimeStepDescription mDescription;
+		std::string mConstellationFile;
+		std::string mIsoSurfaceFile;
+		std::string mSignedLevelSetFile;
+		std::string mParticleVolumeFile;
+		Entry();
+	};
+	static const std::string HEADER;
+protected:
+	std::string mDirectory;
+	std::vector<Entry> mEntries;
+	std::vector<std::string> mSimFiles;
+	std::vector<char> mLoaded;
+	size_t mLoadedCount;
+	bool mRunning;
+	std::mutex mLock;
+	std::thread mThread;
+	bool readManifest(const std::string& file);
+	bool writeManifest(const std::string& file);
+	void store(size_t frame, const Entry& entry, bool ok);
+	void process();
+	static bool ParseSimFile(const std::string& file, Entry& entry);
+public:
+	PlaybackManifest();
+	bool open(const std::string& directory);
+	void add(const SimulationTimeStepDescription& desc);
+	bool get(size_t frame, Entry& entry);
+	inline size_t size() const {
+		return mEntries.size();
+	}
+	bool isComplete();
+	void clear();
+	static std::string GetFile(const std::string& directory,
+			const std::string& name) {
+		return directory + name + ".manifest";
+	}
+	static bool Append(const std::string& file,
+			const SimulationTimeStepDescription& desc,
+			const SpringLevelSetDescription& springlDesc);
+	//Drop the lines recorded after iteration, so a restored run appends after its checkpoint.
+	static bool Truncate(const std::string& file, long iteration);
+	//Split a "<name>_<iteration>.sim" file name.
+	static bool ParseSimFileName(const std::string& file, std::string& name,
+			long& iteration);
+	~PlaybackManifest();
+};
+}
+#endif /* PLAYBACKMANIFEST_H_ */
@@ -0,0 +1,181 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "PlaybackPrefetcher.h"
+#include "SimulationPlayback.h"
+#include "ImageSciUtil.h"
+namespace imagesci {
+PlaybackPrefetcher::PlaybackPrefetcher(SimulationPlayback* playback,
+		long numFrames, size_t ringSize, int threads) :
+		mPlayback(playback), mNumFrames(numFrames), mCursor(0), mDirection(1), mRunning(
+				true), mHits(0), mMisses(0) {
+	mSlots.resize(std::max((size_t) 2, ringSize));
+	for (Slot& slot : mSlots) {
+		slot.mFrameIndex = -1;
+		slot.mState = SLOT_EMPTY;
+		slot.mFrame.reset(new PlaybackFrame());
+	}
+	threads = std::max(1, threads);
+	for (int i = 0; i < threads; i++) {
+		mThreads.push_back(std::thread(&PlaybackPrefetcher::process, this));
+	}
+}
+bool PlaybackPrefetcher::inWindow(long frame) const {
+	long k = (frame - mCursor) * mDirection;
+	return (frame >= 0 && frame < mNumFrames && k >= 0
+			&& k < (long) mSlots.size());
+}
+int PlaybackPrefetcher::findSlot(long frame) const {
+	for (size_t i = 0; i < mSlots.size(); i++) {
+		if (mSlots[i].mState != SLOT_EMPTY && mSlots[i].mFrameIndex == frame)
+			return i;
+	}
+	return -1;
+}
+//Frames nearest the cursor are requested first. A slot is recycled once its frame has left the window.
+long PlaybackPrefetcher::nextRequest(int& slot) {
+	for (long k = 0; k < (long) mSlots.size(); k++) {
+		long frame = mCursor + k * mDirection;
+		if (frame < 0 || frame >= mNumFrames)
+			break;
+		if (findSlot(frame) >= 0)
+			continue;
+		slot = -1;
+		for (size_t i = 0; i < mSlots.size(); i++) {
+			const Slot& s = mSlots[i];
+			if (s.mState == SLOT_EMPTY) {
+				slot = i;
+				break;
+			} else if ((s.mState == SLOT_READY || s.mState == SLOT_FAILED)
+					&& !inWindow(s.mFrameIndex)) {
+				slot = i;
+			}
+		}
+		if (slot < 0)
+			return -1;
+		mSlots[slot].mFrameIndex = frame;
+		mSlots[slot].mState = SLOT_LOADING;
+		return frame;
+	}
+	return -1;
+}
+bool PlaybackPrefetcher::load(long frame, PlaybackFrame& out) {
+	try {
+		return mPlayback->loadFrame(frame, out);
+	} catch (imagesci::Exception& e) {
+		std::cout << "ImageSci Error:: " << e.what() << std::endl;
+	} catch (openvdb::Exception& e) {
+		std::cout << "OpenVDB Error:: " << e.what() << std::endl;
+	}
+	return false;
+}
+void PlaybackPrefetcher::process() {
+	while (true) {
+		int slot = -1;
+		long frame = -1;
+		{
+			std::unique_lock<std::mutex> lockMe(mLock);
+			while (mRunning && (frame = nextRequest(slot)) < 0) {
+				mSlotChanged.wait(lockMe);
+			}
+			if (!mRunning)
+				break;
+		}
+		bool ok = load(frame, *mSlots[slot].mFrame);
+		{
+			std::lock_guard<std::mutex> lockMe(mLock);
+			//A failed slot is not retried by the workers, acquire() loads it again.
+			mSlots[slot].mState = (ok) ? SLOT_READY : SLOT_FAILED;
+			mSlotChanged.notify_all();
+		}
+	}
+}
+void PlaybackPrefetcher::setDirection(int direction) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	mDirection = (direction < 0) ? -1 : 1;
+	mSlotChanged.notify_all();
+}
+void PlaybackPrefetcher::seek(long frame) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	mCursor = clamp(frame, 0L, std::max(0L, mNumFrames - 1));
+	mSlotChanged.notify_all();
+}
+PlaybackFrame* PlaybackPrefetcher::acquire(long frame) {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	if (frame < 0 || frame >= mNumFrames)
+		return NULL;
+	mCursor = frame;
+	mSlotChanged.notify_all();
+	int slot = findSlot(frame);
+	if (slot >= 0 && mSlots[slot].mState == SLOT_READY) {
+		mHits++;
+	} else {
+		mMisses++;
+		while (mRunning
+				&& ((slot = findSlot(frame)) < 0
+						|| (mSlots[slot].mState != SLOT_READY
+								&& mSlots[slot].mState != SLOT_FAILED))) {
+			mSlotChanged.wait(lockMe);
+		}
+		if (!mRunning)
+			return NULL;
+		if (mSlots[slot].mState == SLOT_FAILED) {
+			//Retry on this thread. The slot stays LOADING meanwhile, so the workers neither recycle nor request it.
+			mSlots[slot].mState = SLOT_LOADING;
+			lockMe.unlock();
+			bool ok = load(frame, *mSlots[slot].mFrame);
+			lockMe.lock();
+			if (!ok) {
+				mSlots[slot].mState = SLOT_EMPTY;
+				mSlots[slot].mFrameIndex = -1;
+				mSlotChanged.notify_all();
+				return NULL;
+			}
+		}
+	}
+	mSlots[slot].mState = SLOT_PRESENTING;
+	//Start decoding past this frame while the caller presents it.
+	mCursor = frame + mDirection;
+	mSlotChanged.notify_all();
+	return mSlots[slot].mFrame.get();
+}
+void PlaybackPrefetcher::release(PlaybackFrame* frame) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	for (Slot& slot : mSlots) {
+		if (slot.mFrame.get() == frame) {
+			slot.mState = SLOT_EMPTY;
+			slot.mFrameIndex = -1;
+		}
+	}
+	mSlotChanged.notify_all();
+}
+PlaybackPrefetcher::~PlaybackPrefetcher() {
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		mRunning = false;
+		mSlotChanged.notify_all();
+	}
+	for (std::thread& thread : mThreads) {
+		if (thread.joinable())
+			thread.join();
+	}
+}
+}
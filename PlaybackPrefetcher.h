@@ -0,0 +1,92 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PLAYBACKPREFETCHER_H_
+#define PLAYBACKPREFETCHER_H_
+#include "Simulation.h"
+#include <condition_variable>
+namespace imagesci {
+class SimulationPlayback;
+//Decoded recording frame. Buffers are exchanged with the simulation source when the frame is shown, so they are reused.
+struct PlaybackFrame {
+	long mFrame;
+	bool mHasConstellation;
+	bool mHasIsoSurface;
+	bool mHasParticleVolume;
+	Constellation mConstellation;
+	Mesh mIsoSurface;
+	ParticleVolume mParticleVolume;
+	Mesh mTemporaryMesh;
+	openvdb::FloatGrid::Ptr mSignedLevelSet;
+	PlaybackFrame() :
+			mFrame(-1), mHasConstellation(false), mHasIsoSurface(false), mHasParticleVolume(
+					false) {
+	}
+};
+/*
+ * Ring of frames decoded ahead of playback by worker threads. The ring covers the frames from the cursor in the
+ * playback direction, seeking moves the cursor and frames that fall outside the window are recycled.
+ */
+class PlaybackPrefetcher {
+protected:
+	enum SlotState {
+		SLOT_EMPTY, SLOT_LOADING, SLOT_READY, SLOT_FAILED, SLOT_PRESENTING
+	};
+	struct Slot {
+		long mFrameIndex;
+		SlotState mState;
+		std::unique_ptr<PlaybackFrame> mFrame;
+	};
+	SimulationPlayback* mPlayback;
+	long mNumFrames;
+	long mCursor;
+	int mDirection;
+	bool mRunning;
+	size_t mHits;
+	size_t mMisses;
+	std::vector<Slot> mSlots;
+	std::vector<std::thread> mThreads;
+	std::mutex mLock;
+	std::condition_variable mSlotChanged;
+	bool inWindow(long frame) const;
+	int findSlot(long frame) const;
+	long nextRequest(int& slot);
+	bool load(long frame, PlaybackFrame& out);
+	void process();
+public:
+	PlaybackPrefetcher(SimulationPlayback* playback, long numFrames,
+			size_t ringSize = 8, int threads = 2);
+	void setDirection(int direction);
+	void seek(long frame);
+	//Block until the frame is decoded, loading it on the calling thread if the worker failed. NULL if it cannot be
+	//loaded. The frame belongs to the caller until release() is called.
+	PlaybackFrame* acquire(long frame);
+	void release(PlaybackFrame* frame);
+	inline size_t getHits() const {
+		return mHits;
+	}
+	inline size_t getMisses() const {
+		return mMisses;
+	}
+	~PlaybackPrefetcher();
+};
+}
+#endif /* PLAYBACKPREFETCHER_H_ */
@@ -0,0 +1,591 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "PlyBlockIO.h"
+#include "ImageSciUtil.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include "ply_io.h"
+namespace imagesci {
+using namespace openvdb;
+struct PlyBlockProperty {
+	std::string mName;
+	int mType;
+	int mCountType;
+	bool mIsList;
+};
+struct PlyBlockElement {
+	std::string mName;
+	size_t mCount;
+	std::vector<PlyBlockProperty> mProperties;
+	const PlyBlockProperty* find(const std::string& name,
+			size_t* offset) const {
+		size_t off = 0;
+		for (const PlyBlockProperty& prop : mProperties) {
+			if (prop.mName == name) {
+				if (offset != NULL)
+					*offset = off;
+				return &prop;
+			}
+			off += PlyTypeSize(prop.mType);
+		}
+		return NULL;
+	}
+	size_t stride() const {
+		size_t sz = 0;
+		for (const PlyBlockProperty& prop : mProperties) {
+			sz += PlyTypeSize(prop.mType);
+		}
+		return sz;
+	}
+	bool isScalar() const {
+		for (const PlyBlockProperty& prop : mProperties) {
+			if (prop.mIsList)
+				return false;
+		}
+		return true;
+	}
+	static size_t PlyTypeSize(int type) {
+		static const size_t sizes[] = { 0, 1, 2, 4, 1, 2, 4, 4, 8 };
+		return (type > StartType && type < EndType) ? sizes[type] : 0;
+	}
+};
+struct PlyBlockHeader {
+	int mFormat;
+	std::vector<PlyBlockElement> mElements;
+	const PlyBlockElement* find(const std::string& name) const {
+		for (const PlyBlockElement& elem : mElements) {
+			if (elem.mName == name)
+				return &elem;
+		}
+		return NULL;
+	}
+};
+static int GetPlyBlockType(const std::string& name) {
+	static const char* names[] = { "invalid", "int8", "int16", "int32",
+			"uint8", "uint16", "uint32", "float32", "float64" };
+	static const char* oldNames[] = { "invalid", "char", "short", "int",
+			"uchar", "ushort", "uint", "float", "double" };
+	for (int i = StartType + 1; i < EndType; i++) {
+		if (name == names[i] || name == oldNames[i])
+			return i;
+	}
+	return StartType;
+}
+static bool IsLittleEndian() {
+	const uint16_t one = 1;
+	return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+static bool ReadPlyBlockHeader(std::istream& istr, PlyBlockHeader& header) {
+	std::string line, word;
+	if (!std::getline(istr, line) || line.compare(0, 3, "ply") != 0)
+		return false;
+	header.mFormat = 0;
+	while (std::getline(istr, line)) {
+		std::istringstream words(line);
+		words >> word;
+		if (word == "format") {
+			words >> word;
+			if (word == "binary_little_endian") {
+				header.mFormat = PLY_BINARY_LE;
+			} else if (word == "binary_big_endian") {
+				header.mFormat = PLY_BINARY_BE;
+			} else {
+				return false;
+			}
+		} else if (word == "element") {
+			PlyBlockElement elem;
+			words >> elem.mName >> elem.mCount;
+			header.mElements.push_back(elem);
+		} else if (word == "property") {
+			if (header.mElements.size() == 0)
+				return false;
+			PlyBlockProperty prop;
+			std::string type;
+			words >> type;
+			if (type == "list") {
+				std::string countType;
+				words >> countType >> type;
+				prop.mIsList = true;
+				prop.mCountType = GetPlyBlockType(countType);
+			} else {
+				prop.mIsList = false;
+				prop.mCountType = StartType;
+			}
+			prop.mType = GetPlyBlockType(type);
+			words >> prop.mName;
+			if (prop.mType == StartType
+					|| (prop.mIsList && prop.mCountType == StartType))
+				return false;
+			header.mElements.back().mProperties.push_back(prop);
+		} else if (word == "end_header") {
+			return header.mFormat != 0;
+		}
+	}
+	return false;
+}
+static inline void SwapBytes(char* ptr, size_t sz) {
+	std::reverse(ptr, ptr + sz);
+}
+//Reverse every sz byte word in place. Records hold only 1 and 4 byte fields in the layouts handled here.
+static void SwapWords(std::vector<char>& buffer, size_t offset,
+		const std::vector<size_t>& fieldSizes, size_t stride, size_t count) {
+	OPENMP_FOR
+	for (int64_t i = 0; i < (int64_t) count; i++) {
+		char* ptr = &buffer[offset + i * stride];
+		for (size_t sz : fieldSizes) {
+			if (sz > 1)
+				SwapBytes(ptr, sz);
+			ptr += sz;
+		}
+	}
+}
+static inline float ReadFloat(const char* ptr) {
+	float val;
+	memcpy(&val, ptr, sizeof(float));
+	return val;
+}
+static inline int32_t ReadInt(const char* ptr) {
+	int32_t val;
+	memcpy(&val, ptr, sizeof(int32_t));
+	return val;
+}
+static inline void WriteFloat(char* ptr, float val) {
+	memcpy(ptr, &val, sizeof(float));
+}
+static inline void WriteInt(char* ptr, int32_t val) {
+	memcpy(ptr, &val, sizeof(int32_t));
+}
+static bool ReadRemainder(std::istream& istr, std::vector<char>& buffer) {
+	std::streampos start = istr.tellg();
+	istr.seekg(0, std::ios::end);
+	std::streampos end = istr.tellg();
+	istr.seekg(start, std::ios::beg);
+	buffer.resize(end - start);
+	if (buffer.size() > 0)
+		istr.read(&buffer[0], buffer.size());
+	return !istr.fail();
+}
+//Vertex properties must be float32 scalars, apart from uint8 colors.
+static bool IsBlockVertexElement(const PlyBlockElement& elem) {
+	if (!elem.isScalar())
+		return false;
+	for (const PlyBlockProperty& prop : elem.mProperties) {
+		bool color = (prop.mName == "red" || prop.mName == "green"
+				|| prop.mName == "blue" || prop.mName == "alpha");
+		if (prop.mType != ((color) ? Uint8 : Float32))
+			return false;
+	}
+	return true;
+}
+std::mutex& GetPlyIOLock() {
+	static std::mutex lock;
+	return lock;
+}
+bool ReadPlyMeshBlock(const std::string& file, Mesh& mesh) {
+	std::ifstream istr(file, std::ios::in | std::ios::binary);
+	PlyBlockHeader header;
+	if (!istr.is_open() || !ReadPlyBlockHeader(istr, header))
+		return false;
+	if (header.mElements.size() != 2 || header.mElements[0].mName != "vertex"
+			|| header.mElements[1].mName != "face")
+		return false;
+	const PlyBlockElement& verts = header.mElements[0];
+	const PlyBlockElement& faces = header.mElements[1];
+	if (!IsBlockVertexElement(verts))
+		return false;
+	size_t xOff, yOff, zOff, nOff[3], vOff[3], cOff[3];
+	if (verts.find("x", &xOff) == NULL || verts.find("y", &yOff) == NULL
+			|| verts.find("z", &zOff) == NULL)
+		return false;
+	bool hasNormals = verts.find("nx", &nOff[0]) != NULL
+			&& verts.find("ny", &nOff[1]) != NULL
+			&& verts.find("nz", &nOff[2]) != NULL;
+	bool hasVertexVelocity = verts.find("vx", &vOff[0]) != NULL
+			&& verts.find("vy", &vOff[1]) != NULL
+			&& verts.find("vz", &vOff[2]) != NULL;
+	bool hasColors = verts.find("red", &cOff[0]) != NULL
+			&& verts.find("green", &cOff[1]) != NULL
+			&& verts.find("blue", &cOff[2]) != NULL;
+	//Faces hold the vertex index list and an optional velocity list, both with uint8 counts.
+	bool hasParticleVelocity = false;
+	for (size_t i = 0; i < faces.mProperties.size(); i++) {
+		const PlyBlockProperty& prop = faces.mProperties[i];
+		if (!prop.mIsList || prop.mCountType != Uint8)
+			return false;
+		if (i == 0 && prop.mName == "vertex_indices"
+				&& (prop.mType == Int32 || prop.mType == Uint32)) {
+			continue;
+		} else if (i == 1 && prop.mName == "velocities"
+				&& prop.mType == Float32) {
+			hasParticleVelocity = true;
+		} else {
+			return false;
+		}
+	}
+	if (faces.mProperties.size() == 0)
+		return false;
+	std::vector<char> buffer;
+	if (!ReadRemainder(istr, buffer))
+		return false;
+	size_t stride = verts.stride();
+	size_t numPts = verts.mCount;
+	size_t numPolys = faces.mCount;
+	size_t vertexBytes = stride * numPts;
+	if (buffer.size() < vertexBytes)
+		return false;
+	//Locate each face record. This pass also rejects polygons other than triangles and quads.
+	std::vector<size_t> faceOffsets(numPolys);
+	size_t pos = vertexBytes;
+	for (size_t j = 0; j < numPolys; j++) {
+		faceOffsets[j] = pos;
+		if (pos >= buffer.size())
+			return false;
+		uint8_t nverts = static_cast<uint8_t>(buffer[pos]);
+		if (nverts != 3 && nverts != 4)
+			return false;
+		pos += 1 + 4 * nverts;
+		if (hasParticleVelocity) {
+			if (pos >= buffer.size()
+					|| static_cast<uint8_t>(buffer[pos]) != 3)
+				return false;
+			pos += 1 + 3 * sizeof(float);
+		}
+	}
+	if (pos > buffer.size())
+		return false;
+	bool swap = (header.mFormat == PLY_BINARY_LE) != IsLittleEndian();
+	if (swap) {
+		std::vector<size_t> fieldSizes;
+		for (const PlyBlockProperty& prop : verts.mProperties) {
+			fieldSizes.push_back(PlyBlockElement::PlyTypeSize(prop.mType));
+		}
+		SwapWords(buffer, 0, fieldSizes, stride, numPts);
+		OPENMP_FOR
+		for (int64_t j = 0; j < (int64_t) numPolys; j++) {
+			char* ptr = &buffer[faceOffsets[j]];
+			int nverts = static_cast<uint8_t>(*ptr++);
+			for (int k = 0; k < nverts; k++, ptr += 4)
+				SwapBytes(ptr, 4);
+			if (hasParticleVelocity) {
+				ptr++;
+				for (int k = 0; k < 3; k++, ptr += 4)
+					SwapBytes(ptr, 4);
+			}
+		}
+	}
+	mesh.mTriIndexes.clear();
+	mesh.mQuadIndexes.clear();
+	mesh.mParticles.clear();
+	mesh.mParticleNormals.clear();
+	mesh.mVertexNormals.clear();
+	mesh.mColors.clear();
+	mesh.mParticleVelocity.clear();
+	mesh.mVertexVelocity.clear();
+	mesh.mVertexes.resize(numPts);
+	if (hasNormals)
+		mesh.mVertexNormals.resize(numPts);
+	if (hasVertexVelocity)
+		mesh.mVertexVelocity.resize(numPts);
+	if (hasColors)
+		mesh.mColors.resize(numPts);
+	OPENMP_FOR
+	for (int64_t i = 0; i < (int64_t) numPts; i++) {
+		const char* ptr = &buffer[i * stride];
+		mesh.mVertexes[i] = Vec3s(ReadFloat(ptr + xOff), ReadFloat(ptr + yOff),
+				ReadFloat(ptr + zOff));
+		if (hasNormals) {
+			mesh.mVertexNormals[i] = Vec3s(ReadFloat(ptr + nOff[0]),
+					ReadFloat(ptr + nOff[1]), ReadFloat(ptr + nOff[2]));
+		}
+		if (hasVertexVelocity) {
+			mesh.mVertexVelocity[i] = Vec3s(ReadFloat(ptr + vOff[0]),
+					ReadFloat(ptr + vOff[1]), ReadFloat(ptr + vOff[2]));
+		}
+		if (hasColors) {
+			mesh.mColors[i] = Vec3s(
+					static_cast<uint8_t>(ptr[cOff[0]]) / 255.0f,
+					static_cast<uint8_t>(ptr[cOff[1]]) / 255.0f,
+					static_cast<uint8_t>(ptr[cOff[2]]) / 255.0f);
+		}
+	}
+	mesh.mFaces.resize(numPolys);
+	if (hasParticleVelocity)
+		mesh.mParticleVelocity.resize(numPolys);
+	OPENMP_FOR
+	for (int64_t j = 0; j < (int64_t) numPolys; j++) {
+		const char* ptr = &buffer[faceOffsets[j]];
+		int nverts = static_cast<uint8_t>(*ptr++);
+		Vec4I face(ReadInt(ptr), ReadInt(ptr + 4), ReadInt(ptr + 8),
+				(nverts == 4) ? ReadInt(ptr + 12) : openvdb::util::INVALID_IDX);
+		mesh.mFaces[j] = face;
+		ptr += 4 * nverts;
+		if (hasParticleVelocity) {
+			ptr++;
+			mesh.mParticleVelocity[j] = Vec3s(ReadFloat(ptr), ReadFloat(ptr + 4),
+					ReadFloat(ptr + 8));
+		}
+	}
+	for (const Vec4I& face : mesh.mFaces) {
+		if (face[3] == openvdb::util::INVALID_IDX) {
+			mesh.mTriIndexes.push_back(face[0]);
+			mesh.mTriIndexes.push_back(face[1]);
+			mesh.mTriIndexes.push_back(face[2]);
+		} else {
+			mesh.mQuadIndexes.push_back(face[0]);
+			mesh.mQuadIndexes.push_back(face[1]);
+			mesh.mQuadIndexes.push_back(face[2]);
+			mesh.mQuadIndexes.push_back(face[3]);
+		}
+	}
+	return true;
+}
+static void WritePlyBlockPreamble(std::ostream& ostr) {
+	ostr << "ply\n";
+	ostr << "format binary_little_endian 1.0\n";
+	ostr << "comment PLY File\n";
+	ostr << "obj_info ImageSci\n";
+}
+bool WritePlyMeshBlock(const std::string& file, const Mesh& mesh, const MeshIndexes& indexes) {
+	const std::vector<openvdb::Index32>& quads = *indexes.mQuads;
+	const std::vector<openvdb::Index32>& tris = *indexes.mTris;
+	const std::vector<openvdb::Vec3s>& normals = *indexes.mNormals;
+	size_t numPts = mesh.mVertexes.size();
+	bool hasNormals = normals.size() > 0;
+	bool hasVertexVelocity = mesh.mVertexVelocity.size() > 0;
+	bool hasColors = mesh.mColors.size() > 0;
+	bool hasParticleVelocity = mesh.mParticleVelocity.size() > 0;
+	if ((hasNormals && normals.size() != numPts)
+			|| (hasVertexVelocity && mesh.mVertexVelocity.size() != numPts)
+			|| (hasColors && mesh.mColors.size() != numPts)
+			|| mesh.uvMap.size() > 0)
+		return false;
+	size_t quadCount = quads.size() / 4;
+	size_t triCount = tris.size() / 3;
+	size_t numPolys = quadCount + triCount;
+	//Faces are written in mFaces order when it agrees with the index lists, so each face keeps its own velocity.
+	bool faceOrder = (mesh.mFaces.size() == numPolys);
+	if (hasParticleVelocity
+			&& mesh.mParticleVelocity.size() < ((faceOrder) ? numPolys : std::max(quadCount, triCount)))
+		return false;
+	std::ofstream ostr(file, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!ostr.is_open())
+		return false;
+	WritePlyBlockPreamble(ostr);
+	ostr << "element vertex " << numPts << "\n";
+	ostr << "property float32 x\nproperty float32 y\nproperty float32 z\n";
+	if (hasNormals)
+		ostr << "property float32 nx\nproperty float32 ny\nproperty float32 nz\n";
+	if (hasVertexVelocity)
+		ostr << "property float32 vx\nproperty float32 vy\nproperty float32 vz\n";
+	if (hasColors)
+		ostr << "property uint8 red\nproperty uint8 green\nproperty uint8 blue\n";
+	ostr << "element face " << numPolys << "\n";
+	ostr << "property list uint8 int32 vertex_indices\n";
+	if (hasParticleVelocity)
+		ostr << "property list uint8 float32 velocities\n";
+	ostr << "end_header\n";
+	size_t stride = 3 * sizeof(float);
+	std::vector<size_t> fieldSizes(3, sizeof(float));
+	if (hasNormals) {
+		stride += 3 * sizeof(float);
+		fieldSizes.insert(fieldSizes.end(), 3, sizeof(float));
+	}
+	if (hasVertexVelocity) {
+		stride += 3 * sizeof(float);
+		fieldSizes.insert(fieldSizes.end(), 3, sizeof(float));
+	}
+	if (hasColors) {
+		stride += 3;
+		fieldSizes.insert(fieldSizes.end(), 3, 1);
+	}
+	std::vector<char> buffer(stride * numPts);
+	OPENMP_FOR
+	for (int64_t i = 0; i < (int64_t) numPts; i++) {
+		char* ptr = &buffer[i * stride];
+		const Vec3s& pt = mesh.mVertexes[i];
+		for (int k = 0; k < 3; k++, ptr += sizeof(float))
+			WriteFloat(ptr, pt[k]);
+		if (hasNormals) {
+			const Vec3s& n = normals[i];
+			for (int k = 0; k < 3; k++, ptr += sizeof(float))
+				WriteFloat(ptr, n[k]);
+		}
+		if (hasVertexVelocity) {
+			const Vec3s& v = mesh.mVertexVelocity[i];
+			for (int k = 0; k < 3; k++, ptr += sizeof(float))
+				WriteFloat(ptr, v[k]);
+		}
+		if (hasColors) {
+			const Vec3s& c = mesh.mColors[i];
+			for (int k = 0; k < 3; k++)
+				*ptr++ = static_cast<char>(static_cast<unsigned char>(clamp(
+						c[k] * 255.0f, 0.0f, 255.0f)));
+		}
+	}
+	if (!IsLittleEndian())
+		SwapWords(buffer, 0, fieldSizes, stride, numPts);
+	if (buffer.size() > 0)
+		ostr.write(&buffer[0], buffer.size());
+	//Face records are 1+4n bytes, plus 13 bytes for the velocity list.
+	size_t velocityBytes = (hasParticleVelocity) ? 1 + 3 * sizeof(float) : 0;
+	std::vector<size_t> faceOffsets(numPolys + 1, 0);
+	for (size_t j = 0; j < numPolys; j++) {
+		int nverts;
+		if (faceOrder) {
+			nverts = (mesh.mFaces[j][3] == openvdb::util::INVALID_IDX) ? 3 : 4;
+		} else {
+			nverts = (j < quadCount) ? 4 : 3;
+		}
+		faceOffsets[j + 1] = faceOffsets[j] + 1 + 4 * nverts + velocityBytes;
+	}
+	buffer.resize(faceOffsets[numPolys]);
+	OPENMP_FOR
+	for (int64_t j = 0; j < (int64_t) numPolys; j++) {
+		char* ptr = &buffer[faceOffsets[j]];
+		int nverts;
+		int32_t verts[4];
+		size_t velocityIndex;
+		if (faceOrder) {
+			const Vec4I& face = mesh.mFaces[j];
+			nverts = (face[3] == openvdb::util::INVALID_IDX) ? 3 : 4;
+			for (int k = 0; k < nverts; k++)
+				verts[k] = face[k];
+			velocityIndex = j;
+		} else if (j < (int64_t) quadCount) {
+			nverts = 4;
+			for (int k = 0; k < 4; k++)
+				verts[k] = quads[4 * j + k];
+			velocityIndex = j;
+		} else {
+			nverts = 3;
+			for (int k = 0; k < 3; k++)
+				verts[k] = tris[3 * (j - quadCount) + k];
+			velocityIndex = j - quadCount;
+		}
+		*ptr++ = static_cast<char>(nverts);
+		for (int k = 0; k < nverts; k++, ptr += 4) {
+			WriteInt(ptr, verts[k]);
+			if (!IsLittleEndian())
+				SwapBytes(ptr, 4);
+		}
+		if (hasParticleVelocity) {
+			*ptr++ = 3;
+			const Vec3s& v = mesh.mParticleVelocity[velocityIndex];
+			for (int k = 0; k < 3; k++, ptr += 4) {
+				WriteFloat(ptr, v[k]);
+				if (!IsLittleEndian())
+					SwapBytes(ptr, 4);
+			}
+		}
+	}
+	if (buffer.size() > 0)
+		ostr.write(&buffer[0], buffer.size());
+	return ostr.good();
+}
+bool ReadPlyParticleBlock(const std::string& file, ParticleVolume& volume) {
+	std::ifstream istr(file, std::ios::in | std::ios::binary);
+	PlyBlockHeader header;
+	if (!istr.is_open() || !ReadPlyBlockHeader(istr, header))
+		return false;
+	if (header.mElements.size() != 1 || header.mElements[0].mName != "vertex")
+		return false;
+	const PlyBlockElement& verts = header.mElements[0];
+	if (!IsBlockVertexElement(verts))
+		return false;
+	size_t xOff, yOff, zOff, rOff, nOff[3];
+	if (verts.find("x", &xOff) == NULL || verts.find("y", &yOff) == NULL
+			|| verts.find("z", &zOff) == NULL
+			|| verts.find("intensity", &rOff) == NULL)
+		return false;
+	bool hasVelocity = verts.find("nx", &nOff[0]) != NULL
+			&& verts.find("ny", &nOff[1]) != NULL
+			&& verts.find("nz", &nOff[2]) != NULL;
+	std::vector<char> buffer;
+	size_t stride = verts.stride();
+	size_t numPts = verts.mCount;
+	if (!ReadRemainder(istr, buffer) || buffer.size() < stride * numPts)
+		return false;
+	if ((header.mFormat == PLY_BINARY_LE) != IsLittleEndian()) {
+		std::vector<size_t> fieldSizes;
+		for (const PlyBlockProperty& prop : verts.mProperties) {
+			fieldSizes.push_back(PlyBlockElement::PlyTypeSize(prop.mType));
+		}
+		SwapWords(buffer, 0, fieldSizes, stride, numPts);
+	}
+	volume.mVelocities.clear();
+	volume.mParticles.resize(numPts);
+	if (hasVelocity)
+		volume.mVelocities.resize(numPts);
+	OPENMP_FOR
+	for (int64_t i = 0; i < (int64_t) numPts; i++) {
+		const char* ptr = &buffer[i * stride];
+		volume.mParticles[i] = Vec4s(ReadFloat(ptr + xOff),
+				ReadFloat(ptr + yOff), ReadFloat(ptr + zOff),
+				ReadFloat(ptr + rOff));
+		if (hasVelocity) {
+			volume.mVelocities[i] = Vec3s(ReadFloat(ptr + nOff[0]),
+					ReadFloat(ptr + nOff[1]), ReadFloat(ptr + nOff[2]));
+		}
+	}
+	return numPts > 0;
+}
+bool WritePlyParticleBlock(const std::string& file,
+		const ParticleVolume& volume) {
+	size_t numPts = volume.mParticles.size();
+	bool hasVelocity = volume.mVelocities.size() > 0;
+	if (hasVelocity && volume.mVelocities.size() != numPts)
+		return false;
+	std::ofstream ostr(file, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!ostr.is_open())
+		return false;
+	WritePlyBlockPreamble(ostr);
+	ostr << "element vertex " << numPts << "\n";
+	ostr << "property float32 x\nproperty float32 y\nproperty float32 z\n";
+	ostr << "property float32 intensity\n";
+	if (hasVelocity)
+		ostr << "property float32 nx\nproperty float32 ny\nproperty float32 nz\n";
+	ostr << "end_header\n";
+	size_t fields = (hasVelocity) ? 7 : 4;
+	size_t stride = fields * sizeof(float);
+	std::vector<char> buffer(stride * numPts);
+	OPENMP_FOR
+	for (int64_t i = 0; i < (int64_t) numPts; i++) {
+		char* ptr = &buffer[i * stride];
+		const Vec4s& pt = volume.mParticles[i];
+		for (int k = 0; k < 4; k++, ptr += sizeof(float))
+			WriteFloat(ptr, pt[k]);
+		if (hasVelocity) {
+			const Vec3s& v = volume.mVelocities[i];
+			for (int k = 0; k < 3; k++, ptr += sizeof(float))
+				WriteFloat(ptr, v[k]);
+		}
+	}
+	if (!IsLittleEndian())
+		SwapWords(buffer, 0, std::vector<size_t>(fields, sizeof(float)),
+				stride, numPts);
+	if (buffer.size() > 0)
+		ostr.write(&buffer[0], buffer.size());
+	return ostr.good();
+}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PLYBLOCKIO_H_
+#define PLYBLOCKIO_H_
+#include "Mesh.h"
+#include "ParticleVolume.h"
+#include <string>
+#include <mutex>
+namespace imagesci {
+/*
+ * Whole-array readers and writers for the binary PLY layouts written by Mesh::save and ParticleVolume::save.
+ * Vertex records are fixed size and decoded in parallel, face lists are located with one pass over their
+ * counts. Readers return false before touching their output when the header does not match one of these
+ * layouts, in which case the caller falls back to the generic ply_io path.
+ */
+bool ReadPlyMeshBlock(const std::string& file, Mesh& mesh);
+bool WritePlyMeshBlock(const std::string& file, const Mesh& mesh, const MeshIndexes& indexes);
+bool ReadPlyParticleBlock(const std::string& file, ParticleVolume& volume);
+bool WritePlyParticleBlock(const std::string& file, const ParticleVolume& volume);
+//ply_io parses headers into static buffers, so the generic read and write paths hold this lock.
+std::mutex& GetPlyIOLock();
+}
+#endif /* PLYBLOCKIO_H_ */
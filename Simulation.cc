@@ -20,6 +20,12 @@
  */
 
 #include "Simulation.h"
+#include "FrameStore.h"
+#include "VdbSequence.h"
+#include "Checkpoint.h"
+#include "StashWriter.h"
+#include "PlaybackManifest.h"
+#include "MetricsLog.h"
 #include <boost/filesystem.hpp>
 #include <openvdb/openvdb.h>
 #include <sstream>
@@ -31,9 +37,13 @@ void ExecuteSimulation(Simulation* sim){
 	try {
 		sim->fireUpdateEvent();
 		while(sim->step()){
+			sim->updateCheckpoint();
+			//Listeners stash the frame, so its stash metrics are committed with it.
 			sim->fireUpdateEvent();
+			sim->commitMetrics();
 			std::this_thread::sleep_for(std::chrono::milliseconds(5));
 		}
+		sim->commitMetrics();
 		if(sim->isRunning())sim->stopRunning();
 	} catch (imagesci::Exception& e) {
 		std::cout << "ImageSci Error:: "<< e.what() << std::endl;
@@ -44,46 +54,72 @@ void ExecuteSimulation(Simulation* sim){
 SimulationListener::~SimulationListener(){
 
 }
-Simulation::Simulation(const std::string& name,MotionScheme scheme):mPaused(false),mComputeTimeSeconds(0.0),mName(name),mMotionScheme(scheme),mIsInitialized(false),mIsMeshDirty(false),mRunning(false),mTimeStep(0),mSimulationDuration(0),mSimulationTime(0),mSimulationIteration(0) {
+Simulation::Simulation(const std::string& name,MotionScheme scheme):mFrameStoreEnabled(false),mDeltaFrames(0),mVdbSequenceEnabled(false),mVdbSaveFloatAsHalf(true),mCheckpointInterval(0),mResumeIteration(-1),mPaused(false),mComputeTimeSeconds(0.0),mName(name),mMotionScheme(scheme),mIsInitialized(false),mIsMeshDirty(false),mRunning(false),mTimeStep(0),mSimulationDuration(0),mSimulationTime(0),mSimulationIteration(0) {
 	// TODO Auto-generated constructor stub
 
 }
-bool Simulation::stash(const std::string& directory){
-	SimulationTimeStepDescription simDesc=getDescription();
+bool Simulation::writeFrame(const std::string& directory,const SimulationTimeStepDescription& simDesc,std::map<std::string,double>& metrics,
+		Constellation& constellation,Mesh& isoSurface,ParticleVolume& particleVolume,openvdb::FloatGrid::Ptr signedLevelSet){
+	if(mFrameStoreEnabled){
+		std::string storeFile=MakeString()<<directory<<mName<<".frames";
+		if(mFrameStore.get()==NULL||mFrameStore->getFile()!=storeFile){
+			mFrameStore.reset(new FrameStore());
+			mFrameStore->setDeltaEncoding(mDeltaFrames);
+			if(!mFrameStore->create(storeFile,mName,mResumeIteration)){
+				std::cout<<"Could not create frame store "<<storeFile<<std::endl;
+				mFrameStore.reset();
+				return false;
+			}
+		}
+		return mFrameStore->append(simDesc,metrics,constellation,isoSurface,particleVolume,signedLevelSet);
+	}
+	if(mResumeIteration>=0&&mTrimmedDirectory!=directory){
+		trimRecording(directory);
+		mTrimmedDirectory=directory;
+	}
 	SpringLevelSetDescription springlDesc;
 	std::stringstream constFile,isoFile,signedFile,descFile,fluidFile,rawFile;
-	constFile<< directory<<mName<<"_sls_" <<std::setw(8)<<std::setfill('0')<< mSimulationIteration << ".ply";
-	isoFile<< directory<<mName<<"_iso_" <<std::setw(8)<<std::setfill('0')<< mSimulationIteration << ".ply";
-	fluidFile<< directory<<mName<<"_fluid_" <<std::setw(8)<<std::setfill('0')<< mSimulationIteration << ".ply";
-	signedFile<< directory<<mName<<"_signed_"<<std::setw(8)<<std::setfill('0')<< mSimulationIteration << ".vdb";
-	//rawFile<< directory<<mName<<"_signed_"<<std::setw(8)<<std::setfill('0')<< mSimulationIteration;
-	descFile<< directory<<mName<<"_"<<std::setw(8)<<std::setfill('0')<< mSimulationIteration << ".sim";
+	constFile<< directory<<mName<<"_sls_" <<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration << ".ply";
+	isoFile<< directory<<mName<<"_iso_" <<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration << ".ply";
+	fluidFile<< directory<<mName<<"_fluid_" <<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration << ".ply";
+	signedFile<< directory<<mName<<"_signed_"<<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration << ".vdb";
+	//rawFile<< directory<<mName<<"_signed_"<<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration;
+	descFile<< directory<<mName<<"_"<<std::setw(8)<<std::setfill('0')<< simDesc.mSimulationIteration << ".sim";
 
-	springlDesc.mMetricValues["Elements"]=mSource.mConstellation.getNumSpringls();
-	springlDesc.mMetricValues["Removed"]=mSource.getLastCleanCount();
-	springlDesc.mMetricValues["Added"]=mSource.getLastFillCount();
-	if(mSource.mConstellation.save(constFile.str())){
+	springlDesc.mMetricValues=metrics;
+	if(constellation.save(constFile.str())){
 		springlDesc.mConstellationFile=constFile.str();
 	}
-	//WriteToRawFile(mSource.mSignedLevelSet,rawFile.str());
-	try {
-		openvdb::io::File file(signedFile.str());
-		openvdb::GridPtrVec grids;
-		//GridBase::Ptr ptr=mSource.mSignedLevelSet->copyGrid(CopyPolicy::CP_COPY);
-		mSource.mSignedLevelSet->transform()=mSource.transform();
-		grids.push_back(mSource.mSignedLevelSet);
-		file.write(grids);
-		mSource.mSignedLevelSet->setTransform(Transform::createLinearTransform(1.0));
-		springlDesc.mSignedLevelSetFile=signedFile.str();
-	}catch(openvdb::Exception& e){
-		std::cout<<"OpenVDB: "<<e.what()<<std::endl;
-	} catch(std::exception& e){
-		std::cout<<e.what()<<std::endl;
+	//WriteToRawFile(signedLevelSet,rawFile.str());
+	if(mVdbSequenceEnabled){
+		std::string sequenceFile=MakeString()<<directory<<mName<<"_signed.vdbs";
+		if(mVdbSequenceWriter.get()==NULL||mVdbSequenceWriter->getFile()!=sequenceFile){
+			mVdbSequenceWriter.reset(new VdbSequenceWriter(mVdbSaveFloatAsHalf));
+			if(!mVdbSequenceWriter->create(sequenceFile,mResumeIteration)){
+				std::cout<<"Could not create VDB sequence "<<sequenceFile<<std::endl;
+				mVdbSequenceWriter.reset();
+			}
+		}
+		if(mVdbSequenceWriter.get()!=NULL&&mVdbSequenceWriter->append(simDesc.mSimulationIteration,signedLevelSet)){
+			springlDesc.mSignedLevelSetFile=sequenceFile;
+		}
+	} else {
+		try {
+			openvdb::io::File file(signedFile.str());
+			openvdb::GridPtrVec grids;
+			grids.push_back(signedLevelSet);
+			file.write(grids);
+			springlDesc.mSignedLevelSetFile=signedFile.str();
+		}catch(openvdb::Exception& e){
+			std::cout<<"OpenVDB: "<<e.what()<<std::endl;
+		} catch(std::exception& e){
+			std::cout<<e.what()<<std::endl;
+		}
 	}
-	if(mSource.mIsoSurface.save(isoFile.str())){
+	if(isoSurface.save(isoFile.str())){
 		springlDesc.mIsoSurfaceFile=isoFile.str();
 	}
-	if(mSource.mParticleVolume.save(fluidFile.str())){
+	if(particleVolume.save(fluidFile.str())){
 		springlDesc.mParticleVolumeFile=fluidFile.str();
 	}
 	std::ofstream ofs;
@@ -94,15 +130,91 @@ bool Simulation::stash(const std::string& directory){
 		Json::Value serializeRoot;
 		Json::Value &root = serializeRoot["Simulation Record"];
 		springlDesc.serialize(root);
-		simDesc.serialize(root);
+		SimulationTimeStepDescription desc=simDesc;
+		desc.serialize(root);
 		Json::StyledWriter writer;
 		ofs<<writer.write( serializeRoot );
 		ofs.close();
+		PlaybackManifest::Append(PlaybackManifest::GetFile(directory,mName),simDesc,springlDesc);
 		std::cout << "Done." << std::endl;
 		return true;
 	} else return false;
 	return true;
 }
+//Frames the interrupted run recorded after the restored iteration are recorded again, so their .sim files and
+//manifest lines are removed. The data files they reference are overwritten.
+void Simulation::trimRecording(const std::string& directory){
+	PlaybackManifest::Truncate(PlaybackManifest::GetFile(directory,mName),mResumeIteration);
+	std::vector<std::string> simFiles;
+	GetDirectoryListing(directory,simFiles,"",".sim");
+	for(const std::string& simFile:simFiles){
+		std::string name;
+		long iteration;
+		if(PlaybackManifest::ParseSimFileName(simFile,name,iteration)&&name==mName&&iteration>mResumeIteration){
+			boost::system::error_code err;
+			boost::filesystem::remove(boost::filesystem::path(simFile),err);
+		}
+	}
+}
+void Simulation::snapshot(SimulationSnapshot& out){
+	out.mDescription=getDescription();
+	out.mMetricValues["Elements"]=mSource.mConstellation.getNumSpringls();
+	out.mMetricValues["Removed"]=mSource.getLastCleanCount();
+	out.mMetricValues["Added"]=mSource.getLastFillCount();
+	out.mConstellation.copy(mSource.mConstellation);
+	out.mIsoSurface=mSource.mIsoSurface;
+	out.mParticleVolume=mSource.mParticleVolume;
+	if(mSource.mSignedLevelSet.get()!=NULL){
+		out.mSignedLevelSet=mSource.mSignedLevelSet->deepCopy();
+		out.mSignedLevelSet->setTransform(mSource.transformPtr()->copy());
+	} else {
+		out.mSignedLevelSet.reset();
+	}
+}
+bool Simulation::writeSnapshot(SimulationSnapshot& snapshot,const std::string& directory){
+	return writeFrame(directory,snapshot.mDescription,snapshot.mMetricValues,snapshot.mConstellation,snapshot.mIsoSurface,snapshot.mParticleVolume,snapshot.mSignedLevelSet);
+}
+void Simulation::setStashPolicy(StashPolicy policy,size_t maxQueueSize,int decimation){
+	mStashWriter.reset();
+	if(policy!=STASH_SYNCHRONOUS){
+		mStashWriter.reset(new StashWriter(this,policy,maxQueueSize,decimation));
+	}
+}
+void Simulation::flushStash(){
+	if(mStashWriter.get()!=NULL)mStashWriter->flush();
+}
+bool Simulation::stash(const std::string& directory){
+	//The restored iteration was recorded before the checkpoint was taken.
+	if(mSimulationIteration==mResumeIteration)return true;
+	if(mStashWriter.get()!=NULL){
+		//The simulation thread only pays for the copy, encoding and disk I/O happen on the writer thread.
+		if(!mStashWriter->admit(mSimulationIteration))return false;
+		Clock::time_point t0 = Clock::now();
+		std::unique_ptr<SimulationSnapshot> frame(new SimulationSnapshot());
+		snapshot(*frame);
+		Clock::time_point t1 = Clock::now();
+		frame->mMetricValues["SnapshotSeconds"]=1E-6*std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+		MetricsLog::set("SnapshotSeconds",frame->mMetricValues["SnapshotSeconds"]);
+		return mStashWriter->push(directory,std::move(frame));
+	}
+	std::map<std::string,double> metrics;
+	metrics["Elements"]=mSource.mConstellation.getNumSpringls();
+	metrics["Removed"]=mSource.getLastCleanCount();
+	metrics["Added"]=mSource.getLastFillCount();
+	if(mSource.mSignedLevelSet.get()!=NULL)mSource.mSignedLevelSet->transform()=mSource.transform();
+	bool ret=writeFrame(directory,getDescription(),metrics,mSource.mConstellation,mSource.mIsoSurface,mSource.mParticleVolume,mSource.mSignedLevelSet);
+	if(mSource.mSignedLevelSet.get()!=NULL)mSource.mSignedLevelSet->setTransform(Transform::createLinearTransform(1.0));
+	return ret;
+}
+void Simulation::commitMetrics(){
+	if(!MetricsLog::isEnabled())return;
+	MetricsLog::set("Elements",mSource.mConstellation.getNumSpringls());
+	MetricsLog::set("Removed",mSource.getLastCleanCount());
+	MetricsLog::set("Added",mSource.getLastFillCount());
+	MetricsLog::set("ComputeSeconds",mComputeTimeSeconds);
+	if(mStashWriter.get()!=NULL)mStashWriter->recordMetrics();
+	MetricsLog::getInstance().commit(mName,mSimulationIteration,mSimulationTime,mTimeStep);
+}
 bool Simulation::updateGL(){
 	if(mIsMeshDirty){
 		mSource.mParticleVolume.updateGL();
@@ -164,6 +276,7 @@ SimulationTimeStepDescription Simulation::getDescription(){
 	desc.mTimeStep=mTimeStep;
 	desc.mSimulationName=mName;
 	desc.mComputeTimeSeconds=mComputeTimeSeconds;
+	desc.mMotionScheme=mMotionScheme;
 	return desc;
 }
 void Simulation::reset(){
@@ -197,19 +310,144 @@ bool Simulation::start(){
 		mSimulationThread=std::thread(ExecuteSimulation,this);
 	} else {
 		stop();
+		//Recordings of a previous run are reopened, truncated for a fresh run or cut back to a restored one.
+		flushStash();
+		mFrameStore.reset();
+		mVdbSequenceWriter.reset();
+		mResumeIteration=-1;
+		mTrimmedDirectory.clear();
 		if(mIsInitialized)cleanup();
 		mIsInitialized=false;
 		if(!init()){
 			return false;
 		}
+		if(mRestoreFile.length()>0){
+			if(!restore(mRestoreFile)){
+				std::cout<<"Could not restore checkpoint "<<mRestoreFile<<std::endl;
+				cleanup();
+				return false;
+			}
+			mResumeIteration=mSimulationIteration;
+			mRestoreFile.clear();
+		}
+		//Init and bootstrap record on this thread, the simulation thread only commits its own buffer.
+		commitMetrics();
 		mIsInitialized=true;
 		mRunning=true;
 		mSimulationThread=std::thread(ExecuteSimulation,this);
 	}
 	return true;
 }
+static const openvdb::Int32 CHECKPOINT_MAGIC=0x54504B43; //"CKPT"
+static const openvdb::Int32 CHECKPOINT_VERSION=2;
+bool Simulation::checkpoint(const std::string& file){
+	Clock::time_point t0=Clock::now();
+	std::ostringstream ostr(std::ios_base::binary);
+	WriteCheckpointValue(ostr,CHECKPOINT_MAGIC);
+	WriteCheckpointValue(ostr,CHECKPOINT_VERSION);
+	WriteCheckpointString(ostr,mName);
+	WriteCheckpointValue(ostr,mMotionScheme);
+	WriteCheckpointValue(ostr,mSimulationIteration);
+	WriteCheckpointValue(ostr,mSimulationTime);
+	WriteCheckpointValue(ostr,mTimeStep);
+	WriteCheckpointValue(ostr,mSimulationDuration);
+	WriteCheckpointValue(ostr,mComputeTimeSeconds);
+	mSource.writeState(ostr);
+	writeCheckpointState(ostr);
+	if(!ostr.good())return false;
+	std::string bytes=ostr.str();
+	if(mCheckpointWriter.get()==NULL)mCheckpointWriter.reset(new CheckpointWriter());
+	mCheckpointWriter->push(file,bytes);
+	Clock::time_point t1=Clock::now();
+	std::cout<<"Checkpoint "<<mSimulationIteration<<" serialized in "<<1E-6*std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count()<<" sec"<<std::endl;
+	return true;
+}
+bool Simulation::restore(const std::string& file){
+	std::ifstream ifs(file,std::ios::in|std::ios::binary);
+	if(!ifs.is_open())return false;
+	std::cout<<"Restoring "<<file<<" ... ";
+	openvdb::Int32 magic=0,version=0;
+	std::string name;
+	if(!ReadCheckpointValue(ifs,magic)||!ReadCheckpointValue(ifs,version)||magic!=CHECKPOINT_MAGIC||version!=CHECKPOINT_VERSION){
+		std::cout<<"Not a checkpoint."<<std::endl;
+		return false;
+	}
+	bool ok=ReadCheckpointString(ifs,name)
+			&&ReadCheckpointValue(ifs,mMotionScheme)
+			&&ReadCheckpointValue(ifs,mSimulationIteration)
+			&&ReadCheckpointValue(ifs,mSimulationTime)
+			&&ReadCheckpointValue(ifs,mTimeStep)
+			&&ReadCheckpointValue(ifs,mSimulationDuration)
+			&&ReadCheckpointValue(ifs,mComputeTimeSeconds)
+			&&mSource.readState(ifs)
+			&&readCheckpointState(ifs);
+	if(!ok||name!=mName){
+		std::cout<<"Failed."<<std::endl;
+		return false;
+	}
+	mIsMeshDirty=true;
+	std::cout<<"Done at iteration "<<mSimulationIteration<<"."<<std::endl;
+	return true;
+}
+static bool CompareGrids(const openvdb::FloatGrid::Ptr& a,const openvdb::FloatGrid::Ptr& b){
+	if(a.get()==NULL||b.get()==NULL)return (a.get()==b.get());
+	if(a->activeVoxelCount()!=b->activeVoxelCount())return false;
+	openvdb::FloatGrid::ConstAccessor acc=b->getConstAccessor();
+	for(openvdb::FloatGrid::ValueOnCIter iter=a->cbeginValueOn();iter;++iter){
+		if(!acc.isValueOn(iter.getCoord())||acc.getValue(iter.getCoord())!=*iter)return false;
+	}
+	return true;
+}
+bool Simulation::VerifyRestore(Simulation& straight,Simulation& resumed,long steps,const std::string& checkpointFile,std::ostream& ostr){
+	long half=steps/2;
+	if(!straight.init())return false;
+	straight.mRunning=true;
+	while(straight.mSimulationIteration<steps){
+		if(straight.mSimulationIteration==half){
+			straight.checkpoint(checkpointFile);
+			straight.flushCheckpoint();
+		}
+		if(!straight.step())break;
+	}
+	straight.mRunning=false;
+	if(!resumed.init()||!resumed.restore(checkpointFile)){
+		ostr<<"Could not restore "<<checkpointFile<<std::endl;
+		straight.cleanup();
+		return false;
+	}
+	resumed.mRunning=true;
+	while(resumed.mSimulationIteration<straight.mSimulationIteration&&resumed.step());
+	resumed.mRunning=false;
+	const Constellation& c1=straight.mSource.mConstellation;
+	const Constellation& c2=resumed.mSource.mConstellation;
+	bool iterationMatch=(straight.mSimulationIteration==resumed.mSimulationIteration&&straight.mSimulationTime==resumed.mSimulationTime);
+	bool springlMatch=(c1.mVertexes==c2.mVertexes&&c1.mParticles==c2.mParticles&&c1.mParticleNormals==c2.mParticleNormals&&c1.mSpringlIds==c2.mSpringlIds);
+	bool isoSurfaceMatch=(straight.mSource.mIsoSurface.mVertexes==resumed.mSource.mIsoSurface.mVertexes);
+	bool levelSetMatch=CompareGrids(straight.mSource.mSignedLevelSet,resumed.mSource.mSignedLevelSet);
+	ostr<<"Restored at iteration "<<half<<" and ran to "<<resumed.mSimulationIteration<<" of "<<straight.mSimulationIteration<<std::endl;
+	ostr<<"Iteration and time "<<((iterationMatch)?"match":"differ")<<std::endl;
+	ostr<<"Springls "<<((springlMatch)?"match":"differ")<<" ("<<c1.getNumSpringls()<<" vs "<<c2.getNumSpringls()<<")"<<std::endl;
+	ostr<<"Iso-surface "<<((isoSurfaceMatch)?"matches":"differs")<<std::endl;
+	ostr<<"Signed level set "<<((levelSetMatch)?"matches":"differs")<<std::endl;
+	straight.cleanup();
+	resumed.cleanup();
+	return iterationMatch&&springlMatch&&isoSurfaceMatch&&levelSetMatch;
+}
+void Simulation::setCheckpointPolicy(const std::string& file,int interval){
+	mCheckpointFile=file;
+	mCheckpointInterval=std::max(interval,0);
+}
+bool Simulation::updateCheckpoint(){
+	if(mCheckpointInterval<=0||mCheckpointFile.length()==0||mSimulationIteration%mCheckpointInterval!=0)return false;
+	return checkpoint(mCheckpointFile);
+}
+void Simulation::flushCheckpoint(){
+	if(mCheckpointWriter.get()!=NULL)mCheckpointWriter->flush();
+}
 Simulation::~Simulation() {
 	stop();
+	//Drain the writer before the frame store it writes to is destroyed.
+	mStashWriter.reset();
 }
 void SimulationTimeStepDescription::serialize(Json::Value& root_in)
 {
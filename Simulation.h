@@ -27,7 +27,12 @@
 #include <mutex>
 #include <chrono>
 #include "json/JsonSerializable.h"
+#include <memory>
 namespace imagesci {
+class FrameStore;
+class VdbSequenceWriter;
+class StashWriter;
+class CheckpointWriter;
 class Simulation;
 void ExecuteSimulation(Simulation* sim);
 class SimulationTimeStepDescription: public JsonSerializable{
@@ -44,6 +49,22 @@ public:
 	static bool load(const std::string& file, SimulationTimeStepDescription* out);
 	bool save(const std::string& file);
 };
+//Copy of the state written by Simulation::stash, so frames can be written off the simulation thread.
+struct SimulationSnapshot{
+	SimulationTimeStepDescription mDescription;
+	std::map<std::string,double> mMetricValues;
+	Constellation mConstellation;
+	Mesh mIsoSurface;
+	ParticleVolume mParticleVolume;
+	//Deep copy with the simulation transform applied.
+	openvdb::FloatGrid::Ptr mSignedLevelSet;
+};
+enum StashPolicy {
+	STASH_SYNCHRONOUS,
+	STASH_BLOCK,
+	STASH_DROP,
+	STASH_DECIMATE
+};
 class Simulation;
 class SimulationListener{
 public:
@@ -66,6 +87,26 @@ protected:
 	MotionScheme mMotionScheme;
 	std::thread mSimulationThread;
 	std::list<SimulationListener*> mListeners;
+	bool mFrameStoreEnabled;
+	int mDeltaFrames;
+	std::unique_ptr<FrameStore> mFrameStore;
+	bool mVdbSequenceEnabled;
+	bool mVdbSaveFloatAsHalf;
+	std::unique_ptr<VdbSequenceWriter> mVdbSequenceWriter;
+	std::unique_ptr<StashWriter> mStashWriter;
+	std::unique_ptr<CheckpointWriter> mCheckpointWriter;
+	std::string mCheckpointFile;
+	int mCheckpointInterval;
+	std::string mRestoreFile;
+	//Iteration the run was restored at, recordings are cut back to it. Negative for a fresh run.
+	long mResumeIteration;
+	std::string mTrimmedDirectory;
+	void trimRecording(const std::string& directory);
+	//Solver state beyond the spring level set and step counters, restored after init().
+	virtual void writeCheckpointState(std::ostream& ostr){}
+	virtual bool readCheckpointState(std::istream& istr){return true;}
+	bool writeFrame(const std::string& directory,const SimulationTimeStepDescription& simDesc,std::map<std::string,double>& metrics,
+			Constellation& constellation,Mesh& isoSurface,ParticleVolume& particleVolume,openvdb::FloatGrid::Ptr signedLevelSet);
 public:
 	typedef std::chrono::high_resolution_clock Clock;
 	SimulationTimeStepDescription getDescription();
@@ -100,6 +141,39 @@ public:
 	bool start();
 	bool stop();
 	bool stash(const std::string& directory);
+	void snapshot(SimulationSnapshot& out);
+	//Append the calling thread's record to the metrics log. Called by start() after init and on the simulation thread after each step.
+	void commitMetrics();
+	bool writeSnapshot(SimulationSnapshot& snapshot,const std::string& directory);
+	//Hand stashed frames to a background writer. The queue holds at most maxQueueSize snapshots, and
+	//STASH_DECIMATE keeps only every decimation'th frame.
+	void setStashPolicy(StashPolicy policy,size_t maxQueueSize=4,int decimation=1);
+	//Block until queued frames are written.
+	void flushStash();
+	//Record frames into a single append-only "<name>.frames" store instead of per-frame files.
+	inline void setFrameStoreEnabled(bool enabled){mFrameStoreEnabled=enabled;}
+	//Serialize the complete solver state between steps and write it to file on a background thread.
+	bool checkpoint(const std::string& file);
+	//Restore a checkpoint after init(), the next step continues bit-exactly from the checkpointed one.
+	bool restore(const std::string& file);
+	//Checkpoint to file every interval iterations while running, zero disables.
+	void setCheckpointPolicy(const std::string& file,int interval);
+	//Block until the last checkpoint is written.
+	void flushCheckpoint();
+	bool updateCheckpoint();
+	//Run straight for steps iterations, checkpointing halfway, then restore resumed from the checkpoint and run it to
+	//the same iteration. True if both end in the same state.
+	static bool VerifyRestore(Simulation& straight,Simulation& resumed,long steps,const std::string& checkpointFile,std::ostream& ostr);
+	//Continue from a checkpoint instead of the initial conditions the next time the simulation starts.
+	inline void setRestoreFile(const std::string& file){mRestoreFile=file;}
+	inline bool isFrameStoreEnabled(){return mFrameStoreEnabled;}
+	//Record a keyframe every deltaFrames frames and springl deltas in between. Zero records only keyframes.
+	inline void setDeltaFrames(int deltaFrames){mDeltaFrames=deltaFrames;}
+	//Write signed level sets into one "<name>_signed.vdbs" archive instead of a .vdb file per frame.
+	inline void setVdbSequenceEnabled(bool enabled,bool saveFloatAsHalf=true){
+		mVdbSequenceEnabled=enabled;
+		mVdbSaveFloatAsHalf=saveFloatAsHalf;
+	}
 	virtual ~Simulation();
 };
 
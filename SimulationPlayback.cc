@@ -23,148 +23,186 @@
 #include "ImageSciUtil.h"
 namespace imagesci {
 
-SimulationPlayback::SimulationPlayback(const std::string& directory):Simulation("Recording",MotionScheme::UNDEFINED),mDirectory(directory) {
+SimulationPlayback::SimulationPlayback(const std::string& directory):Simulation("Recording",MotionScheme::UNDEFINED),mDirectory(directory),mPrefetchSize(0),mPrefetchThreads(2),mDirection(1),mCurrentFrame(-1) {
 	// TODO Auto-generated constructor stub
 
 }
-bool SimulationPlayback::init(){
-	if(mIsInitialized)return true;
-	mIsoSurfaceFiles.clear();
-	mConstellationFiles.clear();
-	mSignedDistanceFiles.clear();
-	mParticleVolumeFiles.clear();
-	mTimeSteps.clear();
-	std::vector<std::string> jsonFiles;
-	int n=GetDirectoryListing(mDirectory,jsonFiles,"",".sim");
-
-	Json::Reader reader;
-	SpringLevelSetDescription springlDesc;
-	SimulationTimeStepDescription simDesc;
-	std::ifstream ifs;
-	if(n==0){
-		std::cout<<"Could not find any *.sim files"<<std::endl;
-		return false;
-	}
-	for(std::string& file:jsonFiles){
-		Json::Value deserializeRoot;
-		ifs.open(file, std::ifstream::in);
-		if (!ifs.is_open()) {
-			std::cout<<"Could not open "<<file<<std::endl;
+bool SimulationPlayback::loadFrame(long frame,PlaybackFrame& out,bool signedLevelSet){
+	out.mFrame=frame;
+	out.mHasConstellation=false;
+	out.mHasIsoSurface=false;
+	out.mHasParticleVolume=false;
+	out.mSignedLevelSet.reset();
+	if(frame<0||frame>=(long)mManifest.size())return false;
+	if(mFrameStore.get()!=NULL){
+		if(!mFrameStore->read(frame,out.mConstellation,out.mIsoSurface,out.mParticleVolume,out.mSignedLevelSet)){
+			std::cout<<"Could not read frame "<<frame<<" from "<<mFrameStore->getFile()<<std::endl;
 			return false;
 		}
-		std::string input((std::istreambuf_iterator<char>(ifs)),
-		std::istreambuf_iterator<char>());
-		ifs.close();
-		if ( !reader.parse(input, deserializeRoot) ){
-			std::cout<<"Could not parse "<<file<<std::endl;
-			continue;
-		}
-		springlDesc.deserialize(deserializeRoot["Simulation Record"]);
-		simDesc.deserialize(deserializeRoot["Simulation Record"]);
-		mIsoSurfaceFiles.push_back(springlDesc.mIsoSurfaceFile);
-		mConstellationFiles.push_back(springlDesc.mConstellationFile);
-		mSignedDistanceFiles.push_back(springlDesc.mSignedLevelSetFile);
-		mParticleVolumeFiles.push_back(springlDesc.mParticleVolumeFile);
-		mSimulationDuration=simDesc.mSimulationDuration;
-		mName=simDesc.mSimulationName;
-		mTimeStep=simDesc.mTimeStep;
-		mMotionScheme=simDesc.mMotionScheme;
-		mTimeSteps.push_back(simDesc);
+		out.mConstellation.updateVertexNormals();
+		out.mConstellation.updateBoundingBox();
+		out.mIsoSurface.updateVertexNormals(4);
+		out.mIsoSurface.updateBoundingBox();
+		out.mHasConstellation=true;
+		out.mHasIsoSurface=true;
+		out.mHasParticleVolume=true;
+		return true;
 	}
-
-	mSimulationIteration=0;
-	if(mSimulationIteration<mConstellationFiles.size()&&mConstellationFiles[mSimulationIteration].length()>0&&mTemporaryMesh.openMesh(mDirectory+GetFileName(mConstellationFiles[mSimulationIteration]))){
-		mSource.mConstellation.create(&mTemporaryMesh);
-		mSource.mConstellation.updateVertexNormals();
-		mSource.mConstellation.updateBoundingBox();
+	PlaybackManifest::Entry entry;
+	if(!mManifest.get(frame,entry))return false;
+	if(entry.mConstellationFile.length()>0&&out.mTemporaryMesh.openMesh(mDirectory+GetFileName(entry.mConstellationFile))){
+		out.mConstellation.create(&out.mTemporaryMesh);
+		out.mConstellation.updateVertexNormals();
+		out.mConstellation.updateBoundingBox();
+		out.mHasConstellation=true;
 	}
-	if(mSimulationIteration<mIsoSurfaceFiles.size()&&mIsoSurfaceFiles[mSimulationIteration].length()>0&&mSource.mIsoSurface.openMesh(mDirectory+GetFileName(mIsoSurfaceFiles[mSimulationIteration]))){
-		mSource.mIsoSurface.updateVertexNormals(4);
+	if(entry.mIsoSurfaceFile.length()>0&&out.mIsoSurface.openMesh(mDirectory+GetFileName(entry.mIsoSurfaceFile))){
+		out.mIsoSurface.updateVertexNormals(4);
+		out.mHasIsoSurface=true;
 	}
-
-	if(mSimulationIteration<mParticleVolumeFiles.size()&&mParticleVolumeFiles[mSimulationIteration].length()>0&&mSource.mParticleVolume.open(mDirectory+GetFileName(mParticleVolumeFiles[mSimulationIteration]))){
+	if(entry.mParticleVolumeFile.length()>0&&out.mParticleVolume.open(mDirectory+GetFileName(entry.mParticleVolumeFile))){
+		out.mHasParticleVolume=true;
 	}
-
-	if(mSimulationIteration<mSignedDistanceFiles.size()&&mSignedDistanceFiles[mSimulationIteration].length()>0){
-		openvdb::io::File file(mDirectory+GetFileName(mSignedDistanceFiles[mSimulationIteration]));
+	if(signedLevelSet&&entry.mSignedLevelSetFile.length()>0&&mVdbSequenceReader.get()!=NULL&&GetFileName(entry.mSignedLevelSetFile)==GetFileName(mVdbSequenceReader->getFile())){
+		size_t index;
+		if(mVdbSequenceReader->find(entry.mDescription.mSimulationIteration,index)){
+			mVdbSequenceReader->read(index,out.mSignedLevelSet);
+		}
+	} else if(signedLevelSet&&entry.mSignedLevelSetFile.length()>0){
+		openvdb::io::File file(mDirectory+GetFileName(entry.mSignedLevelSetFile));
 		file.open();
 		if(file.isOpen()){
 			openvdb::GridPtrVecPtr grids =file.getGrids();
-			openvdb::GridPtrVec allGrids;
-			allGrids.insert(allGrids.end(), grids->begin(), grids->end());
-			GridBase::Ptr ptr = allGrids[0];
-			FloatGrid::Ptr mSignedLevelSet=boost::static_pointer_cast<FloatGrid>(ptr);
-			mSource.transform()=mSignedLevelSet->transform();
-			mSignedLevelSet->setTransform(openvdb::math::Transform::createLinearTransform(1.0));
-			mSource.mSignedLevelSet=mSignedLevelSet;
+			if(grids->size()>0){
+				out.mSignedLevelSet=boost::static_pointer_cast<FloatGrid>((*grids)[0]);
+			}
 		}
 	}
-
-	simDesc=mTimeSteps[mSimulationIteration];
-	mSimulationTime=simDesc.mSimulationTime;
-	mTimeStep=simDesc.mTimeStep;
-	mSimulationDuration=simDesc.mSimulationDuration;
-	mName=simDesc.mSimulationName;
-	mComputeTimeSeconds=simDesc.mComputeTimeSeconds;
-	mIsMeshDirty=true;
 	return true;
 }
-bool SimulationPlayback::step(){
-	if(mSimulationIteration<mConstellationFiles.size()&&mConstellationFiles[mSimulationIteration].length()>0&&mTemporaryMesh.openMesh(mDirectory+GetFileName(mConstellationFiles[mSimulationIteration]))){
-		mSource.mConstellation.create(&mTemporaryMesh);
-		mSource.mConstellation.updateVertexNormals();
-		mSource.mConstellation.updateBoundingBox();
-	}
-	if(mSimulationIteration<mIsoSurfaceFiles.size()&&mIsoSurfaceFiles[mSimulationIteration].length()>0&&mSource.mIsoSurface.openMesh(mDirectory+GetFileName(mIsoSurfaceFiles[mSimulationIteration]))){
-		mSource.mIsoSurface.updateVertexNormals(4);
+//Swap decoded buffers into the source. The frame is left holding the previous buffers for reuse.
+void SimulationPlayback::present(PlaybackFrame& frame){
+	if(frame.mHasConstellation)mSource.mConstellation.swap(frame.mConstellation);
+	if(frame.mHasIsoSurface)mSource.mIsoSurface.swap(frame.mIsoSurface);
+	if(frame.mHasParticleVolume){
+		mSource.mParticleVolume.mParticles.swap(frame.mParticleVolume.mParticles);
+		mSource.mParticleVolume.mVelocities.swap(frame.mParticleVolume.mVelocities);
 	}
-	if(mSimulationIteration<mParticleVolumeFiles.size()&&mParticleVolumeFiles[mSimulationIteration].length()>0&&mSource.mParticleVolume.open(mDirectory+GetFileName(mParticleVolumeFiles[mSimulationIteration]))){
+	if(frame.mSignedLevelSet.get()!=NULL){
+		mSource.transform()=frame.mSignedLevelSet->transform();
+		frame.mSignedLevelSet->setTransform(openvdb::math::Transform::createLinearTransform(1.0));
+		mSource.mSignedLevelSet=frame.mSignedLevelSet;
+		frame.mSignedLevelSet.reset();
 	}
-	/*
-	if(mSimulationIteration<mSignedDistanceFiles.size()&&mSignedDistanceFiles[mSimulationIteration].length()>0){
-		openvdb::io::File file(mDirectory+GetFileName(mSignedDistanceFiles[mSimulationIteration]));
-		file.open();
-		if(file.isOpen()){
-			openvdb::GridPtrVecPtr grids =file.getGrids();
-			openvdb::GridPtrVec allGrids;
-			allGrids.insert(allGrids.end(), grids->begin(), grids->end());
-			GridBase::Ptr ptr = allGrids[0];
-			FloatGrid::Ptr mSignedLevelSet=boost::static_pointer_cast<FloatGrid>(ptr);
-			mSource.transform()=mSignedLevelSet->transform();
-			mSignedLevelSet->setTransform(openvdb::math::Transform::createLinearTransform(1.0));
-			mSource.mSignedLevelSet=mSignedLevelSet;
+	mCurrentFrame=frame.mFrame;
+}
+void SimulationPlayback::presentFrame(long frame,bool signedLevelSet){
+	if(mPrefetcher.get()!=NULL){
+		PlaybackFrame* buffer=mPrefetcher->acquire(frame);
+		if(buffer!=NULL){
+			present(*buffer);
+			mPrefetcher->release(buffer);
 		}
+	} else {
+		loadFrame(frame,mFrameBuffer,signedLevelSet);
+		present(mFrameBuffer);
 	}
-	*/
-	SimulationTimeStepDescription& simDesc=mTimeSteps[mSimulationIteration];
-
+	PlaybackManifest::Entry entry;
+	mManifest.get(frame,entry);
+	SimulationTimeStepDescription& simDesc=entry.mDescription;
 	mSimulationTime=simDesc.mSimulationTime;
 	mTimeStep=simDesc.mTimeStep;
 	mSimulationDuration=simDesc.mSimulationDuration;
 	mName=simDesc.mSimulationName;
+	mMotionScheme=simDesc.mMotionScheme;
 	mComputeTimeSeconds=simDesc.mComputeTimeSeconds;
-	mSimulationIteration++;
 	mIsMeshDirty=true;
-
-	if(mSimulationTime<=mSimulationDuration&&mSimulationIteration<mTimeSteps.size()&&mRunning){
+}
+void SimulationPlayback::setPrefetch(size_t ringSize,int threads){
+	mPrefetchSize=ringSize;
+	mPrefetchThreads=threads;
+	mPrefetcher.reset();
+	if(mPrefetchSize>0&&mManifest.size()>0){
+		mPrefetcher.reset(new PlaybackPrefetcher(this,mManifest.size(),mPrefetchSize,mPrefetchThreads));
+		mPrefetcher->setDirection(mDirection);
+		mPrefetcher->seek(mSimulationIteration);
+	}
+}
+void SimulationPlayback::setDirection(int direction){
+	mDirection=(direction<0)?-1:1;
+	if(mCurrentFrame>=0)mSimulationIteration=mCurrentFrame+mDirection;
+	if(mPrefetcher.get()!=NULL){
+		mPrefetcher->setDirection(mDirection);
+		mPrefetcher->seek(mSimulationIteration);
+	}
+}
+bool SimulationPlayback::init(){
+	if(mIsInitialized)return true;
+	mPrefetcher.reset();
+	mManifest.clear();
+	mFrameStore.reset();
+	mVdbSequenceReader.reset();
+	std::vector<std::string> storeFiles;
+	if(GetDirectoryListing(mDirectory,storeFiles,"",".frames")>0){
+		mFrameStore.reset(new FrameStore());
+		if(!mFrameStore->open(storeFiles[0])||mFrameStore->getNumFrames()==0){
+			std::cout<<"Could not open "<<storeFiles[0]<<std::endl;
+			mFrameStore.reset();
+			return false;
+		}
+		for(size_t i=0;i<mFrameStore->getNumFrames();i++){
+			mManifest.add(mFrameStore->getEntry(i).getDescription(mFrameStore->getName()));
+		}
+		mSimulationIteration=0;
+		presentFrame(0,true);
+		setPrefetch(mPrefetchSize,mPrefetchThreads);
+		return true;
+	}
+	std::vector<std::string> sequenceFiles;
+	if(GetDirectoryListing(mDirectory,sequenceFiles,"",".vdbs")>0){
+		mVdbSequenceReader.reset(new VdbSequenceReader());
+		if(!mVdbSequenceReader->open(sequenceFiles[0])){
+			std::cout<<"Could not open "<<sequenceFiles[0]<<std::endl;
+			mVdbSequenceReader.reset();
+		}
+	}
+	//The rest of the index loads in the background, so the first frame shows as soon as it is parsed.
+	if(!mManifest.open(mDirectory))return false;
+	mSimulationIteration=0;
+	presentFrame(0,true);
+	setPrefetch(mPrefetchSize,mPrefetchThreads);
+	return true;
+}
+bool SimulationPlayback::seek(long frame){
+	if(frame<0||frame>=(long)mManifest.size())return false;
+	if(mPrefetcher.get()!=NULL)mPrefetcher->seek(frame);
+	presentFrame(frame);
+	mSimulationIteration=frame+mDirection;
+	return true;
+}
+bool SimulationPlayback::step(){
+	if(mSimulationIteration<0||mSimulationIteration>=(long)mManifest.size())return false;
+	presentFrame(mSimulationIteration);
+	mSimulationIteration+=mDirection;
+	if((mDirection<0||mSimulationTime<=mSimulationDuration)&&mSimulationIteration>=0&&mSimulationIteration<(long)mManifest.size()&&mRunning){
 		return true;
 	} else {
 		return false;
 	}
 }
 void SimulationPlayback::cleanup(){
-	mIsoSurfaceFiles.clear();
-	mConstellationFiles.clear();
-	mSignedDistanceFiles.clear();
-	mParticleVolumeFiles.clear();
-	mTimeSteps.clear();
+	mPrefetcher.reset();
+	mCurrentFrame=-1;
+	mManifest.clear();
+	mFrameStore.reset();
+	mVdbSequenceReader.reset();
 	mSource.mIsoSurface.reset();
 	mSource.mConstellation.reset();
 	mSource.mParticleVolume.reset();
 	mIsInitialized=false;
 }
 SimulationPlayback::~SimulationPlayback() {
-	// TODO Auto-generated destructor stub
+	mPrefetcher.reset();
 }
 
 } /* namespace imagesci */
@@ -22,6 +22,10 @@
 #ifndef SIMULATIONPLAYBACK_H_
 #define SIMULATIONPLAYBACK_H_
 #include "Simulation.h"
+#include "FrameStore.h"
+#include "PlaybackPrefetcher.h"
+#include "PlaybackManifest.h"
+#include "VdbSequence.h"
 namespace imagesci {
 
 /*
@@ -29,13 +33,18 @@ namespace imagesci {
  */
 class SimulationPlayback:public Simulation {
 protected:
-	std::vector<std::string> mIsoSurfaceFiles;
-	std::vector<std::string> mConstellationFiles;
-	std::vector<std::string> mSignedDistanceFiles;
-	std::vector<std::string> mParticleVolumeFiles;
-	std::vector<SimulationTimeStepDescription> mTimeSteps;
+	PlaybackManifest mManifest;
 	std::string mDirectory;
-	Mesh mTemporaryMesh;
+	std::unique_ptr<FrameStore> mFrameStore;
+	std::unique_ptr<VdbSequenceReader> mVdbSequenceReader;
+	std::unique_ptr<PlaybackPrefetcher> mPrefetcher;
+	PlaybackFrame mFrameBuffer;
+	size_t mPrefetchSize;
+	int mPrefetchThreads;
+	int mDirection;
+	long mCurrentFrame;
+	void present(PlaybackFrame& frame);
+	void presentFrame(long frame,bool signedLevelSet=false);
 public:
 	SimulationPlayback(const std::string& directory);
 	virtual bool init();
@@ -45,6 +54,16 @@ public:
 		mRunning=true;
 		return step();
 	}
+	//Load the given frame, the next step() continues from the frame after it in the playback direction.
+	bool seek(long frame);
+	inline size_t getNumFrames(){return mManifest.size();}
+	inline long getCurrentFrame(){return mCurrentFrame;}
+	//Decode frames on worker threads ahead of playback. A ring size of zero loads each frame in step().
+	void setPrefetch(size_t ringSize,int threads=2);
+	void setDirection(int direction);
+	inline int getDirection(){return mDirection;}
+	//Decode a frame into standalone buffers. Safe to call from prefetch threads after init().
+	bool loadFrame(long frame,PlaybackFrame& out,bool signedLevelSet=false);
 	virtual void cleanup();
 	virtual ~SimulationPlayback();
 };
@@ -19,6 +19,7 @@
  * THE SOFTWARE.
  */
 #include "SimulationVisualizer.h"
+#include "SimulationPlayback.h"
 
 #include <openvdb/util/Formats.h> // for formattedInt()
 #include <stdio.h>
@@ -442,6 +443,23 @@ SimulationVisualizer::keyCallback(GLFWwindow* win,int key, int action,int mod)
 		} else if(key==GLFW_KEY_SPACE){
 			mSimulation->step();
 			mSimulation->fireUpdateEvent();
+		} else if(mSimulation->isPlayback()){
+			SimulationPlayback* playback=static_cast<SimulationPlayback*>(mSimulation);
+			if(key=='B'){
+				playback->setDirection(-playback->getDirection());
+			} else if(key==GLFW_KEY_COMMA){
+				playback->seek(playback->getCurrentFrame()-1);
+				mSimulation->fireUpdateEvent();
+			} else if(key==GLFW_KEY_PERIOD){
+				playback->seek(playback->getCurrentFrame()+1);
+				mSimulation->fireUpdateEvent();
+			} else if(key==GLFW_KEY_HOME){
+				playback->seek(0);
+				mSimulation->fireUpdateEvent();
+			} else if(key==GLFW_KEY_END){
+				playback->seek(playback->getNumFrames()-1);
+				mSimulation->fireUpdateEvent();
+			}
 		}
     }
     mCamera->setNeedsDisplay(true);
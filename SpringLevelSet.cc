@@ -25,6 +25,13 @@
  * Visualization and Computer Graphics, IEEE Transactions on 19.5 (2013): 852-865.
  */
 #include "SpringLevelSet.h"
+#include "Checkpoint.h"
+#include "MetricsLog.h"
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
 #include "json/JsonUtil.h"
 #include <openvdb/Grid.h>
 #include <openvdb/util/Util.h>
@@ -33,6 +40,8 @@
 #include <openvdb/tools/VolumeToMesh.h>
 #include <openvdb/tools/LevelSetAdvect.h>
 #include <openvdb/tools/DenseSparseTools.h>
+#include <openvdb/tools/ValueTransformer.h>
+#include <tbb/parallel_sort.h>
 #include <openvdb/openvdb.h>
 namespace imagesci {
 using namespace openvdb;
@@ -53,6 +62,8 @@ const float SpringLevelSet::RELAX_TIMESTEP = 0.1f;
 const float SpringLevelSet::MIN_AREA = 0.05f;
 const float SpringLevelSet::MAX_AREA = 2.0 ;
 const float SpringLevelSet::MIN_ASPECT_RATIO = 0.1f;
+const float SpringLevelSet::FLAT_CURVATURE = 0.05f;
+const float SpringLevelSet::MAX_DENSITY_SCALE = 2.0f;
 MotionScheme DecodeMotionScheme(const std::string& name) {
 	if (name == "implicit" || name == "IMPLICIT") {
 		return MotionScheme::IMPLICIT;
@@ -101,9 +112,64 @@ void SpringLevelSetDescription::deserialize(Json::Value& root_in) {
 }
 
 std::vector<std::string> SpringLevelSetDescription::mMetricNames = { "Elements",
-		"Added", "Removed" };
+		"Added", "Removed", "SnapshotSeconds", "StashWriteSeconds",
+		"StashQueueDepth", "StashDropped" };
 SpringLevelSetDescription::SpringLevelSetDescription() {
 }
+//Ratio between the springl size allowed at pt and the default voxel-scale springl size.
+//Regions with mean curvature above FLAT_CURVATURE keep a scale of 1.
+static float computeDensityScale(
+		openvdb::math::CurvatureStencil<openvdb::FloatGrid>& stencil,
+		const Vec3s& pt) {
+	stencil.moveTo(
+			Coord(std::floor(pt[0] + 0.5f), std::floor(pt[1] + 0.5f),
+					std::floor(pt[2] + 0.5f)));
+	float kappa = std::abs(stencil.meanCurvature());
+	if (!(kappa < SpringLevelSet::FLAT_CURVATURE))
+		return 1.0f;
+	return std::min(SpringLevelSet::MAX_DENSITY_SCALE,
+			std::sqrt(SpringLevelSet::FLAT_CURVATURE / std::max(kappa, 1E-6f)));
+}
+void SpringlFieldLeafs::clear() {
+	mOrigins.clear();
+	mLeafs.clear();
+}
+void SpringlFieldLeafs::update(const FloatGrid& distance,
+		const Int32Grid& index, const VectorGrid* force) {
+	clear();
+	mDistanceBackground = distance.background();
+	mIndexBackground = index.background();
+	for (FloatTree::LeafCIter iter = distance.tree().cbeginLeaf(); iter; ++iter) {
+		mOrigins.push_back(iter->origin());
+	}
+	for (Int32Tree::LeafCIter iter = index.tree().cbeginLeaf(); iter; ++iter) {
+		mOrigins.push_back(iter->origin());
+	}
+	std::sort(mOrigins.begin(), mOrigins.end());
+	mOrigins.erase(std::unique(mOrigins.begin(), mOrigins.end()),
+			mOrigins.end());
+	mLeafs.resize(mOrigins.size());
+	OPENMP_FOR
+	for (int n = 0; n < (int) mOrigins.size(); n++) {
+		LeafSet& leafs = mLeafs[n];
+		leafs.distance = distance.tree().probeConstLeaf(mOrigins[n]);
+		leafs.index = index.tree().probeConstLeaf(mOrigins[n]);
+		leafs.force = (force != NULL) ?
+				force->tree().probeConstLeaf(mOrigins[n]) : NULL;
+	}
+}
+void SpringlFieldLeafs::Accessor::getIndexes(const Coord& ijk, int radius,
+		std::vector<Index32>& indexes) {
+	indexes.clear();
+	for (int i = -radius; i <= radius; i++) {
+		for (int j = -radius; j <= radius; j++) {
+			for (int k = -radius; k <= radius; k++) {
+				indexes.push_back(
+						static_cast<Index32>(getIndex(ijk.offsetBy(i, j, k))));
+			}
+		}
+	}
+}
 std::ostream& operator<<(std::ostream& ostr, const SpringlNeighbor& classname) {
 	ostr << "{" << classname.springlId << "|"
 			<< static_cast<int>(classname.edgeId) << ":" << std::setprecision(4)
@@ -211,6 +277,84 @@ Vec3s Constellation::closestPointOnEdge(const Vec3s& start,
 			&pt);
 	return pt;
 }
+void SpringlGeometry::update(const Springl& springl) {
+	int K = springl.size();
+	Index32 id = springl.id;
+	openvdb::math::BBox<Vec3s>& bbox = mBoundingBoxes[id];
+	bbox.min() = Vec3s(std::numeric_limits<float>::max());
+	bbox.max() = Vec3s(-std::numeric_limits<float>::max());
+	Vec3s norm(0.0f);
+	Vec3s pt = springl.particle();
+	float minEdgeLength = std::numeric_limits<float>::max();
+	float maxEdgeLength = 0.0f;
+	for (int k = 0; k < K; k++) {
+		const Vec3s& v1 = springl[k];
+		const Vec3s& v2 = springl[(k + 1) % K];
+		Vec3s edge = v2 - v1;
+		float len = edge.length();
+		mEdges[springl.offset + k] = edge;
+		minEdgeLength = std::min(minEdgeLength, len);
+		maxEdgeLength = std::max(maxEdgeLength, len);
+		norm += (v1 - pt).cross(v2 - pt);
+		bbox.min() = openvdb::math::Min(bbox.min(), v1);
+		bbox.max() = openvdb::math::Max(bbox.max(), v1);
+	}
+	mAreas[id] = 0.5f * norm.length();
+	mAspectRatios[id] =
+			(maxEdgeLength > 0.0f) ? minEdgeLength / maxEdgeLength : 0.0f;
+	norm.normalize(1E-6f);
+	mNormals[id] = norm;
+}
+void SpringlGeometry::update(const Constellation& constellation) {
+	resize(constellation.getNumSpringls(), constellation.getNumVertexes());
+	int N = constellation.getNumSpringls();
+	OPENMP_FOR
+	for (int i = 0; i < N; i++) {
+		update(constellation.springls[i]);
+	}
+	mValid = true;
+}
+void SpringlGeometry::append(const Springl& springl) {
+	if (!mValid)
+		return;
+	resize(springl.id + 1, springl.offset + springl.size());
+	update(springl);
+}
+void SpringlGeometry::compact(Index32 springlOffset, Index32 vertexOffset,
+		const Springl& from) {
+	if (!mValid)
+		return;
+	mBoundingBoxes[springlOffset] = mBoundingBoxes[from.id];
+	mNormals[springlOffset] = mNormals[from.id];
+	mAreas[springlOffset] = mAreas[from.id];
+	mAspectRatios[springlOffset] = mAspectRatios[from.id];
+	int K = from.size();
+	for (int k = 0; k < K; k++) {
+		mEdges[vertexOffset + k] = mEdges[from.offset + k];
+	}
+}
+void SpringlGeometry::resize(size_t springlCount, size_t vertexCount) {
+	mBoundingBoxes.resize(springlCount);
+	mNormals.resize(springlCount);
+	mAreas.resize(springlCount);
+	mAspectRatios.resize(springlCount);
+	mEdges.resize(vertexCount);
+}
+void SpringlGeometry::clear() {
+	mValid = false;
+	std::vector<openvdb::math::BBox<Vec3s>>().swap(mBoundingBoxes);
+	std::vector<Vec3s>().swap(mNormals);
+	std::vector<float>().swap(mAreas);
+	std::vector<float>().swap(mAspectRatios);
+	std::vector<Vec3s>().swap(mEdges);
+}
+void Constellation::updateGeometry() {
+	if (mGeometry.isEnabled()
+			&& (!mGeometry.isValid()
+					|| mGeometry.mAreas.size() != springls.size())) {
+		mGeometry.update(*this);
+	}
+}
 void SpringLevelSet::draw() {
 	mIsoSurface.draw();
 	mConstellation.draw();
@@ -242,6 +386,8 @@ void RelaxOperation::apply(Springl& springl, SpringLevelSet& mGrid, double dt) {
 	for (int k = 0; k < K; k++) {
 		springl[k] = mGrid.mConstellation.mVertexAuxBuffer[springl.offset + k];
 	}
+	if (mGrid.mConstellation.mGeometry.isValid())
+		mGrid.mConstellation.mGeometry.update(springl);
 }
 void RelaxOperation::compute(Springl& springl, SpringLevelSet& mGrid,
 		double t) {
@@ -327,29 +473,31 @@ void NearestNeighborOperation::init(SpringLevelSet& mGrid) {
 	map.clear();
 	map.resize(mGrid.mConstellation.getNumVertexes(),
 			std::list<SpringlNeighbor>());
+	mGrid.mConstellation.updateGeometry();
 }
 void NearestNeighborOperation::compute(Springl& springl, SpringLevelSet& mGrid,
 		double t) {
 	const float D2 = SpringLevelSet::NEAREST_NEIGHBOR_RANGE
 			* SpringLevelSet::NEAREST_NEIGHBOR_RANGE;
 
-	openvdb::math::DenseStencil<openvdb::Int32Grid> stencil =
-			openvdb::math::DenseStencil<openvdb::Int32Grid>(
-					*mGrid.mSpringlIndexGrid,
-					ceil(SpringLevelSet::NEAREST_NEIGHBOR_RANGE));
+	//Reused across springls, each TBB worker thread keeps its own buffers.
+	static thread_local std::vector<openvdb::Index32> stencil;
+	static thread_local std::vector<openvdb::Index32> stencilCopy;
+	static thread_local std::vector<SpringlNeighbor> tmpRange;
+	SpringlFieldLeafs::Accessor acc(mGrid.mFieldLeafs);
 	openvdb::Vec3s refPoint = springl.particle();
-
-	stencil.moveTo(
+	acc.getIndexes(
 			Coord(std::floor(refPoint[0] + 0.5f),
 					std::floor(refPoint[1] + 0.5f),
-					std::floor(refPoint[2] + 0.5f)));
+					std::floor(refPoint[2] + 0.5f)),
+			ceil(SpringLevelSet::NEAREST_NEIGHBOR_RANGE), stencil);
 	int sz = stencil.size();
 	if (sz == 0)
 		return;
 	Index32 N = mGrid.mConstellation.getNumSpringls();
-	std::vector<openvdb::Index32> stencilCopy;
+	stencilCopy.clear();
 	for (int i = 0; i < sz; i++) {
-		openvdb::Index32 id = stencil.getValue(i);
+		openvdb::Index32 id = stencil[i];
 		if (id >= N)
 			continue;
 		openvdb::Vec3s nbr = mGrid.getParticle(id);
@@ -365,7 +513,8 @@ void NearestNeighborOperation::compute(Springl& springl, SpringLevelSet& mGrid,
 
 	openvdb::Index32 last = -1;
 	SpringlNeighbor bestNbr;
-	std::vector<SpringlNeighbor> tmpRange;
+	const SpringlGeometry& geom = mGrid.mConstellation.mGeometry;
+	bool cached = geom.isValid();
 	for (int k = 0; k < springl.size(); k++) {
 		std::list<SpringlNeighbor>& mapList = mGrid.getNearestNeighbors(
 				springl.id, k);
@@ -378,6 +527,9 @@ void NearestNeighborOperation::compute(Springl& springl, SpringLevelSet& mGrid,
 			openvdb::Index32 nbrId = stencilCopy[i];
 			if (nbrId == last)
 				continue;
+			last = nbrId;
+			if (cached && geom.distanceToBoundingBoxSqr(nbrId, refPoint) > D2)
+				continue;
 			Springl& snbr = mGrid.getSpringl(nbrId);
 			bestNbr = SpringlNeighbor(nbrId, -1, D2);
 			for (int8_t n = 0; n < snbr.size(); n++) {
@@ -389,7 +541,6 @@ void NearestNeighborOperation::compute(Springl& springl, SpringLevelSet& mGrid,
 			}
 			if (bestNbr.edgeId >= 0)
 				tmpRange.push_back(bestNbr);
-			last = nbrId;
 		}
 		sort(tmpRange.begin(), tmpRange.end());
 		for (int nn = 0, nmax = std::min(SpringLevelSet::MAX_NEAREST_NEIGHBORS,
@@ -433,6 +584,7 @@ void SpringLevelSet::relax(int iters) {
 	for (int iter = 0; iter < iters; iter++) {
 		relax.process();
 	}
+	std::vector<openvdb::Vec3s>().swap(mConstellation.mVertexAuxBuffer);
 }
 void SpringLevelSet::evolve() {
 
@@ -458,30 +610,37 @@ void SpringLevelSet::updateUnSignedLevelSet(double distance) {
 	mUnsignedLevelSet = mtol.distGridPtr();
 	mUnsignedLevelSet->setBackground(distance);
 	mSpringlIndexGrid = mtol.indexGridPtr();
+	mFieldLeafs.update(*mUnsignedLevelSet, *mSpringlIndexGrid, NULL);
 }
 double SpringLevelSet::distanceToConstellation(const Vec3s& pt) {
-	openvdb::math::DenseStencil<openvdb::Int32Grid> stencil =
-			openvdb::math::DenseStencil<openvdb::Int32Grid>(*mSpringlIndexGrid,
-					ceil(FILL_DISTANCE));
-	stencil.moveTo(
+	std::vector<openvdb::Index32> stencil, stencilCopy;
+	return distanceToConstellation(pt, stencil, stencilCopy);
+}
+double SpringLevelSet::distanceToConstellation(const Vec3s& pt,
+		std::vector<openvdb::Index32>& stencil,
+		std::vector<openvdb::Index32>& stencilCopy) {
+	SpringlFieldLeafs::Accessor acc(mFieldLeafs);
+	acc.getIndexes(
 			Coord((int) floor(pt[0] + 0.5f), (int) floor(pt[1] + 0.5f),
-					(int) floor(pt[2] + 0.5f)));
+					(int) floor(pt[2] + 0.5f)), ceil(FILL_DISTANCE), stencil);
 	int sz = stencil.size();
 	double levelSetValue = std::numeric_limits<float>::max();
-	std::vector<Index32> stencilCopy;
 	stencilCopy.clear();
 	Index32 last = -1;
 	Index32 springlsCount = mConstellation.getNumSpringls();
 	for (unsigned int nn = 0; nn < sz; nn++) {
-		openvdb::Index32 id = stencil.getValue(nn);
+		openvdb::Index32 id = stencil[nn];
 		if (id >= springlsCount)
 			continue;
 		stencilCopy.push_back(id);
 	}
 	sz = stencilCopy.size();
 	sort(stencilCopy.begin(), stencilCopy.end());
+	const SpringlGeometry& geom = mConstellation.mGeometry;
+	bool cached = geom.isValid() && geom.mAreas.size() == springlsCount;
 	for (Index32 id : stencilCopy) {
-		if (last != id) {
+		if (last != id && (!cached
+				|| geom.distanceToBoundingBoxSqr(id, pt) < levelSetValue)) {
 			float d = mConstellation.springls[id].distanceToFaceSqr(pt);
 			if (d < levelSetValue) {
 				levelSetValue = d;
@@ -505,23 +664,25 @@ void SpringLevelSet::updateSignedLevelSet() {
 void SpringLevelSet::updateGradient() {
 	//mGradient = openvdb::tools::mGradient(*mUnsignedLevelSet);
 	mGradient = advectionForce(*mUnsignedLevelSet);
+	mFieldLeafs.update(*mUnsignedLevelSet, *mSpringlIndexGrid, mGradient.get());
 
 }
 std::list<SpringlNeighbor>& SpringLevelSet::getNearestNeighbors(
 		openvdb::Index32 id, int8_t e) {
 	return mNearestNeighbors[mConstellation.springls[id].offset + e];
 }
-void SpringLevelSet::create(Mesh* mesh,
-		openvdb::math::Transform::Ptr _transform) {
-	this->mTransform = _transform;
-	openvdb::math::Transform::Ptr trans =
-			openvdb::math::Transform::createLinearTransform(1.0);
-	openvdb::tools::MeshToVolume<openvdb::FloatGrid> mtol(trans);
-	mtol.convertToLevelSet(mesh->mVertexes, mesh->mFaces);
-	mSignedLevelSet = mtol.distGridPtr();
-	mIsoSurface.create(mSignedLevelSet);
-	mConstellation.create(&mIsoSurface);
-	updateIsoSurface();
+static std::string& BootstrapCacheDirectory() {
+	static std::string directory;
+	return directory;
+}
+void SpringLevelSet::setBootstrapCacheDirectory(const std::string& directory) {
+	BootstrapCacheDirectory() = directory;
+	if (directory.length() > 0)
+		boost::filesystem::create_directories(
+				boost::filesystem::path(directory));
+}
+//Relax, clean and fill the initial constellation against its iso-surface.
+void SpringLevelSet::bootstrap() {
 	for (int iter = 0; iter < 2; iter++) {
 		updateUnSignedLevelSet();
 		updateNearestNeighbors();
@@ -533,31 +694,137 @@ void SpringLevelSet::create(Mesh* mesh,
 		fillWithNearestNeighbors();
 	}
 	updateGradient();
+}
+//The cache key covers the input and everything bootstrap() depends on. Bump the version when bootstrap() changes.
+bool SpringLevelSet::loadBootstrap(ContentHash& hash) {
+	const int BOOTSTRAP_CACHE_VERSION = 1;
+	mBootstrapCacheFile.clear();
+	if (BootstrapCacheDirectory().length() == 0)
+		return false;
+	hash.append(BOOTSTRAP_CACHE_VERSION);
+	hash.append(NEAREST_NEIGHBOR_RANGE);
+	hash.append(MAX_NEAREST_NEIGHBORS);
+	hash.append(PARTICLE_RADIUS);
+	hash.append(MAX_VEXT);
+	hash.append(FILL_DISTANCE);
+	hash.append(CLEAN_DISTANCE);
+	hash.append(SHARPNESS);
+	hash.append(SPRING_CONSTANT);
+	hash.append(RELAX_TIMESTEP);
+	hash.append(MIN_ASPECT_RATIO);
+	hash.append(MAX_AREA);
+	hash.append(MIN_AREA);
+	hash.append(FLAT_CURVATURE);
+	hash.append(MAX_DENSITY_SCALE);
+	hash.append(mAdaptiveDensity);
+	std::stringstream file;
+	file << "sls_" << std::hex << std::setw(16) << std::setfill('0')
+			<< hash.digest() << ".cache";
+	mBootstrapCacheFile = (boost::filesystem::path(BootstrapCacheDirectory())
+			/ file.str()).string();
+	std::ifstream ifs(mBootstrapCacheFile, std::ios::in | std::ios::binary);
+	if (!ifs.is_open())
+		return false;
+	//The cached state is in index space, the transform belongs to the caller. readState also rebuilds the derived state.
+	openvdb::math::Transform::Ptr transform = mTransform;
+	bool ok = readState(ifs);
+	mTransform = transform;
+	if (!ok) {
+		std::cout << "Ignoring bootstrap cache " << mBootstrapCacheFile
+				<< std::endl;
+		//Bootstrap rebuilds the level sets and springls, but not what a partial read left behind.
+		mFillCount = 0;
+		mCleanCount = 0;
+		mReorderCounter = 0;
+		fillList.clear();
+		mNearestNeighbors.clear();
+		mParticleVolume.mParticles.clear();
+		mParticleVolume.mVelocities.clear();
+		return false;
+	}
+	mBootstrapCacheFile.clear();
+	return true;
+}
+void SpringLevelSet::saveBootstrap() {
+	if (mBootstrapCacheFile.length() == 0)
+		return;
+	//Processes sharing the cache directory each write their own temporary file, the rename picks one.
+	std::string tmpFile = MakeString() << mBootstrapCacheFile << "." << getpid()
+			<< "." << boost::filesystem::unique_path("%%%%%%%%").string()
+			<< ".tmp";
+	std::ofstream ofs(tmpFile, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (ofs.is_open()) {
+		writeState(ofs);
+		ofs.close();
+		boost::system::error_code error;
+		if (!ofs.fail())
+			boost::filesystem::rename(boost::filesystem::path(tmpFile),
+					boost::filesystem::path(mBootstrapCacheFile), error);
+		if (ofs.fail() || error)
+			boost::filesystem::remove(boost::filesystem::path(tmpFile), error);
+	}
+	mBootstrapCacheFile.clear();
+}
+void SpringLevelSet::create(Mesh* mesh,
+		openvdb::math::Transform::Ptr _transform) {
+	this->mTransform = _transform;
+	ContentHash hash;
+	hash.append(1);
+	hash.append(mesh->mVertexes);
+	hash.append(mesh->mFaces);
+	if (loadBootstrap(hash))
+		return;
+	openvdb::math::Transform::Ptr trans =
+			openvdb::math::Transform::createLinearTransform(1.0);
+	openvdb::tools::MeshToVolume<openvdb::FloatGrid> mtol(trans);
+	mtol.convertToLevelSet(mesh->mVertexes, mesh->mFaces);
+	mSignedLevelSet = mtol.distGridPtr();
+	mIsoSurface.create(mSignedLevelSet);
+	mConstellation.create(&mIsoSurface);
+	updateIsoSurface();
+	bootstrap();
+	saveBootstrap();
 
 }
 void SpringLevelSet::create(FloatGrid& grid) {
 	this->mTransform = grid.transformPtr();
 	grid.setTransform(openvdb::math::Transform::createLinearTransform(1.0));
+	ContentHash hash;
+	hash.append(2);
+	hash.append(grid.background());
+	for (FloatGrid::ValueOnCIter iter = grid.cbeginValueOn(); iter; ++iter) {
+		hash.append(iter.getCoord());
+		hash.append(iter.getLevel());
+		hash.append(*iter);
+	}
+	if (loadBootstrap(hash))
+		return;
 	mSignedLevelSet = boost::static_pointer_cast<FloatGrid>(
 			grid.copyGrid(CopyPolicy::CP_COPY));
 	mIsoSurface.create(mSignedLevelSet);
 	updateSignedLevelSet();
 	mConstellation.create(&mIsoSurface);
 	updateIsoSurface();
-	for (int iter = 0; iter < 2; iter++) {
-		updateUnSignedLevelSet();
-		updateNearestNeighbors();
-		relax(10);
-		updateUnSignedLevelSet(2.5 * openvdb::LEVEL_SET_HALF_WIDTH);
-		clean();
-		updateUnSignedLevelSet();
-		fill();
-		fillWithNearestNeighbors();
-	}
-	updateGradient();
+	bootstrap();
+	saveBootstrap();
 }
 void SpringLevelSet::create(RegularGrid<float>& grid) {
 	this->mTransform = grid.transformPtr();
+	ContentHash hash;
+	hash.append(3);
+	hash.append(grid.dimensions());
+	hash.append(grid.bbox().min());
+	hash.append(grid.bbox().max());
+	//The grid is placed by its transform, so the serialized transform is part of the key.
+	if (grid.transformPtr().get() != NULL) {
+		std::ostringstream transform(std::ios_base::binary);
+		grid.transformPtr()->write(transform);
+		std::string bytes = transform.str();
+		hash.append(bytes.data(), bytes.size());
+	}
+	hash.append(grid.data(), sizeof(float) * grid.valueCount());
+	if (loadBootstrap(hash))
+		return;
 	mSignedLevelSet = std::unique_ptr<FloatGrid>(new FloatGrid());
 	mSignedLevelSet->setBackground(openvdb::LEVEL_SET_HALF_WIDTH);
 	mSignedLevelSet->setTransform(grid.transformPtr());
@@ -567,17 +834,8 @@ void SpringLevelSet::create(RegularGrid<float>& grid) {
 	updateSignedLevelSet();
 	mConstellation.create(&mIsoSurface);
 	updateIsoSurface();
-	for (int iter = 0; iter < 2; iter++) {
-		updateUnSignedLevelSet();
-		updateNearestNeighbors();
-		relax(10);
-		updateUnSignedLevelSet(2.5 * openvdb::LEVEL_SET_HALF_WIDTH);
-		clean();
-		updateUnSignedLevelSet();
-		fill();
-		fillWithNearestNeighbors();
-	}
-	updateGradient();
+	bootstrap();
+	saveBootstrap();
 }
 void SpringLevelSet::updateIsoSurface() {
 
@@ -587,25 +845,31 @@ void SpringLevelSet::updateIsoSurface() {
 }
 int SpringLevelSet::fill() {
 
-	openvdb::tree::ValueAccessor<FloatGrid::TreeType> acc(
-			mSignedLevelSet->tree());
 	openvdb::math::GenericMap map(mSignedLevelSet->transform());
 
-	openvdb::math::DenseStencil<openvdb::Int32Grid> stencil =
-			openvdb::math::DenseStencil<openvdb::Int32Grid>(*mSpringlIndexGrid,
-					ceil(FILL_DISTANCE));
-
+	const float maxFillDistance = FILL_DISTANCE
+			* ((mAdaptiveDensity) ? MAX_DENSITY_SCALE : 1.0f);
+	const int stencilRadius = ceil(maxFillDistance);
+	SpringlFieldLeafs::Accessor acc(mFieldLeafs);
+	std::vector<openvdb::Index32> stencil;
+	std::vector<openvdb::Index32> stencilCopy;
+	openvdb::math::CurvatureStencil<openvdb::FloatGrid> curvatureStencil(
+			*mSignedLevelSet);
 	openvdb::tools::PolygonPoolList& polygonPoolList =
 			mVolToMesh.polygonPoolList();
 	Vec3s p[4];
 	Vec3s refPoint;
 
+	mConstellation.releaseIndexes();
+	mConstellation.updateGeometry();
+	const SpringlGeometry& geom = mConstellation.mGeometry;
+	bool cached = geom.isValid();
 	Index32 springlsCount = mConstellation.getNumSpringls();
 	Index32 pcounter = mConstellation.getNumSpringls();
 	Index32 counter = mConstellation.getNumVertexes();
 	int added = 0;
 
-	const float D2 = FILL_DISTANCE * FILL_DISTANCE;
+	float D2 = FILL_DISTANCE * FILL_DISTANCE;
 	Index64 N = mVolToMesh.polygonPoolListSize();
 	Index64 I;
 	fillList.clear();
@@ -614,22 +878,27 @@ int SpringLevelSet::fill() {
 		I = polygons.numQuads();
 #pragma omp for
 		for (Index64 i = 0; i < I; ++i) {
-			std::vector<openvdb::Index32> stencilCopy;
+			stencilCopy.clear();
 			const openvdb::Vec4I& quad = polygons.quad(i);
 			p[0] = mVolToMesh.pointList()[quad[3]];
 			p[1] = mVolToMesh.pointList()[quad[2]];
 			p[2] = mVolToMesh.pointList()[quad[1]];
 			p[3] = mVolToMesh.pointList()[quad[0]];
 			refPoint = 0.25f * (p[0] + p[1] + p[2] + p[3]);
-			stencil.moveTo(
+			if (mAdaptiveDensity) {
+				float scale = computeDensityScale(curvatureStencil, refPoint);
+				D2 = FILL_DISTANCE * FILL_DISTANCE * scale * scale;
+			}
+			acc.getIndexes(
 					Coord(std::floor(refPoint[0] + 0.5f),
 							std::floor(refPoint[1] + 0.5f),
-							std::floor(refPoint[2] + 0.5f)));
+							std::floor(refPoint[2] + 0.5f)), stencilRadius,
+					stencil);
 			int sz = stencil.size();
 			float levelSetValue = std::numeric_limits<float>::max();
 			int last = -1;
 			for (unsigned int nn = 0; nn < sz; nn++) {
-				openvdb::Index32 id = stencil.getValue(nn);
+				openvdb::Index32 id = stencil[nn];
 				if (id >= springlsCount)
 					continue;
 				stencilCopy.push_back(id);
@@ -638,7 +907,9 @@ int SpringLevelSet::fill() {
 			sort(stencilCopy.begin(), stencilCopy.end());
 			for (unsigned int nn = 0; nn < sz; nn++) {
 				openvdb::Index32 id = stencilCopy[nn];
-				if (last != id) {
+				if (last != id && (!cached
+						|| geom.distanceToBoundingBoxSqr(id, refPoint)
+								< levelSetValue)) {
 					float d = mConstellation.springls[id].distanceToFaceSqr(
 							refPoint);
 					if (d < levelSetValue) {
@@ -651,13 +922,9 @@ int SpringLevelSet::fill() {
 #pragma omp critical
 				{
 					added++;
-					mConstellation.mQuadIndexes.push_back(counter);
 					mConstellation.mVertexes.push_back(p[0]);
-					mConstellation.mQuadIndexes.push_back(counter + 1);
 					mConstellation.mVertexes.push_back(p[1]);
-					mConstellation.mQuadIndexes.push_back(counter + 2);
 					mConstellation.mVertexes.push_back(p[2]);
-					mConstellation.mQuadIndexes.push_back(counter + 3);
 					mConstellation.mVertexes.push_back(p[3]);
 
 					Springl springl(&mConstellation);
@@ -681,12 +948,8 @@ int SpringLevelSet::fill() {
 					if(mConstellation.mParticleLabel.size()>0){
 						mConstellation.mParticleLabel.push_back(0);
 					}
-					openvdb::Vec3s norm = springl.computeNormal();
-					mConstellation.mParticleNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
+					mConstellation.mParticleNormals.push_back(
+							springl.computeNormal());
 					mConstellation.springls.push_back(springl);
 					pcounter++;
 					counter += 4;
@@ -696,21 +959,26 @@ int SpringLevelSet::fill() {
 		I = polygons.numTriangles();
 #pragma omp for
 		for (Index64 i = 0; i < I; ++i) {
-			std::vector<openvdb::Index32> stencilCopy;
+			stencilCopy.clear();
 			const openvdb::Vec3I& tri = polygons.triangle(i);
 			p[0] = mVolToMesh.pointList()[tri[2]];
 			p[1] = mVolToMesh.pointList()[tri[1]];
 			p[2] = mVolToMesh.pointList()[tri[0]];
 			refPoint = 0.25f * (p[0] + p[1] + p[2]);
-			stencil.moveTo(
+			if (mAdaptiveDensity) {
+				float scale = computeDensityScale(curvatureStencil, refPoint);
+				D2 = FILL_DISTANCE * FILL_DISTANCE * scale * scale;
+			}
+			acc.getIndexes(
 					Coord(std::floor(refPoint[0] + 0.5f),
 							std::floor(refPoint[1] + 0.5f),
-							std::floor(refPoint[2] + 0.5f)));
+							std::floor(refPoint[2] + 0.5f)), stencilRadius,
+					stencil);
 			int sz = stencil.size();
 			float levelSetValue = std::numeric_limits<float>::max();
 			int last = -1;
 			for (unsigned int nn = 0; nn < sz; nn++) {
-				openvdb::Index32 id = stencil.getValue(nn);
+				openvdb::Index32 id = stencil[nn];
 				if (id >= springlsCount)
 					continue;
 				stencilCopy.push_back(id);
@@ -719,7 +987,9 @@ int SpringLevelSet::fill() {
 			sort(stencilCopy.begin(), stencilCopy.end());
 			for (unsigned int nn = 0; nn < sz; nn++) {
 				openvdb::Index32 id = stencilCopy[nn];
-				if (last != id) {
+				if (last != id && (!cached
+						|| geom.distanceToBoundingBoxSqr(id, refPoint)
+								< levelSetValue)) {
 					float d = mConstellation.springls[id].distanceToFaceSqr(
 							refPoint);
 					if (d < levelSetValue) {
@@ -732,11 +1002,8 @@ int SpringLevelSet::fill() {
 #pragma omp critical
 				{
 					added++;
-					mConstellation.mTriIndexes.push_back(counter);
 					mConstellation.mVertexes.push_back(p[0]);
-					mConstellation.mTriIndexes.push_back(counter + 1);
 					mConstellation.mVertexes.push_back(p[1]);
-					mConstellation.mTriIndexes.push_back(counter + 2);
 					mConstellation.mVertexes.push_back(p[2]);
 					Springl springl(&mConstellation);
 					springl.offset = counter;
@@ -759,12 +1026,8 @@ int SpringLevelSet::fill() {
 					if(mConstellation.mParticleLabel.size()>0){
 						mConstellation.mParticleLabel.push_back(0);
 					}
-					openvdb::Vec3s norm = springl.computeNormal();
-
-					mConstellation.mParticleNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
-					mConstellation.mVertexNormals.push_back(norm);
+					mConstellation.mParticleNormals.push_back(
+							springl.computeNormal());
 					mConstellation.springls.push_back(springl);
 					pcounter++;
 					counter += 3;
@@ -772,7 +1035,11 @@ int SpringLevelSet::fill() {
 			}
 		}
 	}
-
+	//New springls are appended after the parallel loops so cache reads never race a reallocation.
+	for (Index32 id = springlsCount; id < mConstellation.getNumSpringls(); id++) {
+		mConstellation.mGeometry.append(mConstellation.springls[id]);
+	}
+	mConstellation.appendSpringlIds();
 	mFillCount += added;
 	return added;
 }
@@ -794,8 +1061,10 @@ void SpringLevelSet::fillWithNearestNeighbors(){
 	if (fillList.size() > 0) {
 		updateUnSignedLevelSet();
 		updateNearestNeighbors();
-		for (int cycle = 0; cycle < 16; cycle++) {
-			int unfilledCount = 0;
+		int unfilledCount = 0;
+		int cycle;
+		for (cycle = 0; cycle < 16; cycle++) {
+			unfilledCount = 0;
 			for (int fid : fillList) {
 				Springl& springl = mConstellation.springls[fid];
 				int K = springl.size();
@@ -825,8 +1094,9 @@ void SpringLevelSet::fillWithNearestNeighbors(){
 			}
 			if (unfilledCount == 0)
 				break;
-			std::cout << cycle << ":: un-filled " << unfilledCount << std::endl;
 		}
+		MetricsLog::add("FillCycles", std::min(cycle + 1, 16));
+		MetricsLog::add("Unfilled", unfilledCount);
 		fillList.clear();
 	}
 }
@@ -843,8 +1113,9 @@ void SpringLevelSet::computeStatistics(Mesh& mesh) {
 	double minls = 1E30, bias = 0, maxls = -1E30, meanls = 0, v, sqrs = 0,
 			stdev;
 	int count = 0;
+	std::vector<openvdb::Index32> stencil, stencilCopy;
 	for (Vec3s pt : mesh.mVertexes) {
-		float levelSetValue = distanceToConstellation(pt);
+		float levelSetValue = distanceToConstellation(pt, stencil, stencilCopy);
 		count++;
 		v = fabs(levelSetValue);
 		sqrs += v * v;
@@ -868,7 +1139,7 @@ void SpringLevelSet::computeStatistics(Mesh& mesh) {
 	count = 0;
 
 	for (Vec3s pt : mesh.mParticles) {
-		float levelSetValue = distanceToConstellation(pt);
+		float levelSetValue = distanceToConstellation(pt, stencil, stencilCopy);
 		count++;
 		v = fabs(levelSetValue);
 		sqrs += v * v;
@@ -951,19 +1222,62 @@ void SpringLevelSet::computeStatistics(Mesh& mesh, FloatGrid& levelSet) {
 				<< std::endl;
 
 }
+void Constellation::copy(const Constellation& constellation) {
+	releaseIndexes();
+	mGeometry.invalidate();
+	mParticles = constellation.mParticles;
+	mParticleNormals = constellation.mParticleNormals;
+	mParticleVelocity = constellation.mParticleVelocity;
+	mParticleLabel = constellation.mParticleLabel;
+	mVertexes = constellation.mVertexes;
+	mVertexVelocity = constellation.mVertexVelocity;
+	mColors = constellation.mColors;
+	mFaces = constellation.mFaces;
+	mSpringlIds = constellation.mSpringlIds;
+	mSpringlIdOrder = constellation.mSpringlIdOrder;
+	mNextSpringlId = constellation.mNextSpringlId;
+	springls.resize(constellation.springls.size(), Springl(this));
+	for (size_t i = 0; i < springls.size(); i++) {
+		Springl& springl = springls[i];
+		springl = Springl(this);
+		springl.id = constellation.springls[i].id;
+		springl.offset = constellation.springls[i].offset;
+	}
+	updateBoundingBox();
+}
+void Constellation::swap(Constellation& constellation) {
+	Mesh::swap(constellation);
+	springls.swap(constellation.springls);
+	mSpringlIds.swap(constellation.mSpringlIds);
+	mSpringlIdOrder.swap(constellation.mSpringlIdOrder);
+	std::swap(mNextSpringlId, constellation.mNextSpringlId);
+	for (Springl& springl : springls) {
+		Index32 id = springl.id, offset = springl.offset;
+		springl = Springl(this);
+		springl.id = id;
+		springl.offset = offset;
+	}
+	for (Springl& springl : constellation.springls) {
+		Index32 id = springl.id, offset = springl.offset;
+		springl = Springl(&constellation);
+		springl.id = id;
+		springl.offset = offset;
+	}
+	mGeometry.invalidate();
+	constellation.mGeometry.invalidate();
+}
 void Constellation::create(Mesh* mesh) {
 	size_t faceCount = mesh->mFaces.size();
 	size_t counter = 0;
 	size_t pcounter = 0;
 	springls.clear();
 	mFaces.clear();
-	mQuadIndexes.clear();
-	mTriIndexes.clear();
+	releaseIndexes();
+	mGeometry.invalidate();
 	mVertexes.clear();
 	mVertexes.resize(mesh->mQuadIndexes.size() + mesh->mTriIndexes.size());
 	mParticles.resize(faceCount);
 	mParticleNormals.resize(faceCount);
-	mVertexNormals.resize(mVertexes.size());
 	mParticleVelocity=mesh->mParticleVelocity;
 	mVertexVelocity=mesh->mVertexVelocity;
 	for (openvdb::Vec4I face : mesh->mFaces) {
@@ -974,48 +1288,137 @@ void Constellation::create(Mesh* mesh) {
 			mFaces.push_back(
 					openvdb::Vec4I(counter, counter + 1, counter + 2,
 							counter + 3));
-			mQuadIndexes.push_back(counter);
-			mQuadIndexes.push_back(counter + 1);
-			mQuadIndexes.push_back(counter + 2);
-			mQuadIndexes.push_back(counter + 3);
 			mVertexes[counter++] = mesh->mVertexes[face[0]];
 			mVertexes[counter++] = mesh->mVertexes[face[1]];
 			mVertexes[counter++] = mesh->mVertexes[face[2]];
 			mVertexes[counter++] = mesh->mVertexes[face[3]];
 			mParticles[pcounter] = springl.computeCentroid();
-			openvdb::Vec3s norm = springl.computeNormal();
-			mParticleNormals[pcounter] = norm;
-			mVertexNormals[counter - 1] = norm;
-			mVertexNormals[counter - 2] = norm;
-			mVertexNormals[counter - 3] = norm;
-			mVertexNormals[counter - 4] = norm;
+			mParticleNormals[pcounter] = springl.computeNormal();
 			springls.push_back(springl);
 		} else {
 			mFaces.push_back(
 					openvdb::Vec4I(counter, counter + 1, counter + 2,
 							openvdb::util::INVALID_IDX));
-			mTriIndexes.push_back(counter);
-			mTriIndexes.push_back(counter + 1);
-			mTriIndexes.push_back(counter + 2);
 			mVertexes[counter++] = mesh->mVertexes[face[0]];
 			mVertexes[counter++] = mesh->mVertexes[face[1]];
 			mVertexes[counter++] = mesh->mVertexes[face[2]];
 			mParticles[pcounter] = springl.computeCentroid();
-			openvdb::Vec3s norm = springl.computeNormal();
-			mParticleNormals[pcounter] = norm;
-			mVertexNormals[counter - 1] = norm;
-			mVertexNormals[counter - 2] = norm;
-			mVertexNormals[counter - 3] = norm;
-
+			mParticleNormals[pcounter] = springl.computeNormal();
 			springls.push_back(springl);
 		}
 		pcounter++;
 	}
+	resetSpringlIds();
 	updateBoundingBox();
 }
-
+void Constellation::resetSpringlIds() {
+	size_t N = springls.size();
+	mSpringlIds.resize(N);
+	for (size_t i = 0; i < N; i++) {
+		mSpringlIds[i] = i;
+	}
+	mNextSpringlId = N;
+	updateSpringlIdIndex();
+}
+void Constellation::appendSpringlIds() {
+	size_t N = springls.size();
+	if (mSpringlIds.size() > N) {
+		resetSpringlIds();
+		return;
+	}
+	//New ids are larger than any existing one, so they go at the end of the order.
+	for (size_t i = mSpringlIds.size(); i < N; i++) {
+		mSpringlIds.push_back(mNextSpringlId++);
+		if (mSpringlIdOrder.size() > 0)
+			mSpringlIdOrder.push_back(i);
+	}
+}
+void Constellation::updateSpringlIdIndex() {
+	if (mSpringlIds.size() != springls.size()) {
+		resetSpringlIds();
+		return;
+	}
+	if (std::is_sorted(mSpringlIds.begin(), mSpringlIds.end())) {
+		mSpringlIdOrder.clear();
+		return;
+	}
+	size_t N = mSpringlIds.size();
+	mSpringlIdOrder.resize(N);
+	for (size_t i = 0; i < N; i++) {
+		mSpringlIdOrder[i] = i;
+	}
+	const std::vector<Index64>& ids = mSpringlIds;
+	std::sort(mSpringlIdOrder.begin(), mSpringlIdOrder.end(),
+			[&ids](Index32 a, Index32 b) {
+				return ids[a] < ids[b];
+			});
+}
+bool Constellation::findSpringl(Index64 id, Index32& index) const {
+	if (mSpringlIdOrder.size() == 0) {
+		std::vector<Index64>::const_iterator iter = std::lower_bound(
+				mSpringlIds.begin(), mSpringlIds.end(), id);
+		if (iter == mSpringlIds.end() || *iter != id)
+			return false;
+		index = iter - mSpringlIds.begin();
+		return true;
+	}
+	const std::vector<Index64>& ids = mSpringlIds;
+	std::vector<Index32>::const_iterator iter = std::lower_bound(
+			mSpringlIdOrder.begin(), mSpringlIdOrder.end(), id,
+			[&ids](Index32 a, Index64 value) {
+				return ids[a] < value;
+			});
+	if (iter == mSpringlIdOrder.end() || mSpringlIds[*iter] != id)
+		return false;
+	index = *iter;
+	return true;
+}
+void Constellation::getIndexes(MeshIndexes& indexes) const {
+	size_t N = mFaces.size();
+	std::vector<openvdb::Index32>& quads = indexes.mQuadBuffer;
+	std::vector<openvdb::Index32>& tris = indexes.mTriBuffer;
+	quads.clear();
+	tris.clear();
+	for (size_t i = 0; i < N; i++) {
+		const openvdb::Vec4I& face = mFaces[i];
+		if (face[3] != openvdb::util::INVALID_IDX) {
+			quads.push_back(face[0]);
+			quads.push_back(face[1]);
+			quads.push_back(face[2]);
+			quads.push_back(face[3]);
+		} else {
+			tris.push_back(face[0]);
+			tris.push_back(face[1]);
+			tris.push_back(face[2]);
+		}
+	}
+	indexes.mQuads = &quads;
+	indexes.mTris = &tris;
+	indexes.mNormals = &mVertexNormals;
+	if (mVertexNormals.size() != mVertexes.size()
+			&& mParticleNormals.size() == N) {
+		std::vector<openvdb::Vec3s>& normals = indexes.mNormalBuffer;
+		normals.resize(mVertexes.size());
+		OPENMP_FOR
+		for (int i = 0; i < (int) N; i++) {
+			const Springl& springl = springls[i];
+			int K = springl.size();
+			for (int k = 0; k < K; k++) {
+				normals[springl.offset + k] = mParticleNormals[i];
+			}
+		}
+		indexes.mNormals = &normals;
+	}
+}
+void Constellation::releaseIndexes() {
+	std::vector<openvdb::Index32>().swap(mQuadIndexes);
+	std::vector<openvdb::Index32>().swap(mTriIndexes);
+	std::vector<openvdb::Vec3s>().swap(mVertexNormals);
+}
 int SpringLevelSet::clean() {
 	openvdb::math::BoxStencil<openvdb::FloatGrid> stencil(*mSignedLevelSet);
+	openvdb::math::CurvatureStencil<openvdb::FloatGrid> curvatureStencil(
+			*mSignedLevelSet);
 	Vec3s pt, pt1, pt2, pt3;
 	float area;
 	float minEdgeLength, maxEdgeLength;
@@ -1031,6 +1434,11 @@ int SpringLevelSet::clean() {
 	int removeSmallCount = 0;
 	int removeAspectCount = 0;
 	std::vector<float> levelSetValues(mConstellation.springls.size());
+	mConstellation.updateGeometry();
+	SpringlGeometry& geom = mConstellation.mGeometry;
+	bool cached = geom.isValid();
+	std::vector<float> densityScales(
+			(mAdaptiveDensity) ? mConstellation.springls.size() : 0);
 #pragma omp for
 	for (int nn = 0; nn < mConstellation.springls.size(); nn++) {
 		Springl& springl = mConstellation.springls[nn];
@@ -1038,9 +1446,15 @@ int SpringLevelSet::clean() {
 		stencil.moveTo(
 				Coord(std::floor(pt[0]), std::floor(pt[1]), std::floor(pt[2])));
 		levelSetValues[nn] = stencil.interpolation(pt);
+		if (mAdaptiveDensity) {
+			densityScales[nn] = computeDensityScale(curvatureStencil, pt);
+		}
 	}
 	for (Springl& springl : mConstellation.springls) {
+		float scale = (mAdaptiveDensity) ? densityScales[count] : 1.0f;
 		float levelSetValue = levelSetValues[count++];
+		float minArea = MIN_AREA * scale * scale;
+		float maxArea = MAX_AREA * scale * scale;
 		int K = springl.size();
 		double v = std::abs(levelSetValue);
 		meanls += v;
@@ -1048,26 +1462,31 @@ int SpringLevelSet::clean() {
 		minls = std::min(minls, v);
 		maxls = std::max(maxls, v);
 		if (v <= CLEAN_DISTANCE) {
-			minEdgeLength = 1E30;
-			maxEdgeLength = -1E30;
-			area = 0.0f;
-			for (int i = 0; i < K; i++) {
-				pt1 = springl[i];
-				pt2 = springl[(i + 1) % K];
-				float len = (pt1 - pt2).length();
-				minEdgeLength = std::min(minEdgeLength, len);
-				maxEdgeLength = std::max(maxEdgeLength, len);
+			float aspect;
+			if (cached) {
+				aspect = geom.mAspectRatios[springl.id];
+				area = geom.mAreas[springl.id];
+			} else {
+				minEdgeLength = 1E30;
+				maxEdgeLength = -1E30;
+				for (int i = 0; i < K; i++) {
+					pt1 = springl[i];
+					pt2 = springl[(i + 1) % K];
+					float len = (pt1 - pt2).length();
+					minEdgeLength = std::min(minEdgeLength, len);
+					maxEdgeLength = std::max(maxEdgeLength, len);
+				}
+				aspect = minEdgeLength / maxEdgeLength;
+				area = springl.area();
 			}
-			float aspect = minEdgeLength / maxEdgeLength;
-			area = springl.area();
 			//std::cout<<"AREA "<<area<<" ASPECT "<<aspect<<std::endl;
-			if (area >= MIN_AREA && area < MAX_AREA
+			if (area >= minArea && area < maxArea
 					&& aspect >= MIN_ASPECT_RATIO) {
 				keepList.push_back(springl.id);
 				newSpringlCount++;
 				newVertexCount += K;
 			} else {
-				if (area < MIN_AREA || area >= MAX_AREA) {
+				if (area < minArea || area >= maxArea) {
 					removeSmallCount++;
 				}
 				if (aspect < MIN_ASPECT_RATIO) {
@@ -1080,17 +1499,22 @@ int SpringLevelSet::clean() {
 		index++;
 	}
 	levelSetValues.clear();
+	densityScales.clear();
 	meanls /= count;
 	bias /= count;
 
-	std::cout << "Clean mean=" << meanls << " bias=" << bias << " [" << minls<< "," << maxls << "] [far:" << removeFarCount << ", small:"<< removeSmallCount << ", aspect:" << removeAspectCount << "]" << std::endl;
+	MetricsLog::set("CleanMean", meanls);
+	MetricsLog::set("CleanBias", bias);
+	MetricsLog::add("RemovedFar", removeFarCount);
+	MetricsLog::add("RemovedSmall", removeSmallCount);
+	MetricsLog::add("RemovedAspect", removeAspectCount);
 
 	if (newSpringlCount == N)
 		return 0;
+	mConstellation.releaseIndexes();
+	bool hasIds = (mConstellation.mSpringlIds.size() == N);
 	Index32 springlOffset = 0;
 	Index32 vertexOffset = 0;
-	Index32 quadIndex = 0;
-	Index32 triIndex = 0;
 	for (int n : keepList) {
 		Springl& rspringl = mConstellation.springls[n];
 		Springl& springl = mConstellation.springls[springlOffset];
@@ -1110,8 +1534,13 @@ int SpringLevelSet::clean() {
 			if(mConstellation.mParticleLabel.size()>0){
 				mConstellation.mParticleLabel[springlOffset]=mConstellation.mParticleLabel[n];
 			}
+			if (hasIds) {
+				mConstellation.mSpringlIds[springlOffset] =
+						mConstellation.mSpringlIds[n];
+			}
 			mConstellation.mParticleNormals[springlOffset] =
 					mConstellation.mParticleNormals[n];
+			geom.compact(springlOffset, vertexOffset, rspringl);
 			springl.offset = vertexOffset;
 			springl.id = springlOffset;
 			Vec4I quad;
@@ -1119,38 +1548,13 @@ int SpringLevelSet::clean() {
 			for (int k = 0; k < K; k++) {
 				mConstellation.mVertexes[vertexOffset + k] =
 						mConstellation.mVertexes[rspringl.offset + k];
-				mConstellation.mVertexNormals[vertexOffset + k] =
-						mConstellation.mVertexNormals[rspringl.offset + k];
 				quad[k] = vertexOffset + k;
 			}
-			if (K == 4) {
-				for (int k = 0; k < K; k++) {
-					mConstellation.mQuadIndexes[quadIndex++] = vertexOffset + k;
-				}
-			} else if (K == 3) {
-				for (int k = 0; k < K; k++) {
-					mConstellation.mTriIndexes[triIndex++] = vertexOffset + k;
-				}
-			}
 			mConstellation.mFaces[springlOffset] = quad;
-		} else {
-			if (K == 4) {
-				quadIndex += K;
-			} else if (K == 3) {
-				triIndex += K;
-			}
 		}
 		vertexOffset += K;
 		springlOffset++;
 	}
-	mConstellation.mTriIndexes.erase(
-			mConstellation.mTriIndexes.begin() + triIndex,
-			mConstellation.mTriIndexes.end());
-
-	mConstellation.mQuadIndexes.erase(
-			mConstellation.mQuadIndexes.begin() + quadIndex,
-			mConstellation.mQuadIndexes.end());
-
 	mConstellation.springls.erase(
 			mConstellation.springls.begin() + springlOffset,
 			mConstellation.springls.end());
@@ -1174,15 +1578,262 @@ int SpringLevelSet::clean() {
 	mConstellation.mFaces.erase(mConstellation.mFaces.begin() + springlOffset,
 			mConstellation.mFaces.end());
 
-	mConstellation.mVertexNormals.erase(
-			mConstellation.mVertexNormals.begin() + vertexOffset,
-			mConstellation.mVertexNormals.end());
 	mConstellation.mVertexes.erase(
 			mConstellation.mVertexes.begin() + vertexOffset,
 			mConstellation.mVertexes.end());
+	if (hasIds) {
+		mConstellation.mSpringlIds.erase(
+				mConstellation.mSpringlIds.begin() + springlOffset,
+				mConstellation.mSpringlIds.end());
+	}
+	mConstellation.updateSpringlIdIndex();
+	if (geom.isValid())
+		geom.resize(springlOffset, vertexOffset);
 	mCleanCount += (N - newSpringlCount);
 	return (N - newSpringlCount);
 }
 
+//Interleave the lower 21 bits of each coordinate into a 63 bit Morton code.
+static inline openvdb::Index64 spreadBits(openvdb::Index64 x) {
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8) & 0x100f00f00f00f00fULL;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2) & 0x1249249249249249ULL;
+	return x;
+}
+struct RemapIndexOperator {
+	const std::vector<openvdb::Index32>& mInverse;
+	RemapIndexOperator(const std::vector<openvdb::Index32>& inverse) :
+			mInverse(inverse) {
+	}
+	inline void operator()(const openvdb::Int32Grid::ValueOnIter& iter) const {
+		openvdb::Index32 id = static_cast<openvdb::Index32>(*iter);
+		if (id < mInverse.size())
+			iter.setValue(mInverse[id]);
+	}
+};
+template<typename T> static void permuteSpringlAttribute(std::vector<T>& values,
+		const std::vector<openvdb::Index32>& permutation) {
+	if (values.size() != permutation.size())
+		return;
+	std::vector<T> tmp(values.size());
+	OPENMP_FOR
+	for (int i = 0; i < (int) permutation.size(); i++) {
+		tmp[i] = values[permutation[i]];
+	}
+	values.swap(tmp);
+}
+template<typename T> static void permuteVertexAttribute(std::vector<T>& values,
+		const std::vector<Springl>& springls,
+		const std::vector<openvdb::Index32>& permutation,
+		const std::vector<openvdb::Index32>& offsets) {
+	if (values.size() != offsets.back())
+		return;
+	std::vector<T> tmp(values.size());
+	OPENMP_FOR
+	for (int i = 0; i < (int) permutation.size(); i++) {
+		const Springl& springl = springls[permutation[i]];
+		int K = springl.size();
+		for (int k = 0; k < K; k++) {
+			tmp[offsets[i] + k] = values[springl.offset + k];
+		}
+	}
+	values.swap(tmp);
+}
+//Sorts springls by the Morton code of their particle so that spatially adjacent springls are adjacent in memory.
+//Returns the permutation, where new springl i was springl permutation[i] before the call.
+std::vector<openvdb::Index32> SpringLevelSet::reorder() {
+	Constellation& c = mConstellation;
+	size_t N = c.getNumSpringls();
+	std::vector<openvdb::Index32> permutation(N);
+	if (N == 0)
+		return permutation;
+	openvdb::math::BBox<Vec3s> bbox;
+	for (Vec3s& pt : c.mParticles) {
+		bbox.expand(pt);
+	}
+	Vec3s extent = bbox.extents();
+	float scale = 2097151.0f
+			/ std::max(1E-6f, std::max(extent[0], std::max(extent[1], extent[2])));
+	std::vector<std::pair<openvdb::Index64, openvdb::Index32>> codes(N);
+	OPENMP_FOR
+	for (int i = 0; i < (int) N; i++) {
+		Vec3s pt = scale * (c.mParticles[i] - bbox.min());
+		codes[i] = std::pair<openvdb::Index64, openvdb::Index32>(
+				spreadBits((openvdb::Index64) pt[0])
+						| (spreadBits((openvdb::Index64) pt[1]) << 1)
+						| (spreadBits((openvdb::Index64) pt[2]) << 2),
+				static_cast<openvdb::Index32>(i));
+	}
+	tbb::parallel_sort(codes.begin(), codes.end());
+	std::vector<openvdb::Index32> inverse(N);
+	std::vector<openvdb::Index32> offsets(N + 1);
+	offsets[0] = 0;
+	for (size_t i = 0; i < N; i++) {
+		permutation[i] = codes[i].second;
+		inverse[codes[i].second] = i;
+		offsets[i + 1] = offsets[i] + c.springls[codes[i].second].size();
+	}
+	codes.clear();
+	//Vertex attributes are gathered through the old offsets, so they must be permuted before the springls.
+	permuteVertexAttribute(c.mVertexes, c.springls, permutation, offsets);
+	permuteVertexAttribute(c.mVertexVelocity, c.springls, permutation, offsets);
+	permuteVertexAttribute(c.mVertexAuxBuffer, c.springls, permutation, offsets);
+	permuteVertexAttribute(c.mColors, c.springls, permutation, offsets);
+	if (mNearestNeighbors.size() == offsets.back()) {
+		permuteVertexAttribute(mNearestNeighbors, c.springls, permutation,
+				offsets);
+	} else {
+		mNearestNeighbors.clear();
+	}
+	permuteSpringlAttribute(c.mParticles, permutation);
+	permuteSpringlAttribute(c.mParticleNormals, permutation);
+	permuteSpringlAttribute(c.mParticleVelocity, permutation);
+	permuteSpringlAttribute(c.mParticleLabel, permutation);
+	permuteSpringlAttribute(c.mSpringlIds, permutation);
+	if (c.mGeometry.isValid()) {
+		permuteVertexAttribute(c.mGeometry.mEdges, c.springls, permutation,
+				offsets);
+		permuteSpringlAttribute(c.mGeometry.mBoundingBoxes, permutation);
+		permuteSpringlAttribute(c.mGeometry.mNormals, permutation);
+		permuteSpringlAttribute(c.mGeometry.mAreas, permutation);
+		permuteSpringlAttribute(c.mGeometry.mAspectRatios, permutation);
+	}
+	c.releaseIndexes();
+	for (size_t i = 0; i < N; i++) {
+		Index32 offset = offsets[i];
+		if (offsets[i + 1] - offset == 4) {
+			c.mFaces[i] = Vec4I(offset, offset + 1, offset + 2, offset + 3);
+		} else {
+			c.mFaces[i] = Vec4I(offset, offset + 1, offset + 2,
+					openvdb::util::INVALID_IDX);
+		}
+		c.springls[i].id = i;
+		c.springls[i].offset = offset;
+	}
+	c.updateSpringlIdIndex();
+	OPENMP_FOR
+	for (int i = 0; i < (int) mNearestNeighbors.size(); i++) {
+		for (SpringlNeighbor& nbr : mNearestNeighbors[i]) {
+			nbr.springlId = inverse[nbr.springlId];
+		}
+	}
+	if (mSpringlIndexGrid.get() != nullptr) {
+		openvdb::tools::foreach(mSpringlIndexGrid->beginValueOn(),
+				RemapIndexOperator(inverse));
+	}
+	for (int& fid : fillList) {
+		fid = inverse[fid];
+	}
+	return permutation;
+}
+std::vector<openvdb::Index32> SpringLevelSet::updateOrdering() {
+	if (mReorderInterval <= 0 || ++mReorderCounter < mReorderInterval) {
+		return std::vector<openvdb::Index32>();
+	}
+	mReorderCounter = 0;
+	return reorder();
 }
 
+void SpringLevelSet::writeState(std::ostream& ostr) const {
+	WriteCheckpointValue(ostr, mFillCount);
+	WriteCheckpointValue(ostr, mCleanCount);
+	WriteCheckpointValue(ostr, mReorderCounter);
+	mTransform->write(ostr);
+	WriteCheckpointMesh(ostr, mConstellation);
+	WriteCheckpointVector(ostr, mConstellation.mSpringlIds);
+	WriteCheckpointValue(ostr, mConstellation.mNextSpringlId);
+	WriteCheckpointMesh(ostr, mIsoSurface);
+	WriteCheckpointVector(ostr, mParticleVolume.mParticles);
+	WriteCheckpointVector(ostr, mParticleVolume.mVelocities);
+	//Neighbor lists are flattened with their sizes.
+	std::vector<Index32> neighborCounts(mNearestNeighbors.size());
+	std::vector<SpringlNeighbor> neighbors;
+	for (size_t i = 0; i < mNearestNeighbors.size(); i++) {
+		neighborCounts[i] = mNearestNeighbors[i].size();
+		neighbors.insert(neighbors.end(), mNearestNeighbors[i].begin(),
+				mNearestNeighbors[i].end());
+	}
+	WriteCheckpointVector(ostr, neighborCounts);
+	WriteCheckpointVector(ostr, neighbors);
+	WriteCheckpointVector(ostr,
+			std::vector<int>(fillList.begin(), fillList.end()));
+	WriteCheckpointVdb(ostr, mSignedLevelSet);
+	WriteCheckpointVdb(ostr, mUnsignedLevelSet);
+	WriteCheckpointVdb(ostr, mGradient);
+	WriteCheckpointVdb(ostr, mSpringlIndexGrid);
+}
+bool SpringLevelSet::readState(std::istream& istr) {
+	Constellation& c = mConstellation;
+	c.releaseIndexes();
+	c.mGeometry.invalidate();
+	if (!ReadCheckpointValue(istr, mFillCount)
+			|| !ReadCheckpointValue(istr, mCleanCount)
+			|| !ReadCheckpointValue(istr, mReorderCounter))
+		return false;
+	mTransform = openvdb::math::Transform::createLinearTransform(1.0);
+	mTransform->read(istr);
+	if (!ReadCheckpointMesh(istr, c)
+			|| !ReadCheckpointVector(istr, c.mSpringlIds)
+			|| !ReadCheckpointValue(istr, c.mNextSpringlId)
+			|| !ReadCheckpointMesh(istr, mIsoSurface)
+			|| !ReadCheckpointVector(istr, mParticleVolume.mParticles)
+			|| !ReadCheckpointVector(istr, mParticleVolume.mVelocities))
+		return false;
+	//Springl vertexes are contiguous, so springls follow directly from the faces.
+	size_t N = c.mFaces.size();
+	c.springls.resize(N, Springl(&c));
+	Index32 offset = 0;
+	for (size_t i = 0; i < N; i++) {
+		c.springls[i].id = i;
+		c.springls[i].offset = offset;
+		offset += c.springls[i].size();
+	}
+	c.updateSpringlIdIndex();
+	mIsoSurface.mQuadIndexes.clear();
+	mIsoSurface.mTriIndexes.clear();
+	for (Vec4I& face : mIsoSurface.mFaces) {
+		if (face[3] == openvdb::util::INVALID_IDX) {
+			mIsoSurface.mTriIndexes.push_back(face[0]);
+			mIsoSurface.mTriIndexes.push_back(face[1]);
+			mIsoSurface.mTriIndexes.push_back(face[2]);
+		} else {
+			mIsoSurface.mQuadIndexes.push_back(face[0]);
+			mIsoSurface.mQuadIndexes.push_back(face[1]);
+			mIsoSurface.mQuadIndexes.push_back(face[2]);
+			mIsoSurface.mQuadIndexes.push_back(face[3]);
+		}
+	}
+	std::vector<Index32> neighborCounts;
+	std::vector<SpringlNeighbor> neighbors;
+	std::vector<int> fills;
+	if (!ReadCheckpointVector(istr, neighborCounts)
+			|| !ReadCheckpointVector(istr, neighbors)
+			|| !ReadCheckpointVector(istr, fills))
+		return false;
+	mNearestNeighbors.clear();
+	mNearestNeighbors.resize(neighborCounts.size());
+	size_t index = 0;
+	for (size_t i = 0; i < neighborCounts.size(); i++) {
+		if (index + neighborCounts[i] > neighbors.size())
+			return false;
+		mNearestNeighbors[i].assign(neighbors.begin() + index,
+				neighbors.begin() + index + neighborCounts[i]);
+		index += neighborCounts[i];
+	}
+	fillList.assign(fills.begin(), fills.end());
+	if (!ReadCheckpointVdb<FloatGrid>(istr, mSignedLevelSet)
+			|| !ReadCheckpointVdb<FloatGrid>(istr, mUnsignedLevelSet)
+			|| !ReadCheckpointVdb<VectorGrid>(istr, mGradient)
+			|| !ReadCheckpointVdb<Int32Grid>(istr, mSpringlIndexGrid))
+		return false;
+	updateDerivedState();
+	return true;
+}
+void SpringLevelSet::updateDerivedState() {
+	mVolToMesh(*mSignedLevelSet);
+	mFieldLeafs.update(*mUnsignedLevelSet, *mSpringlIndexGrid, mGradient.get());
+}
+}
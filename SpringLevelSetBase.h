@@ -30,6 +30,7 @@
 #include <tbb/parallel_for.h>
 #include <vector>
 #include <list>
+#include <algorithm>
 #include <iostream>
 #include "Mesh.h"
 #include "ParticleVolume.h"
@@ -120,11 +121,82 @@ public:
 };
 
 std::ostream& operator<<(std::ostream& ostr, const SpringlNeighbor& classname);
+class Constellation;
+/*
+ * Springl geometry cached in SoA arrays. Only advection and relaxation move springl vertexes,
+ * and they refresh the cache in the same kernel. Edges are stored per vertex, from vertex k to k+1.
+ */
+class SpringlGeometry {
+protected:
+	bool mEnabled;
+	bool mValid;
+public:
+	std::vector<openvdb::math::BBox<openvdb::Vec3s>> mBoundingBoxes;
+	std::vector<openvdb::Vec3s> mNormals;
+	std::vector<float> mAreas;
+	std::vector<float> mAspectRatios;
+	std::vector<openvdb::Vec3s> mEdges;
+	SpringlGeometry() :
+			mEnabled(false), mValid(false) {
+	}
+	inline void setEnabled(bool enabled) {
+		mEnabled = enabled;
+		if (!enabled)
+			clear();
+	}
+	inline bool isEnabled() const {
+		return mEnabled;
+	}
+	inline bool isValid() const {
+		return mValid;
+	}
+	inline void invalidate() {
+		mValid = false;
+	}
+	//Squared distance from pt to the springl's bounding box, a lower bound on distance to the face and its edges.
+	inline float distanceToBoundingBoxSqr(openvdb::Index32 id,
+			const openvdb::Vec3s& pt) const {
+		const openvdb::math::BBox<openvdb::Vec3s>& bbox = mBoundingBoxes[id];
+		openvdb::Vec3s delta = openvdb::math::Max(bbox.min() - pt,
+				openvdb::math::Max(pt - bbox.max(), openvdb::Vec3s(0.0f)));
+		return delta.lengthSqr();
+	}
+	void update(const Springl& springl);
+	void update(const Constellation& constellation);
+	void append(const Springl& springl);
+	void compact(openvdb::Index32 springlOffset, openvdb::Index32 vertexOffset,
+			const Springl& from);
+	void resize(size_t springlCount, size_t vertexCount);
+	void clear();
+};
 class Constellation: public Mesh {
 public:
 
 	std::vector<Springl> springls;
+	SpringlGeometry mGeometry;
+	//Persistent springl ids, parallel to springls. Springl::id is the array position, these survive clean, fill and reorder.
+	std::vector<openvdb::Index64> mSpringlIds;
+	//Springl positions ordered by id. Empty while mSpringlIds is ascending, which clean and fill preserve, so only reorder needs it.
+	std::vector<openvdb::Index32> mSpringlIdOrder;
+	openvdb::Index64 mNextSpringlId;
+	Constellation() :
+			mNextSpringlId(0) {
+	}
 	void create(Mesh* mesh);
+	//Number the springls from zero.
+	void resetSpringlIds();
+	//Assign new ids to springls appended since the ids were last updated.
+	void appendSpringlIds();
+	//Rebuild the id to index table after springls are removed or reordered.
+	void updateSpringlIdIndex();
+	//Binary search for the springl with an id.
+	bool findSpringl(openvdb::Index64 id, openvdb::Index32& index) const;
+	//Copy springl data from another constellation, springls refer to this copy afterwards.
+	void copy(const Constellation& constellation);
+	//Exchange springl data with another constellation without copying.
+	void swap(Constellation& constellation);
+	//Rebuilds the geometry cache if it is enabled and stale.
+	void updateGeometry();
 	virtual ~Constellation() {
 	}
 	inline size_t getNumSpringls() const {
@@ -142,12 +214,94 @@ public:
 	}
 	openvdb::Vec3s closestPointOnEdge(const openvdb::Vec3s& start,
 			const SpringlNeighbor& ci);
+	//Springl vertexes are contiguous, so mFaces is the only topology stored. Quad and triangle indexes are generated on demand.
+	virtual void getIndexes(MeshIndexes& indexes) const;
+	virtual void releaseIndexes();
 };
 
 typedef std::vector<std::list<SpringlNeighbor>> NearestNeighborMap;
 typedef openvdb::FloatGrid::Ptr SLevelSetPtr;
 typedef openvdb::VectorGrid::Ptr SGradientPtr;
 typedef openvdb::Int32Grid::Ptr SIndexPtr;
+/*
+ * The unsigned level set, springl index grid and gradient share one topology. SpringlFieldLeafs registers the
+ * three leafs of each origin in one entry, sorted by origin, so all three fields are fetched with a single lookup.
+ */
+class SpringlFieldLeafs {
+public:
+	typedef openvdb::FloatTree::LeafNodeType DistanceLeafT;
+	typedef openvdb::Int32Tree::LeafNodeType IndexLeafT;
+	typedef openvdb::VectorTree::LeafNodeType ForceLeafT;
+	struct LeafSet {
+		const DistanceLeafT* distance;
+		const IndexLeafT* index;
+		const ForceLeafT* force;
+	};
+	class Accessor {
+	protected:
+		const SpringlFieldLeafs& mFields;
+		openvdb::Coord mLastOrigin;
+		const LeafSet* mLast;
+	public:
+		Accessor(const SpringlFieldLeafs& fields) :
+				mFields(fields), mLastOrigin(openvdb::Coord::max()), mLast(NULL) {
+		}
+		inline const LeafSet* probe(const openvdb::Coord& ijk) {
+			openvdb::Coord origin(ijk[0] & ~(IndexLeafT::DIM - 1),
+					ijk[1] & ~(IndexLeafT::DIM - 1),
+					ijk[2] & ~(IndexLeafT::DIM - 1));
+			if (origin != mLastOrigin) {
+				mLastOrigin = origin;
+				mLast = mFields.findLeaf(origin);
+			}
+			return mLast;
+		}
+		inline float getDistance(const openvdb::Coord& ijk) {
+			const LeafSet* leafs = probe(ijk);
+			return (leafs != NULL && leafs->distance != NULL) ?
+					leafs->distance->getValue(DistanceLeafT::coordToOffset(ijk)) :
+					mFields.mDistanceBackground;
+		}
+		inline openvdb::Int32 getIndex(const openvdb::Coord& ijk) {
+			const LeafSet* leafs = probe(ijk);
+			return (leafs != NULL && leafs->index != NULL) ?
+					leafs->index->getValue(IndexLeafT::coordToOffset(ijk)) :
+					mFields.mIndexBackground;
+		}
+		//Returns false where no gradient leaf is registered, so the caller can fall back to sampling the grid.
+		inline bool getForce(const openvdb::Coord& ijk, openvdb::Vec3s& force) {
+			const LeafSet* leafs = probe(ijk);
+			if (leafs == NULL || leafs->force == NULL)
+				return false;
+			force = leafs->force->getValue(ForceLeafT::coordToOffset(ijk));
+			return true;
+		}
+		//Collect springl indexes in the box of the given radius around ijk, equivalent to a DenseStencil sweep.
+		void getIndexes(const openvdb::Coord& ijk, int radius,
+				std::vector<openvdb::Index32>& indexes);
+	};
+protected:
+	//Sorted leaf origins, parallel to mLeafs. Memory follows the leaf count however far apart the leafs are.
+	std::vector<openvdb::Coord> mOrigins;
+	std::vector<LeafSet> mLeafs;
+	float mDistanceBackground;
+	openvdb::Int32 mIndexBackground;
+public:
+	SpringlFieldLeafs() :
+			mDistanceBackground(0.0f), mIndexBackground(-1) {
+	}
+	inline const LeafSet* findLeaf(const openvdb::Coord& origin) const {
+		std::vector<openvdb::Coord>::const_iterator iter = std::lower_bound(
+				mOrigins.begin(), mOrigins.end(), origin);
+		if (iter == mOrigins.end() || *iter != origin)
+			return NULL;
+		return &mLeafs[iter - mOrigins.begin()];
+	}
+	//The gradient may be NULL while it is out of date with the level set.
+	void update(const openvdb::FloatGrid& distance,
+			const openvdb::Int32Grid& index, const openvdb::VectorGrid* force);
+	void clear();
+};
 class SpringLevelSetDescription: public JsonSerializable{
 	public:
 		std::string mConstellationFile;
@@ -167,6 +321,15 @@ protected:
 	std::list<int> fillList;
 	int mFillCount;
 	int mCleanCount;
+	bool mAdaptiveDensity;
+	int mReorderInterval;
+	int mReorderCounter;
+	std::string mBootstrapCacheFile;
+	void bootstrap();
+	bool loadBootstrap(ContentHash& hash);
+	void saveBootstrap();
+	//Rebuild the mesher and leaf table, which are derived from the restored level sets rather than stored.
+	void updateDerivedState();
 public:
 	static const float NEAREST_NEIGHBOR_RANGE; //voxel units
 	static const int MAX_NEAREST_NEIGHBORS;
@@ -180,6 +343,8 @@ public:
 	static const float MIN_ASPECT_RATIO;
 	static const float MAX_AREA;
 	static const float MIN_AREA;
+	static const float FLAT_CURVATURE;
+	static const float MAX_DENSITY_SCALE;
 
 	Mesh mIsoSurface;
 	ParticleVolume mParticleVolume;
@@ -189,6 +354,7 @@ public:
 	SLevelSetPtr mUnsignedLevelSet;
 	SGradientPtr mGradient;
 	SIndexPtr mSpringlIndexGrid;
+	SpringlFieldLeafs mFieldLeafs;
 
 	inline openvdb::math::Transform& transform() {
 		return *mTransform;
@@ -213,9 +379,33 @@ public:
 		mCleanCount=0;
 		mFillCount=0;
 	}
+	//Scale fill/clean thresholds by local curvature so flat regions are covered by fewer springls.
+	inline void setAdaptiveDensityEnabled(bool enabled){
+		mAdaptiveDensity=enabled;
+	}
+	inline bool isAdaptiveDensityEnabled() const {
+		return mAdaptiveDensity;
+	}
+	//Number of updateOrdering() calls between Morton reorders, 0 disables reordering.
+	inline void setReorderInterval(int interval){
+		mReorderInterval=interval;
+		mReorderCounter=0;
+	}
+	inline int getReorderInterval() const {
+		return mReorderInterval;
+	}
+	//Cache springl bounding boxes, normals, areas and edges between topology changes.
+	inline void setGeometryCacheEnabled(bool enabled){
+		mConstellation.mGeometry.setEnabled(enabled);
+	}
+	inline bool isGeometryCacheEnabled() const {
+		return mConstellation.mGeometry.isEnabled();
+	}
 	void draw();
 	int clean();
 	int fill();
+	std::vector<openvdb::Index32> reorder();
+	std::vector<openvdb::Index32> updateOrdering();
 	void fillWithNearestNeighbors();
 	void fillWithVelocityField(MACGrid<float>& grid,float radius);
 	void evolve();
@@ -229,13 +419,22 @@ public:
 	void computeStatistics(Mesh& mesh);
 	void relax(int iters = 10);
 	double distanceToConstellation(const Vec3s& pt);
+	//Same, reusing the caller's stencil buffers.
+	double distanceToConstellation(const Vec3s& pt,
+			std::vector<openvdb::Index32>& stencil,
+			std::vector<openvdb::Index32>& stencilCopy);
 	void updateNearestNeighbors(bool threaded = true);
 	void create(Mesh* mesh, openvdb::math::Transform::Ptr transform =
 			openvdb::math::Transform::createLinearTransform());
 	void create(FloatGrid& grid);
 	void create(RegularGrid<float>& grid);
+	//Cache the bootstrapped state of create() in directory, keyed on the input and springl constants. Empty disables.
+	static void setBootstrapCacheDirectory(const std::string& directory);
+	//Complete state for checkpoints, including neighbor lists and intermediate level sets.
+	void writeState(std::ostream& ostr) const;
+	bool readState(std::istream& istr);
 	SpringLevelSet() :
-			mCleanCount(0),mFillCount(0),mVolToMesh(0.0), mTransform(
+			mCleanCount(0),mFillCount(0),mAdaptiveDensity(false),mReorderInterval(0),mReorderCounter(0),mVolToMesh(0.0), mTransform(
 					openvdb::math::Transform::createLinearTransform(1.0)) {
 	}
 
@@ -29,6 +29,7 @@
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/LevelSetAdvect.h>
 #include "SpringLevelSetOperations.h"
+#include "MetricsLog.h"
 namespace imagesci {
 template<typename FieldT, typename InterruptT = openvdb::util::NullInterrupter>
 class SpringLevelSetFieldDeformation {
@@ -140,10 +141,13 @@ public:
 	template<typename MapT> void track(double time) {
 		const int RELAX_OUTER_ITERS = 1;
 		const int RELAX_INNER_ITERS = 5;
-		mGrid.updateUnSignedLevelSet();
-		for (int iter = 0; iter < RELAX_OUTER_ITERS; iter++) {
-			mGrid.updateNearestNeighbors();
-			mGrid.relax(RELAX_INNER_ITERS);
+		{
+			MetricsTimer timer("Relax");
+			mGrid.updateUnSignedLevelSet();
+			for (int iter = 0; iter < RELAX_OUTER_ITERS; iter++) {
+				mGrid.updateNearestNeighbors();
+				mGrid.relax(RELAX_INNER_ITERS);
+			}
 		}
 		if (mMotionScheme == MotionScheme::SEMI_IMPLICIT) {
 			mGrid.updateUnSignedLevelSet(2.5 * openvdb::LEVEL_SET_HALF_WIDTH);
@@ -164,13 +168,13 @@ public:
 			evolve.process();
 		}
 		if (mResample) {
+			MetricsTimer timer("Resample");
 			int cleaned = mGrid.clean();
 			mGrid.updateUnSignedLevelSet();
 			mGrid.updateIsoSurface();
 			int added=mGrid.fill();
 			mGrid.fillWithNearestNeighbors();
-			std::cout<<"Surface Filled "<<added<<" "<<100*added/(double)mGrid.mConstellation.getNumSpringls()<<"%"<<std::endl;
-
+			mGrid.updateOrdering();
 		} else {
 			mGrid.updateIsoSurface();
 		}
@@ -196,19 +200,23 @@ public:
 			if (dt < EPS) {
 				break;
 			}
-			std::cout<<"Advect ["<<time<<","<<dt<<"] "<<dt<<" max:: "<<maxV<<" duration:: "<<(mEndTime - mStartTime)<<std::endl;
-
-			if (mMotionScheme == MotionScheme::EXPLICIT) {
-				AdvectSpringlFieldOperator<ParticleAdvectT, FieldT, InterruptT> op1(mGrid, mField,
-						mTemporalScheme, time, dt, mInterrupt);
-				op1.process();
-				AdvectMeshVertexOperator<VertexAdvectT, FieldT, InterruptT> op2(mGrid,
-						mField, mTemporalScheme, time, dt, mInterrupt);
-				op2.process();
-			} else {
-				AdvectSpringlFieldOperator<SpringlAdvectT, FieldT, InterruptT> op1(mGrid, mField,
-						mTemporalScheme, time, dt, mInterrupt);
-				op1.process();
+			MetricsLog::add("AdvectSteps",1);
+			MetricsLog::max("MaxVelocity",maxV);
+			MetricsLog::set("AdvectTimeStep",dt);
+			{
+				MetricsTimer timer("Advect");
+				if (mMotionScheme == MotionScheme::EXPLICIT) {
+					AdvectSpringlFieldOperator<ParticleAdvectT, FieldT, InterruptT> op1(mGrid, mField,
+							mTemporalScheme, time, dt, mInterrupt);
+					op1.process();
+					AdvectMeshVertexOperator<VertexAdvectT, FieldT, InterruptT> op2(mGrid,
+							mField, mTemporalScheme, time, dt, mInterrupt);
+					op2.process();
+				} else {
+					AdvectSpringlFieldOperator<SpringlAdvectT, FieldT, InterruptT> op1(mGrid, mField,
+							mTemporalScheme, time, dt, mInterrupt);
+					op1.process();
+				}
 			}
 			if (mMotionScheme == MotionScheme::SEMI_IMPLICIT)track<MapT>(time);
 		}
@@ -224,26 +232,31 @@ public:
 		TrackerT& mTracker;
 		DiscreteField<openvdb::VectorGrid> mDiscreteField;
 		const MapT* mMap;
+		bool mIndexSpace;
 		ScalarType mDt;
 		double mTime;
 		double mTolerance;
 		int mIterations;
 		SpringLevelSetEvolve(SpringLevelSetFieldDeformation& parent, TrackerT& tracker,
 				double time, double dt, int iterations, double tolerance) :
-				mMap(NULL), mParent(parent), mTracker(tracker), mIterations(
+				mMap(NULL), mIndexSpace(false), mParent(parent), mTracker(tracker), mIterations(
 						iterations), mDiscreteField(*parent.mGrid.mGradient), mTime(
 						time), mDt(dt), mTolerance(tolerance), mLeafs(
 						tracker.leafs()) {
 			mParent.mSignChanges = 0;
 		}
 		void process(bool threaded = true) {
+			MetricsTimer timer("Evolve");
 			mMap = (mTracker.grid().transform().template constMap<MapT>().get());
+			mIndexSpace = mTracker.grid().transform().isIdentity()
+					&& mParent.mGrid.mGradient->transform().isIdentity();
 			if (mParent.mInterrupt)
 			mParent.mInterrupt->start("Processing voxels");
 			mParent.mSignChanges=0;
 			const int MIN_NUM_SIGN_CHANGES=32;
 			int maxSignChanges=MIN_NUM_SIGN_CHANGES;
-			for(int iter=0;iter<mIterations;iter++) {
+			int iter;
+			for(iter=0;iter<mIterations;iter++) {
 				mLeafs.rebuildAuxBuffers(1);
 				mParent.mSignChanges=0;
 				if (threaded) {
@@ -260,6 +273,7 @@ public:
 					break;
 				}
 			}
+			MetricsLog::add("EvolveIterations",std::min(iter+1,mIterations));
 			if (mParent.mInterrupt){
 				mParent.mInterrupt->end();
 			}
@@ -272,13 +286,17 @@ public:
 			typedef typename LeafType::ValueOnCIter VoxelIterT;
 			const MapT& map = *mMap;
 			Stencil stencil(mTracker.grid());
+			SpringlFieldLeafs::Accessor fields(mParent.mGrid.mFieldLeafs);
 			int count=0;
 			int signChanges=0;
 			for (size_t n=range.begin(), e=range.end(); n != e; ++n) {
 				BufferType& result = mLeafs.getBuffer(n, 1);
 				for (VoxelIterT iter = mLeafs.leaf(n).cbeginValueOn(); iter;++iter) {
 					stencil.moveTo(iter);
-					const VectorType V = mDiscreteField(map.applyMap(iter.getCoord().asVec3d()), mTime);
+					//In index space each voxel is a gradient voxel, read from the registered leafs without sampling.
+					openvdb::Vec3s V;
+					if (!mIndexSpace || !fields.getForce(iter.getCoord(), V))
+						V = mDiscreteField(map.applyMap(iter.getCoord().asVec3d()), mTime);
 					const VectorType G = math::GradientBiased<MapT,BiasedGradientScheme::FIRST_BIAS>::result(map, stencil, V);
 					ScalarType delta=mDt * V.dot(G);
 					ScalarType old=*iter;
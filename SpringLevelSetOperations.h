@@ -157,6 +157,8 @@ public:
 			vel = ComputeVelocity(field, mIntegrationScheme, pt, t, h);
 			springl[k] = trans->worldToIndex(pt + vel);
 		}
+		if (mGrid.mConstellation.mGeometry.isValid())
+			mGrid.mConstellation.mGeometry.update(springl);
 	}
 	double findTimeStep(Springl& springl, SpringLevelSet& mGrid,
 			const FieldT& field, double t) {
@@ -218,6 +220,8 @@ public:
 			vel = ComputeVelocity(field, mIntegrationScheme, pt, t, h);
 			springl[k] = trans->worldToIndex(pt + vel);	//Apply integration scheme here, need buffer for previous time points?
 		}
+		if (mGrid.mConstellation.mGeometry.isValid())
+			mGrid.mConstellation.mGeometry.update(springl);
 	}
 	double findTimeStep(Springl& springl, SpringLevelSet& mGrid,
 			const FieldT& field, double t) {
@@ -29,6 +29,7 @@
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/LevelSetAdvect.h>
 #include "SpringLevelSetOperations.h"
+#include "MetricsLog.h"
 namespace imagesci {
 template<typename ParticleAdvectionFunc,typename InterruptT = openvdb::util::NullInterrupter>
 class SpringLevelSetParticleDeformation {
@@ -125,12 +126,13 @@ public:
 			evolve.process();
 		}
 		if (mResample) {
+			MetricsTimer timer("Resample");
 			int cleaned = mGrid.clean();
 			mGrid.updateUnSignedLevelSet();
 			mGrid.updateIsoSurface();
 			int added=mGrid.fill();
 			mGrid.fillWithNearestNeighbors();
-			//std::cout<<"Particle Filled "<<added<<" "<<100*added/(double)mGrid.mConstellation.getNumSpringls()<<"% "<<std::endl;
+			mGrid.updateOrdering();
 		} else {
 			mGrid.updateIsoSurface();
 		}
@@ -157,6 +159,9 @@ public:
 			if (dt < EPS) {
 				break;
 			}
+			MetricsLog::add("AdvectSteps",1);
+			MetricsLog::max("MaxVelocity",maxV);
+			MetricsLog::set("AdvectTimeStep",dt);
 			int N=mGrid.mConstellation.springls.size();
 			openvdb::math::Transform::Ptr trans = mGrid.transformPtr();
 #pragma omp for
@@ -190,20 +195,24 @@ public:
 		TrackerT& mTracker;
 		DiscreteField<openvdb::VectorGrid> mDiscreteField;
 		const MapT* mMap;
+		bool mIndexSpace;
 		ScalarType mDt;
 		double mTime;
 		double mTolerance;
 		int mIterations;
 		SpringLevelSetEvolve(SpringLevelSetParticleDeformation& parent, TrackerT& tracker,
 				double time, double dt, int iterations, double tolerance) :
-				mMap(NULL), mParent(parent), mTracker(tracker), mIterations(
+				mMap(NULL), mIndexSpace(false), mParent(parent), mTracker(tracker), mIterations(
 						iterations), mDiscreteField(*parent.mGrid.mGradient), mTime(
 						time), mDt(dt), mTolerance(tolerance), mLeafs(
 						tracker.leafs()) {
 			mParent.mSignChanges = 0;
 		}
 		void process(bool threaded = true) {
+			MetricsTimer timer("Evolve");
 			mMap = (mTracker.grid().transform().template constMap<MapT>().get());
+			mIndexSpace = mTracker.grid().transform().isIdentity()
+					&& mParent.mGrid.mGradient->transform().isIdentity();
 			if (mParent.mInterrupt)
 			mParent.mInterrupt->start("Processing voxels");
 			mParent.mSignChanges=0;
@@ -227,6 +236,7 @@ public:
 					break;
 				}
 			}
+			MetricsLog::add("EvolveIterations",std::min(iter+1,mIterations));
 			if (mParent.mInterrupt){
 				mParent.mInterrupt->end();
 			}
@@ -239,13 +249,17 @@ public:
 			typedef typename LeafType::ValueOnCIter VoxelIterT;
 			const MapT& map = *mMap;
 			Stencil stencil(mTracker.grid());
+			SpringlFieldLeafs::Accessor fields(mParent.mGrid.mFieldLeafs);
 			int count=0;
 			int signChanges=0;
 			for (size_t n=range.begin(), e=range.end(); n != e; ++n) {
 				BufferType& result = mLeafs.getBuffer(n, 1);
 				for (VoxelIterT iter = mLeafs.leaf(n).cbeginValueOn(); iter;++iter) {
 					stencil.moveTo(iter);
-					const Vec3s V = mDiscreteField(map.applyMap(iter.getCoord().asVec3d()), mTime);
+					//In index space each voxel is a gradient voxel, read from the registered leafs without sampling.
+					Vec3s V;
+					if (!mIndexSpace || !fields.getForce(iter.getCoord(), V))
+						V = mDiscreteField(map.applyMap(iter.getCoord().asVec3d()), mTime);
 					const Vec3s G = math::GradientBiased<MapT,BiasedGradientScheme::FIRST_BIAS>::result(map, stencil, V);
 					ScalarType delta=mDt * V.dot(G);
 					ScalarType old=*iter;
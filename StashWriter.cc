@@ -0,0 +1,130 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "StashWriter.h"
+#include "MetricsLog.h"
+namespace imagesci {
+StashWriter::StashWriter(Simulation* simulation, StashPolicy policy,
+		size_t maxQueueSize, int decimation) :
+		mSimulation(simulation), mPolicy(policy), mMaxQueueSize(
+				std::max((size_t) 1, maxQueueSize)), mDecimation(
+				std::max(1, decimation)), mRunning(true), mWriting(false), mLastWriteSeconds(
+				0.0), mDroppedCount(0), mWrittenCount(0) {
+	mThread = std::thread(&StashWriter::process, this);
+}
+bool StashWriter::admit(long iteration) {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	if (mPolicy == STASH_DECIMATE && iteration % mDecimation != 0) {
+		return false;
+	}
+	if (mPolicy == STASH_DROP) {
+		if (mQueue.size() >= mMaxQueueSize) {
+			mDroppedCount++;
+			return false;
+		}
+		return mRunning;
+	}
+	while (mRunning && mQueue.size() >= mMaxQueueSize) {
+		mQueueChanged.wait(lockMe);
+	}
+	return mRunning;
+}
+bool StashWriter::push(const std::string& directory,
+		std::unique_ptr<SimulationSnapshot> snapshot) {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	while (mRunning && mQueue.size() >= mMaxQueueSize) {
+		mQueueChanged.wait(lockMe);
+	}
+	if (!mRunning)
+		return false;
+	snapshot->mMetricValues["StashQueueDepth"] = mQueue.size();
+	snapshot->mMetricValues["StashWriteSeconds"] = mLastWriteSeconds;
+	snapshot->mMetricValues["StashDropped"] = mDroppedCount;
+	QueuedFrame frame;
+	frame.mDirectory = directory;
+	frame.mSnapshot = std::move(snapshot);
+	mQueue.push_back(std::move(frame));
+	mQueueChanged.notify_all();
+	return true;
+}
+void StashWriter::process() {
+	while (true) {
+		QueuedFrame frame;
+		{
+			std::unique_lock<std::mutex> lockMe(mLock);
+			while (mRunning && mQueue.empty()) {
+				mQueueChanged.wait(lockMe);
+			}
+			//Frames still queued at shutdown are written before the thread exits.
+			if (mQueue.empty())
+				break;
+			frame = std::move(mQueue.front());
+			mQueue.pop_front();
+			mWriting = true;
+			mQueueChanged.notify_all();
+		}
+		Simulation::Clock::time_point t0 = Simulation::Clock::now();
+		try {
+			mSimulation->writeSnapshot(*frame.mSnapshot, frame.mDirectory);
+		} catch (imagesci::Exception& e) {
+			std::cout << "ImageSci Error:: " << e.what() << std::endl;
+		} catch (openvdb::Exception& e) {
+			std::cout << "OpenVDB Error:: " << e.what() << std::endl;
+		}
+		Simulation::Clock::time_point t1 = Simulation::Clock::now();
+		frame.mSnapshot.reset();
+		{
+			std::lock_guard<std::mutex> lockMe(mLock);
+			mLastWriteSeconds = 1E-6
+					* std::chrono::duration_cast<std::chrono::microseconds>(
+							t1 - t0).count();
+			mWrittenCount++;
+			mWriting = false;
+			mQueueChanged.notify_all();
+		}
+	}
+}
+void StashWriter::flush() {
+	std::unique_lock<std::mutex> lockMe(mLock);
+	while (!mQueue.empty() || mWriting) {
+		mQueueChanged.wait(lockMe);
+	}
+}
+size_t StashWriter::getQueueDepth() {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	return mQueue.size();
+}
+void StashWriter::recordMetrics() {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	MetricsLog::set("StashQueueDepth", mQueue.size());
+	MetricsLog::set("StashWriteSeconds", mLastWriteSeconds);
+	MetricsLog::set("StashDropped", mDroppedCount);
+}
+StashWriter::~StashWriter() {
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		mRunning = false;
+		mQueueChanged.notify_all();
+	}
+	if (mThread.joinable())
+		mThread.join();
+}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef STASHWRITER_H_
+#define STASHWRITER_H_
+#include "Simulation.h"
+#include <deque>
+#include <condition_variable>
+namespace imagesci {
+/*
+ * Background writer for Simulation::stash. Snapshots are queued by the simulation thread and written in order
+ * by a single writer thread. When the queue is full, STASH_BLOCK waits for space, STASH_DROP skips the frame
+ * and STASH_DECIMATE keeps only every N'th frame and waits for space.
+ */
+class StashWriter {
+protected:
+	struct QueuedFrame {
+		std::string mDirectory;
+		std::unique_ptr<SimulationSnapshot> mSnapshot;
+	};
+	Simulation* mSimulation;
+	StashPolicy mPolicy;
+	size_t mMaxQueueSize;
+	int mDecimation;
+	std::deque<QueuedFrame> mQueue;
+	std::mutex mLock;
+	std::condition_variable mQueueChanged;
+	std::thread mThread;
+	bool mRunning;
+	bool mWriting;
+	double mLastWriteSeconds;
+	size_t mDroppedCount;
+	size_t mWrittenCount;
+	void process();
+public:
+	StashWriter(Simulation* simulation, StashPolicy policy,
+			size_t maxQueueSize = 4, int decimation = 1);
+	//Decide whether to stash the frame before paying for the snapshot copy.
+	bool admit(long iteration);
+	bool push(const std::string& directory,
+			std::unique_ptr<SimulationSnapshot> snapshot);
+	void flush();
+	size_t getQueueDepth();
+	//Record queue depth, last write time and dropped frames in the calling thread's metrics.
+	void recordMetrics();
+	inline size_t getDroppedCount() const {
+		return mDroppedCount;
+	}
+	inline size_t getWrittenCount() const {
+		return mWrittenCount;
+	}
+	inline double getLastWriteSeconds() const {
+		return mLastWriteSeconds;
+	}
+	~StashWriter();
+};
+}
+#endif /* STASHWRITER_H_ */
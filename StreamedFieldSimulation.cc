@@ -0,0 +1,81 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "StreamedFieldSimulation.h"
+#include "ImageSciUtil.h"
+#include "MetricsLog.h"
+#include <chrono>
+namespace imagesci {
+
+StreamedFieldSimulation::StreamedFieldSimulation(const std::string& fileName,const std::string& velocityDirectory,double frameTime,float voxelSize,MotionScheme scheme):Simulation("Streamed",scheme),mSourceFileName(fileName),mVelocityDirectory(velocityDirectory),mFrameTime(frameTime),mVoxelSize(voxelSize) {
+}
+
+StreamedFieldSimulation::~StreamedFieldSimulation() {
+}
+bool StreamedFieldSimulation::init(){
+	std::vector<std::string> files;
+	if(GetDirectoryListing(mVelocityDirectory,files,"",".vdb")<2){
+		std::cout<<"Need at least two velocity fields in "<<mVelocityDirectory<<std::endl;
+		return false;
+	}
+	Mesh mesh;
+	if(!mesh.openMesh(mSourceFileName))return false;
+	BBoxd bbox=mesh.updateBoundingBox();
+	float voxelSize=(mVoxelSize>0.0f)?mVoxelSize:2.0f*mesh.estimateVoxelSize();
+	mesh.mapIntoBoundingBox(voxelSize);
+	mesh.updateBoundingBox();
+	mSource.create(&mesh);
+	//Map index space back onto the mesh coordinates, which are the world coordinates of the velocity fields.
+	openvdb::math::Transform::Ptr trans=mSource.transformPtr();
+	trans->postScale(voxelSize);
+	trans->postTranslate(bbox.min());
+	mField=std::unique_ptr<FieldT>(new FieldT(files,mFrameTime));
+	mAdvect=std::unique_ptr<AdvectT>(new AdvectT(mSource,*mField,mMotionScheme));
+	mAdvect->setTemporalScheme(imagesci::TemporalIntegrationScheme::RK4b);
+	mAdvect->setResampleEnabled(true);
+	mSimulationDuration=mField->getDuration();
+	mTimeStep=mFrameTime;
+	mIsMeshDirty=true;
+	return true;
+}
+bool StreamedFieldSimulation::step(){
+	Clock::time_point t0 = Clock::now();
+	if(!mField->update(mSimulationTime,mSimulationTime+mTimeStep))return false;
+	mAdvect->advect(mSimulationTime,mSimulationTime+mTimeStep);
+    Clock::time_point t1 = Clock::now();
+    mComputeTimeSeconds= 1E-6*std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+	MetricsLog::set("PrefetchHits",mField->getHits());
+	MetricsLog::set("PrefetchMisses",mField->getMisses());
+	mIsMeshDirty=true;
+	mSimulationIteration++;
+	mSimulationTime=mTimeStep*mSimulationIteration;
+	if(mSimulationTime<mSimulationDuration&&mRunning){
+		return true;
+	} else {
+		mSimulationTime=mSimulationDuration;
+		return false;
+	}
+}
+void StreamedFieldSimulation::cleanup(){
+	mAdvect.reset();
+	mField.reset();
+}
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef STREAMEDFIELDSIMULATION_H_
+#define STREAMEDFIELDSIMULATION_H_
+#include <openvdb/openvdb.h>
+#include "SpringLevelSetFieldDeformation.h"
+#include "VelocityFieldStream.h"
+#include "Simulation.h"
+namespace imagesci {
+
+/*
+ * Tracks a mesh through a precomputed velocity sequence, one VDB per frame in the velocity directory.
+ * The mesh keeps its world coordinates and is voxelized with the given voxel size, or twice the estimated voxel
+ * size when zero, so the same flow can be re-tracked at several springl resolutions.
+ */
+class StreamedFieldSimulation : public Simulation{
+	typedef VelocityFieldStream FieldT;
+	typedef SpringLevelSetFieldDeformation<FieldT> AdvectT;
+private:
+	std::unique_ptr<FieldT> mField;
+	std::unique_ptr<AdvectT> mAdvect;
+	std::string mSourceFileName;
+	std::string mVelocityDirectory;
+	double mFrameTime;
+	float mVoxelSize;
+public:
+	bool init();
+	bool step();
+	void cleanup();
+	StreamedFieldSimulation(const std::string& fileName,const std::string& velocityDirectory,double frameTime,float voxelSize=0.0f,MotionScheme motionScheme=EXPLICIT);
+	virtual ~StreamedFieldSimulation();
+};
+
+} /* namespace imagesci */
+
+#endif /* STREAMEDFIELDSIMULATION_H_ */
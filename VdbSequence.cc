@@ -0,0 +1,341 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "VdbSequence.h"
+#include <openvdb/io/Stream.h>
+#include <openvdb/io/Compression.h>
+#include <OpenEXR/half.h>
+#include <boost/filesystem.hpp>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+using namespace openvdb;
+namespace imagesci {
+const Int32 VdbSequenceWriter::FILE_MAGIC = 0x51455356; //"VSEQ"
+const Int32 VdbSequenceWriter::RECORD_MAGIC = 0x4D415246; //"FRAM"
+const Int32 VdbSequenceWriter::VERSION = 1;
+typedef FloatTree::LeafNodeType FloatLeaf;
+//Bits of a leaf value as stored, the half bits when floats are saved as half.
+static inline uint32_t GetValueBits(float value, bool saveFloatAsHalf) {
+	if (saveFloatAsHalf)
+		return half(value).bits();
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(float));
+	return bits;
+}
+static inline float GetBitsValue(uint32_t bits, bool saveFloatAsHalf) {
+	if (saveFloatAsHalf) {
+		half value;
+		value.setBits(static_cast<unsigned short>(bits));
+		return value;
+	}
+	float value;
+	std::memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+//Leaves of trees with the same topology are visited in the same order.
+template<typename WordType> static void EncodeLeaves(const FloatTree& tree,
+		FloatTree& reference, bool saveFloatAsHalf, std::ostream& ostr) {
+	std::vector<WordType> words(reference.leafCount() * FloatLeaf::SIZE);
+	size_t n = 0;
+	FloatTree::LeafIter refIter = reference.beginLeaf();
+	for (FloatTree::LeafCIter iter = tree.cbeginLeaf(); iter && refIter;
+			++iter, ++refIter) {
+		const float* values = iter->buffer().data();
+		float* refValues = refIter->buffer().data();
+		for (Index i = 0; i < FloatLeaf::SIZE; i++) {
+			uint32_t bits = GetValueBits(values[i], saveFloatAsHalf);
+			words[n++] = static_cast<WordType>(bits
+					^ GetValueBits(refValues[i], saveFloatAsHalf));
+			refValues[i] = GetBitsValue(bits, saveFloatAsHalf);
+		}
+	}
+	io::zipToStream(ostr, reinterpret_cast<const char*>(words.data()),
+			sizeof(WordType) * words.size());
+}
+template<typename WordType> static bool DecodeLeaves(std::istream& istr,
+		FloatTree& reference, bool saveFloatAsHalf) {
+	std::vector<WordType> words(reference.leafCount() * FloatLeaf::SIZE);
+	io::unzipFromStream(istr, reinterpret_cast<char*>(words.data()),
+			sizeof(WordType) * words.size());
+	if (istr.fail())
+		return false;
+	size_t n = 0;
+	for (FloatTree::LeafIter refIter = reference.beginLeaf(); refIter;
+			++refIter) {
+		float* refValues = refIter->buffer().data();
+		for (Index i = 0; i < FloatLeaf::SIZE; i++) {
+			refValues[i] = GetBitsValue(
+					GetValueBits(refValues[i], saveFloatAsHalf) ^ words[n++],
+					saveFloatAsHalf);
+		}
+	}
+	return true;
+}
+VdbSequenceWriter::VdbSequenceWriter(bool saveFloatAsHalf, int keyFrameInterval) :
+		mSaveFloatAsHalf(saveFloatAsHalf), mKeyFrameInterval(
+				std::max(keyFrameInterval, 1)), mFramesSinceKeyFrame(0), mNumFrames(
+				0) {
+}
+bool VdbSequenceWriter::create(const std::string& file, Int64 resumeIteration) {
+	close();
+	mFile = file;
+	if (resumeIteration >= 0
+			&& boost::filesystem::exists(boost::filesystem::path(mFile))) {
+		//Resume a restored run. Frames after the restored iteration are recorded again, so they are cut.
+		VdbSequenceReader reader;
+		if (!reader.open(mFile))
+			return false;
+		Int64 fileSize = 0;
+		mNumFrames = reader.getFramesBefore(resumeIteration + 1, fileSize);
+		mSaveFloatAsHalf = reader.isSaveFloatAsHalf();
+		reader.close();
+		boost::filesystem::resize_file(boost::filesystem::path(mFile),
+				fileSize);
+		//The next frame is a keyframe, since mReference is empty.
+		mOut.open(mFile, std::ios::out | std::ios::binary | std::ios::app);
+		return mOut.is_open();
+	}
+	mOut.open(mFile, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!mOut.is_open())
+		return false;
+	Int32 saveFloatAsHalf = (mSaveFloatAsHalf) ? 1 : 0;
+	mOut.write(reinterpret_cast<const char*>(&FILE_MAGIC), sizeof(Int32));
+	mOut.write(reinterpret_cast<const char*>(&VERSION), sizeof(Int32));
+	mOut.write(reinterpret_cast<const char*>(&saveFloatAsHalf), sizeof(Int32));
+	mOut.flush();
+	return mOut.good();
+}
+bool VdbSequenceWriter::append(Int64 iteration, FloatGrid::ConstPtr grid) {
+	if (!mOut.is_open() || grid.get() == NULL)
+		return false;
+	std::ostringstream ostr(std::ios_base::binary);
+	Int32 type = KEY_FRAME;
+	if (mReference.get() != NULL && mFramesSinceKeyFrame < mKeyFrameInterval
+			&& grid->tree().leafCount() > 0
+			&& grid->background() == mReference->background()
+			&& grid->transform() == mReference->transform()
+			&& grid->tree().hasSameTopology(mReference->tree())) {
+		type = DELTA_FRAME;
+		Int64 leafCount = grid->tree().leafCount();
+		ostr.write(reinterpret_cast<const char*>(&leafCount), sizeof(Int64));
+		if (mSaveFloatAsHalf) {
+			EncodeLeaves<uint16_t>(grid->tree(), mReference->tree(), true, ostr);
+		} else {
+			EncodeLeaves<uint32_t>(grid->tree(), mReference->tree(), false,
+					ostr);
+		}
+		mFramesSinceKeyFrame++;
+	} else {
+		try {
+			//Shallow copy, only the metadata differs.
+			FloatGrid::Ptr copy = grid->copy();
+			copy->setSaveFloatAsHalf(mSaveFloatAsHalf);
+			GridCPtrVec grids;
+			grids.push_back(copy);
+			io::Stream(ostr).write(grids);
+		} catch (openvdb::Exception& e) {
+			std::cout << "OpenVDB: " << e.what() << std::endl;
+			mReference.reset();
+			return false;
+		}
+		mReference = grid->deepCopy();
+		if (mSaveFloatAsHalf) {
+			for (FloatTree::LeafIter iter = mReference->tree().beginLeaf(); iter;
+					++iter) {
+				float* values = iter->buffer().data();
+				for (Index i = 0; i < FloatLeaf::SIZE; i++) {
+					values[i] = GetBitsValue(GetValueBits(values[i], true), true);
+				}
+			}
+		}
+		mFramesSinceKeyFrame = 1;
+	}
+	std::string bytes = ostr.str();
+	Int64 numBytes = bytes.size();
+	mOut.write(reinterpret_cast<const char*>(&RECORD_MAGIC), sizeof(Int32));
+	mOut.write(reinterpret_cast<const char*>(&iteration), sizeof(Int64));
+	mOut.write(reinterpret_cast<const char*>(&type), sizeof(Int32));
+	mOut.write(reinterpret_cast<const char*>(&numBytes), sizeof(Int64));
+	mOut.write(bytes.data(), numBytes);
+	mOut.flush();
+	if (!mOut.good()) {
+		mReference.reset();
+		return false;
+	}
+	mNumFrames++;
+	return true;
+}
+void VdbSequenceWriter::close() {
+	if (mOut.is_open())
+		mOut.close();
+	mReference.reset();
+	mFramesSinceKeyFrame = 0;
+	mNumFrames = 0;
+}
+VdbSequenceWriter::~VdbSequenceWriter() {
+	close();
+}
+VdbSequenceReader::VdbSequenceReader() :
+		mHeaderSize(0), mSaveFloatAsHalf(false), mReferenceFrame(-1) {
+}
+bool VdbSequenceReader::open(const std::string& file) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	close();
+	mFile = file;
+	mIn.open(mFile, std::ios::in | std::ios::binary);
+	if (!mIn.is_open())
+		return false;
+	mIn.seekg(0, std::ios::end);
+	Int64 fileSize = mIn.tellg();
+	mIn.seekg(0, std::ios::beg);
+	Int32 magic = 0, version = 0, saveFloatAsHalf = 0;
+	mIn.read(reinterpret_cast<char*>(&magic), sizeof(Int32));
+	mIn.read(reinterpret_cast<char*>(&version), sizeof(Int32));
+	mIn.read(reinterpret_cast<char*>(&saveFloatAsHalf), sizeof(Int32));
+	if (!mIn.good() || magic != VdbSequenceWriter::FILE_MAGIC
+			|| version > VdbSequenceWriter::VERSION)
+		return false;
+	mSaveFloatAsHalf = (saveFloatAsHalf != 0);
+	mHeaderSize = mIn.tellg();
+	//Index the records, a truncated trailing record is dropped.
+	Int64 keyFrame = -1;
+	while (mIn.tellg() < fileSize) {
+		Record record;
+		mIn.read(reinterpret_cast<char*>(&magic), sizeof(Int32));
+		mIn.read(reinterpret_cast<char*>(&record.mIteration), sizeof(Int64));
+		mIn.read(reinterpret_cast<char*>(&record.mType), sizeof(Int32));
+		mIn.read(reinterpret_cast<char*>(&record.mBytes), sizeof(Int64));
+		if (!mIn.good() || magic != VdbSequenceWriter::RECORD_MAGIC)
+			break;
+		record.mOffset = mIn.tellg();
+		if (record.mBytes < 0 || record.mOffset + record.mBytes > fileSize)
+			break;
+		if (record.mType == VdbSequenceWriter::KEY_FRAME) {
+			keyFrame = mRecords.size();
+		} else if (keyFrame < 0) {
+			break;
+		}
+		record.mKeyFrame = keyFrame;
+		mRecords.push_back(record);
+		mIn.seekg(record.mBytes, std::ios::cur);
+	}
+	mIn.clear();
+	return true;
+}
+bool VdbSequenceReader::decode(size_t frame) {
+	if ((long) frame == mReferenceFrame)
+		return true;
+	const Record& record = mRecords[frame];
+	if (record.mType == VdbSequenceWriter::DELTA_FRAME
+			&& mReferenceFrame != (long) frame - 1) {
+		size_t start = record.mKeyFrame;
+		if (mReferenceFrame >= (long) start && mReferenceFrame < (long) frame)
+			start = mReferenceFrame + 1;
+		for (size_t j = start; j < frame; j++) {
+			if (!decode(j))
+				return false;
+		}
+	}
+	mIn.clear();
+	mIn.seekg(record.mOffset, std::ios::beg);
+	bool ok = false;
+	if (record.mType == VdbSequenceWriter::KEY_FRAME) {
+		try {
+			std::string bytes(record.mBytes, '\0');
+			mIn.read(&bytes[0], bytes.size());
+			std::istringstream istr(bytes, std::ios_base::binary);
+			GridPtrVecPtr grids = io::Stream(istr).getGrids();
+			if (grids.get() != NULL && grids->size() > 0) {
+				mReference = gridPtrCast<FloatGrid>((*grids)[0]);
+				ok = (mReference.get() != NULL);
+			}
+		} catch (openvdb::Exception& e) {
+			std::cout << "OpenVDB: " << e.what() << std::endl;
+		}
+	} else if (mReference.get() != NULL) {
+		Int64 leafCount = 0;
+		mIn.read(reinterpret_cast<char*>(&leafCount), sizeof(Int64));
+		if (mIn.good()
+				&& leafCount == (Int64) mReference->tree().leafCount()) {
+			ok = (mSaveFloatAsHalf) ?
+					DecodeLeaves<uint16_t>(mIn, mReference->tree(), true) :
+					DecodeLeaves<uint32_t>(mIn, mReference->tree(), false);
+		}
+	}
+	if (!ok) {
+		//A failed delta leaves the reference partially updated.
+		mReference.reset();
+		mReferenceFrame = -1;
+		return false;
+	}
+	mReferenceFrame = frame;
+	return true;
+}
+bool VdbSequenceReader::read(size_t frame, FloatGrid::Ptr& grid) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	if (frame >= mRecords.size() || !mIn.is_open() || !decode(frame))
+		return false;
+	grid = mReference->deepCopy();
+	return true;
+}
+bool VdbSequenceReader::next(FloatGrid::Ptr& grid) {
+	std::lock_guard<std::mutex> lockMe(mLock);
+	size_t frame = mReferenceFrame + 1;
+	if (frame >= mRecords.size() || !mIn.is_open() || !decode(frame))
+		return false;
+	grid = mReference->deepCopy();
+	return true;
+}
+bool VdbSequenceReader::find(Int64 iteration, size_t& frame) const {
+	for (size_t i = mRecords.size(); i > 0; i--) {
+		if (mRecords[i - 1].mIteration == iteration) {
+			frame = i - 1;
+			return true;
+		}
+	}
+	return false;
+}
+size_t VdbSequenceReader::getFramesBefore(Int64 iteration,
+		Int64& fileSize) const {
+	//Each record starts with its magic, iteration, type and size.
+	const Int64 recordHeaderSize = 2 * sizeof(Int32) + 2 * sizeof(Int64);
+	fileSize = mHeaderSize;
+	for (size_t i = 0; i < mRecords.size(); i++) {
+		if (mRecords[i].mIteration >= iteration) {
+			fileSize = mRecords[i].mOffset - recordHeaderSize;
+			return i;
+		}
+		fileSize = mRecords[i].mOffset + mRecords[i].mBytes;
+	}
+	return mRecords.size();
+}
+void VdbSequenceReader::close() {
+	if (mIn.is_open())
+		mIn.close();
+	mRecords.clear();
+	mReference.reset();
+	mReferenceFrame = -1;
+}
+VdbSequenceReader::~VdbSequenceReader() {
+	close();
+}
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef VDBSEQUENCE_H_
+#define VDBSEQUENCE_H_
+#include <openvdb/openvdb.h>
+#include <fstream>
+#include <mutex>
+#include <vector>
+namespace imagesci {
+/*
+ * Single file archive of signed level set frames, one grid per frame. Keyframes are complete VDB streams,
+ * optionally saved with floats as half. A frame with the same tree topology, transform and background as the
+ * previous frame only stores its leaf values, XOR'd against the previous frame and zlib compressed, so the
+ * reconstruction is exact up to the half conversion.
+ */
+class VdbSequenceWriter {
+protected:
+	std::ofstream mOut;
+	std::string mFile;
+	bool mSaveFloatAsHalf;
+	int mKeyFrameInterval;
+	int mFramesSinceKeyFrame;
+	size_t mNumFrames;
+	//Leaf values as a reader decodes them.
+	openvdb::FloatGrid::Ptr mReference;
+public:
+	static const openvdb::Int32 FILE_MAGIC;
+	static const openvdb::Int32 RECORD_MAGIC;
+	static const openvdb::Int32 VERSION;
+	enum RecordType {
+		KEY_FRAME = 0, DELTA_FRAME = 1
+	};
+	VdbSequenceWriter(bool saveFloatAsHalf = true, int keyFrameInterval = 16);
+	//A negative resumeIteration starts a new archive, replacing an existing file. Otherwise the existing archive
+	//keeps its frames up to and including resumeIteration and is appended to.
+	bool create(const std::string& file, openvdb::Int64 resumeIteration = -1);
+	bool append(openvdb::Int64 iteration, openvdb::FloatGrid::ConstPtr grid);
+	void close();
+	inline const std::string& getFile() const {
+		return mFile;
+	}
+	inline size_t getNumFrames() const {
+		return mNumFrames;
+	}
+	~VdbSequenceWriter();
+};
+/*
+ * Reads frames written by VdbSequenceWriter. Reading frames in order decodes each delta once, reading out of
+ * order decodes forward from the nearest keyframe.
+ */
+class VdbSequenceReader {
+protected:
+	struct Record {
+		openvdb::Int64 mOffset;
+		openvdb::Int64 mBytes;
+		openvdb::Int64 mIteration;
+		openvdb::Int32 mType;
+		openvdb::Int64 mKeyFrame;
+	};
+	std::ifstream mIn;
+	std::string mFile;
+	std::vector<Record> mRecords;
+	openvdb::Int64 mHeaderSize;
+	bool mSaveFloatAsHalf;
+	openvdb::FloatGrid::Ptr mReference;
+	long mReferenceFrame;
+	std::mutex mLock;
+	bool decode(size_t frame);
+public:
+	VdbSequenceReader();
+	bool open(const std::string& file);
+	//Read the frame after the last one read. The grid is a copy owned by the caller.
+	bool next(openvdb::FloatGrid::Ptr& grid);
+	bool read(size_t frame, openvdb::FloatGrid::Ptr& grid);
+	//Find the last frame recorded for a simulation iteration.
+	bool find(openvdb::Int64 iteration, size_t& frame) const;
+	//Count the frames before the first one recorded at or after iteration, and the file size that keeps only them.
+	size_t getFramesBefore(openvdb::Int64 iteration, openvdb::Int64& fileSize) const;
+	inline bool isSaveFloatAsHalf() const {
+		return mSaveFloatAsHalf;
+	}
+	void close();
+	inline size_t getNumFrames() const {
+		return mRecords.size();
+	}
+	inline const std::string& getFile() const {
+		return mFile;
+	}
+	~VdbSequenceReader();
+};
+}
+#endif /* VDBSEQUENCE_H_ */
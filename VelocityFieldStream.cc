@@ -0,0 +1,156 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "VelocityFieldStream.h"
+#include <openvdb/tools/Interpolation.h>
+#include <iostream>
+namespace imagesci {
+VelocityFieldStream::VelocityFieldStream(const std::vector<std::string>& files,
+		double frameTime, double startTime) :
+		mFiles(files), mFrameTime(frameTime), mStartTime(startTime), mFirstFrame(
+				0), mPrefetchedFrame(-1), mRequestedFrame(-1), mLoadingFrame(
+				-1), mRunning(true), mHits(0), mMisses(0) {
+	mThread = std::thread(&VelocityFieldStream::process, this);
+}
+openvdb::VectorGrid::Ptr VelocityFieldStream::load(long frame) const {
+	openvdb::VectorGrid::Ptr grid;
+	try {
+		openvdb::io::File file(mFiles[frame]);
+		file.open();
+		openvdb::GridPtrVecPtr grids = file.getGrids();
+		file.close();
+		for (openvdb::GridBase::Ptr base : *grids) {
+			grid = openvdb::gridPtrCast<openvdb::VectorGrid>(base);
+			if (grid)
+				break;
+		}
+	} catch (openvdb::Exception& e) {
+		std::cout << "OpenVDB: " << e.what() << std::endl;
+	}
+	if (!grid)
+		std::cout << "Could not read velocity field from " << mFiles[frame]
+				<< std::endl;
+	return grid;
+}
+void VelocityFieldStream::process() {
+	while (true) {
+		long frame = -1;
+		{
+			std::unique_lock<std::mutex> lockMe(mLock);
+			while (mRunning && mRequestedFrame < 0) {
+				mFrameChanged.wait(lockMe);
+			}
+			if (!mRunning)
+				break;
+			frame = mLoadingFrame = mRequestedFrame;
+			mRequestedFrame = -1;
+		}
+		openvdb::VectorGrid::Ptr grid = load(frame);
+		{
+			std::lock_guard<std::mutex> lockMe(mLock);
+			mPrefetched = grid;
+			mPrefetchedFrame = frame;
+			mLoadingFrame = -1;
+			mFrameChanged.notify_all();
+		}
+	}
+}
+openvdb::VectorGrid::Ptr VelocityFieldStream::acquire(long frame) {
+	{
+		std::unique_lock<std::mutex> lockMe(mLock);
+		while (mRunning && mLoadingFrame == frame) {
+			mFrameChanged.wait(lockMe);
+		}
+		if (mPrefetchedFrame == frame && mPrefetched) {
+			mHits++;
+			openvdb::VectorGrid::Ptr grid = mPrefetched;
+			mPrefetched.reset();
+			mPrefetchedFrame = -1;
+			return grid;
+		}
+		//Claim a request the worker has not started, so the frame is not loaded twice.
+		if (mRequestedFrame == frame)
+			mRequestedFrame = -1;
+		mMisses++;
+	}
+	return load(frame);
+}
+bool VelocityFieldStream::update(double startTime, double endTime) {
+	if (mFiles.size() == 0)
+		return false;
+	long first = clampFrame(
+			(long) std::floor((startTime - mStartTime) / mFrameTime));
+	long last = clampFrame(
+			(long) std::ceil((endTime - mStartTime) / mFrameTime));
+	last = clampFrame(std::max(last, first + 1));
+	std::vector<openvdb::VectorGrid::Ptr> window(last - first + 1);
+	for (long k = first; k <= last; k++) {
+		long old = k - mFirstFrame;
+		if (old >= 0 && old < (long) mWindow.size() && mWindow[old]) {
+			window[k - first] = mWindow[old];
+		} else {
+			window[k - first] = acquire(k);
+		}
+		if (!window[k - first])
+			return false;
+	}
+	mWindow.swap(window);
+	mFirstFrame = first;
+	long next = last + 1;
+	if (next < (long) mFiles.size()) {
+		std::lock_guard<std::mutex> lockMe(mLock);
+		if (next != mPrefetchedFrame && next != mLoadingFrame) {
+			mRequestedFrame = next;
+			mFrameChanged.notify_all();
+		}
+	}
+	return true;
+}
+//Called concurrently by advection threads, so samples go straight to the tree without cached accessors.
+VelocityFieldStream::VectorType VelocityFieldStream::operator()(
+		const openvdb::Vec3d& pt, ScalarType time) const {
+	if (mWindow.size() == 0)
+		return VectorType(0.0f);
+	double s = (time - mStartTime) / mFrameTime - mFirstFrame;
+	s = std::max(0.0, std::min((double) (mWindow.size() - 1), s));
+	size_t k = std::min((size_t) std::floor(s), mWindow.size() - 1);
+	float w = (float) (s - k);
+	const openvdb::VectorGrid& grid0 = *mWindow[k];
+	VectorType v0(0.0f), v1(0.0f);
+	openvdb::tools::BoxSampler::sample(grid0.tree(),
+			grid0.transform().worldToIndex(pt), v0);
+	if (k + 1 >= mWindow.size() || w <= 0.0f)
+		return v0;
+	const openvdb::VectorGrid& grid1 = *mWindow[k + 1];
+	openvdb::tools::BoxSampler::sample(grid1.tree(),
+			grid1.transform().worldToIndex(pt), v1);
+	return (1.0f - w) * v0 + w * v1;
+}
+VelocityFieldStream::~VelocityFieldStream() {
+	{
+		std::lock_guard<std::mutex> lockMe(mLock);
+		mRunning = false;
+		mFrameChanged.notify_all();
+	}
+	if (mThread.joinable())
+		mThread.join();
+}
+}
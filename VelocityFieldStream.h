@@ -0,0 +1,94 @@
+/*
+ * Copyright(C) 2014, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef VELOCITYFIELDSTREAM_H_
+#define VELOCITYFIELDSTREAM_H_
+#include <openvdb/openvdb.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace imagesci {
+/*
+ * Velocity field streamed from a sequence of precomputed velocity VDBs, one file per frame spaced frameTime apart.
+ * The frames bracketing the current time step are kept resident and sampled with trilinear interpolation in space
+ * and linear interpolation in time. The frame after the resident window is loaded ahead on a background thread.
+ */
+class VelocityFieldStream {
+public:
+	typedef float ScalarType;
+	typedef openvdb::math::Vec3<float> VectorType;
+protected:
+	std::vector<std::string> mFiles;
+	double mFrameTime;
+	double mStartTime;
+	long mFirstFrame;
+	std::vector<openvdb::VectorGrid::Ptr> mWindow;
+	openvdb::VectorGrid::Ptr mPrefetched;
+	long mPrefetchedFrame;
+	long mRequestedFrame;
+	long mLoadingFrame;
+	bool mRunning;
+	//Read without the lock by the metrics.
+	std::atomic<size_t> mHits;
+	std::atomic<size_t> mMisses;
+	std::mutex mLock;
+	std::condition_variable mFrameChanged;
+	std::thread mThread;
+	void process();
+	openvdb::VectorGrid::Ptr load(long frame) const;
+	openvdb::VectorGrid::Ptr acquire(long frame);
+	inline long clampFrame(long frame) const {
+		return std::max(0L, std::min((long) mFiles.size() - 1, frame));
+	}
+public:
+	VelocityFieldStream(const std::vector<std::string>& files,
+			double frameTime, double startTime = 0.0);
+	//Make the frames spanning [startTime, endTime] resident. Call before advecting over that interval.
+	bool update(double startTime, double endTime);
+	const openvdb::math::Transform transform() const {
+		return openvdb::math::Transform();
+	}
+	VectorType operator()(const openvdb::Vec3d& pt, ScalarType time) const;
+	inline VectorType operator()(const openvdb::Coord& ijk,
+			ScalarType time) const {
+		return (*this)(ijk.asVec3d(), time);
+	}
+	inline size_t getNumFrames() const {
+		return mFiles.size();
+	}
+	inline double getFrameTime() const {
+		return mFrameTime;
+	}
+	inline double getDuration() const {
+		return mFrameTime * std::max(0, (int) mFiles.size() - 1);
+	}
+	inline size_t getHits() const {
+		return mHits.load(std::memory_order_relaxed);
+	}
+	inline size_t getMisses() const {
+		return mMisses.load(std::memory_order_relaxed);
+	}
+	~VelocityFieldStream();
+};
+}
+#endif /* VELOCITYFIELDSTREAM_H_ */
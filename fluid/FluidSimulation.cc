@@ -27,8 +27,13 @@
 #include "fluid_utility.h"
 #include "laplace_solver.h"
 #include "../ImageSciUtil.h"
+#include "../Checkpoint.h"
+#include "../MetricsLog.h"
 
 #include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <limits>
 #include <openvdb/openvdb.h>
 #include <openvdb/math/Math.h>
 #include <openvdb/tools/Composite.h>
@@ -41,9 +46,201 @@ using namespace std;
 namespace imagesci {
 namespace fluid {
 const float FluidSimulation::GRAVITY = 9.8067f;
+const int FluidSimulation::DEFAULT_REORDER_INTERVAL = 8;
 const float RELAXATION_KERNEL_WIDTH=1.4;
 const float SPRING_STIFFNESS=50.0;
 static int frameCounter=0;
+//Jitter in [0,1] from the particle pair, so parallel loops give the same result on every run.
+static inline float JitterHash(const openvdb::Vec3f& p0,const openvdb::Vec3f& p1,long iteration){
+	uint32_t hash=2166136261u^static_cast<uint32_t>(iteration);
+	for(int i=0;i<3;i++){
+		uint32_t bits[2];
+		std::memcpy(&bits[0],&p0[i],sizeof(float));
+		std::memcpy(&bits[1],&p1[i],sizeof(float));
+		hash=(hash^bits[0])*16777619u;
+		hash=(hash^bits[1])*16777619u;
+	}
+	return (hash%101)/100.0f;
+}
+static inline float SmoothKernel( float r2, float h ) {
+    return max( 1.0-r2/(h*h), 0.0 );
+}
+static inline float SharpKernel( float r2, float h ) {
+    return max( h*h/fmax(r2,1.0e-5) - 1.0, 0.0 );
+}
+//Grow the set cells of a mask by r cells along each axis, one separable pass per axis.
+static void DilateMask(RegularGrid<char>& mask,int r){
+	const int dims[3]={(int)mask.rows(),(int)mask.cols(),(int)mask.slices()};
+	for(int axis=2;axis>=0;axis--){
+		//Lines run along axis, and the parallel loop runs over the first of the other two axes.
+		int a0=(axis==0)?1:0;
+		int a1=(axis==2)?1:2;
+		int N=dims[axis];
+		OPENMP_FOR for(int u=0;u<dims[a0];u++){
+			std::vector<char> line(N);
+			int ijk[3];
+			ijk[a0]=u;
+			for(int v=0;v<dims[a1];v++){
+				ijk[a1]=v;
+				for(int n=0;n<N;n++){
+					ijk[axis]=n;
+					line[n]=mask(ijk[0],ijk[1],ijk[2]);
+				}
+				for(int n=0;n<N;n++){
+					char value=0;
+					for(int m=std::max(0,n-r);m<=std::min(N-1,n+r)&&!value;m++){
+						value=line[m];
+					}
+					ijk[axis]=n;
+					mask(ijk[0],ijk[1],ijk[2])=value;
+				}
+			}
+		}
+	}
+}
+//Neighbor visitors for ParticleLocator::forEachNeighbor, called with particle indexes.
+struct DensitySum {
+	const FluidParticles& mParticles;
+	const Vec3f& mPoint;
+	float mRadius;
+	float mSum;
+	DensitySum(const FluidParticles& particles,const Vec3f& pt,float radius):mParticles(particles),mPoint(pt),mRadius(radius),mSum(0.0f){}
+	inline void operator()(int np){
+		if (mParticles.isType(np,ObjectType::WALL))
+			return;
+		mSum += mParticles.mMass[np] * SmoothKernel((mParticles.mLocation[np] - mPoint).lengthSqr(), mRadius);
+	}
+};
+//Pushes a point out of nearby wall particles and removes the velocity components into the wall.
+struct WallCollision {
+	const FluidParticles& mParticles;
+	Vec3f& mLocation;
+	float mRadius;
+	Vec3f* mVelocity;
+	Springl* mSpringl;
+	WallCollision(const FluidParticles& particles,Vec3f& location,float radius,Vec3f* velocity,Springl* springl):mParticles(particles),mLocation(location),mRadius(radius),mVelocity(velocity),mSpringl(springl){}
+	inline void operator()(int np){
+		if (!mParticles.isType(np,ObjectType::WALL))
+			return;
+		const Vec3f& location=mParticles.mLocation[np];
+		float dist = (mLocation - location).length();
+		if (dist >= mRadius)
+			return;
+		Vec3f normal = mParticles.mNormal[np];
+		if (normal[0] == 0.0 && normal[1] == 0.0&& normal[2] == 0.0 && dist) {
+			normal = (mLocation - location)/ dist;
+		}
+		mLocation += (mRadius - dist) * normal;
+		if (mVelocity != NULL) {
+			*mVelocity -= mVelocity->dot(normal) * normal;
+		}
+		if (mSpringl != NULL) {
+			mSpringl->particleVelocity() -= mSpringl->particleVelocity().dot(normal) * normal;
+			for(int ii=0;ii<mSpringl->size();ii++){
+				mSpringl->vertexVelocity(ii) -= mSpringl->vertexVelocity(ii).dot(normal) * normal;
+			}
+		}
+	}
+};
+//Weighted sum of one velocity component at a grid face, with particle positions in index space.
+struct FaceVelocity {
+	const FluidParticles& mParticles;
+	const Vec3f& mFace;
+	const openvdb::Coord& mDims;
+	float mScale;
+	int mAxis;
+	float mSumW;
+	float mSumV;
+	FaceVelocity(const FluidParticles& particles,const Vec3f& face,const openvdb::Coord& dims,float scale,int axis):mParticles(particles),mFace(face),mDims(dims),mScale(scale),mAxis(axis),mSumW(0.0f),mSumV(0.0f){}
+	inline void operator()(int p){
+		if (!mParticles.isType(p,ObjectType::FLUID))
+			return;
+		const Vec3f& location=mParticles.mLocation[p];
+		Vec3f pos(clamp(mScale*location[0],0.0f,(float)mDims[0]),
+				clamp(mScale*location[1],0.0f,(float)mDims[1]),
+				clamp(mScale*location[2],0.0f,(float)mDims[2]));
+		float w = mParticles.mMass[p] * SharpKernel((pos - mFace).lengthSqr(),RELAXATION_KERNEL_WIDTH);
+		mSumV += w*mParticles.mVelocity[p][mAxis];
+		mSumW += w;
+	}
+};
+struct VelocitySum {
+	const FluidParticles& mParticles;
+	const Vec3f& mPoint;
+	float mRadius;
+	Vec3f mSum;
+	float mSumW;
+	VelocitySum(const FluidParticles& particles,const Vec3f& pt,float radius):mParticles(particles),mPoint(pt),mRadius(radius),mSum(0.0f),mSumW(0.0f){}
+	inline void operator()(int np){
+		if (!mParticles.isType(np,ObjectType::FLUID))
+			return;
+		float w = mParticles.mMass[np] * SharpKernel((mPoint - mParticles.mLocation[np]).lengthSqr(),mRadius);
+		mSum += w * mParticles.mVelocity[np];
+		mSumW += w;
+	}
+};
+struct SpringForce {
+	const FluidParticles& mParticles;
+	int mParticle;
+	float mRadius;
+	float mTimeStep;
+	long mIteration;
+	Vec3f mSpring;
+	SpringForce(const FluidParticles& particles,int p,float radius,float dt,long iteration):mParticles(particles),mParticle(p),mRadius(radius),mTimeStep(dt),mIteration(iteration),mSpring(0.0f){}
+	inline void operator()(int np){
+		if (mParticle == np)
+			return;
+		const float re=mRadius;
+		const float dt=mTimeStep;
+		const Vec3f& location=mParticles.mLocation[mParticle];
+		const Vec3f& neighbor=mParticles.mLocation[np];
+		float dist = (location - neighbor).length();
+		float w = SPRING_STIFFNESS * mParticles.mMass[np] * SmoothKernel(dist*dist,re);
+		if( dist > 0.1*re ) {
+			mSpring += w * (location-neighbor) / dist * re;
+		} else {
+			if( mParticles.isType(np,ObjectType::FLUID) ) {
+				mSpring += 0.01*re/dt*JitterHash(location,neighbor,mIteration);
+			} else {
+				mSpring += 0.05*re/dt*mParticles.mNormal[np];
+			}
+		}
+	}
+};
+//Distance in voxels to the closest fluid particle, noting any wall particle closer than the radius.
+struct ClosestParticle {
+	const FluidParticles& mParticles;
+	const Vec3f& mPoint;
+	float mScale;
+	float mRadius;
+	double mDistance;
+	bool mWallHit;
+	ClosestParticle(const FluidParticles& particles,const Vec3f& pt,float scale,float radius):mParticles(particles),mPoint(pt),mScale(scale),mRadius(radius),mDistance(8.0f*radius),mWallHit(false){}
+	inline void operator()(int np){
+		double d= (mParticles.mLocation[np] - mPoint).length()*mScale;
+		if( mParticles.isType(np,ObjectType::WALL) ) {
+			if(d < mRadius) mWallHit=true;
+			return;
+		}
+		if( d < mDistance ) {
+			mDistance = d;
+		}
+	}
+};
+struct WallNormalSum {
+	const FluidParticles& mParticles;
+	int mParticle;
+	Vec3f mNormal;
+	WallNormalSum(const FluidParticles& particles,int p):mParticles(particles),mParticle(p),mNormal(0.0f){}
+	inline void operator()(int np){
+		if (mParticle != np && mParticles.isType(np,ObjectType::WALL)) {
+			Vec3f delta = mParticles.mLocation[mParticle] - mParticles.mLocation[np];
+			float d = delta.length();
+			float w = 1.0 / d;
+			mNormal += w * delta / d;
+		}
+	}
+};
 FluidSimulation::FluidSimulation(const openvdb::Coord& dims, float voxelSize,
 		MotionScheme scheme) :
 		Simulation("Fluid_Simulation", scheme), mMaxDensity(0.0), mStuckParticleCount(
@@ -54,11 +251,11 @@ FluidSimulation::FluidSimulation(const openvdb::Coord& dims, float voxelSize,
 				mLabel(dims, voxelSize), mLaplacian(dims, voxelSize), mDivergence(dims,
 				voxelSize), mPressure(dims, voxelSize), mVelocity(dims,
 				voxelSize), mVelocityLast(dims, voxelSize), mWallWeight(dims,
-				voxelSize),mSpringlTracking(scheme!=IMPLICIT),
+				voxelSize),mTransferMask(Coord(dims[0] + 1, dims[1] + 1, dims[2] + 1), voxelSize),mSpringlTracking(scheme!=IMPLICIT),mReorderInterval(DEFAULT_REORDER_INTERVAL),mReorderCounter(0),mPressurePreconditioner(PRECONDITIONER_IC0),mPressureTolerance(DEFAULT_PRESSURE_TOLERANCE),mMaxPressureIterations(DEFAULT_PRESSURE_ITERATIONS),mWarmStartPressure(true),
 				mSignedLevelSet(Coord(dims[0] * 2, dims[1] * 2, dims[2] * 2), 0.5f * voxelSize,0.0f),
 				mDistanceField(dims[0] * 2, dims[1] * 2, dims[2] * 2){
 	mWallThickness = mVoxelSize;
-	srand(52372143L);
+	mRandom.seed(52372143L);
 	mTimeStep = 0.5 * mVoxelSize;
 	mDomainSize=Vec3s(dims[0]*mVoxelSize,dims[1]*mVoxelSize,dims[2]*mVoxelSize);
 	mSimulationDuration = 4.0f;
@@ -67,34 +264,22 @@ void FluidSimulation::computeParticleDensity(float maxDensity) {
 	float scale=1.0f/mVoxelSize;
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		ParticlePtr& p = mParticles[n];
-		if (p->mObjectType == ObjectType::WALL) {
-			p->mDensity = 1.0;
+		if (mParticles.isType(n,ObjectType::WALL)) {
+			mParticles.mDensity[n] = 1.0;
 			continue;
 		}
-		Vec3f& pt = p->mLocation;
-		int i = clamp((int) (scale * p->mLocation[0]), 0,
+		const Vec3f& pt = mParticles.mLocation[n];
+		int i = clamp((int) (scale * pt[0]), 0,
 				mGridSize[0] - 1);
-		int j = clamp((int) (scale * p->mLocation[1]), 0,
+		int j = clamp((int) (scale * pt[1]), 0,
 				mGridSize[1] - 1);
-		int k = clamp((int) (scale* p->mLocation[2]), 0,
+		int k = clamp((int) (scale* pt[2]), 0,
 				mGridSize[2] - 1);
-		//Search in small region
-		std::vector<FluidParticle*> neighbors =
-				mParticleLocator->getNeigboringCellParticles(i, j, k, 1, 1, 1);
-		float wsum = 0.0;
-		//Density a function of how close particles are to their neighbors.
-		for (FluidParticle* np : neighbors) {
-			if (np->mObjectType == ObjectType::WALL)
-				continue;
-			float d2 = distanceSquared(np->mLocation, pt);
-			float w = np->mMass
-					* smoothKernel(d2,
-							4.0f * mFluidParticleDiameter * mVoxelSize);
-			wsum += w;
-		}
+		//Density a function of how close particles are to their neighbors in a small region.
+		DensitySum density(mParticles,pt,4.0f * mFluidParticleDiameter * mVoxelSize);
+		mParticleLocator->forEachNeighbor(i, j, k, 1, 1, 1, density);
 		//Estimate density in region using current particle configuration.
-		p->mDensity = wsum / maxDensity;
+		mParticles.mDensity[n] = density.mSum / maxDensity;
 	}
 }
 void FluidSimulation::placeWalls() {
@@ -186,7 +371,6 @@ void FluidSimulation::addSimulationObject(SimulationObject* obj){
 }
 /*
 void FluidSimulation::operator()(Springl& springl,double time,double dt){
-	std::cout<<"time step "<<time<<" "<<dt<<std::endl;
 	Transform::Ptr trans=mSource.transformPtr();
 	Vec3d v = Vec3d(springl.particle());
 	Vec3d pt = trans->indexToWorld(v);
@@ -266,17 +450,16 @@ void FluidSimulation::repositionParticles(vector<int>& indices) {
 	// Shuffle
 	shuffleCoordinates(waters);
 	for (int n = 0; n < indices.size(); n++) {
-		ParticlePtr& p = mParticles[indices[n]];
-		p->mLocation[0] = mVoxelSize* (waters[n][0] + 0.25 + 0.5 * (rand() % 101) / 100);
-		p->mLocation[1] = mVoxelSize* (waters[n][1] + 0.25 + 0.5 * (rand() % 101) / 100);
-		p->mLocation[2] = mVoxelSize* (waters[n][2] + 0.25 + 0.5 * (rand() % 101) / 100);
+		Vec3f& location = mParticles.mLocation[indices[n]];
+		location[0] = mVoxelSize* (waters[n][0] + 0.25 + 0.5 * (mRandom() % 101) / 100);
+		location[1] = mVoxelSize* (waters[n][1] + 0.25 + 0.5 * (mRandom() % 101) / 100);
+		location[2] = mVoxelSize* (waters[n][2] + 0.25 + 0.5 * (mRandom() % 101) / 100);
 	}
 	mParticleLocator->update(mParticles);
 	for (int n = 0; n < indices.size(); n++) {
-		ParticlePtr &p = mParticles[indices[n]];
 		Vec3f u(0.0);
-		resampleParticles(p->mLocation, u, mVoxelSize);
-		p->mVelocity = u;
+		resampleParticles(mParticles.mLocation[indices[n]], u, mVoxelSize);
+		mParticles.mVelocity[indices[n]] = u;
 	}
 }
 void FluidSimulation::addParticle(openvdb::Vec3s pt, openvdb::Vec3s center,ObjectType type) {
@@ -302,24 +485,16 @@ void FluidSimulation::addParticle(openvdb::Vec3s pt, openvdb::Vec3s center,Objec
 		}
 	}
 	if (inside_obj) {
-		FluidParticle *p = new FluidParticle;
-
-		Vec3s axis(((rand() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f,
-				((rand() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f,
-				((rand() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f);
+		Vec3s axis(((mRandom() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f,
+				((mRandom() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f,
+				((mRandom() % MAX_INT) / (MAX_INT - 1.0)) * 2.0f - 1.0f);
 		axis.normalize(1E-6f);
-		Mat3s R = rotation<Mat3s>(axis,MAX_ANGLE * (rand() % MAX_INT) / (MAX_INT - 1.0));
+		Mat3s R = rotation<Mat3s>(axis,MAX_ANGLE * (mRandom() % MAX_INT) / (MAX_INT - 1.0));
+		Vec3f location = pt;
 		if (inside_obj->mType == ObjectType::FLUID) {
-			p->mLocation = center + R * (pt - center);
-		} else {
-			p->mLocation = pt;
+			location = center + R * (pt - center);
 		}
-		p->mVelocity = Vec3f(0.0);
-		p->mNormal = Vec3f(0.0);
-		p->mDensity = 10.0;
-		p->mObjectType = inside_obj->mType;
-		p->mMass = 1.0;
-		mParticles.push_back(ParticlePtr(p));
+		mParticles.add(location, Vec3f(0.0), inside_obj->mType, 10.0, 1.0);
 	}
 }
 bool FluidSimulation::init() {
@@ -332,19 +507,16 @@ bool FluidSimulation::init() {
 	float h = mFluidParticleDiameter * mVoxelSize;
 	FOR_EVERY_CELL(10,10,10)
 		{
-			FluidParticle *p = new FluidParticle;
-			p->mLocation = Vec3f((i + 0.5) * h, (j + 0.5) * h, (k + 0.5) * h);
-			p->mObjectType = ObjectType::FLUID;
-			p->mMass = 1.0;
-			mParticles.push_back(std::unique_ptr<FluidParticle>(p));
+			mParticles.add(Vec3f((i + 0.5) * h, (j + 0.5) * h, (k + 0.5) * h), Vec3f(0.0), ObjectType::FLUID, 0.0, 1.0);
 		}END_FOR
 	mParticleLocator->update(mParticles);
 	computeParticleDensity(1.0f);
 	mMaxDensity = 0.0;
-	for (ParticlePtr& p : mParticles) {
-		mMaxDensity = max(mMaxDensity, p->mDensity);
+	for (float density : mParticles.mDensity) {
+		mMaxDensity = max(mMaxDensity, density);
 	}
 	mParticles.clear();
+	mParticles.mNextId = 0;
 	Vec3s center;
 	Vec3s pt;
 	// Place Fluid Particles And Walls
@@ -392,22 +564,16 @@ bool FluidSimulation::init() {
 	mParticleLocator->markAsWater(mLabel, mWallWeight, mFluidParticleDiameter);
 // Remove Particles That Stuck On Wal Cells
 	float scale=1.0f/mVoxelSize;
-	for (std::vector<ParticlePtr>::iterator iter = mParticles.begin();
-			iter != mParticles.end();) {
-		ParticlePtr& p = *iter;
-		if (p->mObjectType == ObjectType::WALL) {
-			iter++;
+	FOR_EVERY_PARTICLE(mParticles) {
+		if (mParticles.isType(n,ObjectType::WALL))
 			continue;
-		}
-		int i = clamp((int) (scale * p->mLocation[0]), 0,mGridSize[0] - 1);
-		int j = clamp((int) (scale * p->mLocation[1]), 0,mGridSize[1] - 1);
-		int k = clamp((int) (scale * p->mLocation[2]), 0,mGridSize[2] - 1);
-		if (mLabel(i, j, k) == static_cast<char>(ObjectType::WALL)) {
-			iter = mParticles.erase(iter);
-		} else {
-			iter++;
-		}
+		const Vec3f& location = mParticles.mLocation[n];
+		int i = clamp((int) (scale * location[0]), 0,mGridSize[0] - 1);
+		int j = clamp((int) (scale * location[1]), 0,mGridSize[1] - 1);
+		int k = clamp((int) (scale * location[2]), 0,mGridSize[2] - 1);
+		mParticles.mRemoveIndicator[n] = (mLabel(i, j, k) == static_cast<char>(ObjectType::WALL));
 	}
+	mParticles.removeMarked();
 // Comput Normal for Walls
 	computeWallNormals();
 	updateParticleVolume();
@@ -438,18 +604,12 @@ void FluidSimulation::pourWater(int limit, float maxDensity) {
 		for (float z = w + w / 2.0; z < 1.0 - w / 2.0; z += w) {
 			if (hypot(x - mPourPosition[0], z - mPourPosition[1])
 					< mPourRadius) {
-				FluidParticle *p = new FluidParticle;
-				p->mLocation = Vec3f(x,
+				mParticles.add(Vec3f(x,
 						1.0 - mWallThickness
-								- 2.5 * mFluidParticleDiameter * mVoxelSize, z);
-				p->mVelocity = Vec3f(0.0,
+								- 2.5 * mFluidParticleDiameter * mVoxelSize, z),
+						Vec3f(0.0,
 						-0.5 * mVoxelSize * mFluidParticleDiameter / mTimeStep,
-						0.0);
-				p->mNormal = Vec3f(0.0);
-				p->mObjectType = ObjectType::FLUID;
-				p->mDensity = maxDensity;
-				p->mMass = 1.0;
-				mParticles.push_back(ParticlePtr(p));
+						0.0), ObjectType::FLUID, maxDensity, 1.0);
 				cnt++;
 			}
 		}
@@ -461,8 +621,8 @@ void FluidSimulation::addExternalForce() {
 	int count=0;
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		if (mParticles[n]->mObjectType == ObjectType::FLUID){
-			mParticles[n]->mVelocity[1] += velocity;
+		if (mParticles.isType(n,ObjectType::FLUID)){
+			mParticles.mVelocity[n][1] += velocity;
 			count++;
 		}
 	}
@@ -485,9 +645,8 @@ void FluidSimulation::advectParticles() {
 // Advect Particle Through Grid
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		ParticlePtr& p = mParticles[n];
-		if (p->mObjectType == ObjectType::FLUID) {
-			p->mLocation += mTimeStep * mVelocity.interpolate(p->mLocation);
+		if (mParticles.isType(n,ObjectType::FLUID)) {
+			mParticles.mLocation[n] += mTimeStep * mVelocity.interpolate(mParticles.mLocation[n]);
 		}
 	}
 	//Update localization
@@ -502,30 +661,16 @@ void FluidSimulation::advectParticles() {
 	//Correct particle locations
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		ParticlePtr& p = mParticles[n];
-		if (p->mObjectType == ObjectType::FLUID) {
-			p->mLocation[0] = clamp(p->mLocation[0], r, mx - r);
-			p->mLocation[1] = clamp(p->mLocation[1], r, my - r);
-			p->mLocation[2] = clamp(p->mLocation[2], r, mz - r);
-			int i = clamp((int) (p->mLocation[0] * scale), 0,mGridSize[0] - 1);
-			int j = clamp((int) (p->mLocation[1] * scale), 0,mGridSize[1] - 1);
-			int k = clamp((int) (p->mLocation[2] * scale), 0,mGridSize[2] - 1);
-			vector<FluidParticle*> neighbors =mParticleLocator->getNeigboringCellParticles(i, j, k, 1, 1,1);
-			for (int n = 0; n < neighbors.size(); n++) {
-				FluidParticle *np = neighbors[n];
-				if (np->mObjectType == ObjectType::WALL) {
-					float dist = distance(p->mLocation, np->mLocation);
-					if (dist < re) {
-						Vec3f normal =  np->mNormal;
-						if (normal[0] == 0.0 && normal[1] == 0.0&& normal[2] == 0.0 && dist) {
-							normal = (p->mLocation - np->mLocation)/ dist;
-						}
-						p->mLocation += (re - dist) * normal;
-						float dot = p->mVelocity.dot(normal);
-						p->mVelocity -= dot * normal;
-					}
-				}
-			}
+		if (mParticles.isType(n,ObjectType::FLUID)) {
+			Vec3f& location = mParticles.mLocation[n];
+			location[0] = clamp(location[0], r, mx - r);
+			location[1] = clamp(location[1], r, my - r);
+			location[2] = clamp(location[2], r, mz - r);
+			int i = clamp((int) (location[0] * scale), 0,mGridSize[0] - 1);
+			int j = clamp((int) (location[1] * scale), 0,mGridSize[1] - 1);
+			int k = clamp((int) (location[2] * scale), 0,mGridSize[2] - 1);
+			WallCollision collision(mParticles,location,re,&mParticles.mVelocity[n],NULL);
+			mParticleLocator->forEachNeighbor(i, j, k, 1, 1, 1, collision);
 		}
 	}
 	if(mSpringlTracking){
@@ -549,27 +694,8 @@ void FluidSimulation::advectParticles() {
 				int i = clamp((int) (mLocation[0] * scale), 0,mGridSize[0] - 1);
 				int j = clamp((int) (mLocation[1] * scale), 0,mGridSize[1] - 1);
 				int k = clamp((int) (mLocation[2] * scale), 0,mGridSize[2] - 1);
-				vector<FluidParticle*> neighbors =mParticleLocator->getNeigboringCellParticles(i, j, k, 1, 1,1);
-				for (int n = 0; n < neighbors.size(); n++) {
-					FluidParticle *np = neighbors[n];
-					if (np->mObjectType == ObjectType::WALL) {
-						float dist = distance(mLocation, np->mLocation);
-						if (dist < re) {
-							Vec3f normal =  np->mNormal;
-							if (normal[0] == 0.0 && normal[1] == 0.0&& normal[2] == 0.0 && dist) {
-								normal = (mLocation - np->mLocation)/ dist;
-							}
-							mLocation += (re - dist) * normal;
-							float dot = springl.particleVelocity().dot(normal);
-							springl.particleVelocity()-= dot * normal;
-							for(int ii=0;ii<springl.size();ii++){
-								dot = springl.vertexVelocity(ii).dot(normal);
-								springl.vertexVelocity(ii)-= dot * normal;
-							}
-
-						}
-					}
-				}
+				WallCollision collision(mParticles,mLocation,re,NULL,&springl);
+				mParticleLocator->forEachNeighbor(i, j, k, 1, 1, 1, collision);
 				pt=trans->worldToIndex(Vec3s(mLocation));
 				springl.particle()=Vec3s(pt);
 				for(int ii=0;ii<springl.size();ii++){
@@ -582,6 +708,9 @@ void FluidSimulation::advectParticles() {
 					pt=trans->worldToIndex(Vec3s(mLocation));
 					springl[ii]=Vec3s(pt);
 				}
+				if(mSource.mConstellation.mGeometry.isValid()){
+					mSource.mConstellation.mGeometry.update(springl);
+				}
 		}
 	}
 	/*
@@ -603,66 +732,124 @@ void FluidSimulation::advectParticles() {
 // Remove Particles That Stuck On The Up-Down Wall Cells...
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		ParticlePtr& p = mParticles[n];
-		p->mRemoveIndicator = false;
+		mParticles.mRemoveIndicator[n] = false;
 		// Focus on Only Fluid Particle
-		if (p->mObjectType == ObjectType::FLUID) {
-			int i = clamp((int) (p->mLocation[0] * scale), 0, mGridSize[0] - 1);
-			int j = clamp((int) (p->mLocation[1] * scale), 0, mGridSize[1] - 1);
-			int k = clamp((int) (p->mLocation[2] * scale), 0, mGridSize[2] - 1);
+		if (mParticles.isType(n,ObjectType::FLUID)) {
+			const Vec3f& location = mParticles.mLocation[n];
+			int i = clamp((int) (location[0] * scale), 0, mGridSize[0] - 1);
+			int j = clamp((int) (location[1] * scale), 0, mGridSize[1] - 1);
+			int k = clamp((int) (location[2] * scale), 0, mGridSize[2] - 1);
 			// If Stuck On Wall Cells Just Reposition
 			if (mLabel(i, j, k) == static_cast<char>(ObjectType::WALL)) {
-				p->mRemoveIndicator = true;
+				mParticles.mRemoveIndicator[n] = true;
 			}
-			i = clamp((int) (p->mLocation[0] * scale), 2, mGridSize[0] - 3);
-			j = clamp((int) (p->mLocation[1] * scale), 2, mGridSize[1] - 3);
-			k = clamp((int) (p->mLocation[2] * scale), 2, mGridSize[2] - 3);
-			if (p->mDensity < 0.04
+			i = clamp((int) (location[0] * scale), 2, mGridSize[0] - 3);
+			j = clamp((int) (location[1] * scale), 2, mGridSize[1] - 3);
+			k = clamp((int) (location[2] * scale), 2, mGridSize[2] - 3);
+			if (mParticles.mDensity[n] < 0.04
 					&& (mLabel(i, max(0, j - 1), k) == static_cast<char>(ObjectType::WALL)
 							|| mLabel(i, min(mGridSize[1] - 1, j + 1), k) == static_cast<char>(ObjectType::WALL))) {
 				// Put Into Reposition List
-				p->mRemoveIndicator = true;
+				mParticles.mRemoveIndicator[n] = true;
 			}
 		}
 
 	}
 // Reposition If Necessary
 	vector<int> reposition_indices;
-	size_t n = 0;
-	for (ParticlePtr& p : mParticles) {
-		if (p->mRemoveIndicator) {
-			p->mRemoveIndicator = false;
+	FOR_EVERY_PARTICLE(mParticles) {
+		if (mParticles.mRemoveIndicator[n]) {
+			mParticles.mRemoveIndicator[n] = false;
 			reposition_indices.push_back(n);
 		}
-		n++;
 	}
 
 // Store Stuck Particle Number
 	mStuckParticleCount = reposition_indices.size();
 	repositionParticles(reposition_indices);
 }
+void FluidSimulation::writeCheckpointState(std::ostream& ostr) {
+	WriteCheckpointValue(ostr,mMaxDensity);
+	WriteCheckpointValue(ostr,mStuckParticleCount);
+	std::ostringstream random;
+	random<<mRandom;
+	WriteCheckpointString(ostr,random.str());
+	WriteCheckpointVector(ostr,mParticles.mLocation);
+	WriteCheckpointVector(ostr,mParticles.mVelocity);
+	WriteCheckpointVector(ostr,mParticles.mNormal);
+	WriteCheckpointVector(ostr,mParticles.mObjectType);
+	WriteCheckpointVector(ostr,mParticles.mMass);
+	WriteCheckpointVector(ostr,mParticles.mDensity);
+	WriteCheckpointVector(ostr,mParticles.mIds);
+	WriteCheckpointValue(ostr,mParticles.mNextId);
+	WriteCheckpointValue(ostr,mReorderCounter);
+	for(int i=0;i<3;i++){
+		WriteCheckpointGrid(ostr,mVelocity[i]);
+		WriteCheckpointGrid(ostr,mVelocityLast[i]);
+	}
+	WriteCheckpointGrid(ostr,mPressure);
+	WriteCheckpointGrid(ostr,mLabel);
+	WriteCheckpointGrid(ostr,mWallWeight);
+	WriteCheckpointGrid(ostr,mParticleLevelSet);
+	WriteCheckpointGrid(ostr,mSignedLevelSet);
+	WriteCheckpointVdb(ostr,mSparseLevelSet);
+}
+bool FluidSimulation::readCheckpointState(std::istream& istr) {
+	std::string random;
+	if(!ReadCheckpointValue(istr,mMaxDensity)||!ReadCheckpointValue(istr,mStuckParticleCount)||!ReadCheckpointString(istr,random))return false;
+	std::istringstream(random)>>mRandom;
+	mParticles.clear();
+	if(!ReadCheckpointVector(istr,mParticles.mLocation)||!ReadCheckpointVector(istr,mParticles.mVelocity)
+			||!ReadCheckpointVector(istr,mParticles.mNormal)||!ReadCheckpointVector(istr,mParticles.mObjectType)
+			||!ReadCheckpointVector(istr,mParticles.mMass)||!ReadCheckpointVector(istr,mParticles.mDensity)
+			||!ReadCheckpointVector(istr,mParticles.mIds)||!ReadCheckpointValue(istr,mParticles.mNextId)
+			||!ReadCheckpointValue(istr,mReorderCounter))return false;
+	mParticles.mRemoveIndicator.assign(mParticles.size(),0);
+	for(int i=0;i<3;i++){
+		if(!ReadCheckpointGrid(istr,mVelocity[i])||!ReadCheckpointGrid(istr,mVelocityLast[i]))return false;
+	}
+	if(!ReadCheckpointGrid(istr,mPressure)||!ReadCheckpointGrid(istr,mLabel)||!ReadCheckpointGrid(istr,mWallWeight)
+			||!ReadCheckpointGrid(istr,mParticleLevelSet)||!ReadCheckpointGrid(istr,mSignedLevelSet))return false;
+	if(!ReadCheckpointVdb<FloatGrid>(istr,mSparseLevelSet))return false;
+	updateParticleVolume();
+	return true;
+}
 void FluidSimulation::cleanup() {
 	mParticles.clear();
 }
 bool FluidSimulation::step() {
-	//Rebuild location data structure
-	mParticleLocator->update(mParticles);
-	//Compute density for each cell, capped by max density as pre-computed
-	computeParticleDensity(mMaxDensity);
+	{
+		MetricsTimer timer("Density");
+		//Rebuild location data structure
+		mParticleLocator->update(mParticles);
+		//Periodically store the particles in cell order so neighbor visits and grid transfers stream through memory.
+		if (mReorderInterval > 0 && ++mReorderCounter >= mReorderInterval) {
+			mReorderCounter = 0;
+			mParticleLocator->reorder(mParticles);
+		}
+		//Compute density for each cell, capped by max density as pre-computed
+		computeParticleDensity(mMaxDensity);
+	}
 	//Add external gravity force
 	addExternalForce();
 	solvePicFlip();
 	if(!mSpringlTracking){
-		advectParticles();
-		correctParticles( mParticles, mTimeStep,mFluidParticleDiameter * mVoxelSize);
+		{
+			MetricsTimer timer("AdvectParticles");
+			advectParticles();
+			correctParticles( mParticles, mTimeStep,mFluidParticleDiameter * mVoxelSize);
+		}
+		MetricsTimer timer("LevelSet");
 		createLevelSet();
 		mSource.updateIsoSurface();
 	} else {
+		MetricsTimer timer("Tracking");
 
 		mSource.clean();
 		mSource.updateUnSignedLevelSet();
 		int count=mSource.fill();
 		mSource.fillWithVelocityField(mVelocity,0.5f*mVoxelSize);
+		mSource.updateOrdering();
 		mSource.updateUnSignedLevelSet(2.5f*LEVEL_SET_HALF_WIDTH);
 
 		advectParticles();
@@ -737,13 +924,24 @@ void FluidSimulation::enforceBoundaryCondition() {
 void FluidSimulation::project() {
 // Cell Width
 // Compute Divergence
-	OPENMP_FOR FOR_EVERY_GRID_CELL(mLabel)
+	//Each divergence is accurate to float epsilon times the sum of its face speeds over the cell width.
+	const double eps = std::numeric_limits<float>::epsilon();
+	double divergenceFloor = 0.0;
+#ifdef MP
+#pragma omp parallel for reduction(+:divergenceFloor)
+#endif
+	FOR_EVERY_GRID_CELL(mLabel)
 		{
 			if (mLabel(i, j, k) == static_cast<char>(ObjectType::FLUID)) {
 				mDivergence(i, j, k) = (mVelocity[0](i + 1, j, k)
 						- mVelocity[0](i, j, k) + mVelocity[1](i, j + 1, k)
 						- mVelocity[1](i, j, k) + mVelocity[2](i, j, k + 1)
 						- mVelocity[2](i, j, k)) / mVoxelSize;
+				double speed = (fabs(mVelocity[0](i + 1, j, k))
+						+ fabs(mVelocity[0](i, j, k)) + fabs(mVelocity[1](i, j + 1, k))
+						+ fabs(mVelocity[1](i, j, k)) + fabs(mVelocity[2](i, j, k + 1))
+						+ fabs(mVelocity[2](i, j, k))) / mVoxelSize;
+				divergenceFloor += eps * eps * speed * speed;
 			}
 		}END_FOR;
 
@@ -754,7 +952,11 @@ void FluidSimulation::project() {
 					mWallWeight, mFluidParticleDiameter);
 		}END_FOR;
 
-	laplace_solve(mLabel, mLaplacian, mPressure, mDivergence);
+	//The last solve left zero pressure outside its fluid, so cells that just became fluid start from zero.
+	if (!mWarmStartPressure)
+		mPressure.fill(0.0f);
+	laplace_solve(mLabel, mLaplacian, mPressure, mDivergence, mPressurePreconditioner, mPressureTolerance,
+			mMaxPressureIterations, divergenceFloor);
 // Subtract Pressure Gradient
 	OPENMP_FOR FOR_EVERY_GRID_CELL(mVelocity[0])
 		{
@@ -876,20 +1078,27 @@ void FluidSimulation::extrapolateVelocity() {
 		}END_FOR;
 }
 void FluidSimulation::solvePicFlip() {
-	mParticleLocator->update(mParticles);
-	mapParticlesToGrid();
-	mParticleLocator->markAsWater(mLabel, mWallWeight, mFluidParticleDiameter);
+	{
+		MetricsTimer timer("ParticlesToGrid");
+		mParticleLocator->update(mParticles);
+		mapParticlesToGrid();
+		mParticleLocator->markAsWater(mLabel, mWallWeight, mFluidParticleDiameter);
+	}
 	copyGridToBuffer();
 	enforceBoundaryCondition();
-	project();
+	{
+		MetricsTimer timer("Pressure");
+		project();
+	}
 	enforceBoundaryCondition();
 	extrapolateVelocity();
+	MetricsTimer timer("GridToParticles");
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles)
 	{
-		ParticlePtr& p = mParticles[n];
-		openvdb::Vec3s currentVelocity=mVelocity.interpolate(p->mLocation);
-		openvdb::Vec3s velocity=p->mVelocity+currentVelocity-mVelocityLast.interpolate(p->mLocation);
-		p->mVelocity = (1.0 - mPicFlipBlendWeight) *currentVelocity  + mPicFlipBlendWeight * velocity;
+		const Vec3f& location = mParticles.mLocation[n];
+		openvdb::Vec3s currentVelocity=mVelocity.interpolate(location);
+		openvdb::Vec3s velocity=mParticles.mVelocity[n]+currentVelocity-mVelocityLast.interpolate(location);
+		mParticles.mVelocity[n] = (1.0 - mPicFlipBlendWeight) *currentVelocity  + mPicFlipBlendWeight * velocity;
 	}
 	if(mSpringlTracking){
 		int N=mSource.mConstellation.getNumSpringls();
@@ -917,16 +1126,26 @@ void FluidSimulation::updateParticleVolume(){
 		mSource.mParticleVolume.mParticles.clear();
 		mSource.mParticleVolume.mVelocities.clear();
 		float scale = mVoxelSize / voxelSize;
+		//Exported in id order so the particle volume does not change with the storage order.
+		//Id in the high word and index in the low word, so sorting the live particles orders them by id.
+		std::vector<Index64> order;
+		order.reserve(mParticles.size());
 		FOR_EVERY_PARTICLE(mParticles)
 		{
-			FluidParticle* p = mParticles[n].get();
-			if (p->mObjectType == ObjectType::FLUID) {
-				Vec3s l = p->mLocation / voxelSize;
-				Vec4s v(l[0], l[1], l[2], scale * 0.5f * mFluidParticleDiameter);
-				mSource.mParticleVolume.mParticles.push_back(v);
-				mSource.mParticleVolume.mVelocities.push_back(p->mVelocity);
+			if (mParticles.isType(n,ObjectType::FLUID)) {
+				order.push_back((Index64(mParticles.mIds[n]) << 32) | Index64(n));
 			}
 		}
+		std::sort(order.begin(), order.end());
+		mSource.mParticleVolume.mParticles.reserve(order.size());
+		mSource.mParticleVolume.mVelocities.reserve(order.size());
+		for (Index64 key : order) {
+			int n = (int) (key & 0xFFFFFFFF);
+			Vec3s l = mParticles.mLocation[n] / voxelSize;
+			Vec4s v(l[0], l[1], l[2], scale * 0.5f * mFluidParticleDiameter);
+			mSource.mParticleVolume.mParticles.push_back(v);
+			mSource.mParticleVolume.mVelocities.push_back(mParticles.mVelocity[n]);
+		}
 		Coord dims(mParticleLevelSet.rows(), mParticleLevelSet.cols(), mParticleLevelSet.slices());
 		mSource.mParticleVolume.setBoundingBox(BBoxd(Vec3d(0, 0, 0), Vec3d(dims[0], dims[1], dims[2])));
 }
@@ -997,15 +1216,15 @@ float FluidSimulation::distance(const openvdb::Vec3f& p0,const openvdb::Vec3f& p
 }
 
 void FluidSimulation::shuffleCoordinates( std::vector<openvdb::Coord> &waters ) {
-	random_shuffle( waters.begin(), waters.end() );
+	std::shuffle( waters.begin(), waters.end(), mRandom );
 }
 
 
 float FluidSimulation::smoothKernel( float r2, float h ) {
-    return max( 1.0-r2/(h*h), 0.0 );
+    return SmoothKernel(r2, h);
 }
 float FluidSimulation::sharpKernel( float r2, float h ) {
-    return max( h*h/fmax(r2,1.0e-5) - 1.0, 0.0 );
+    return SharpKernel(r2, h);
 }
 
 
@@ -1017,72 +1236,45 @@ void FluidSimulation::mapParticlesToGrid() {
 
 	openvdb::Coord dims(mVelocity.rows(),mVelocity.cols(),mVelocity.slices());
 	float scale=1.0f/mVoxelSize;
-//OPENMP_FOR
-	FOR_EVERY_CELL(dims[0]+1,dims[1]+1,dims[2]+1) {
-		// Variales for Particle Sorter
-		vector<FluidParticle*> neighbors;
-
+	//A face gathers from at most two cells away, so faces outside the dilated fluid cells have no weight.
+	mTransferMask.fill(0);
+	mParticleLocator->markFluidCells(mTransferMask);
+	DilateMask(mTransferMask,2);
+	//Every face is written by exactly one iteration, so the gather runs in parallel with the serial result.
+	OPENMP_FOR FOR_EVERY_CELL(dims[0]+1,dims[1]+1,dims[2]+1) {
+		bool active = mTransferMask(i,j,k) != 0;
 		// Map X Grids
 		if( j <dims[1] && k < dims[2]) {
-			openvdb::Vec3f px(i, j+0.5, k+0.5);
-			float sumw = 0.0;
-			float sumx = 0.0;
-			neighbors = mParticleLocator->getNeigboringWallParticles(i,j,k,1,2,2);
-
-			for( int n=0; n<neighbors.size(); n++ ) {
-				FluidParticle *p = neighbors[n];
-				if( p->mObjectType == ObjectType::FLUID ) {
-					float x = clamp(scale*p->mLocation[0],0.0f,(float)dims[0]);
-					float y = clamp(scale*p->mLocation[1],0.0f,(float)dims[1]);
-					float z = clamp(scale*p->mLocation[2],0.0f,(float)dims[2]);
-					openvdb::Vec3f pos(x, y, z);
-					float w = p->mMass * sharpKernel(distanceSquared(pos,px),RELAXATION_KERNEL_WIDTH);
-					sumx += w*p->mVelocity[0];
-					sumw += w;
-				}
+			float value = 0.0;
+			if (active) {
+				openvdb::Vec3f px(i, j+0.5, k+0.5);
+				FaceVelocity face(mParticles,px,dims,scale,0);
+				mParticleLocator->forEachWallNeighbor(i,j,k,1,2,2,face);
+				if (face.mSumW) value = face.mSumV/face.mSumW;
 			}
-			mVelocity[0](i,j,k) = sumw ? sumx/sumw : 0.0;
+			mVelocity[0](i,j,k) = value;
 		}
-
 		// Map Y Grids
 		if( i < dims[0] && k < dims[2] ) {
-			openvdb::Vec3f py( i+0.5, j, k+0.5);
-			float sumw = 0.0;
-			float sumy = 0.0;
-			neighbors =mParticleLocator->getNeigboringWallParticles(i,j,k,2,1,2);
-			for( int n=0; n<neighbors.size(); n++ ) {
-				FluidParticle *p = neighbors[n];
-				if( p->mObjectType == ObjectType::FLUID ) {
-					float x = clamp(scale*p->mLocation[0],0.0f,(float)dims[0]);
-					float y = clamp(scale*p->mLocation[1],0.0f,(float)dims[1]);
-					float z = clamp(scale*p->mLocation[2],0.0f,(float)dims[2]);
-					openvdb::Vec3s pos( x, y, z );
-					float w = p->mMass * sharpKernel(distanceSquared(pos,py),RELAXATION_KERNEL_WIDTH);
-					sumy += w*p->mVelocity[1];
-					sumw += w;
-				}
+			float value = 0.0;
+			if (active) {
+				openvdb::Vec3f py( i+0.5, j, k+0.5);
+				FaceVelocity face(mParticles,py,dims,scale,1);
+				mParticleLocator->forEachWallNeighbor(i,j,k,2,1,2,face);
+				if (face.mSumW) value = face.mSumV/face.mSumW;
 			}
-			mVelocity[1](i,j,k) = sumw ? sumy/sumw : 0.0;
+			mVelocity[1](i,j,k) = value;
 		}
 		// Map Z Grids
 		if( i < dims[0] && j < dims[1] ) {
-			openvdb::Vec3f pz(i+0.5, j+0.5, k);
-			float sumw = 0.0;
-			float sumz = 0.0;
-			neighbors =mParticleLocator->getNeigboringWallParticles(i,j,k,2,2,1);
-			for( int n=0; n<neighbors.size(); n++ ) {
-				FluidParticle *p = neighbors[n];
-				if( p->mObjectType == ObjectType::FLUID ) {
-					float x = clamp(scale*p->mLocation[0],0.0f,(float)dims[0]);
-					float y = clamp(scale*p->mLocation[1],0.0f,(float)dims[1]);
-					float z = clamp(scale*p->mLocation[2],0.0f,(float)dims[2]);
-					openvdb::Vec3s pos( x, y, z );
-					float w = p->mMass * sharpKernel(distanceSquared(pos,pz),RELAXATION_KERNEL_WIDTH);
-					sumz += w*p->mVelocity[2];
-					sumw += w;
-				}
+			float value = 0.0;
+			if (active) {
+				openvdb::Vec3f pz(i+0.5, j+0.5, k);
+				FaceVelocity face(mParticles,pz,dims,scale,2);
+				mParticleLocator->forEachWallNeighbor(i,j,k,2,2,1,face);
+				if (face.mSumW) value = face.mSumV/face.mSumW;
 			}
-			mVelocity[2](i,j,k) = sumw ? sumz/sumw : 0.0;
+			mVelocity[2](i,j,k) = value;
 		}
 	} END_FOR
 }
@@ -1102,72 +1294,42 @@ float FluidSimulation::linear ( RegularGrid<float>& q, float x, float y, float z
 }
 
 void FluidSimulation::resampleParticles( openvdb::Vec3f& p,openvdb::Vec3f& u, float re ) {
-	// Variables for Neighboring Particles
-	std::vector<FluidParticle*> neighbors;
 	openvdb::Coord cell_size = mParticleLocator->getGridSize();
-	float wsum = 0.0;
-	openvdb::Vec3f save(u);
-	u[0] = u[1] = u[2] = 0.0;
 	float scale=mParticleLocator->getVoxelSize();
 	int i = clamp((int)(p[0]*scale),0,cell_size[0]-1);
 	int j = clamp((int)(p[1]*scale),0,cell_size[1]-1);
 	int k = clamp((int)(p[2]*scale),0,cell_size[2]-1);
-	// Gather Neighboring Particles
-	neighbors = mParticleLocator->getNeigboringCellParticles(i,j,k,1,1,1);
-	for(FluidParticle *np:neighbors) {
-		if( np->mObjectType == ObjectType::FLUID ) {
-			float dist2 = distanceSquared(p,np->mLocation);
-			float w = np->mMass * sharpKernel(dist2,re);
-			u += w * np->mVelocity;
-			wsum += w;
-		}
-	}
-	if( wsum ) {
-		u /= wsum;
-	} else {
-		u = save;
+	VelocitySum sum(mParticles,p,re);
+	mParticleLocator->forEachNeighbor(i,j,k,1,1,1,sum);
+	if( sum.mSumW ) {
+		u = sum.mSum / sum.mSumW;
 	}
 }
 
-void FluidSimulation::correctParticles(std::vector<ParticlePtr>& particles, float dt, float re ) {
+void FluidSimulation::correctParticles(FluidParticles& particles, float dt, float re ) {
 	// Variables for Neighboring Particles
 	openvdb::Coord cell_size = mParticleLocator->getGridSize();
 	mParticleLocator->update(particles);
 	float scale=1.0f/mParticleLocator->getVoxelSize();
+	particles.mTmp[0].resize(particles.size());
+	particles.mTmp[1].resize(particles.size());
 	// Compute Pseudo Moved Point
 	OPENMP_FOR FOR_EVERY_PARTICLE(particles) {
-		if( particles[n]->mObjectType == ObjectType::FLUID ) {
-			FluidParticle *p = particles[n].get();
-			openvdb::Vec3f spring(0.0);
-			int i = clamp((int)(p->mLocation[0]*scale),0,cell_size[0]-1);
-			int j = clamp((int)(p->mLocation[1]*scale),0,cell_size[1]-1);
-			int k = clamp((int)(p->mLocation[2]*scale),0,cell_size[2]-1);
-			std::vector<FluidParticle*> neighbors = mParticleLocator->getNeigboringCellParticles(i,j,k,1,1,1);
-			for( int n=0; n<neighbors.size(); n++ ) {
-				FluidParticle *np = neighbors[n];
-				if( p != np ) {
-					float dist = distance(p->mLocation,np->mLocation);
-					float w = SPRING_STIFFNESS * np->mMass * smoothKernel(dist*dist,re);
-					if( dist > 0.1*re ) {
-						spring += w * (p->mLocation-np->mLocation) / dist * re;
-					} else {
-						if( np->mObjectType == ObjectType::FLUID ) {
-							spring += 0.01*re/dt*(rand()%101)/100.0;
-						} else {
-							spring += 0.05*re/dt*np->mNormal;
-						}
-					}
-				}
-			}
-			p->mTmp[0] = p->mLocation + dt*spring;
+		if( particles.isType(n,ObjectType::FLUID) ) {
+			const Vec3f& location = particles.mLocation[n];
+			int i = clamp((int)(location[0]*scale),0,cell_size[0]-1);
+			int j = clamp((int)(location[1]*scale),0,cell_size[1]-1);
+			int k = clamp((int)(location[2]*scale),0,cell_size[2]-1);
+			SpringForce spring(particles,n,re,dt,mSimulationIteration);
+			mParticleLocator->forEachNeighbor(i,j,k,1,1,1,spring);
+			particles.mTmp[0][n] = location + dt*spring.mSpring;
 		}
 	}
 	// Resample New Velocity
 	OPENMP_FOR FOR_EVERY_PARTICLE(particles) {
-		if( particles[n]->mObjectType == ObjectType::FLUID ) {
-			FluidParticle *p = particles[n].get();
-			p->mTmp[1] = p->mVelocity;
-			resampleParticles( p->mTmp[0], p->mTmp[1], re );
+		if( particles.isType(n,ObjectType::FLUID) ) {
+			particles.mTmp[1][n] = particles.mVelocity[n];
+			resampleParticles( particles.mTmp[0][n], particles.mTmp[1][n], re );
 		}
 	}
 
@@ -1177,38 +1339,23 @@ void FluidSimulation::correctParticles(std::vector<ParticlePtr>& particles, floa
 		for(int n=0;n<N;n++){
 			Springl& springl=mSource.mConstellation.springls[n];
 			//velocities[n]=mVelocity.interpolate(0.5f*mVoxelSize*positions[n]);
-			// Variables for Neighboring Particles
-			float wsum = 0.0;
-			Vec3s u(0.0f);
+			//Vertexes gather from the neighborhood of the springl particle.
 			Vec3s pt=springl.particle();
-			std::vector<FluidParticle*> neighbors = mParticleLocator->getNeigboringCellParticles((int)(0.5f*pt[0]),(int)(0.5f*pt[1]),(int)(0.5f*pt[2]),1,1,1);
+			int i=(int)(0.5f*pt[0]);
+			int j=(int)(0.5f*pt[1]);
+			int k=(int)(0.5f*pt[2]);
 			pt*=0.5f*mVoxelSize;
-			for(FluidParticle *np:neighbors) {
-				if( np->mObjectType == ObjectType::FLUID ) {
-					float w = np->mMass * sharpKernel(distanceSquared(pt,np->mLocation),mFluidParticleDiameter * mVoxelSize);
-					u += w * np->mVelocity;
-					wsum += w;
-				}
+			VelocitySum sum(mParticles,pt,mFluidParticleDiameter * mVoxelSize);
+			mParticleLocator->forEachNeighbor(i,j,k,1,1,1,sum);
+			if(sum.mSumW>0.0f) {
+				springl.particleVelocity()=sum.mSum/sum.mSumW;
 			}
-			if(wsum>0.0f) {
-				u /= wsum;
-				springl.particleVelocity()=u;
-			}
-			for(int i=0;i<springl.size();i++){
-				pt=springl[i];
-				pt*=0.5f*mVoxelSize;
-				u=Vec3s(0.0f);
-				wsum=0.0f;
-				for(FluidParticle *np:neighbors) {
-					if( np->mObjectType == ObjectType::FLUID ) {
-						float w = np->mMass * sharpKernel(distanceSquared(pt,np->mLocation),mFluidParticleDiameter * mVoxelSize);
-						u += w * np->mVelocity;
-						wsum += w;
-					}
-				}
-				if(wsum>0.0f) {
-					u /= wsum;
-					springl.vertexVelocity(i)=u;
+			for(int n=0;n<springl.size();n++){
+				Vec3s vt=0.5f*mVoxelSize*springl[n];
+				VelocitySum vsum(mParticles,vt,mFluidParticleDiameter * mVoxelSize);
+				mParticleLocator->forEachNeighbor(i,j,k,1,1,1,vsum);
+				if(vsum.mSumW>0.0f) {
+					springl.vertexVelocity(n)=vsum.mSum/vsum.mSumW;
 				}
 			}
 		}
@@ -1216,45 +1363,27 @@ void FluidSimulation::correctParticles(std::vector<ParticlePtr>& particles, floa
 
 	// Update
 	OPENMP_FOR FOR_EVERY_PARTICLE(particles) {
-		if( particles[n]->mObjectType == ObjectType::FLUID ) {
-			FluidParticle *p = particles[n].get();
-			p->mLocation = p->mTmp[0];
-			p->mVelocity = p->mTmp[1];
+		if( particles.isType(n,ObjectType::FLUID) ) {
+			particles.mLocation[n] = particles.mTmp[0][n];
+			particles.mVelocity[n] = particles.mTmp[1][n];
 		}
 	}
 }
 void FluidSimulation::mapGridToParticles() {
 	OPENMP_FOR FOR_EVERY_PARTICLE(mParticles){
-		ParticlePtr& p=mParticles[n];
-		p->mVelocity=mVelocity.interpolate(p->mLocation);
+		mParticles.mVelocity[n]=mVelocity.interpolate(mParticles.mLocation[n]);
 	}
 }
-double FluidSimulation::implicit_func( vector<FluidParticle*> &neighbors,openvdb::Vec3f& p, float radius,float voxelSize) {
-	double phi = 8.0f*radius;
-	float scale=1.0f/mParticleLocator->getVoxelSize();
-	for( int m=0; m<neighbors.size(); m++ ) {
-		FluidParticle &np = *neighbors[m];
-		double d= distance(np.mLocation,p)*scale;
-		if( np.mObjectType == ObjectType::WALL ) {
-			if(d < radius) return 4.5*radius;
-			continue;
-		}
-		if( d < phi ) {
-			phi = d;
-		}
-	}
-	//std::cout<<"IMPLICIT "<<phi<<" "<<density<<" "<<voxelSize<<std::endl;
-	return phi - radius;
-}
 double FluidSimulation::implicit_func( openvdb::Vec3f& p, float radius ) {
 	openvdb::Coord cell_size = mParticleLocator->getGridSize();
 	float scale=1.0f/mParticleLocator->getVoxelSize();
-	vector<FluidParticle *> neighbors = mParticleLocator->getNeigboringCellParticles(
+	ClosestParticle closest(mParticles,p,scale,radius);
+	mParticleLocator->forEachNeighbor(
 			clamp((int)(p[0]*scale),0,cell_size[0]-1),
 			clamp((int)(p[1]*scale),0,cell_size[1]-1),
-			clamp((int)(p[2]*scale),0,cell_size[2]-1),2,2,2
-			);
-	return implicit_func( neighbors, p, radius,mParticleLocator->getVoxelSize());
+			clamp((int)(p[2]*scale),0,cell_size[2]-1),2,2,2,closest);
+	if(closest.mWallHit)return 4.5*radius;
+	return closest.mDistance - radius;
 }
 void FluidSimulation::computeWallNormals() {
 // mParticleLocator Particles
@@ -1266,50 +1395,44 @@ void FluidSimulation::computeWallNormals() {
 	float my=mVoxelSize*mGridSize[1];
 	float mz=mVoxelSize*mGridSize[2];
 
-	for (ParticlePtr& p : mParticles) {
-		int i = clamp((int) (p->mLocation[0] * scale), 0,mGridSize[0] - 1);
-		int j = clamp((int) (p->mLocation[1] * scale), 0,mGridSize[1] - 1);
-		int k = clamp((int) (p->mLocation[2] * scale), 0,mGridSize[2] - 1);
+	FOR_EVERY_PARTICLE(mParticles) {
+		const Vec3f& location = mParticles.mLocation[n];
+		Vec3f& particleNormal = mParticles.mNormal[n];
+		int i = clamp((int) (location[0] * scale), 0,mGridSize[0] - 1);
+		int j = clamp((int) (location[1] * scale), 0,mGridSize[1] - 1);
+		int k = clamp((int) (location[2] * scale), 0,mGridSize[2] - 1);
 		mWallNormal(i, j, k) = Vec3f(0.0f);
-		p->mNormal = Vec3f(0.0);
+		particleNormal = Vec3f(0.0);
 
-		if (p->mObjectType == ObjectType::WALL) {
-			if (p->mLocation[0] <= (mx+0.1) * mWallThickness) {
-				p->mNormal[0] = 1.0;
+		if (mParticles.isType(n,ObjectType::WALL)) {
+			if (location[0] <= (mx+0.1) * mWallThickness) {
+				particleNormal[0] = 1.0;
 			}
-			if (p->mLocation[0] >= mx - (mx-0.1) * mWallThickness) {
-				p->mNormal[0] = -1.0;
+			if (location[0] >= mx - (mx-0.1) * mWallThickness) {
+				particleNormal[0] = -1.0;
 			}
-			if (p->mLocation[1] <= (my+0.1) * mWallThickness) {
-				p->mNormal[1] = 1.0;
+			if (location[1] <= (my+0.1) * mWallThickness) {
+				particleNormal[1] = 1.0;
 			}
-			if (p->mLocation[1] >= my - (my-0.1) * mWallThickness) {
-				p->mNormal[1] = -1.0;
+			if (location[1] >= my - (my-0.1) * mWallThickness) {
+				particleNormal[1] = -1.0;
 			}
-			if (p->mLocation[2] <= (mz+0.1) * mWallThickness) {
-				p->mNormal[2] = 1.0;
+			if (location[2] <= (mz+0.1) * mWallThickness) {
+				particleNormal[2] = 1.0;
 			}
-			if (p->mLocation[2] >= mz - (mz-0.1) * mWallThickness) {
-				p->mNormal[2] = -1.0;
+			if (location[2] >= mz - (mz-0.1) * mWallThickness) {
+				particleNormal[2] = -1.0;
 			}
 
-			if (p->mNormal[0] == 0.0 && p->mNormal[1] == 0.0
-					&& p->mNormal[2] == 0.0) {
-				vector<FluidParticle*> neighbors =
-						mParticleLocator->getNeigboringCellParticles(i, j, k, 3,
-								3, 3);
-				for (int n = 0; n < neighbors.size(); n++) {
-					FluidParticle *np = neighbors[n];
-					if (p.get() != np && np->mObjectType == ObjectType::WALL) {
-						float d = distance(p->mLocation, np->mLocation);
-						float w = 1.0 / d;
-						p->mNormal += w * (p->mLocation - np->mLocation) / d;
-					}
-				}
+			if (particleNormal[0] == 0.0 && particleNormal[1] == 0.0
+					&& particleNormal[2] == 0.0) {
+				WallNormalSum normal(mParticles,n);
+				mParticleLocator->forEachNeighbor(i, j, k, 3, 3, 3, normal);
+				particleNormal += normal.mNormal;
 			}
 		}
-		p->mNormal.normalize();
-		mWallNormal(i, j, k) = p->mNormal;
+		particleNormal.normalize();
+		mWallNormal(i, j, k) = particleNormal;
 	}
 
 	mParticleLocator->update(mParticles);
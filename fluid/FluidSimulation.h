@@ -31,6 +31,7 @@
 
 #include "fluid_common.h"
 #include "fluid_sorter.h"
+#include "laplace_solver.h"
 #include "../ParticleVolume.h"
 #include "../Simulation.h"
 #include "../SpringLevelSetFieldDeformation.h"
@@ -38,6 +39,7 @@
 #include "../DistanceField.h"
 #include "FluidVelocityField.h"
 #include "FluidTrackingField.h"
+#include <random>
 #undef OPENVDB_REQUIRE_VERSION_NAME
 
 
@@ -54,6 +56,7 @@ class FluidSimulation :public Simulation{
 		std::unique_ptr<imagesci::SpringLevelSetFieldDeformation<FluidTrackingField<float>,openvdb::util::NullInterrupter> > mTrack;
 		//Constant, even though gravity really isn't constant on earth.
 		const static float GRAVITY ;
+		static const int DEFAULT_REORDER_INTERVAL;
 		float mMaxDensity;
 		float mPicFlipBlendWeight ;
 		float mFluidParticleDiameter;
@@ -68,6 +71,8 @@ class FluidSimulation :public Simulation{
 		RegularGrid<openvdb::Vec3s> mWallNormal;
 		RegularGrid<openvdb::Vec3s> mDenseMap;
 		RegularGrid<float> mWallWeight;
+		//Cells within reach of a fluid particle, sized to the MAC faces.
+		RegularGrid<char> mTransferMask;
 		RegularGrid<float> mParticleLevelSet;
 		RegularGrid<float> mSignedLevelSet;
 		openvdb::FloatGrid::Ptr mSparseLevelSet;
@@ -85,7 +90,17 @@ class FluidSimulation :public Simulation{
 		std::vector<std::shared_ptr<SimulationObject>> mWallObjects;
 		std::vector<std::shared_ptr<SimulationObject>> mAirObjects;
 
-		std::vector<ParticlePtr> mParticles;
+		FluidParticles mParticles;
+		//Steps between reordering the particle arrays into cell order, 0 disables reordering.
+		int mReorderInterval;
+		int mReorderCounter;
+		PressurePreconditioner mPressurePreconditioner;
+		float mPressureTolerance;
+		int mMaxPressureIterations;
+		//Start each pressure solve from the previous step's pressure, which is zero at cells that were not fluid.
+		bool mWarmStartPressure;
+		//Seeded once, checkpointed with the solver state.
+		std::mt19937 mRandom;
 		void copyGridToBuffer();
 		void subtractGrid();
 		void placeObjects();
@@ -113,20 +128,51 @@ class FluidSimulation :public Simulation{
 		void shuffleCoordinates( std::vector<openvdb::Coord> &waters );
 		float linear( RegularGrid<float>& q, float x, float y, float z ) ;
 		void resampleParticles(openvdb::Vec3f& p, openvdb::Vec3f& u, float re );
-		void correctParticles(std::vector<ParticlePtr>& particle, float dt, float re);
+		void correctParticles(FluidParticles& particles, float dt, float re);
 		double implicit_func(openvdb::Vec3f& p, float density );
-		double implicit_func( std::vector<FluidParticle*> &neighbors,openvdb::Vec3f& p, float density,float voxelSize);
 		void mapParticlesToGrid();
 		void mapGridToParticles();
 
 		inline float isWallIndicator( char a ) {
 			return ((a == static_cast<char>(ObjectType::WALL)) ? 1.0f : -1.0f);
 		}
+		virtual void writeCheckpointState(std::ostream& ostr);
+		virtual bool readCheckpointState(std::istream& istr);
 		virtual void addFluid()=0;
 		void addSimulationObject(SimulationObject* obj);
 	public:
 		//void operator()(Springl& springl,double time,double dt);
 		FluidSimulation(const openvdb::Coord& dims,float voxelSize,MotionScheme scheme) ;
+		inline void setReorderInterval(int interval){
+			mReorderInterval=interval;
+			mReorderCounter=0;
+		}
+		inline int getReorderInterval() const {
+			return mReorderInterval;
+		}
+		inline void setPressurePreconditioner(PressurePreconditioner preconditioner){
+			mPressurePreconditioner=preconditioner;
+		}
+		inline PressurePreconditioner getPressurePreconditioner() const {
+			return mPressurePreconditioner;
+		}
+		//Tolerance is relative to the norm of the divergence.
+		inline void setPressureTolerance(float tolerance,int maxIterations){
+			mPressureTolerance=tolerance;
+			mMaxPressureIterations=maxIterations;
+		}
+		inline float getPressureTolerance() const {
+			return mPressureTolerance;
+		}
+		inline int getMaxPressureIterations() const {
+			return mMaxPressureIterations;
+		}
+		inline void setWarmStartPressure(bool warmStart){
+			mWarmStartPressure=warmStart;
+		}
+		inline bool isWarmStartPressure() const {
+			return mWarmStartPressure;
+		}
 		virtual bool init();
 		virtual bool step();
 		virtual void cleanup();
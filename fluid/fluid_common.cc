@@ -106,5 +106,78 @@ bool SphereObject::insideShell(openvdb::Vec3f& pt){
 		return false;
 	}
 }
+template<typename T> static void PermuteParticleAttribute(std::vector<T>& values,const std::vector<int>& order) {
+	std::vector<T> tmp(order.size());
+	OPENMP_FOR
+	for (int n = 0; n < (int) order.size(); n++) {
+		tmp[n] = values[order[n]];
+	}
+	values.swap(tmp);
+}
+template<typename T> static void CompactParticleAttribute(std::vector<T>& values,const std::vector<char>& remove) {
+	size_t count = 0;
+	for (size_t n = 0; n < values.size(); n++) {
+		if (!remove[n]) {
+			values[count++] = values[n];
+		}
+	}
+	values.resize(count);
+}
+void FluidParticles::clear() {
+	mLocation.clear();
+	mVelocity.clear();
+	mNormal.clear();
+	mObjectType.clear();
+	mRemoveIndicator.clear();
+	mTmp[0].clear();
+	mTmp[1].clear();
+	mMass.clear();
+	mDensity.clear();
+	mIds.clear();
+}
+void FluidParticles::reserve(size_t count) {
+	mLocation.reserve(count);
+	mVelocity.reserve(count);
+	mNormal.reserve(count);
+	mObjectType.reserve(count);
+	mRemoveIndicator.reserve(count);
+	mMass.reserve(count);
+	mDensity.reserve(count);
+	mIds.reserve(count);
+}
+void FluidParticles::add(const openvdb::Vec3f& location,const openvdb::Vec3f& velocity,ObjectType type,float density,float mass) {
+	mLocation.push_back(location);
+	mVelocity.push_back(velocity);
+	mNormal.push_back(openvdb::Vec3f(0.0f));
+	mObjectType.push_back(static_cast<char>(type));
+	mRemoveIndicator.push_back(0);
+	mMass.push_back(mass);
+	mDensity.push_back(density);
+	mIds.push_back(mNextId++);
+}
+void FluidParticles::permute(const std::vector<int>& order) {
+	PermuteParticleAttribute(mLocation, order);
+	PermuteParticleAttribute(mVelocity, order);
+	PermuteParticleAttribute(mNormal, order);
+	PermuteParticleAttribute(mObjectType, order);
+	PermuteParticleAttribute(mRemoveIndicator, order);
+	PermuteParticleAttribute(mMass, order);
+	PermuteParticleAttribute(mDensity, order);
+	PermuteParticleAttribute(mIds, order);
+}
+size_t FluidParticles::removeMarked() {
+	size_t count = size();
+	std::vector<char> remove;
+	remove.swap(mRemoveIndicator);
+	CompactParticleAttribute(mLocation, remove);
+	CompactParticleAttribute(mVelocity, remove);
+	CompactParticleAttribute(mNormal, remove);
+	CompactParticleAttribute(mObjectType, remove);
+	CompactParticleAttribute(mMass, remove);
+	CompactParticleAttribute(mDensity, remove);
+	CompactParticleAttribute(mIds, remove);
+	mRemoveIndicator.assign(size(), 0);
+	return count - size();
+}
 }
 
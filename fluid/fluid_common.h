@@ -32,6 +32,7 @@
 #include "../ImageSciUtil.h"
 #include "../Mesh.h"
 #include <memory>
+#include <vector>
 namespace imagesci {
 
 
@@ -100,17 +101,39 @@ public:
 };
 
 
-struct FluidParticle {
-	openvdb::Vec3f mLocation;
-	openvdb::Vec3f mVelocity;
-	openvdb::Vec3f mNormal;
-	ObjectType mObjectType;
-	//char mVisible;
-	bool mRemoveIndicator;
-	openvdb::Vec3f mTmp[2];
-	float mMass;
-	float mDensity;
+/*
+ * Fluid particles stored as parallel arrays, so loops over one attribute stream through memory. Particle n is
+ * index n of every array. mIds are assigned in creation order and survive reordering and removal.
+ */
+struct FluidParticles {
+	std::vector<openvdb::Vec3f> mLocation;
+	std::vector<openvdb::Vec3f> mVelocity;
+	std::vector<openvdb::Vec3f> mNormal;
+	std::vector<char> mObjectType;
+	std::vector<char> mRemoveIndicator;
+	std::vector<openvdb::Vec3f> mTmp[2];
+	std::vector<float> mMass;
+	std::vector<float> mDensity;
+	std::vector<openvdb::Index32> mIds;
+	openvdb::Index32 mNextId;
+	FluidParticles():mNextId(0){
+	}
+	inline size_t size() const {
+		return mLocation.size();
+	}
+	inline bool empty() const {
+		return mLocation.empty();
+	}
+	inline bool isType(size_t n,ObjectType type) const {
+		return mObjectType[n]==static_cast<char>(type);
+	}
+	void clear();
+	void reserve(size_t count);
+	void add(const openvdb::Vec3f& location,const openvdb::Vec3f& velocity,ObjectType type,float density,float mass);
+	//Gather every array so new particle n is old particle order[n].
+	void permute(const std::vector<int>& order);
+	//Erase particles with mRemoveIndicator set, keeping the order of the others. Returns the number removed.
+	size_t removeMarked();
 };
-typedef std::unique_ptr<FluidParticle> ParticlePtr;
 }
 #endif
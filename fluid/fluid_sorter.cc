@@ -28,72 +28,88 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <algorithm>
 using namespace std;
 namespace imagesci {
 namespace fluid {
+const int ParticleLocator::MIN_BLOCK_SIZE = 4096;
 ParticleLocator::ParticleLocator(openvdb::Coord dims, float voxelSize) :
-		mVoxelSize(voxelSize), cells(dims, voxelSize,
-				std::vector<FluidParticle*>()), mGridSize(dims) {
+		mVoxelSize(voxelSize), mGridSize(dims), mParticles(NULL) {
+	mCellStart.resize((size_t) dims[0] * dims[1] * dims[2] + 1, 0);
 }
 ParticleLocator::~ParticleLocator() {
 }
-
-void ParticleLocator::update(std::vector<ParticlePtr>& particles) {
-	// Clear All Cells
-	OPENMP_FOR FOR_EVERY_GRID_CELL(cells)
-		{
-			cells(i, j, k).clear();
-		}END_FOR
-
+//Stable counting sort. Each block of particles is counted and scattered by one thread into its own slice of every
+//cell, so particles keep their input order within a cell and queries see the same order as a serial build.
+void ParticleLocator::update(const FluidParticles& particles) {
+	const int N = particles.size();
+	const size_t cellCount = mCellStart.size() - 1;
 	float scale=1.0f/mVoxelSize;
-	// Store Into The Cells
-	for (ParticlePtr& p : particles) {
-		int i = clamp((int) (scale * p->mLocation[0]), 0,mGridSize[0] - 1);
-		int j = clamp((int) (scale * p->mLocation[1]), 0,mGridSize[1] - 1);
-		int k = clamp((int) (scale * p->mLocation[2]), 0,mGridSize[2] - 1);
-		cells(i, j, k).push_back(p.get());
+	mParticles = &particles;
+	mOrder.resize(N);
+	mParticleCell.resize(N);
+	OPENMP_FOR FOR_EVERY_PARTICLE(particles) {
+		const openvdb::Vec3f& pt = particles.mLocation[n];
+		int i = clamp((int) (scale * pt[0]), 0,mGridSize[0] - 1);
+		int j = clamp((int) (scale * pt[1]), 0,mGridSize[1] - 1);
+		int k = clamp((int) (scale * pt[2]), 0,mGridSize[2] - 1);
+		mParticleCell[n] = getCellIndex(i, j, k);
 	}
-}
-
-std::vector<FluidParticle*> ParticleLocator::getNeigboringWallParticles(int i,
-		int j, int k, int w, int h, int d) {
-	std::vector<FluidParticle*> res;
-	for (int si = max(i - w, 0); si <= min(i + w - 1, mGridSize[0] - 1); si++) {
-		for (int sj = max(j - h, 0); sj <= min(j + h - 1, mGridSize[1] - 1);sj++) {
-			for (int sk = max(k - d, 0); sk <= min(k + d - 1, mGridSize[2] - 1);sk++) {
-				for (FluidParticle* p : cells(si, sj, sk)) {
-					res.push_back(p);
-				}
-			}
+	int blocks = 1;
+#ifdef MP
+	//Per block counts cost one pass over the cells, so keep them within a few times the particle count.
+	blocks = std::min(omp_get_max_threads(), N / MIN_BLOCK_SIZE + 1);
+	blocks = std::max(1, std::min(blocks, (int) (4 * (size_t) N / std::max((size_t) 1, cellCount))));
+#endif
+	mBlockOffsets.assign(blocks * cellCount, 0);
+	OPENMP_FOR for (int b = 0; b < blocks; b++) {
+		int* counts = &mBlockOffsets[b * cellCount];
+		int end = (int) (((long) N * (b + 1)) / blocks);
+		for (int n = (int) (((long) N * b) / blocks); n < end; n++) {
+			counts[mParticleCell[n]]++;
 		}
 	}
-	return res;
-}
-
-std::vector<FluidParticle*> ParticleLocator::getNeigboringCellParticles(int i,int j, int k, int w, int h, int d) {
-	std::vector<FluidParticle*> res;
-	for (int si = max(i - w, 0); si <= min(i + w, mGridSize[0] - 1); si++) {
-		for (int sj = max(j - h, 0); sj <= min(j + h, mGridSize[1] - 1); sj++) {
-			for (int sk = max(k - d, 0); sk <= min(k + d, mGridSize[2] - 1);sk++) {
-				for (FluidParticle* p : cells(si, sj, sk)) {
-					res.push_back(p);
-				}
-			}
+	int offset = 0;
+	for (size_t c = 0; c < cellCount; c++) {
+		mCellStart[c] = offset;
+		for (int b = 0; b < blocks; b++) {
+			int& count = mBlockOffsets[b * cellCount + c];
+			int tmp = count;
+			count = offset;
+			offset += tmp;
+		}
+	}
+	mCellStart[cellCount] = offset;
+	OPENMP_FOR for (int b = 0; b < blocks; b++) {
+		int* offsets = &mBlockOffsets[b * cellCount];
+		int end = (int) (((long) N * (b + 1)) / blocks);
+		for (int n = (int) (((long) N * b) / blocks); n < end; n++) {
+			mOrder[offsets[mParticleCell[n]]++] = n;
 		}
 	}
-	return res;
+}
+void ParticleLocator::reorder(FluidParticles& particles) {
+	if (mParticles != &particles || mOrder.size() != particles.size())
+		return;
+	particles.permute(mOrder);
+	OPENMP_FOR for (int n = 0; n < (int) mOrder.size(); n++) {
+		mOrder[n] = n;
+	}
 }
 
 int ParticleLocator::getParticleCount(int i, int j, int k) {
-	return cells(i, j, k).size();
+	size_t c = getCellIndex(i, j, k);
+	return mCellStart[c + 1] - mCellStart[c];
 }
 
 float ParticleLocator::getLevelSetValue(int i, int j, int k,
 		RegularGrid<float>& halfwall, float density) {
 	float accm = 0.0;
-	for (FluidParticle* p : cells(i, j, k)) {
-		if (p->mObjectType == ObjectType::FLUID) {
-			accm += p->mDensity;
+	size_t c = getCellIndex(i, j, k);
+	for (int n = mCellStart[c]; n < mCellStart[c + 1]; n++) {
+		int p = mOrder[n];
+		if (mParticles->isType(p, ObjectType::FLUID)) {
+			accm += mParticles->mDensity[p];
 		} else {
 			return 1.0;
 		}
@@ -105,11 +121,12 @@ float ParticleLocator::getLevelSetValue(int i, int j, int k,
 
 void ParticleLocator::markAsWater(RegularGrid<char>& A,
 		RegularGrid<float>& halfwall, float density) {
-	OPENMP_FOR FOR_EVERY_GRID_CELL(cells)
+	OPENMP_FOR FOR_EVERY_CELL(mGridSize[0], mGridSize[1], mGridSize[2])
 		{
 			A(i, j, k) = static_cast<char>(ObjectType::AIR);
-			for (FluidParticle* p : cells(i, j, k)) {
-				if (p->mObjectType == ObjectType::WALL) {
+			size_t c = getCellIndex(i, j, k);
+			for (int n = mCellStart[c]; n < mCellStart[c + 1]; n++) {
+				if (mParticles->isType(mOrder[n], ObjectType::WALL)) {
 					A(i, j, k) = static_cast<char>(ObjectType::WALL);
 					break;
 				}
@@ -120,11 +137,25 @@ void ParticleLocator::markAsWater(RegularGrid<char>& A,
 								ObjectType::FLUID : ObjectType::AIR);
 		}END_FOR
 }
-void ParticleLocator::deleteAllParticles() {
-	OPENMP_FOR FOR_EVERY_GRID_CELL(cells)
+void ParticleLocator::markFluidCells(RegularGrid<char>& mask) const {
+	if (mParticles == NULL)
+		return;
+	OPENMP_FOR FOR_EVERY_CELL(mGridSize[0], mGridSize[1], mGridSize[2])
 		{
-			cells(i, j, k).clear();
+			size_t c = getCellIndex(i, j, k);
+			for (int n = mCellStart[c]; n < mCellStart[c + 1]; n++) {
+				if (mParticles->isType(mOrder[n], ObjectType::FLUID)) {
+					mask(i, j, k) = 1;
+					break;
+				}
+			}
 		}END_FOR
 }
+void ParticleLocator::deleteAllParticles() {
+	mParticles = NULL;
+	mOrder.clear();
+	mParticleCell.clear();
+	std::fill(mCellStart.begin(), mCellStart.end(), 0);
+}
 }
 }
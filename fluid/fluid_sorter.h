@@ -30,25 +30,68 @@
 #define _SORTER_H
 namespace imagesci{
 namespace fluid{
+/*
+ * Particles bucketed by grid cell in compressed form: mOrder holds every particle index sorted by cell and the
+ * particles of cell c are mOrder[mCellStart[c]..mCellStart[c+1]). Cells along k are adjacent, so a neighborhood
+ * query reads one contiguous range per (i,j) row and allocates nothing. After reorder() the particle arrays
+ * themselves are in cell order and mOrder is the identity.
+ */
 class ParticleLocator {
 public:
 	ParticleLocator(openvdb::Coord dims,float voxelSize);
 	~ParticleLocator();
 	
-	void update( std::vector<ParticlePtr>& particles );
-	std::vector<FluidParticle*> getNeigboringWallParticles( int i, int j, int k, int w=1, int h=1, int d=1 );
-	std::vector<FluidParticle*> getNeigboringCellParticles( int i, int j, int k, int w=1, int h=1, int d=1 );
+	void update( const FluidParticles& particles );
+	//Permute the particles into the cell order of the last update.
+	void reorder( FluidParticles& particles );
+	//Call fn(n) for the index of particles in cells [i-w,i+w]x[j-h,j+h]x[k-d,k+d].
+	template<typename FunctorT> void forEachNeighbor(int i, int j, int k, int w, int h, int d, FunctorT& fn) const {
+		forEachInBox(i - w, j - h, k - d, i + w, j + h, k + d, fn);
+	}
+	//Call fn(n) for the index of particles in cells [i-w,i+w-1]x[j-h,j+h-1]x[k-d,k+d-1], the cells around a grid face.
+	template<typename FunctorT> void forEachWallNeighbor(int i, int j, int k, int w, int h, int d, FunctorT& fn) const {
+		forEachInBox(i - w, j - h, k - d, i + w - 1, j + h - 1, k + d - 1, fn);
+	}
 	float getLevelSetValue( int i, int j, int k, RegularGrid<float>& halfwall, float density );
 	const openvdb::Coord& getGridSize(){ return mGridSize; }
 	float getVoxelSize(){return mVoxelSize;}
 	int	 getParticleCount( int i, int j, int k );
 	void markAsWater(RegularGrid<char>& A, RegularGrid<float>& halfwall, float density );
+	//Set mask(i,j,k) for cells holding a fluid particle. The mask may be larger than the grid.
+	void markFluidCells(RegularGrid<char>& mask) const;
 	void deleteAllParticles();
 	
 protected:
+	static const int MIN_BLOCK_SIZE;
 	openvdb::Coord mGridSize;
 	float mVoxelSize;
-	RegularGrid<std::vector<FluidParticle*> > cells;
+	const FluidParticles* mParticles;
+	std::vector<int> mOrder;
+	std::vector<int> mCellStart;
+	std::vector<int> mParticleCell;
+	std::vector<int> mBlockOffsets;
+	inline size_t getCellIndex(int i, int j, int k) const {
+		return ((size_t) i * mGridSize[1] + j) * mGridSize[2] + k;
+	}
+	template<typename FunctorT> void forEachInBox(int i0, int j0, int k0, int i1, int j1, int k1, FunctorT& fn) const {
+		i0 = std::max(i0, 0);
+		j0 = std::max(j0, 0);
+		k0 = std::max(k0, 0);
+		i1 = std::min(i1, mGridSize[0] - 1);
+		j1 = std::min(j1, mGridSize[1] - 1);
+		k1 = std::min(k1, mGridSize[2] - 1);
+		if (k0 > k1)
+			return;
+		for (int si = i0; si <= i1; si++) {
+			for (int sj = j0; sj <= j1; sj++) {
+				size_t row = getCellIndex(si, sj, 0);
+				int end = mCellStart[row + k1 + 1];
+				for (int n = mCellStart[row + k0]; n < end; n++) {
+					fn(mOrder[n]);
+				}
+			}
+		}
+	}
 };
 }}
 #endif
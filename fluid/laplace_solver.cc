@@ -24,98 +24,30 @@
  *  Visualization and Computer Graphics, IEEE Transactions on, 18(8), 1202-1214.
  */
 #include "laplace_solver.h"
+#include "../MetricsLog.h"
 #include "fluid_common.h"
 #include "fluid_utility.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <ostream>
 using namespace openvdb;
 using namespace openvdb::tools;
 using namespace std;
 namespace imagesci {
 namespace fluid {
+const float DEFAULT_PRESSURE_TOLERANCE = 1E-3f;
+const int DEFAULT_PRESSURE_ITERATIONS = 1000;
 #define FOR_EVERY_COMP(N) for( int gn=0; gn<(N)*(N)*(N); gn++ ) { int i=(gn%((N)*(N)))%(N); int j=(gn%((N)*(N)))/(N); int k = gn/((N)*(N)); 
-// Clamped Fetch
-static float x_ref(RegularGrid<char>& A, RegularGrid<float>& L,
-		RegularGrid<float>& x, int fi, int fj, int fk, int i, int j, int k) {
-	i = clamp(i,0,(int)x.rows()-1);
-	j = clamp(j,0,(int)x.cols()-1);
-	k = clamp(k,0,(int)x.slices()-1);
-	if (A(i,j,k) == static_cast<char>(ObjectType::FLUID))
-		return x(i,j,k);
-	else if (A(i,j,k) == static_cast<char>(ObjectType::WALL))
-		return x(fi,fj,fk);
-	return L(i,j,k) / fmin(1.0e-6, L(fi,fj,fk)) * x(fi,fj,fk);
-}
-
-// Ans = Ax
-static void compute_Ax(RegularGrid<char>& A, RegularGrid<float>& L,
-		RegularGrid<float>& x, RegularGrid<float>& ans) {
-	float h2 = x.voxelSize()*x.voxelSize();
-	OPENMP_FOR FOR_EVERY_GRID_CELL(x)
-		{
-			if (A(i,j,k) == static_cast<char>(ObjectType::FLUID)) {
-				ans(i,j,k) = (6.0 * x(i,j,k)
-						- x_ref(A, L, x, i, j, k, i + 1, j, k)
-						- x_ref(A, L, x, i, j, k, i - 1, j, k)
-						- x_ref(A, L, x, i, j, k, i, j + 1, k)
-						- x_ref(A, L, x, i, j, k, i, j - 1, k)
-						- x_ref(A, L, x, i, j, k, i, j, k + 1)
-						- x_ref(A, L, x, i, j, k, i, j, k - 1)) / h2;
-			} else {
-				ans(i,j,k) = 0.0;
-			}
-		}END_FOR;
-}
-
-// ans = x^T * x
-static double product(RegularGrid<char>& A, RegularGrid<float>& x,
-		RegularGrid<float>& y) {
-	static double ans;
-	ans = 0.0;
-#ifdef MP
-#pragma omp parallel for reduction(+:ans)
-#endif
-	FOR_EVERY_GRID_CELL(A)
-		{
-			if (A(i,j,k) == static_cast<char>(ObjectType::FLUID))
-				ans += x(i,j,k) * y(i,j,k);
-		}END_FOR;
-	return ans;
-}
-
 static void flipDivergence(RegularGrid<float>& x) {
 	OPENMP_FOR FOR_EVERY_GRID_CELL(x){
 		x(i,j,k) = -x(i,j,k);
 	} END_FOR;
 }
 
-// x <= y
-static void copy(RegularGrid<float>& x, RegularGrid<float>& y) {
-	y.copyTo(x);
-}
-
-// Ans = x + a*y
-static void op(RegularGrid<char>& A, RegularGrid<float>& x,
-		RegularGrid<float>& y, RegularGrid<float>& ans, float a) {
-	RegularGrid<float> tmp(x.rows(),x.cols(),x.slices(),x.voxelSize());
-	OPENMP_FOR FOR_EVERY_GRID_CELL(x)
-		{
-			if (A(i,j,k) == static_cast<char>(ObjectType::FLUID))
-				tmp(i,j,k) = x(i,j,k) + a * y(i,j,k);
-			else
-				tmp(i,j,k) = 0.0;
-		}END_FOR;
-	copy(ans, tmp);
-}
-
-// r = b - Ax
-static void residual(RegularGrid<char>& A, RegularGrid<float>& L,
-		RegularGrid<float>& x, RegularGrid<float>& b, RegularGrid<float>& r) {
-	compute_Ax(A, L, x, r);
-	op(A, b, r, r, -1.0);
-}
-
 static inline float square(float a) {
 	return a * a;
 }
@@ -152,121 +84,757 @@ static float A_diag(RegularGrid<char>& A, RegularGrid<float>& L, int i, int j,
 	return diag;
 }
 
+/*
+ * Matrix-free form of the pressure operator over the fluid cells only. Cells are flat offsets into grids with the
+ * dimensions of A, in memory order, each with the offsets of its fluid neighbors (-1 for none) and the ghost fluid
+ * diagonal of A_diag. Products and updates visit only these cells and reduce in double precision.
+ */
+struct FluidCellSystem {
+	std::vector<int> mCells;
+	std::vector<int> mNeighbors;
+	std::vector<float> mDiag;
+	float mScale;
+	FluidCellSystem(RegularGrid<char>& A, RegularGrid<float>& L) :
+			mScale(1.0f / (L.voxelSize() * L.voxelSize())) {
+		const int nx = A.rows(), ny = A.cols(), nz = A.slices();
+		const int strideX = A.xStride(), strideY = A.yStride();
+		std::vector<int> offsets(nx + 1, 0);
+		OPENMP_FOR for (int i = 0; i < nx; i++) {
+			int count = 0;
+			for (int j = 0; j < ny; j++) {
+				for (int k = 0; k < nz; k++) {
+					if (A(i,j,k) == static_cast<char>(ObjectType::FLUID))
+						count++;
+				}
+			}
+			offsets[i + 1] = count;
+		}
+		for (int i = 0; i < nx; i++) {
+			offsets[i + 1] += offsets[i];
+		}
+		mCells.resize(offsets[nx]);
+		mNeighbors.resize(6 * mCells.size());
+		mDiag.resize(mCells.size());
+		OPENMP_FOR for (int i = 0; i < nx; i++) {
+			int n = offsets[i];
+			for (int j = 0; j < ny; j++) {
+				for (int k = 0; k < nz; k++) {
+					if (A(i,j,k) != static_cast<char>(ObjectType::FLUID))
+						continue;
+					int offset = i * strideX + j * strideY + k;
+					int q[][3] = { { i - 1, j, k }, { i + 1, j, k }, { i, j - 1, k }, { i, j + 1, k }, { i, j, k - 1 }, { i, j, k + 1 } };
+					for (int m = 0; m < 6; m++) {
+						bool fluid = (q[m][0] >= 0 && q[m][1] >= 0 && q[m][2] >= 0 && q[m][0] < nx && q[m][1] < ny && q[m][2] < nz
+								&& A(q[m][0], q[m][1], q[m][2]) == static_cast<char>(ObjectType::FLUID));
+						mNeighbors[6 * n + m] = fluid ? q[m][0] * strideX + q[m][1] * strideY + q[m][2] : -1;
+					}
+					mCells[n] = offset;
+					mDiag[n] = A_diag(A, L, i, j, k);
+					n++;
+				}
+			}
+		}
+	}
+	inline int size() const {
+		return mCells.size();
+	}
+	inline float multiply(const float* x, int n) const {
+		const int* nbr = &mNeighbors[6 * n];
+		float sum = mDiag[n] * x[mCells[n]];
+		for (int m = 0; m < 6; m++) {
+			if (nbr[m] >= 0)
+				sum -= x[nbr[m]];
+		}
+		return mScale * sum;
+	}
+	//r = b - Ax, returning r.r
+	double residual(const float* x, const float* b, float* r) const {
+		double sum = 0.0;
+		const int N = size();
+#ifdef MP
+#pragma omp parallel for reduction(+:sum)
+#endif
+		for (int n = 0; n < N; n++) {
+			int c = mCells[n];
+			r[c] = b[c] - multiply(x, n);
+			sum += (double) r[c] * r[c];
+		}
+		return sum;
+	}
+	//q = As, returning s.q
+	double multiply(const float* s, float* q) const {
+		double sum = 0.0;
+		const int N = size();
+#ifdef MP
+#pragma omp parallel for reduction(+:sum)
+#endif
+		for (int n = 0; n < N; n++) {
+			int c = mCells[n];
+			q[c] = multiply(s, n);
+			sum += (double) s[c] * q[c];
+		}
+		return sum;
+	}
+	//x += alpha*s and r -= alpha*q, returning r.r
+	double update(float* x, float* r, const float* s, const float* q, float alpha) const {
+		double sum = 0.0;
+		const int N = size();
+#ifdef MP
+#pragma omp parallel for reduction(+:sum)
+#endif
+		for (int n = 0; n < N; n++) {
+			int c = mCells[n];
+			x[c] += alpha * s[c];
+			r[c] -= alpha * q[c];
+			sum += (double) r[c] * r[c];
+		}
+		return sum;
+	}
+	double dot(const float* x, const float* y) const {
+		double sum = 0.0;
+		const int N = size();
+#ifdef MP
+#pragma omp parallel for reduction(+:sum)
+#endif
+		for (int n = 0; n < N; n++) {
+			int c = mCells[n];
+			sum += (double) x[c] * y[c];
+		}
+		return sum;
+	}
+	//s = z + beta*s
+	void direction(const float* z, float* s, float beta) const {
+		const int N = size();
+		OPENMP_FOR for (int n = 0; n < N; n++) {
+			int c = mCells[n];
+			s[c] = z[c] + beta * s[c];
+		}
+	}
+};
+//Value of P at a fluid cell, zero outside the fluid.
 template<class T>
-static float P_ref(RegularGrid<T>& P, int i, int j, int k) {
-	if (i < 0 || i > P.rows() - 1 || j < 0 || j > P.cols() - 1 || k < 0 || k > P.slices() - 1
-			|| P(i,j,k) != static_cast<char>(ObjectType::FLUID))
+static double P_ref(RegularGrid<char>& A, RegularGrid<T>& P, int i, int j, int k) {
+	if (i < 0 || i > A.rows() - 1 || j < 0 || j > A.cols() - 1 || k < 0 || k > A.slices() - 1
+			|| A(i,j,k) != static_cast<char>(ObjectType::FLUID))
 		return 0.0;
 	return P(i,j,k);
 }
-
+/*
+ * IC(0) factorization and triangular solves for one cell. Couplings to cells with an x index below i0 or at or above
+ * i1 are dropped, so a slab [i0,i1) can be factored and solved independently of its neighbors.
+ */
+static inline void factorCell(RegularGrid<double>& P, RegularGrid<float>& L,
+		RegularGrid<char>& A, int i, int j, int k, int i0) {
+	if (A(i,j,k) != static_cast<char>(ObjectType::FLUID))
+		return;
+	const double a = 0.25;
+	double left = (i > i0) ? A_ref(A, i - 1, j, k, i, j, k) * P_ref(A, P, i - 1, j, k) : 0.0;
+	double bottom = A_ref(A, i, j - 1, k, i, j, k) * P_ref(A, P, i, j - 1, k);
+	double back = A_ref(A, i, j, k - 1, i, j, k) * P_ref(A, P, i, j, k - 1);
+	double diag = A_diag(A, L, i, j, k);
+	double e = diag - square(left) - square(bottom) - square(back);
+	if (e < a * diag)
+		e = diag;
+	P(i,j,k) = 1.0 / sqrt(e);
+}
+static inline void forwardCell(RegularGrid<double>& q, RegularGrid<float>& r,
+		RegularGrid<double>& P, RegularGrid<char>& A, int i, int j, int k, int i0) {
+	if (A(i,j,k) != static_cast<char>(ObjectType::FLUID))
+		return;
+	double left = (i > i0) ? A_ref(A, i - 1, j, k, i, j, k) * P_ref(A, P, i - 1, j, k) * P_ref(A, q, i - 1, j, k) : 0.0;
+	double bottom = A_ref(A, i, j - 1, k, i, j, k) * P_ref(A, P, i, j - 1, k) * P_ref(A, q, i, j - 1, k);
+	double back = A_ref(A, i, j, k - 1, i, j, k) * P_ref(A, P, i, j, k - 1) * P_ref(A, q, i, j, k - 1);
+	double t = r(i,j,k) - left - bottom - back;
+	q(i,j,k) = t * P(i,j,k);
+}
+static inline void backwardCell(RegularGrid<float>& z, RegularGrid<double>& q,
+		RegularGrid<double>& P, RegularGrid<char>& A, int i, int j, int k, int i1) {
+	if (A(i,j,k) != static_cast<char>(ObjectType::FLUID))
+		return;
+	double right = (i + 1 < i1) ? A_ref(A, i, j, k, i + 1, j, k) * P(i,j,k) * P_ref(A, z, i + 1, j, k) : 0.0;
+	double top = A_ref(A, i, j, k, i, j + 1, k) * P(i,j,k) * P_ref(A, z, i, j + 1, k);
+	double front = A_ref(A, i, j, k, i, j, k + 1) * P(i,j,k) * P_ref(A, z, i, j, k + 1);
+	double t = q(i,j,k) - right - top - front;
+	z(i,j,k) = t * P(i,j,k);
+}
 static void buildPreconditioner(RegularGrid<double>& P, RegularGrid<float>& L,
-		RegularGrid<char>& A) {
-	double a = 0.25;
-	FOR_EVERY_GRID_CELL(A)
-		{
-			if (A(i,j,k) == static_cast<char>(ObjectType::FLUID)) {
-				double left = A_ref(A, i - 1, j, k, i, j, k)
-						* P_ref(P, i - 1, j, k);
-				double bottom = A_ref(A, i, j - 1, k, i, j, k)
-						* P_ref(P, i, j - 1, k);
-				double back = A_ref(A, i, j, k - 1, i, j, k)
-						* P_ref(P, i, j, k - 1);
-				double diag = A_diag(A, L, i, j, k);
-				double e = diag - square(left) - square(bottom) - square(back);
-				if (e < a * diag)
-					e = diag;
-				P(i,j,k) = 1.0 / sqrtf(e);
+		RegularGrid<char>& A, int i0, int i1) {
+	for (int i = i0; i < i1; i++) {
+		for (int j = 0; j < A.cols(); j++) {
+			for (int k = 0; k < A.slices(); k++) {
+				factorCell(P, L, A, i, j, k, i0);
 			}
-		}END_FOR;
+		}
+	}
 }
-
 static void applyPreconditioner(RegularGrid<float>& z, RegularGrid<float>& r,
-		RegularGrid<double>& P, RegularGrid<float>& L, RegularGrid<char>& A) {
-	RegularGrid<double> q(P.rows(),P.cols(),P.slices(),P.voxelSize(),0.0);
+		RegularGrid<double>& P, RegularGrid<double>& q, RegularGrid<char>& A, int i0, int i1) {
 	// Lq = r
-	FOR_EVERY_GRID_CELL(q){
-				if (A(i,j,k) == static_cast<char>(ObjectType::FLUID)) {
-					double left = A_ref(A, i - 1, j, k, i, j, k)
-							* P_ref(P, i - 1, j, k)
-							* P_ref(q, i - 1, j, k);
-					double bottom = A_ref(A, i, j - 1, k, i, j, k)
-							* P_ref(P, i, j - 1, k)
-							* P_ref(q, i, j - 1, k);
-					double back = A_ref(A, i, j, k - 1, i, j, k)
-							* P_ref(P, i, j, k - 1)
-							* P_ref(q, i, j, k - 1);
-					double t = r(i,j,k) - left - bottom - back;
-					q(i,j,k) = t * P(i,j,k);
-				}
-	}END_FOR;
-
+	for (int i = i0; i < i1; i++) {
+		for (int j = 0; j < A.cols(); j++) {
+			for (int k = 0; k < A.slices(); k++) {
+				forwardCell(q, r, P, A, i, j, k, i0);
+			}
+		}
+	}
 	// L^T z = q
-	for (int i = q.rows() - 1; i >= 0; i--) {
-		for (int j = q.cols() - 1; j >= 0; j--) {
-			for (int k = q.slices() - 1; k >= 0; k--) {
-				if (A(i,j,k) == static_cast<char>(ObjectType::FLUID)) {
-					double right = A_ref(A, i, j, k, i + 1, j, k)
-							* P_ref(P, i, j, k) * P_ref(z, i + 1, j, k);
-					double top = A_ref(A, i, j, k, i, j + 1, k)
-							* P_ref(P, i, j, k) * P_ref(z, i, j + 1, k);
-					double front = A_ref(A, i, j, k, i, j, k + 1)
-							* P_ref(P, i, j, k) * P_ref(z, i, j, k + 1);
-
-					double t = q(i,j,k) - right - top - front;
-					z(i,j,k) = t * P(i,j,k);
+	for (int i = i1 - 1; i >= i0; i--) {
+		for (int j = A.cols() - 1; j >= 0; j--) {
+			for (int k = A.slices() - 1; k >= 0; k--) {
+				backwardCell(z, q, P, A, i, j, k, i1);
+			}
+		}
+	}
+}
+struct IncompleteCholeskyPreconditioner {
+	RegularGrid<char>& mA;
+	RegularGrid<double> mP;
+	RegularGrid<double> mQ;
+	IncompleteCholeskyPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L) :
+			mA(A), mP(A.rows(), A.cols(), A.slices(), L.voxelSize()), mQ(A.rows(), A.cols(), A.slices(), L.voxelSize()) {
+		buildPreconditioner(mP, L, mA, 0, mA.rows());
+	}
+	inline void apply(RegularGrid<float>& z, RegularGrid<float>& r) {
+		applyPreconditioner(z, r, mP, mQ, mA, 0, mA.rows());
+	}
+};
+//IC(0) with the couplings between slabs of x dropped, one slab per thread.
+struct BlockJacobiPreconditioner {
+	RegularGrid<char>& mA;
+	RegularGrid<double> mP;
+	RegularGrid<double> mQ;
+	std::vector<int> mSlabs;
+	BlockJacobiPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L) :
+			mA(A), mP(A.rows(), A.cols(), A.slices(), L.voxelSize()), mQ(A.rows(), A.cols(), A.slices(), L.voxelSize()) {
+		int blocks = 1;
+#ifdef MP
+		blocks = std::max(1, std::min(omp_get_max_threads(), (int) A.rows()));
+#endif
+		for (int b = 0; b <= blocks; b++) {
+			mSlabs.push_back((int) (((long) A.rows() * b) / blocks));
+		}
+		OPENMP_FOR for (int b = 0; b < blocks; b++) {
+			buildPreconditioner(mP, L, mA, mSlabs[b], mSlabs[b + 1]);
+		}
+	}
+	inline void apply(RegularGrid<float>& z, RegularGrid<float>& r) {
+		int blocks = mSlabs.size() - 1;
+		OPENMP_FOR for (int b = 0; b < blocks; b++) {
+			applyPreconditioner(z, r, mP, mQ, mA, mSlabs[b], mSlabs[b + 1]);
+		}
+	}
+};
+//The IC(0) factorization and solves scheduled by wavefront. Cells on a plane i+j+k=s depend only on earlier planes,
+//so each plane runs in parallel and the result equals the lexicographic order.
+struct WavefrontPreconditioner {
+	RegularGrid<char>& mA;
+	RegularGrid<double> mP;
+	RegularGrid<double> mQ;
+	template<typename FunctorT> void forEachPlane(bool reverse, FunctorT& fn) {
+		const int nx = mA.rows(), ny = mA.cols(), nz = mA.slices();
+		const int planes = nx + ny + nz - 2;
+		for (int p = 0; p < planes; p++) {
+			int s = reverse ? planes - 1 - p : p;
+			int iMin = std::max(0, s - (ny - 1) - (nz - 1));
+			int iMax = std::min(nx - 1, s);
+			OPENMP_FOR for (int i = iMin; i <= iMax; i++) {
+				int jMin = std::max(0, s - i - (nz - 1));
+				int jMax = std::min(ny - 1, s - i);
+				for (int j = jMin; j <= jMax; j++) {
+					fn(i, j, s - i - j);
 				}
 			}
 		}
 	}
+	struct Factor {
+		RegularGrid<double>& mP;
+		RegularGrid<float>& mL;
+		RegularGrid<char>& mA;
+		Factor(RegularGrid<double>& P, RegularGrid<float>& L, RegularGrid<char>& A) :
+				mP(P), mL(L), mA(A) {
+		}
+		inline void operator()(int i, int j, int k) {
+			factorCell(mP, mL, mA, i, j, k, 0);
+		}
+	};
+	struct Forward {
+		RegularGrid<double>& mQ;
+		RegularGrid<float>& mR;
+		RegularGrid<double>& mP;
+		RegularGrid<char>& mA;
+		Forward(RegularGrid<double>& q, RegularGrid<float>& r, RegularGrid<double>& P, RegularGrid<char>& A) :
+				mQ(q), mR(r), mP(P), mA(A) {
+		}
+		inline void operator()(int i, int j, int k) {
+			forwardCell(mQ, mR, mP, mA, i, j, k, 0);
+		}
+	};
+	struct Backward {
+		RegularGrid<float>& mZ;
+		RegularGrid<double>& mQ;
+		RegularGrid<double>& mP;
+		RegularGrid<char>& mA;
+		Backward(RegularGrid<float>& z, RegularGrid<double>& q, RegularGrid<double>& P, RegularGrid<char>& A) :
+				mZ(z), mQ(q), mP(P), mA(A) {
+		}
+		inline void operator()(int i, int j, int k) {
+			backwardCell(mZ, mQ, mP, mA, i, j, k, mA.rows());
+		}
+	};
+	WavefrontPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L) :
+			mA(A), mP(A.rows(), A.cols(), A.slices(), L.voxelSize()), mQ(A.rows(), A.cols(), A.slices(), L.voxelSize()) {
+		Factor factor(mP, L, mA);
+		forEachPlane(false, factor);
+	}
+	inline void apply(RegularGrid<float>& z, RegularGrid<float>& r) {
+		Forward forward(mQ, r, mP, mA);
+		forEachPlane(false, forward);
+		Backward backward(z, mQ, mP, mA);
+		forEachPlane(true, backward);
+	}
+};
+/*
+ * MIC(0) in red-black order, where red cells have i+j+k even. Red cells couple only to black cells, so the factor is
+ * D+F with D diagonal and F the black-red couplings, and every sweep of M=(D+F)D^-1(D+F^T) is parallel within a color.
+ * The fill dropped between black cells that share a red neighbor is subtracted from the black diagonal (scaled by
+ * TAU), with the same safety fallback as IC(0). The black diagonal approaches zero as TAU approaches one in this
+ * order, so TAU is kept moderate.
+ */
+struct RedBlackPreconditioner {
+	static const double TAU;
+	static const double SIGMA;
+	RegularGrid<char>& mA;
+	RegularGrid<double> mD;
+	RegularGrid<double> mQ;
+	inline bool isFluid(int i, int j, int k) {
+		return (i >= 0 && j >= 0 && k >= 0 && i < mA.rows() && j < mA.cols() && k < mA.slices()
+				&& mA(i,j,k) == static_cast<char>(ObjectType::FLUID));
+	}
+	inline int fluidNeighbors(int i, int j, int k) {
+		return isFluid(i - 1, j, k) + isFluid(i + 1, j, k) + isFluid(i, j - 1, k) + isFluid(i, j + 1, k)
+				+ isFluid(i, j, k - 1) + isFluid(i, j, k + 1);
+	}
+	template<typename T> inline double neighborSum(RegularGrid<T>& x, int i, int j, int k) {
+		return P_ref(mA, x, i - 1, j, k) + P_ref(mA, x, i + 1, j, k) + P_ref(mA, x, i, j - 1, k)
+				+ P_ref(mA, x, i, j + 1, k) + P_ref(mA, x, i, j, k - 1) + P_ref(mA, x, i, j, k + 1);
+	}
+	RedBlackPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L) :
+			mA(A), mD(A.rows(), A.cols(), A.slices(), L.voxelSize()), mQ(A.rows(), A.cols(), A.slices(), L.voxelSize()) {
+		OPENMP_FOR FOR_EVERY_GRID_CELL(mA)
+			{
+				if (mA(i,j,k) == static_cast<char>(ObjectType::FLUID) && ((i + j + k) & 1) == 0)
+					mD(i,j,k) = A_diag(A, L, i, j, k);
+			}END_FOR;
+		OPENMP_FOR FOR_EVERY_GRID_CELL(mA)
+			{
+				if (mA(i,j,k) != static_cast<char>(ObjectType::FLUID) || ((i + j + k) & 1) == 0)
+					continue;
+				double diag = A_diag(A, L, i, j, k);
+				double e = diag;
+				int q[][3] = { { i - 1, j, k }, { i + 1, j, k }, { i, j - 1, k }, { i, j + 1, k }, { i, j, k - 1 }, { i, j, k + 1 } };
+				for (int m = 0; m < 6; m++) {
+					if (isFluid(q[m][0], q[m][1], q[m][2])) {
+						e -= (1.0 + TAU * (fluidNeighbors(q[m][0], q[m][1], q[m][2]) - 1)) / mD(q[m][0], q[m][1], q[m][2]);
+					}
+				}
+				if (e < SIGMA * diag)
+					e = diag;
+				mD(i,j,k) = e;
+			}END_FOR;
+	}
+	inline void apply(RegularGrid<float>& z, RegularGrid<float>& r) {
+		// (D+F)q = r
+		OPENMP_FOR FOR_EVERY_GRID_CELL(mA)
+			{
+				if (mA(i,j,k) == static_cast<char>(ObjectType::FLUID) && ((i + j + k) & 1) == 0)
+					mQ(i,j,k) = r(i,j,k) / mD(i,j,k);
+			}END_FOR;
+		OPENMP_FOR FOR_EVERY_GRID_CELL(mA)
+			{
+				if (mA(i,j,k) == static_cast<char>(ObjectType::FLUID) && ((i + j + k) & 1) == 1) {
+					mQ(i,j,k) = (r(i,j,k) + neighborSum(mQ, i, j, k)) / mD(i,j,k);
+					z(i,j,k) = mQ(i,j,k);
+				}
+			}END_FOR;
+		// (D+F^T)z = Dq
+		OPENMP_FOR FOR_EVERY_GRID_CELL(mA)
+			{
+				if (mA(i,j,k) == static_cast<char>(ObjectType::FLUID) && ((i + j + k) & 1) == 0)
+					z(i,j,k) = mQ(i,j,k) + neighborSum(z, i, j, k) / mD(i,j,k);
+			}END_FOR;
+	}
+};
+const double RedBlackPreconditioner::TAU = 0.5;
+const double RedBlackPreconditioner::SIGMA = 0.25;
+/*
+ * Geometric multigrid V-cycle for conjGrad. The finest level keeps the ghost fluid diagonal of A_diag and coarser
+ * levels are rediscretized with Dirichlet air cells, where a coarse cell is fluid if any of its children is.
+ * Red-black Gauss-Seidel sweeps run in reverse order after the coarse correction and restriction is the scaled
+ * transpose of trilinear prolongation, so the cycle is symmetric.
+ */
+class MultigridPreconditioner {
+protected:
+	struct Level {
+		RegularGrid<char> mLabel;
+		RegularGrid<float> mDiag;
+		RegularGrid<float> mX;
+		RegularGrid<float> mB;
+		RegularGrid<float> mR;
+		Level(const openvdb::Coord& dims, float voxelSize) :
+				mLabel(dims, voxelSize), mDiag(dims, voxelSize), mX(dims, voxelSize), mB(dims, voxelSize), mR(dims, voxelSize) {
+		}
+		inline bool isFluid(int i, int j, int k) {
+			return (i >= 0 && j >= 0 && k >= 0 && i < mLabel.rows() && j < mLabel.cols() && k < mLabel.slices()
+					&& mLabel(i, j, k) == static_cast<char>(ObjectType::FLUID));
+		}
+		inline float neighborSum(RegularGrid<float>& x, int i, int j, int k) {
+			float sum = 0.0f;
+			if (isFluid(i - 1, j, k)) sum += x(i - 1, j, k);
+			if (isFluid(i + 1, j, k)) sum += x(i + 1, j, k);
+			if (isFluid(i, j - 1, k)) sum += x(i, j - 1, k);
+			if (isFluid(i, j + 1, k)) sum += x(i, j + 1, k);
+			if (isFluid(i, j, k - 1)) sum += x(i, j, k - 1);
+			if (isFluid(i, j, k + 1)) sum += x(i, j, k + 1);
+			return sum;
+		}
+	};
+	static const int MIN_COARSE_SIZE;
+	static const int SMOOTH_SWEEPS;
+	static const int COARSE_SWEEPS;
+	static const float PROLONGATION_WEIGHTS[4];
+	std::vector<std::unique_ptr<Level> > mLevels;
+	void smooth(Level& level, int color);
+	void restrictResidual(Level& fine, Level& coarse);
+	void prolongateCorrection(Level& coarse, Level& fine);
+	void cycle(size_t l);
+public:
+	MultigridPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L);
+	void apply(RegularGrid<float>& z, RegularGrid<float>& r);
+	inline size_t getNumLevels() const {
+		return mLevels.size();
+	}
+};
+const int MultigridPreconditioner::MIN_COARSE_SIZE = 4;
+const int MultigridPreconditioner::SMOOTH_SWEEPS = 2;
+const int MultigridPreconditioner::COARSE_SWEEPS = 16;
+//Weights of coarse cell I on fine cells 2I-1..2I+2.
+const float MultigridPreconditioner::PROLONGATION_WEIGHTS[4] = { 0.25f, 0.75f, 0.75f, 0.25f };
+MultigridPreconditioner::MultigridPreconditioner(RegularGrid<char>& A, RegularGrid<float>& L) {
+	openvdb::Coord dims(A.rows(), A.cols(), A.slices());
+	float voxelSize = L.voxelSize();
+	Level* level = new Level(dims, voxelSize);
+	mLevels.push_back(std::unique_ptr<Level>(level));
+	A.copyTo(level->mLabel);
+	OPENMP_FOR FOR_EVERY_GRID_CELL(A)
+		{
+			level->mDiag(i, j, k) = A_diag(A, L, i, j, k);
+		}END_FOR;
+	while (std::min(dims[0], std::min(dims[1], dims[2])) > MIN_COARSE_SIZE) {
+		Level& fine = *level;
+		dims = openvdb::Coord((dims[0] + 1) / 2, (dims[1] + 1) / 2, (dims[2] + 1) / 2);
+		voxelSize *= 2.0f;
+		level = new Level(dims, voxelSize);
+		mLevels.push_back(std::unique_ptr<Level>(level));
+		OPENMP_FOR FOR_EVERY_GRID_CELL(level->mLabel)
+			{
+				char label = static_cast<char>(ObjectType::AIR);
+				for (int n = 0; n < 8; n++) {
+					int fi = 2 * i + (n & 1), fj = 2 * j + ((n >> 1) & 1), fk = 2 * k + (n >> 2);
+					if (fi >= fine.mLabel.rows() || fj >= fine.mLabel.cols() || fk >= fine.mLabel.slices())
+						continue;
+					char child = fine.mLabel(fi, fj, fk);
+					if (child == static_cast<char>(ObjectType::FLUID)) {
+						label = child;
+						break;
+					} else if (child == static_cast<char>(ObjectType::WALL)) {
+						label = child;
+					}
+				}
+				level->mLabel(i, j, k) = label;
+			}END_FOR;
+		Level& coarse = *level;
+		OPENMP_FOR FOR_EVERY_GRID_CELL(coarse.mDiag)
+			{
+				float diag = 6.0f;
+				int q[][3] = { { i - 1, j, k }, { i + 1, j, k }, { i, j - 1, k }, { i, j + 1, k }, { i, j, k - 1 }, { i, j, k + 1 } };
+				for (int m = 0; m < 6; m++) {
+					if (q[m][0] < 0 || q[m][1] < 0 || q[m][2] < 0 || q[m][0] >= coarse.mLabel.rows()
+							|| q[m][1] >= coarse.mLabel.cols() || q[m][2] >= coarse.mLabel.slices()
+							|| coarse.mLabel(q[m][0], q[m][1], q[m][2]) == static_cast<char>(ObjectType::WALL))
+						diag -= 1.0f;
+				}
+				coarse.mDiag(i, j, k) = diag;
+			}END_FOR;
+	}
+}
+void MultigridPreconditioner::smooth(Level& level, int color) {
+	OPENMP_FOR FOR_EVERY_GRID_CELL(level.mX)
+		{
+			if (((i + j + k) & 1) != color || level.mLabel(i, j, k) != static_cast<char>(ObjectType::FLUID)
+					|| level.mDiag(i, j, k) <= 0.0f)
+				continue;
+			level.mX(i, j, k) = (level.mB(i, j, k) + level.neighborSum(level.mX, i, j, k)) / level.mDiag(i, j, k);
+		}END_FOR;
+}
+void MultigridPreconditioner::restrictResidual(Level& fine, Level& coarse) {
+	OPENMP_FOR FOR_EVERY_GRID_CELL(fine.mR)
+		{
+			if (fine.mLabel(i, j, k) == static_cast<char>(ObjectType::FLUID)) {
+				fine.mR(i, j, k) = fine.mB(i, j, k) - fine.mDiag(i, j, k) * fine.mX(i, j, k)
+						+ fine.neighborSum(fine.mX, i, j, k);
+			} else {
+				fine.mR(i, j, k) = 0.0f;
+			}
+		}END_FOR;
+	//The coarse operator is unscaled like the fine one, so the averaged residual is scaled by (2h/h)^2/8=0.5.
+	OPENMP_FOR FOR_EVERY_GRID_CELL(coarse.mB)
+		{
+			coarse.mX(i, j, k) = 0.0f;
+			if (coarse.mLabel(i, j, k) != static_cast<char>(ObjectType::FLUID)) {
+				coarse.mB(i, j, k) = 0.0f;
+				continue;
+			}
+			float sum = 0.0f;
+			for (int a = 0; a < 4; a++) {
+				int fi = 2 * i - 1 + a;
+				if (fi < 0 || fi >= fine.mR.rows())
+					continue;
+				for (int b = 0; b < 4; b++) {
+					int fj = 2 * j - 1 + b;
+					if (fj < 0 || fj >= fine.mR.cols())
+						continue;
+					for (int c = 0; c < 4; c++) {
+						int fk = 2 * k - 1 + c;
+						if (fk < 0 || fk >= fine.mR.slices())
+							continue;
+						sum += PROLONGATION_WEIGHTS[a] * PROLONGATION_WEIGHTS[b] * PROLONGATION_WEIGHTS[c] * fine.mR(fi, fj, fk);
+					}
+				}
+			}
+			coarse.mB(i, j, k) = 0.5f * sum;
+		}END_FOR;
+}
+void MultigridPreconditioner::prolongateCorrection(Level& coarse, Level& fine) {
+	OPENMP_FOR FOR_EVERY_GRID_CELL(fine.mX)
+		{
+			if (fine.mLabel(i, j, k) != static_cast<char>(ObjectType::FLUID))
+				continue;
+			int ci[2] = { i >> 1, (i >> 1) + ((i & 1) ? 1 : -1) };
+			int cj[2] = { j >> 1, (j >> 1) + ((j & 1) ? 1 : -1) };
+			int ck[2] = { k >> 1, (k >> 1) + ((k & 1) ? 1 : -1) };
+			const float w[2] = { 0.75f, 0.25f };
+			float sum = 0.0f;
+			for (int a = 0; a < 2; a++) {
+				for (int b = 0; b < 2; b++) {
+					for (int c = 0; c < 2; c++) {
+						if (coarse.isFluid(ci[a], cj[b], ck[c]))
+							sum += w[a] * w[b] * w[c] * coarse.mX(ci[a], cj[b], ck[c]);
+					}
+				}
+			}
+			fine.mX(i, j, k) += sum;
+		}END_FOR;
+}
+void MultigridPreconditioner::cycle(size_t l) {
+	Level& level = *mLevels[l];
+	int sweeps = (l + 1 == mLevels.size()) ? COARSE_SWEEPS : SMOOTH_SWEEPS;
+	for (int s = 0; s < sweeps; s++) {
+		smooth(level, 0);
+		smooth(level, 1);
+	}
+	if (l + 1 < mLevels.size()) {
+		restrictResidual(level, *mLevels[l + 1]);
+		cycle(l + 1);
+		prolongateCorrection(*mLevels[l + 1], level);
+	}
+	for (int s = 0; s < sweeps; s++) {
+		smooth(level, 1);
+		smooth(level, 0);
+	}
+}
+void MultigridPreconditioner::apply(RegularGrid<float>& z, RegularGrid<float>& r) {
+	Level& fine = *mLevels[0];
+	OPENMP_FOR FOR_EVERY_GRID_CELL(fine.mB)
+		{
+			bool fluid = (fine.mLabel(i, j, k) == static_cast<char>(ObjectType::FLUID));
+			fine.mB(i, j, k) = fluid ? r(i, j, k) : 0.0f;
+			fine.mX(i, j, k) = 0.0f;
+		}END_FOR;
+	cycle(0);
+	fine.mX.copyTo(z);
 }
-
 // Conjugate Gradient Method
-static void conjGrad(RegularGrid<char>& A, RegularGrid<double>& P,
-		RegularGrid<float>& L, RegularGrid<float>& x, RegularGrid<float>& b) {
+template<class PreconditionerT> static int conjGrad(RegularGrid<char>& A, PreconditionerT& M,
+		RegularGrid<float>& L, RegularGrid<float>& x, RegularGrid<float>& b, float tolerance, int maxIterations,
+		double divergenceFloor) {
+	FluidCellSystem system(A, L);
+	double b2 = system.dot(b.data(), b.data());
+	//A divergence at the rounding error of the velocity has the zero solution, and a tolerance relative to it is
+	//never reached.
+	if (b2 <= divergenceFloor) {
+		x.fill(0.0f);
+		MetricsLog::set("PressureInitialResidual", std::sqrt(b2));
+		MetricsLog::set("PressureIterations", 0);
+		MetricsLog::set("PressureResidual", std::sqrt(b2));
+		return 0;
+	}
 	// Pre-allocate Memory
 	openvdb::Coord dims(x.rows(),x.cols(),x.slices());
 	RegularGrid<float> r(dims,x.voxelSize(),0.0);
 	RegularGrid<float> z(dims,x.voxelSize(),0.0);
 	RegularGrid<float> s(dims,x.voxelSize(),0.0);
-	compute_Ax(A, L, x, z);                // z = applyA(x)
-	op(A, b, z, r, -1.0);                  // r = b-Ax
-	double error2_0 = product(A, r, r);    // error2_0 = r . r
-	applyPreconditioner(z, r, P, L, A);		// Apply Conditioner z = f(r)
-	copy(s, z);								// s = z
-	int V=dims[0]*dims[1]*dims[2];
-	double eps = 1.0e-2 * (V);
-	double a = product(A, z, r);			// a = z . r
-	for (int k = 0; k < V; k++) {
-		compute_Ax(A, L, s, z);			// z = applyA(s)
-		double alpha = a / product(A, z, s);	// alpha = a/(z . s)
-		op(A, x, s, x, alpha);				// x = x + alpha*s
-		op(A, r, z, r, -alpha);			// r = r - alpha*z;
-		float error2 = product(A, r, r);	// error2 = r . r
-		error2_0 = fmax(error2_0, error2);
-		//std::cout<<"ERROR "<<error2<<" "<<error2_0<<std::endl;
-		// Dump Progress
-		double rate = 1.0
-				- max(0.0, min(1.0, (error2 - eps) / (error2_0 - eps)));
-		//std::cout<<"Laplace iteration "<<(k + 1)<<" ["<<100.0f * powf(rate, 6)<<"%]"<<std::endl;
-		if (error2 <= eps)
-			break;
-		applyPreconditioner(z, r, P, L, A);	// Apply Conditioner z = f(r)
-		double a2 = product(A, z, r);		// a2 = z . r
-		double beta = a2 / a;                     // beta = a2 / a
-		op(A, z, s, s, beta);				// s = z + beta*s
-		a = a2;
+	RegularGrid<float> q(dims,x.voxelSize(),0.0);
+	float* X = x.data();
+	float* R = r.data();
+	float* Z = z.data();
+	float* S = s.data();
+	float* Q = q.data();
+	double eps = square(tolerance) * b2;	// eps = (tolerance*|b|)^2
+	double error2 = system.residual(X, b.data(), R);	// r = b-Ax, error2 = r . r
+	MetricsLog::set("PressureInitialResidual", std::sqrt(error2));
+	int k = 0;
+	if (error2 > eps) {
+		M.apply(z, r);						// Apply Conditioner z = f(r)
+		system.direction(Z, S, 0.0f);		// s = z
+		double a = system.dot(Z, R);		// a = z . r
+		while (k < maxIterations) {
+			double alpha = a / system.multiply(S, Q);	// q = applyA(s), alpha = a/(q . s)
+			error2 = system.update(X, R, S, Q, alpha);	// x = x + alpha*s, r = r - alpha*q, error2 = r . r
+			k++;
+			if (error2 <= eps || k >= maxIterations)
+				break;
+			M.apply(z, r);					// Apply Conditioner z = f(r)
+			double a2 = system.dot(Z, R);	// a2 = z . r
+			double beta = a2 / a;                     // beta = a2 / a
+			system.direction(Z, S, beta);	// s = z + beta*s
+			a = a2;
+		}
 	}
+	//Pressure outside the fluid is read as zero by the gradient update, and the next solve starts from it.
+	OPENMP_FOR FOR_EVERY_GRID_CELL(A)
+		{
+			if (A(i,j,k) != static_cast<char>(ObjectType::FLUID))
+				x(i,j,k) = 0.0f;
+		}END_FOR;
+	MetricsLog::set("PressureIterations", k);
+	MetricsLog::set("PressureResidual", std::sqrt(error2));
+	return k;
 }
 
 
-void laplace_solve(RegularGrid<char>& A, RegularGrid<float>& L,
-		RegularGrid<float>& x, RegularGrid<float>& b) {
-	RegularGrid<double> P(x.rows(),x.cols(),x.slices(),x.voxelSize());
+PressurePreconditioner DecodePressurePreconditioner(const std::string& name) {
+	if (name == "multigrid") {
+		return PRECONDITIONER_MULTIGRID;
+	} else if (name == "red_black") {
+		return PRECONDITIONER_RED_BLACK_MIC;
+	} else if (name == "block_jacobi") {
+		return PRECONDITIONER_BLOCK_JACOBI;
+	} else if (name == "wavefront") {
+		return PRECONDITIONER_WAVEFRONT;
+	}
+	return PRECONDITIONER_IC0;
+}
+std::string EncodePressurePreconditioner(PressurePreconditioner preconditioner) {
+	switch (preconditioner) {
+	case PRECONDITIONER_MULTIGRID:
+		return "multigrid";
+	case PRECONDITIONER_RED_BLACK_MIC:
+		return "red_black";
+	case PRECONDITIONER_BLOCK_JACOBI:
+		return "block_jacobi";
+	case PRECONDITIONER_WAVEFRONT:
+		return "wavefront";
+	default:
+		return "ic";
+	}
+}
+int laplace_solve(RegularGrid<char>& A, RegularGrid<float>& L,
+		RegularGrid<float>& x, RegularGrid<float>& b, PressurePreconditioner preconditioner, float tolerance,
+		int maxIterations, double divergenceFloor) {
+	MetricsTimer timer("PressureSolve");
 	// Flip Divergence
 	flipDivergence(b);
-	buildPreconditioner(P, L, A);
-	conjGrad(A, P, L, x, b);
+	switch (preconditioner) {
+	case PRECONDITIONER_MULTIGRID: {
+		MultigridPreconditioner M(A, L);
+		MetricsLog::set("MultigridLevels", M.getNumLevels());
+		return conjGrad(A, M, L, x, b, tolerance, maxIterations, divergenceFloor);
+	}
+	case PRECONDITIONER_RED_BLACK_MIC: {
+		RedBlackPreconditioner M(A, L);
+		return conjGrad(A, M, L, x, b, tolerance, maxIterations, divergenceFloor);
+	}
+	case PRECONDITIONER_BLOCK_JACOBI: {
+		BlockJacobiPreconditioner M(A, L);
+		return conjGrad(A, M, L, x, b, tolerance, maxIterations, divergenceFloor);
+	}
+	case PRECONDITIONER_WAVEFRONT: {
+		WavefrontPreconditioner M(A, L);
+		return conjGrad(A, M, L, x, b, tolerance, maxIterations, divergenceFloor);
+	}
+	default: {
+		IncompleteCholeskyPreconditioner M(A, L);
+		return conjGrad(A, M, L, x, b, tolerance, maxIterations, divergenceFloor);
+	}
+	}
+}
+void laplace_benchmark(int dim, std::ostream& ostr) {
+	//Tank filled to 60% with a wavy surface and the walls one cell thick.
+	RegularGrid<char> A(dim, dim, dim, 1.0f / dim);
+	RegularGrid<float> L(dim, dim, dim, 1.0f / dim);
+	RegularGrid<float> b(dim, dim, dim, 1.0f / dim);
+	FOR_EVERY_GRID_CELL(A)
+		{
+			float level = (j - 0.6f * dim) + 0.03f * dim * sin(0.3f * i) * cos(0.2f * k);
+			if (i == 0 || j == 0 || k == 0 || i == dim - 1 || j == dim - 1 || k == dim - 1) {
+				A(i,j,k) = static_cast<char>(ObjectType::WALL);
+			} else {
+				A(i,j,k) = static_cast<char>((level < 0) ? ObjectType::FLUID : ObjectType::AIR);
+			}
+			L(i,j,k) = level;
+			b(i,j,k) = dim * sin(0.37f * i + 0.11f * j * k);
+		}END_FOR;
+	std::vector<int> threads(1, 1);
+#ifdef MP
+	const int maxThreads = omp_get_max_threads();
+	for (int t = 2; t < maxThreads; t *= 2) {
+		threads.push_back(t);
+	}
+	if (maxThreads > 1)
+		threads.push_back(maxThreads);
+#endif
+	const PressurePreconditioner preconditioners[] = { PRECONDITIONER_IC0, PRECONDITIONER_WAVEFRONT,
+			PRECONDITIONER_BLOCK_JACOBI, PRECONDITIONER_RED_BLACK_MIC, PRECONDITIONER_MULTIGRID };
+	ostr << "Pressure solve " << dim << "^3" << std::endl;
+	ostr << "preconditioner threads iterations seconds speedup warm_iterations" << std::endl;
+	for (PressurePreconditioner preconditioner : preconditioners) {
+		double serial = 0.0;
+		for (int t : threads) {
+#ifdef MP
+			omp_set_num_threads(t);
+#endif
+			RegularGrid<float> x(dim, dim, dim, 1.0f / dim, 0.0f);
+			RegularGrid<float> rhs(dim, dim, dim, 1.0f / dim);
+			b.copyTo(rhs);
+			std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+			int iterations = laplace_solve(A, L, x, rhs, preconditioner);
+			std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+			double seconds = 1E-6 * std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+			if (t == 1)
+				serial = seconds;
+			//Warm start from the solution, as the fluid does from the previous step.
+			FOR_EVERY_GRID_CELL(rhs)
+				{
+					rhs(i,j,k) = 1.05f * b(i,j,k);
+				}END_FOR;
+			int warmIterations = laplace_solve(A, L, x, rhs, preconditioner);
+			ostr << EncodePressurePreconditioner(preconditioner) << " " << t << " " << iterations << " " << seconds
+					<< " " << serial / std::max(1E-9, seconds) << " " << warmIterations << std::endl;
+		}
+	}
+#ifdef MP
+	omp_set_num_threads(threads.back());
+#endif
 }
 }
 }
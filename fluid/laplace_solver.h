@@ -23,10 +23,35 @@
  *  Ando, R., Thurey, N., & Tsuruno, R. (2012). Preserving fluid sheets with adaptively sampled anisotropic particles.
  *  Visualization and Computer Graphics, IEEE Transactions on, 18(8), 1202-1214.
  */
+#ifndef _LAPLACE_SOLVER_H
+#define _LAPLACE_SOLVER_H
 #include "fluid_common.h"
 #include "../ImageSciUtil.h"
+#include <ostream>
+#include <string>
 namespace imagesci {
 namespace fluid {
-	void laplace_solve(RegularGrid<char>& A, RegularGrid<float>& L, RegularGrid<float>& x, RegularGrid<float>& b );
+	enum PressurePreconditioner {
+		PRECONDITIONER_IC0 = 0,
+		PRECONDITIONER_MULTIGRID = 1,
+		PRECONDITIONER_RED_BLACK_MIC = 2,
+		PRECONDITIONER_BLOCK_JACOBI = 3,
+		PRECONDITIONER_WAVEFRONT = 4
+	};
+	PressurePreconditioner DecodePressurePreconditioner(const std::string& name);
+	std::string EncodePressurePreconditioner(PressurePreconditioner preconditioner);
+	//Stop when the residual falls below this fraction of the norm of the divergence.
+	extern const float DEFAULT_PRESSURE_TOLERANCE;
+	extern const int DEFAULT_PRESSURE_ITERATIONS;
+	//Solve starting from x, which is read at fluid cells and zero elsewhere on return. Returns the number of CG iterations.
+	//A divergence whose squared norm is at most divergenceFloor is rounding error of the velocity, x is zeroed without
+	//iterating.
+	int laplace_solve(RegularGrid<char>& A, RegularGrid<float>& L, RegularGrid<float>& x, RegularGrid<float>& b,
+			PressurePreconditioner preconditioner = PRECONDITIONER_IC0, float tolerance = DEFAULT_PRESSURE_TOLERANCE,
+			int maxIterations = DEFAULT_PRESSURE_ITERATIONS, double divergenceFloor = 0.0);
+	//Solve a synthetic tank with every preconditioner and thread count, writing iterations, time and speedup,
+	//then the iterations to re-solve from that solution after a small change in the divergence.
+	void laplace_benchmark(int dim, std::ostream& ostr);
 }
 }
+#endif
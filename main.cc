@@ -58,6 +58,9 @@
 #include "ArmadilloTwist.h"
 #include "SplashSimulation.h"
 #include "DamBreakSimulation.h"
+#include "fluid/laplace_solver.h"
+#include "StreamedFieldSimulation.h"
+#include "MetricsLog.h"
 #include <iostream>
 using namespace openvdb;
 using namespace imagesci;
@@ -75,14 +78,135 @@ int main(int argc, char *argv[]) {
 	const int WIN_HEIGHT=720;
 	try {
 		openvdb::initialize();
+		bool frameStore=false;
+		StashPolicy stashPolicy=STASH_SYNCHRONOUS;
+		int stashDecimation=1;
+		size_t prefetchFrames=0;
+		int deltaFrames=0;
+		bool vdbSequence=false;
+		bool vdbHalf=true;
+		std::string checkpointFile,restoreFile;
+		int checkpointInterval=0;
+		fluid::PressurePreconditioner pressurePreconditioner=fluid::PRECONDITIONER_IC0;
+		float pressureTolerance=fluid::DEFAULT_PRESSURE_TOLERANCE;
+		int pressureIterations=fluid::DEFAULT_PRESSURE_ITERATIONS;
+		bool pressureWarmStart=true;
+		bool adaptiveDensity=false;
+		int springlReorderInterval=0;
+		bool geometryCache=false;
 		for(int i=0;i<args.size();i++){
-			if( args[i]== "-compare") {
+			if( args[i]== "-frame_store") {
+				frameStore=true;
+			} else if( args[i]== "-delta_frames") {
+				frameStore=true;
+				if(i+1<args.size()){
+					deltaFrames=std::max(0,atoi(args[++i].c_str()));
+				}
+			} else if( args[i]== "-vdb_sequence") {
+				vdbSequence=true;
+				if(i+1<args.size()){
+					vdbHalf=(args[++i]!="float");
+				}
+			} else if( args[i]== "-checkpoint") {
+				if(i+2<args.size()){
+					checkpointFile=args[++i];
+					checkpointInterval=std::max(0,atoi(args[++i].c_str()));
+				}
+			} else if( args[i]== "-restore") {
+				if(i+1<args.size()){
+					restoreFile=args[++i];
+				}
+			} else if( args[i]== "-bootstrap_cache") {
+				if(i+1<args.size()){
+					SpringLevelSet::setBootstrapCacheDirectory(args[++i]);
+				}
+			} else if( args[i]== "-metrics") {
+				if(i+2<args.size()){
+					std::string file=args[++i];
+					std::string level=args[++i];
+					MetricsVerbosity verbosity=METRICS_FRAME;
+					if(level=="off"){
+						verbosity=METRICS_OFF;
+					} else if(level=="verbose"){
+						verbosity=METRICS_VERBOSE;
+					}
+					MetricsLog::getInstance().open(file,verbosity);
+				}
+			} else if( args[i]== "-adaptive_density") {
+				adaptiveDensity=true;
+			} else if( args[i]== "-springl_reorder") {
+				if(i+1<args.size()){
+					springlReorderInterval=std::max(0,atoi(args[++i].c_str()));
+				}
+			} else if( args[i]== "-geometry_cache") {
+				geometryCache=true;
+			} else if( args[i]== "-pressure") {
+				if(i+1<args.size()){
+					pressurePreconditioner=fluid::DecodePressurePreconditioner(args[++i]);
+				}
+			} else if( args[i]== "-pressure_tolerance") {
+				if(i+2<args.size()){
+					pressureTolerance=std::max(0.0,atof(args[++i].c_str()));
+					pressureIterations=std::max(1,atoi(args[++i].c_str()));
+				}
+			} else if( args[i]== "-pressure_cold") {
+				pressureWarmStart=false;
+			} else if( args[i]== "-prefetch") {
+				if(i+1<args.size()){
+					prefetchFrames=std::max(0,atoi(args[++i].c_str()));
+				}
+			} else if( args[i]== "-async_stash") {
+				if(i+1<args.size()){
+					std::string policy=args[++i];
+					if(policy=="block"){
+						stashPolicy=STASH_BLOCK;
+					} else if(policy=="drop"){
+						stashPolicy=STASH_DROP;
+					} else {
+						stashPolicy=STASH_DECIMATE;
+						stashDecimation=std::max(1,atoi(policy.c_str()));
+					}
+				}
+			} else if( args[i]== "-pressure_benchmark") {
+				int dim=64;
+				if(i+1<args.size()){
+					dim=std::max(8,atoi(args[++i].c_str()));
+				}
+				fluid::laplace_benchmark(dim,std::cout);
+				status=EXIT_SUCCESS;
+			} else if( args[i]== "-verify_restore") {
+				if(i+1<args.size()){
+					std::string checkpoint=args[++i];
+					int steps=20;
+					int dim=64;
+					if(i+1<args.size()){
+						steps=std::max(2,atoi(args[++i].c_str()));
+						if(i+1<args.size()){
+							dim=std::max(8,atoi(args[++i].c_str()));
+						}
+					}
+					EnrightSimulation straight(dim,MotionScheme::SEMI_IMPLICIT);
+					EnrightSimulation resumed(dim,MotionScheme::SEMI_IMPLICIT);
+					straight.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+					straight.getSource().setReorderInterval(springlReorderInterval);
+					resumed.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+					resumed.getSource().setReorderInterval(springlReorderInterval);
+					if(Simulation::VerifyRestore(straight,resumed,steps,checkpoint,std::cout)){
+						status=EXIT_SUCCESS;
+					} else {
+						cout<<"Restored run differs from the straight run."<<endl;
+						return EXIT_FAILURE;
+					}
+				}
+			} else if( args[i]== "-compare") {
 				if(i+3<args.size()){
 					std::string dirName1=std::string(args[++i]);
 					std::string dirName2=std::string(args[++i]);
 					std::string outputDir=std::string(args[++i]);
 					SimulationPlayback sim1(dirName1);
 					SimulationPlayback sim2(dirName2);
+					sim1.setPrefetch(prefetchFrames);
+					sim2.setPrefetch(prefetchFrames);
 					SimulationComparisonVisualizer::run(&sim1,&sim2,WIN_WIDTH,WIN_HEIGHT,outputDir);
 					status=EXIT_SUCCESS;
 				}
@@ -90,6 +214,7 @@ int main(int argc, char *argv[]) {
 				if(i+1<args.size()){
 					std::string dirName=std::string(args[++i]);
 					SimulationPlayback sim(dirName);
+					sim.setPrefetch(prefetchFrames);
 					SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
 					status=EXIT_SUCCESS;
 				}
@@ -105,6 +230,15 @@ int main(int argc, char *argv[]) {
 						break;
 					}
 					EnrightSimulation sim(dim,scheme);
+					sim.setFrameStoreEnabled(frameStore);
+					sim.setDeltaFrames(deltaFrames);
+					sim.setVdbSequenceEnabled(vdbSequence,vdbHalf);
+					sim.setCheckpointPolicy(checkpointFile,checkpointInterval);
+					sim.setRestoreFile(restoreFile);
+					sim.setStashPolicy(stashPolicy,4,stashDecimation);
+					sim.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+					sim.getSource().setReorderInterval(springlReorderInterval);
+					sim.getSource().setGeometryCacheEnabled(geometryCache);
 					SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
 					status=EXIT_SUCCESS;
 				}
@@ -124,6 +258,18 @@ int main(int argc, char *argv[]) {
 						break;
 					}
 					SplashSimulation sim(sourceFileName,dim,scheme);
+					sim.setFrameStoreEnabled(frameStore);
+					sim.setDeltaFrames(deltaFrames);
+					sim.setVdbSequenceEnabled(vdbSequence,vdbHalf);
+					sim.setCheckpointPolicy(checkpointFile,checkpointInterval);
+					sim.setRestoreFile(restoreFile);
+					sim.setStashPolicy(stashPolicy,4,stashDecimation);
+					sim.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+					sim.getSource().setReorderInterval(springlReorderInterval);
+					sim.getSource().setGeometryCacheEnabled(geometryCache);
+					sim.setPressurePreconditioner(pressurePreconditioner);
+					sim.setPressureTolerance(pressureTolerance,pressureIterations);
+					sim.setWarmStartPressure(pressureWarmStart);
 					SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
 					status=EXIT_SUCCESS;
 				}
@@ -143,6 +289,18 @@ int main(int argc, char *argv[]) {
 						break;
 					}
 					DamBreakSimulation sim(sourceFileName,dim,scheme);
+					sim.setFrameStoreEnabled(frameStore);
+					sim.setDeltaFrames(deltaFrames);
+					sim.setVdbSequenceEnabled(vdbSequence,vdbHalf);
+					sim.setCheckpointPolicy(checkpointFile,checkpointInterval);
+					sim.setRestoreFile(restoreFile);
+					sim.setStashPolicy(stashPolicy,4,stashDecimation);
+					sim.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+					sim.getSource().setReorderInterval(springlReorderInterval);
+					sim.getSource().setGeometryCacheEnabled(geometryCache);
+					sim.setPressurePreconditioner(pressurePreconditioner);
+					sim.setPressureTolerance(pressureTolerance,pressureIterations);
+					sim.setWarmStartPressure(pressureWarmStart);
 					SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
 					status=EXIT_SUCCESS;
 				}
@@ -161,6 +319,43 @@ int main(int argc, char *argv[]) {
 					break;
 				}
 				ArmadilloTwist sim(sourceFileName,cycles,scheme);
+				sim.setFrameStoreEnabled(frameStore);
+				sim.setDeltaFrames(deltaFrames);
+				sim.setVdbSequenceEnabled(vdbSequence,vdbHalf);
+				sim.setCheckpointPolicy(checkpointFile,checkpointInterval);
+				sim.setRestoreFile(restoreFile);
+				sim.setStashPolicy(stashPolicy,4,stashDecimation);
+				sim.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+				sim.getSource().setReorderInterval(springlReorderInterval);
+				sim.getSource().setGeometryCacheEnabled(geometryCache);
+				SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
+				status=EXIT_SUCCESS;
+			} else if(args[i]=="-stream_field"){
+				if(i+5>=args.size()){
+					break;
+				}
+				std::string dirName=std::string(argv[++i]);
+				MotionScheme scheme=DecodeMotionScheme(args[++i]);
+				std::string velocityDir=args[++i];
+				double frameTime=atof(args[++i].c_str());
+				std::string sourceFileName=args[++i];
+				float voxelSize=0.0f;
+				if(i+1<args.size()){
+					voxelSize=atof(args[++i].c_str());
+				}
+				if(scheme==MotionScheme::UNDEFINED||frameTime<=0.0){
+					break;
+				}
+				StreamedFieldSimulation sim(sourceFileName,velocityDir,frameTime,voxelSize,scheme);
+				sim.setFrameStoreEnabled(frameStore);
+				sim.setDeltaFrames(deltaFrames);
+				sim.setVdbSequenceEnabled(vdbSequence,vdbHalf);
+				sim.setCheckpointPolicy(checkpointFile,checkpointInterval);
+				sim.setRestoreFile(restoreFile);
+				sim.setStashPolicy(stashPolicy,4,stashDecimation);
+				sim.getSource().setAdaptiveDensityEnabled(adaptiveDensity);
+				sim.getSource().setReorderInterval(springlReorderInterval);
+				sim.getSource().setGeometryCacheEnabled(geometryCache);
 				SimulationVisualizer::run(static_cast<Simulation*>(&sim),WIN_WIDTH,WIN_HEIGHT,dirName);
 				status=EXIT_SUCCESS;
 			}
@@ -176,7 +371,22 @@ int main(int argc, char *argv[]) {
 		cout<<"Usage: "<<argv[0]<<" -enright <OUTPUT_DIRECTORY> <implicit|semi-implicit|explicit> <INTEGER_GRID_SIZE=256>"<<endl;
 		cout<<"Usage: "<<argv[0]<<" -splash <OUTPUT_DIRECTORY> <implicit|semi-implicit|explicit> <INTEGER_GRID_SIZE=64> <MESH_FILE=\"armadillo.ply\">"<<endl;
 		cout<<"Usage: "<<argv[0]<<" -twist <OUTPUT_DIRECTORY> <implicit|semi-implicit|explicit> <FLOAT_CYCLES=1.0> <MESH_FILE=\"armadillo.ply\">"<<endl;
+		cout<<"Usage: "<<argv[0]<<" -stream_field <OUTPUT_DIRECTORY> <implicit|semi-implicit|explicit> <VELOCITY_DIRECTORY> <FRAME_TIME> <MESH_FILE> <VOXEL_SIZE=auto>"<<endl;
+		cout<<"Usage: "<<argv[0]<<" -pressure_benchmark <INTEGER_GRID_SIZE=64>"<<endl;
+		cout<<"Usage: "<<argv[0]<<" -verify_restore <CHECKPOINT_FILE> <INTEGER_STEPS=20> <INTEGER_GRID_SIZE=64>"<<endl;
 		cout<<"Usage: "<<argv[0]<<" -compare <RECORDING_ONE_DIRECTORY> <RECORDING_TWO_DIRECTORY> <OUTPUT_DIRECTORY>"<<endl;
+		cout<<"Prefix simulation commands with -frame_store to record into a single <NAME>.frames file."<<endl;
+		cout<<"Prefix simulation commands with -delta_frames N to record into a frame store with a keyframe every N frames and springl deltas in between."<<endl;
+		cout<<"Prefix simulation commands with -vdb_sequence <half|float> to write signed level sets into one <NAME>_signed.vdbs archive."<<endl;
+		cout<<"Prefix simulation commands with -checkpoint <FILE> <N> to checkpoint the solver every N iterations, and -restore <FILE> to resume from a checkpoint."<<endl;
+		cout<<"Prefix simulation commands with -bootstrap_cache <DIRECTORY> to reuse initial springls built from identical geometry."<<endl;
+		cout<<"Prefix simulation commands with -adaptive_density to space springls by local curvature, fewer on flat regions."<<endl;
+		cout<<"Prefix simulation commands with -springl_reorder N to sort springl storage into Morton order every N steps."<<endl;
+		cout<<"Prefix simulation commands with -geometry_cache to keep springl bounding boxes, normals and areas between topology changes."<<endl;
+		cout<<"Prefix simulation commands with -metrics <FILE> <off|frame|verbose> to append one JSON record per frame to FILE, echoing records to the console when verbose."<<endl;
+		cout<<"Prefix fluid simulation commands with -pressure <ic|wavefront|block_jacobi|red_black|multigrid> to choose the pressure solve preconditioner."<<endl;
+		cout<<"Prefix fluid simulation commands with -pressure_tolerance <TOLERANCE> <MAX_ITERATIONS> to stop the pressure solve at a residual relative to the divergence, and -pressure_cold to solve from zero instead of the previous pressure."<<endl;
+		cout<<"Prefix simulation commands with -async_stash <block|drop|N> to write frames on a background thread, keeping every N'th frame for an integer N."<<endl;
 	}
 	return status;
 }